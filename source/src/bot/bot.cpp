@@ -26,14 +26,7 @@ const vec g_vecZero(0, 0, 0);
 CBot::~CBot()
 {
      // Delete all waypoints
-     loopi(MAX_MAP_GRIDS)
-     {
-          loopj(MAX_MAP_GRIDS)
-          {
-               while (m_WaypointList[i][j].Empty() == false)
-                    delete m_WaypointList[i][j].Pop();
-          }
-     }
+     m_WaypointList.deletecontents();
 }
 
 void CBot::Spawn()
@@ -187,7 +187,7 @@ public:
      vec m_vWaterGoal; // Place to go to when underwater
 
      // Waypoint variabeles
-     TLinkedList<waypoint_s *> m_WaypointList[MAX_MAP_GRIDS][MAX_MAP_GRIDS];
+     vector<waypoint_s *> m_WaypointList; // A* state of every waypoint, indexed by node id
      float m_iWaypointTime;
      waypoint_s *m_pCurrentWaypoint;
      waypoint_s *m_pCurrentGoalWaypoint;
@@ -270,6 +270,7 @@ public:
      bool AStar(void);
      float AStarCost(waypoint_s *pWP1, waypoint_s *pWP2);
      void CleanAStarLists(bool bPathFailed);
+     bool RouteLookup(void);
      bool IsReachable(vec to, float flMaxHeight=JUMP_HEIGHT);
      bool WaterNav(void);
      void HearSound(int n, vec *o);
@@ -175,11 +175,10 @@ void TraceLine(vec from, vec to, dynent *pTracer, bool CheckPlayers, traceresult
      tr->end = from;
      tr->collided = false;
 
-     static float flNearestDist, flDist;
-     static vec v;
-     static bool solid;
-
-     flNearestDist = 9999.0f;
+     // (no statics: the flood compiler traces on several threads)
+     float flNearestDist = 9999.0f, flDist;
+     vec v;
+     bool solid;
 
      if(OUTBORD((int)from.x, (int)from.y)) return;
 
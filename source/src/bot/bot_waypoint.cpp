@@ -31,15 +31,6 @@ CWaypointClass::CWaypointClass(void) : m_bDrawWaypoints(false), m_bDrawWPPaths(t
                                        m_iCurFloodY(0), m_iFloodSize(0),
                                        m_iFilteredNodes(0), m_iWaypointCount(0)
 {
-     loopi(MAX_MAP_GRIDS)
-     {
-          loopj(MAX_MAP_GRIDS)
-          {
-               while(!m_Waypoints[i][j].Empty())
-                    delete m_Waypoints[i][j].Pop();
-          }
-     }
-
      m_szMapName[0] = 0;
 }
 
@@ -47,15 +38,6 @@ void CWaypointClass::Init()
 {
      Clear();  // Free previously allocated path memory
 
-     loopi(MAX_MAP_GRIDS)
-     {
-          loopj(MAX_MAP_GRIDS)
-          {
-               while(!m_Waypoints[i][j].Empty())
-                    delete m_Waypoints[i][j].Pop();
-          }
-     }
-
      m_fPathDrawTime = 0.0;
      m_iWaypointCount = 0;
      m_vLastCreatedWP = g_vecZero;
@@ -63,24 +45,53 @@ void CWaypointClass::Init()
 
 void CWaypointClass::Clear()
 {
-     for(int i=0;i<MAX_MAP_GRIDS;i++)
+     ClearRoutes();
+
+     while(!m_Nodes.empty())
      {
-          for(int j=0;j<MAX_MAP_GRIDS;j++)
-          {
-               while(!m_Waypoints[i][j].Empty())
-               {
-                    node_s *p = m_Waypoints[i][j].Pop();
-                    p->ConnectedWPs.DeleteAllNodes();
-                    p->ConnectedWPsWithMe.DeleteAllNodes();
-                    BotManager.DelWaypoint(p);
-                    delete p;
-               }
-          }
+          node_s *p = m_Nodes.last();
+          p->ConnectedWPs.DeleteAllNodes();
+          p->ConnectedWPsWithMe.DeleteAllNodes();
+          UnlinkNode(p);
+          delete p;
      }
 }
 
-//fixme
-TLinkedList<node_s *>::node_s *testx;
+// Adds a node to the node store and the spatial hash, its node id is the next free index
+void CWaypointClass::LinkNode(node_s *pNode)
+{
+     ClearRoutes();
+
+     pNode->iIndex = m_Nodes.length();
+     m_Nodes.add(pNode);
+     GetNodeCell(pNode->v_origin).add(pNode);
+     m_iWaypointCount++;
+     BotManager.AddWaypoint(pNode);
+}
+
+// Removes a node, the last node takes over its node id
+void CWaypointClass::UnlinkNode(node_s *pNode)
+{
+     ClearRoutes();
+     BotManager.DelWaypoint(pNode);
+
+     vector<node_s *> &cell = GetNodeCell(pNode->v_origin);
+     int i = cell.find(pNode);
+     if (i >= 0)
+     {
+          cell[i] = cell.last();
+          cell.pop();
+     }
+
+     node_s *pLast = m_Nodes.pop();
+     if (pLast != pNode)
+     {
+          pLast->iIndex = pNode->iIndex;
+          m_Nodes[pLast->iIndex] = pLast;
+     }
+     pNode->iIndex = -1;
+     m_iWaypointCount--;
+}
 
 // returns true if waypoints succesfull loaded
 bool CWaypointClass::LoadWaypoints()
@@ -124,7 +135,6 @@ bool CWaypointClass::LoadWaypoints()
                          waypoint_version_1_s WPs[1024];
                          int path_index;
 
-                         m_iWaypointCount = header.iWPCount;
                          for (i=0; i < header.iWPCount; i++)
                          {
                               bfp->read(&WPs[i], sizeof(WPs[0]));
@@ -132,13 +142,7 @@ bool CWaypointClass::LoadWaypoints()
                                                            // a file, so just clear it
 
                               // Convert to new waypoint structure
-                              node_s *pNode = new node_s(WPs[i].v_origin, WPs[i].iFlags, 0);
-
-                              short x, y;
-                              GetNodeIndexes(pNode->v_origin, &x, &y);
-
-                              m_Waypoints[x][y].AddNode(pNode);
-                              BotManager.AddWaypoint(pNode);
+                              LinkNode(new node_s(WPs[i].v_origin, WPs[i].iFlags, 0));
                          }
 
                          // read and add waypoint paths...
@@ -179,8 +183,6 @@ bool CWaypointClass::LoadWaypoints()
                     }
                     else if (header.iFileVersion == 2)
                     {
-                         m_iWaypointCount = header.iWPCount;
-
                          for (i=0; i < header.iWPCount; i++)
                          {
                               bfp->read(&from, sizeof(from)); // Read origin
@@ -188,13 +190,7 @@ bool CWaypointClass::LoadWaypoints()
                               bfp->read(&triggernr, sizeof(triggernr)); // Read trigger nr
                               bfp->read(&yaw, sizeof(yaw)); // Read target yaw
 
-                              node_s *pNode = new node_s(from, flags, triggernr, yaw);
-
-                              short x, y;
-                              GetNodeIndexes(pNode->v_origin, &x, &y);
-
-                              m_Waypoints[x][y].AddNode(pNode);
-                              BotManager.AddWaypoint(pNode);
+                              LinkNode(new node_s(from, flags, triggernr, yaw));
 
                               if ((BotManager.m_sCurrentTriggerNr == -1) ||
                                   (triggernr < BotManager.m_sCurrentTriggerNr))
@@ -276,7 +272,7 @@ bool CWaypointClass::LoadWaypoints()
 
      conoutf("Waypoints for map %s loaded", (m_szMapName));
 
-     testx = m_Waypoints[1][1].pNodeList;
+     CompileRoutes();
 
      return true;
 }
@@ -319,51 +315,40 @@ void CWaypointClass::SaveWaypoints()
      bfp->write(&header, sizeof(header));
 
      // write the waypoint data to the file...
-     loopi(MAX_MAP_GRIDS)
+     loopv(m_Nodes)
      {
-          loopj(MAX_MAP_GRIDS)
-          {
-               TLinkedList<node_s *>::node_s *p = m_Waypoints[i][j].GetFirst();
-               while(p)
-               {
-                    bfp->write(&p->Entry->v_origin, sizeof(p->Entry->v_origin)); // Write origin
-                    bfp->write(&p->Entry->iFlags, sizeof(p->Entry->iFlags)); // Write waypoint flags
-                    bfp->write(&p->Entry->sTriggerNr, sizeof(p->Entry->sTriggerNr)); // Write trigger nr
-                    bfp->write(&p->Entry->sYaw, sizeof(p->Entry->sYaw)); // Write target yaw
-
-                    p = p->next;
-               }
-          }
+          node_s *p = m_Nodes[i];
+          bfp->write(&p->v_origin, sizeof(p->v_origin)); // Write origin
+          bfp->write(&p->iFlags, sizeof(p->iFlags)); // Write waypoint flags
+          bfp->write(&p->sTriggerNr, sizeof(p->sTriggerNr)); // Write trigger nr
+          bfp->write(&p->sYaw, sizeof(p->sYaw)); // Write target yaw
      }
 
-     loopi(MAX_MAP_GRIDS)
+     loopv(m_Nodes)
      {
-          loopj(MAX_MAP_GRIDS)
-          {
-               TLinkedList<node_s *>::node_s *p = m_Waypoints[i][j].GetFirst();
-               while(p)
-               {
-                    // save the waypoint paths...
+          node_s *p = m_Nodes[i];
 
-                    // count the number of paths from this node...
-                    pPath = p->Entry->ConnectedWPs.GetFirst();
-                    num = p->Entry->ConnectedWPs.NodeCount();
+          // save the waypoint paths...
 
-                    bfp->write(&num, sizeof(num));  // write the count
-                    bfp->write(&p->Entry->v_origin, sizeof(p->Entry->v_origin)); // write the origin of this path
+          // count the number of paths from this node...
+          pPath = p->ConnectedWPs.GetFirst();
+          num = p->ConnectedWPs.NodeCount();
 
-                    // now write out each path...
-                    while (pPath != NULL)
-                    {
-                         bfp->write(&pPath->Entry->v_origin, sizeof(pPath->Entry->v_origin));
-                         pPath = pPath->next;  // go to next node in linked list
-                    }
-                    p = p->next;
-               }
+          bfp->write(&num, sizeof(num));  // write the count
+          bfp->write(&p->v_origin, sizeof(p->v_origin)); // write the origin of this path
+
+          // now write out each path...
+          while (pPath != NULL)
+          {
+               bfp->write(&pPath->Entry->v_origin, sizeof(pPath->Entry->v_origin));
+               pPath = pPath->next;  // go to next node in linked list
           }
      }
 
      delete bfp;
+
+     // (editing drops the compiled routes)
+     if (!m_Routes.Ready() && !m_Routes.Compiling()) CompileRoutes();
 }
 
 bool CWaypointClass::LoadWPExpFile()
@@ -512,41 +497,317 @@ void CWaypointClass::SaveWPExpFile()
      fwrite(&header, sizeof(header), 1, bfp);
 
      // save the waypoint experience data...
-     loopi(MAX_MAP_GRIDS)
+     loopv(m_Nodes)
      {
-          loopj(MAX_MAP_GRIDS)
+          node_s *p = m_Nodes[i];
+
+          // count the number of paths from this node...
+          TLinkedList<node_s *>::node_s *p2 = p->FailedGoalList.GetFirst();
+          num = p->FailedGoalList.NodeCount();
+
+          if (!num || !p2) continue;
+
+          fwrite(&num, sizeof(num), 1, bfp);  // write the count
+          fwrite(&p->v_origin, sizeof(vec), 1, bfp); // write the origin of this node
+
+          while (p2 != NULL)
           {
-               TLinkedList<node_s *>::node_s *p = m_Waypoints[i][j].GetFirst();
-               while(p)
-               {
-                    // count the number of paths from this node...
-                    TLinkedList<node_s *>::node_s *p2 = p->Entry->FailedGoalList.GetFirst();
-                    num = p->Entry->FailedGoalList.NodeCount();
+               // Write out the node which a bot can't reach with the current node
+               fwrite(&p2->Entry->v_origin, sizeof(vec), 1, bfp);
+               p2 = p2->next;  // go to next node in linked list
+          }
+     }
 
-                    if (!num || !p2) continue;
+     fclose(bfp);
+}
 
-                    fwrite(&num, sizeof(num), 1, bfp);  // write the count
-                    fwrite(&p->Entry->v_origin, sizeof(vec), 1, bfp); // write the origin of this node
+// Waypoint routes begin
 
-                    while (p2 != NULL)
-                    {
-                         // Write out the node which a bot can't reach with the current node
-                         fwrite(&p2->Entry->v_origin, sizeof(vec), 1, bfp);
-                         p2 = p2->next;  // go to next node in linked list
-                    }
-                    p = p->next;
+void waypoint_routes_s::Clear()
+{
+     ClearCompileData();
+     DELETEA(pFirstEdge);
+     DELETEA(pEdgeTo);
+     DELETEA(pEdgeCost);
+     DELETEA(pNextHop);
+     iNodes = iEdges = iCompiledGoals = 0;
+     uChecksum = 0;
+}
+
+void waypoint_routes_s::ClearCompileData()
+{
+     DELETEA(pRevFirst);
+     DELETEA(pRevEdge);
+     DELETEA(pEdgeFrom);
+}
+
+static unsigned int RouteHash(unsigned int h, const void *data, int len)
+{
+     const unsigned char *p = (const unsigned char *)data;
+     loopi(len) h = (h ^ p[i]) * 16777619U; // FNV-1a
+     return h;
+}
+
+void CWaypointClass::ClearRoutes()
+{
+     m_Routes.Clear();
+}
+
+// Builds the CSR arrays from the waypoint lists and starts compiling the next hop table,
+// unless the route file of the map matches the current waypoints
+void CWaypointClass::CompileRoutes()
+{
+     ClearRoutes();
+
+     waypoint_routes_s &r = m_Routes;
+     int iNodes = m_Nodes.length(), iEdges = 0;
+     loopv(m_Nodes)
+     {
+          int iCount = m_Nodes[i]->ConnectedWPs.NodeCount();
+          if (iCount >= WPROUTE_NOHOP) return; // (hops are stored in a byte)
+          iEdges += iCount;
+     }
+     if (!iNodes || (iNodes > WPROUTE_MAXNODES)) return;
+
+     r.iNodes = iNodes;
+     r.iEdges = iEdges;
+     r.pFirstEdge = new int[iNodes+1];
+     r.pEdgeTo = new int[max(iEdges, 1)];
+     r.pEdgeCost = new float[max(iEdges, 1)];
+
+     unsigned int h = RouteHash(2166136261U, &iNodes, sizeof(iNodes));
+     int e = 0;
+     loopi(iNodes)
+     {
+          node_s *pNode = m_Nodes[i];
+          h = RouteHash(h, &pNode->v_origin, sizeof(pNode->v_origin));
+          h = RouteHash(h, &pNode->sCost, sizeof(pNode->sCost));
+          r.pFirstEdge[i] = e;
+          for(TLinkedList<node_s *>::node_s *p = pNode->ConnectedWPs.GetFirst(); p; p = p->next)
+          {
+               r.pEdgeTo[e] = p->Entry->iIndex;
+               // same as CBot::AStarCost()
+               r.pEdgeCost[e] = pNode->v_origin.dist(p->Entry->v_origin) * p->Entry->sCost;
+               h = RouteHash(h, &r.pEdgeTo[e], sizeof(int));
+               e++;
+          }
+     }
+     r.pFirstEdge[iNodes] = e;
+     r.uChecksum = h;
+
+     r.pNextHop = new unsigned char[iNodes*iNodes];
+     r.iCompiledGoals = 0;
+     if (LoadRoutes()) return;
+
+     // Reversed edges, the table is compiled by a search from every goal
+     r.pRevFirst = new int[iNodes+1];
+     r.pRevEdge = new int[max(iEdges, 1)];
+     r.pEdgeFrom = new int[max(iEdges, 1)];
+     memset(r.pRevFirst, 0, (iNodes+1)*sizeof(int));
+     loopi(iNodes) for(e = r.pFirstEdge[i]; e < r.pFirstEdge[i+1]; e++)
+     {
+          r.pEdgeFrom[e] = i;
+          r.pRevFirst[r.pEdgeTo[e]+1]++;
+     }
+     loopi(iNodes) r.pRevFirst[i+1] += r.pRevFirst[i];
+     int *pFill = new int[iNodes];
+     memcpy(pFill, r.pRevFirst, iNodes*sizeof(int));
+     loopk(iEdges) r.pRevEdge[pFill[r.pEdgeTo[k]]++] = k;
+     delete[] pFill;
+}
+
+struct routeheap_s
+{
+     float flDist;
+     int iNode;
+};
+
+static vector<routeheap_s> RouteHeap;
+static vector<float> RouteDist;
+
+static void RouteHeapPush(float flDist, int iNode)
+{
+     int i = RouteHeap.length();
+     RouteHeap.add();
+     while(i > 0)
+     {
+          int parent = (i-1)/2;
+          if (RouteHeap[parent].flDist <= flDist) break;
+          RouteHeap[i] = RouteHeap[parent];
+          i = parent;
+     }
+     RouteHeap[i].flDist = flDist;
+     RouteHeap[i].iNode = iNode;
+}
+
+static routeheap_s RouteHeapPop()
+{
+     routeheap_s top = RouteHeap[0], last = RouteHeap.pop();
+     int n = RouteHeap.length(), i = 0;
+     if (!n) return top;
+     for(;;)
+     {
+          int child = 2*i+1;
+          if (child >= n) break;
+          if ((child+1 < n) && (RouteHeap[child+1].flDist < RouteHeap[child].flDist)) child++;
+          if (last.flDist <= RouteHeap[child].flDist) break;
+          RouteHeap[i] = RouteHeap[child];
+          i = child;
+     }
+     RouteHeap[i] = last;
+     return top;
+}
+
+// Compiles the next hop table for a few goals per frame, bots keep using A* until it's done
+void CWaypointClass::RouteThink()
+{
+     waypoint_routes_s &r = m_Routes;
+     if (!r.Compiling()) return;
+
+     int iGoals = max(1, WPROUTE_FRAMEEDGES / max(r.iEdges, 1));
+     RouteDist.setsize(0);
+     RouteDist.pad(r.iNodes);
+
+     while(iGoals-- > 0 && r.iCompiledGoals < r.iNodes)
+     {
+          int iGoal = r.iCompiledGoals++;
+          unsigned char *pHops = &r.pNextHop[iGoal*r.iNodes];
+          memset(pHops, WPROUTE_NOHOP, r.iNodes);
+          loopi(r.iNodes) RouteDist[i] = 1e16f;
+
+          // Dijkstra over the reversed edges: the first hop of a node is the edge it was reached by
+          RouteDist[iGoal] = 0.0f;
+          RouteHeap.setsize(0);
+          RouteHeapPush(0.0f, iGoal);
+          while(!RouteHeap.empty())
+          {
+               routeheap_s cur = RouteHeapPop();
+               if (cur.flDist > RouteDist[cur.iNode]) continue; // outdated entry
+
+               for(int k = r.pRevFirst[cur.iNode]; k < r.pRevFirst[cur.iNode+1]; k++)
+               {
+                    int e = r.pRevEdge[k], from = r.pEdgeFrom[e];
+                    float flDist = cur.flDist + r.pEdgeCost[e];
+                    if (flDist >= RouteDist[from]) continue;
+                    RouteDist[from] = flDist;
+                    pHops[from] = (unsigned char)(e - r.pFirstEdge[from]);
+                    RouteHeapPush(flDist, from);
                }
           }
      }
 
-     fclose(bfp);
+     if (r.Ready())
+     {
+          r.ClearCompileData();
+          RouteHeap.setsize(0);
+          RouteDist.setsize(0);
+          SaveRoutes();
+     }
+}
+
+node_s *CWaypointClass::GetNextHop(node_s *pFrom, node_s *pGoal)
+{
+     waypoint_routes_s &r = m_Routes;
+     if (!r.Ready() || (pFrom->iIndex < 0) || (pGoal->iIndex < 0))
+          return NULL;
+
+     int hop = r.pNextHop[pGoal->iIndex*r.iNodes + pFrom->iIndex];
+     if (hop == WPROUTE_NOHOP)
+          return NULL;
+
+     return m_Nodes[r.pEdgeTo[r.pFirstEdge[pFrom->iIndex] + hop]];
 }
 
+struct route_header_s
+{
+     waypoint_header_s header;
+     unsigned int uChecksum;
+     int iEdgeCount;
+};
+
+bool CWaypointClass::LoadRoutes()
+{
+     char szRouteFileName[64];
+     char filename[256];
+     route_header_s hdr;
+     waypoint_routes_s &r = m_Routes;
+
+     strcpy(szRouteFileName, m_szMapName);
+     strcat(szRouteFileName, ".wpr");
+
+     BotManager.MakeBotFileName(szRouteFileName, "waypoints", NULL, filename);
+
+     stream *f = opengzfile(filename, "rb");
+     if (!f)
+          return false;
+
+     bool bLoaded = false;
+     if ((f->read(&hdr, sizeof(hdr)) == sizeof(hdr)) &&
+         !strncmp(hdr.header.szFileType, "cube_bot", sizeof(hdr.header.szFileType)) &&
+         (hdr.header.iFileVersion == WPROUTE_VERSION) && (hdr.header.iWPCount == r.iNodes) &&
+         (hdr.iEdgeCount == r.iEdges) && (hdr.uChecksum == r.uChecksum))
+     {
+          int iSize = r.iNodes*r.iNodes;
+          bLoaded = (f->read(r.pNextHop, iSize) == iSize);
+
+          // Every hop has to be one of the edges of its node, else the file is damaged and the routes get compiled again
+          for(int i = 0; bLoaded && (i < iSize); i++)
+          {
+               int hop = r.pNextHop[i], iNode = i % r.iNodes;
+               if ((hop != WPROUTE_NOHOP) && (hop >= r.pFirstEdge[iNode+1] - r.pFirstEdge[iNode]))
+                    bLoaded = false;
+          }
+     }
+     delete f;
+
+     if (!bLoaded)
+          return false;
+
+     r.iCompiledGoals = r.iNodes;
+     conoutf("Waypoint routes for map %s loaded", m_szMapName);
+     return true;
+}
+
+void CWaypointClass::SaveRoutes()
+{
+     char szRouteFileName[64];
+     char filename[256];
+     route_header_s hdr;
+     waypoint_routes_s &r = m_Routes;
+
+     memset(&hdr, 0, sizeof(hdr));
+     strcpy(hdr.header.szFileType, "cube_bot");
+     hdr.header.iFileVersion = WPROUTE_VERSION;
+     hdr.header.iWPCount = r.iNodes;
+     strncpy(hdr.header.szMapName, m_szMapName, sizeof(hdr.header.szMapName)-1);
+     hdr.uChecksum = r.uChecksum;
+     hdr.iEdgeCount = r.iEdges;
+
+     strcpy(szRouteFileName, m_szMapName);
+     strcat(szRouteFileName, ".wpr");
+
+     BotManager.MakeBotFileName(szRouteFileName, "waypoints", NULL, filename);
+
+     stream *f = opengzfile(filename, "wb");
+     if (!f)
+     {
+          condebug("Can't write waypoint route file");
+          return;
+     }
+
+     f->write(&hdr, sizeof(hdr));
+     f->write(r.pNextHop, r.iNodes*r.iNodes);
+     delete f;
+}
+
+// Waypoint routes end
+
 void CWaypointClass::Think()
 {
 #ifdef WP_FLOOD
      FloodThink();
 #endif
+     RouteThink();
 
      if (m_bAutoWaypoint) // is auto waypoint on?
      {
@@ -625,23 +886,8 @@ void CWaypointClass::DrawNearWaypoints()
 
      TLinkedList<node_s *>::node_s *pNode;
      node_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceilf(15.0f / MAX_MAP_GRIDS);
      float flNearestDist = 9999.99f, flDist;
-
-     GetNodeIndexes(player1->o, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
-
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
+     static vector<node_s *> nearnodes;
 
      node_s *nearestwp = WaypointClass.GetNearestWaypoint(curselection, 20.0f);
 
@@ -650,49 +896,38 @@ void CWaypointClass::DrawNearWaypoints()
           nearestwp = GetNearestFloodWP(player1, 20.0f);
 #endif
 
-     for (int x=MinI;x<=MaxI;x++)
+     GetNodesInRange(worldpos, 15.0f, nearnodes);
+     loopv(nearnodes)
      {
-          for(int y=MinJ;y<=MaxJ;y++)
-          {
-               pNode = m_Waypoints[x][y].GetFirst();
+          node_s *p = nearnodes[i];
+          vec o = p->v_origin;
+          vec e = o;
+          o.z -= 2;
+          e.z += 2;
 
-               while(pNode)
-               {
-                    flDist = GetDistance(worldpos, pNode->Entry->v_origin);
-                    if (flDist <= 15)
-                    {
-                         vec o = pNode->Entry->v_origin;
-                         vec e = o;
-                         o.z -= 2;
-                         e.z += 2;
-
-                         if (pNode->Entry->iFlags & W_FL_JUMP)
-                         {
-                              // draw a red waypoint
-                              linestyle(2.5f, 0xFF, 0x40, 0x40);
-                         }
-                         else if (nearestwp == pNode->Entry)
-                         {
-                              // draw a green waypoint
-                              linestyle(2.5f, 0x40, 0xFF, 0x40);
-                         }
-                         else
-                         {
-                              // draw a blue waypoint
-                              linestyle(2.5f, 0x40, 0x40, 0xFF);
-                         }
-
-                         line(int(o.x), int(o.y), int(o.z), int(e.x), int(e.y), int(e.z));
+          if (p->iFlags & W_FL_JUMP)
+          {
+               // draw a red waypoint
+               linestyle(2.5f, 0xFF, 0x40, 0x40);
+          }
+          else if (nearestwp == p)
+          {
+               // draw a green waypoint
+               linestyle(2.5f, 0x40, 0xFF, 0x40);
+          }
+          else
+          {
+               // draw a blue waypoint
+               linestyle(2.5f, 0x40, 0x40, 0xFF);
+          }
 
-                         if (flNearestDist > flDist)
-                         {
-                              flNearestDist = flDist;
-                              pNearest = pNode->Entry;
-                         }
-                    }
+          line(int(o.x), int(o.y), int(o.z), int(e.x), int(e.y), int(e.z));
 
-                    pNode = pNode->next;
-               }
+          flDist = GetDistance(worldpos, p->v_origin);
+          if (flNearestDist > flDist)
+          {
+               flNearestDist = flDist;
+               pNearest = p;
           }
      }
 
@@ -774,47 +1009,29 @@ void CWaypointClass::DrawNearWaypoints()
 // Add waypoint at location o, returns pointer of created wp
 node_s *CWaypointClass::AddWaypoint(vec o, bool connectwp)
 {
-     short x, y;
      int flags = 0;
      if (S((int)o.x, (int)o.y)->tag) flags |= W_FL_INTAG;
 
      node_s *pNode = new node_s(o, flags, 0);
      m_vLastCreatedWP = o;
 
-     GetNodeIndexes(o, &x, &y);
-
-     m_Waypoints[x][y].AddNode(pNode);
-     BotManager.AddWaypoint(pNode);
-
-     m_iWaypointCount++;
+     LinkNode(pNode);
 
      if (connectwp && m_bAutoPlacePaths)
      {
           // Connect new waypoint with other near waypoints.
 
-          loopi(MAX_MAP_GRIDS)
+          loopv(m_Nodes)
           {
-               loopj(MAX_MAP_GRIDS)
-               {
-                    TLinkedList<node_s *>::node_s *p = m_Waypoints[i][j].GetFirst();
-
-                    while(p)
-                    {
-                         if (p->Entry == pNode)
-                         {
-                              p = p->next;
-                              continue;  // skip the waypoint that was just added
-                         }
-
-                         // check if the waypoint is reachable from the new one (one-way)
-                         if (WPIsReachable(o, p->Entry->v_origin))
-                              AddPath(pNode, p->Entry); // Add a path from a to b
-                         if (WPIsReachable(p->Entry->v_origin, pNode->v_origin))
-                              AddPath(p->Entry, pNode); // Add a path from b to a
-
-                         p = p->next;
-                    }
-               }
+               node_s *p = m_Nodes[i];
+               if (p == pNode)
+                    continue;  // skip the waypoint that was just added
+
+               // check if the waypoint is reachable from the new one (one-way)
+               if (WPIsReachable(o, p->v_origin))
+                    AddPath(pNode, p); // Add a path from a to b
+               if (WPIsReachable(p->v_origin, pNode->v_origin))
+                    AddPath(p, pNode); // Add a path from b to a
           }
      }
 
@@ -833,25 +1050,20 @@ void CWaypointClass::DeleteWaypoint(vec v_src)
           return;
      }
 
-     BotManager.DelWaypoint(pWP);
-
      // delete any paths that lead to this index...
      DeletePath(pWP);
 
-     short x, y;
-     GetNodeIndexes(pWP->v_origin, &x, &y);
-
-     m_Waypoints[x][y].DeleteEntry(pWP);
+     UnlinkNode(pWP);
 
      pWP->ConnectedWPs.DeleteAllNodes();
      pWP->ConnectedWPsWithMe.DeleteAllNodes();
 
-     m_iWaypointCount--;
      delete pWP;
 }
 
 void CWaypointClass::AddPath(node_s *pWP1, node_s *pWP2)
 {
+     ClearRoutes();
      pWP1->ConnectedWPs.AddNode(pWP2);
      pWP2->ConnectedWPsWithMe.AddNode(pWP1);
 }
@@ -859,26 +1071,19 @@ void CWaypointClass::AddPath(node_s *pWP1, node_s *pWP2)
 // Deletes all paths connected to the given waypoint
 void CWaypointClass::DeletePath(node_s *pWP)
 {
-     TLinkedList<node_s *>::node_s *p;
+     ClearRoutes();
 
-     loopi(MAX_MAP_GRIDS)
+     loopv(m_Nodes)
      {
-          loopj(MAX_MAP_GRIDS)
-          {
-               p = m_Waypoints[i][j].GetFirst();
-               while (p)
-               {
-                    p->Entry->ConnectedWPs.DeleteEntry(pWP);
-                    pWP->ConnectedWPsWithMe.DeleteEntry(p->Entry);
-                    p = p->next;
-               }
-          }
+          m_Nodes[i]->ConnectedWPs.DeleteEntry(pWP);
+          pWP->ConnectedWPsWithMe.DeleteEntry(m_Nodes[i]);
      }
 }
 
 // Deletes path between 2 waypoints(1 way)
 void CWaypointClass::DeletePath(node_s *pWP1, node_s *pWP2)
 {
+     ClearRoutes();
      pWP1->ConnectedWPs.DeleteEntry(pWP2);
      pWP2->ConnectedWPsWithMe.DeleteEntry(pWP1);
 }
@@ -1053,121 +1258,109 @@ bool CWaypointClass::WPIsReachable(vec from, vec to)
      return false;
 }
 
-node_s *CWaypointClass::GetNearestWaypoint(vec v_src, float flRange)
+// Cells of the spatial hash, that cover the square flRange around o (every bucket only once)
+void CWaypointClass::GetCellRange(const vec &o, float flRange, int &x1, int &y1, int &x2, int &y2)
 {
-     TLinkedList<node_s *>::node_s *pNode;
-     node_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
-     float flNearestDist = 9999.99f, flDist;
-
-     GetNodeIndexes(v_src, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
+     x1 = GetCellCoord(o.x - flRange);
+     x2 = GetCellCoord(o.x + flRange);
+     y1 = GetCellCoord(o.y - flRange);
+     y2 = GetCellCoord(o.y + flRange);
+     if (x2 - x1 >= WP_CELLS) { x1 = 0; x2 = WP_CELLS - 1; }
+     if (y2 - y1 >= WP_CELLS) { y1 = 0; y2 = WP_CELLS - 1; }
+}
 
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
+void CWaypointClass::GetNodesInRange(const vec &o, float flRange, vector<node_s *> &nodes)
+{
+     int x1, y1, x2, y2;
+     GetCellRange(o, flRange, x1, y1, x2, y2);
 
-     for (int x=MinI;x<=MaxI;x++)
+     nodes.setsize(0);
+     for (int x=x1;x<=x2;x++)
      {
-          for(int y=MinJ;y<=MaxJ;y++)
+          for (int y=y1;y<=y2;y++)
           {
-               pNode = m_Waypoints[x][y].GetFirst();
-
-               while(pNode)
+               vector<node_s *> &cell = GetNodeCell(x, y);
+               loopv(cell)
                {
-                    flDist = GetDistance(v_src, pNode->Entry->v_origin);
-                    if ((flDist < flNearestDist) && (flDist <= flRange))
-                    {
-                         if (IsVisible(v_src, pNode->Entry->v_origin, NULL))
-                         {
-                              pNearest = pNode->Entry;
-                              flNearestDist = flDist;
-                         }
-                    }
-
-                    pNode = pNode->next;
+                    if (GetDistance(o, cell[i]->v_origin) <= flRange)
+                         nodes.add(cell[i]);
                }
           }
      }
-     return pNearest;
 }
 
-node_s *CWaypointClass::GetNearestTriggerWaypoint(vec v_src, float flRange)
+struct nodedist_s
 {
-     TLinkedList<node_s *>::node_s *pNode;
-     node_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
-     float flNearestDist = 9999.99f, flDist;
+     node_s *pNode;
+     float flDist;
+};
 
-     GetNodeIndexes(v_src, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
+static int nodedistcmp(const nodedist_s *a, const nodedist_s *b)
+{
+     if (a->flDist < b->flDist) return -1;
+     if (a->flDist > b->flDist) return 1;
+     return 0;
+}
 
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
+// Returns the nearest visible node within flRange, that has one of iNeedFlags (if any) and none of
+// iSkipFlags. The candidates are sorted by distance, so only the nearest ones need a traceline.
+node_s *CWaypointClass::FindNearestNode(const vec &o, float flRange, int iNeedFlags, int iSkipFlags,
+                                        node_s *pIgnore, bool SkipTags)
+{
+     static vector<nodedist_s> candidates;
+     int x1, y1, x2, y2;
+     GetCellRange(o, flRange, x1, y1, x2, y2);
 
-     for (int x=MinI;x<=MaxI;x++)
+     candidates.setsize(0);
+     for (int x=x1;x<=x2;x++)
      {
-          for(int y=MinJ;y<=MaxJ;y++)
+          for (int y=y1;y<=y2;y++)
           {
-               pNode = m_Waypoints[x][y].GetFirst();
-
-               while(pNode)
+               vector<node_s *> &cell = GetNodeCell(x, y);
+               loopv(cell)
                {
-                    if ((pNode->Entry->iFlags & W_FL_FLOOD) || !(pNode->Entry->iFlags & W_FL_TRIGGER))
-                    {
-                         pNode = pNode->next;
+                    node_s *p = cell[i];
+                    if ((p == pIgnore) || (p->iFlags & iSkipFlags) ||
+                        (iNeedFlags && !(p->iFlags & iNeedFlags)))
                          continue;
-                    }
 
-                    flDist = GetDistance(v_src, pNode->Entry->v_origin);
-                    if ((flDist < flNearestDist) && (flDist <= flRange))
-                    {
-                         if (IsVisible(v_src, pNode->Entry->v_origin, NULL))
-                         {
-                              pNearest = pNode->Entry;
-                              flNearestDist = flDist;
-                         }
-                    }
+                    float flDist = GetDistance(o, p->v_origin);
+                    if (flDist > flRange) continue;
 
-                    pNode = pNode->next;
+                    nodedist_s &c = candidates.add();
+                    c.pNode = p;
+                    c.flDist = flDist;
                }
           }
      }
-     return pNearest;
+
+     candidates.sort(nodedistcmp);
+     loopv(candidates)
+     {
+          if (IsVisible(o, candidates[i].pNode->v_origin, NULL, SkipTags))
+               return candidates[i].pNode;
+     }
+     return NULL;
 }
 
-node_s *CWaypointClass::GetWaypointFromVec(const vec &v_src)
+node_s *CWaypointClass::GetNearestWaypoint(vec v_src, float flRange)
 {
-     static TLinkedList<node_s *>::node_s *pNode;
-     static short x, y;
+     return FindNearestNode(v_src, flRange, 0, 0);
+}
 
-     GetNodeIndexes(v_src, &x, &y);
+node_s *CWaypointClass::GetNearestTriggerWaypoint(vec v_src, float flRange)
+{
+     return FindNearestNode(v_src, flRange, W_FL_TRIGGER, W_FL_FLOOD);
+}
 
-     pNode = m_Waypoints[x][y].GetFirst();
+node_s *CWaypointClass::GetWaypointFromVec(const vec &v_src)
+{
+     vector<node_s *> &cell = GetNodeCell(v_src);
 
-     while(pNode)
+     loopv(cell)
      {
-          if (pNode->Entry->v_origin==v_src)
-               return pNode->Entry;
-
-          pNode = pNode->next;
+          if (cell[i]->v_origin==v_src)
+               return cell[i];
      }
      return NULL;
 }
@@ -1248,18 +1441,7 @@ void CWaypointClass::CalcCost(node_s *pNode)
 
 void CWaypointClass::ReCalcCosts(void)
 {
-     loopi(MAX_MAP_GRIDS)
-     {
-          loopj(MAX_MAP_GRIDS)
-          {
-               TLinkedList<node_s *>::node_s *p = m_Waypoints[i][j].GetFirst();
-               while(p)
-               {
-                    CalcCost(p->Entry);
-                    p = p->next;
-               }
-          }
-     }
+     loopv(m_Nodes) CalcCost(m_Nodes[i]);
 }
 
 #ifdef WP_FLOOD
@@ -1330,12 +1512,8 @@ void CWaypointClass::FloodThink()
 
                     node_s *pWP = new node_s(from, flags, 0);
 
-                    short i, j;
-                    GetNodeIndexes(from, &i, &j);
-                    m_Waypoints[i][j].PushNode(pWP);
-                    BotManager.AddWaypoint(pWP);
+                    LinkNode(pWP);
                     m_iFloodSize += sizeof(node_s);
-                    m_iWaypointCount++;
 
                     // Connect with other nearby nodes
                     ConnectFloodWP(pWP);
@@ -1353,43 +1531,49 @@ void CWaypointClass::FloodThink()
      count = 0;
 
      // Filter all nodes which aren't connected to any other nodes
-     for (x=m_iCurFloodX;x<MAX_MAP_GRIDS;x++)
+     // (a removed node's id is taken over by the last node, which is checked next)
+     for (x=m_iCurFloodX;x<m_Nodes.length();)
      {
-          if (count > 3)
+          if (count >= 256)
           {
                AddScreenText("Filtering useless waypoints and");
-               AddScreenText("adding costs... %.2f %%", ((float)x / float(MAX_MAP_GRIDS)) * 100.0f);
+               AddScreenText("adding costs... %.2f %%", ((float)x / float(m_Nodes.length())) * 100.0f);
                m_iCurFloodX = x;
                return;
           }
 
           count++;
 
-          for (y=0;y<MAX_MAP_GRIDS;y++)
-          {
-               TLinkedList<node_s *>::node_s *pNode = m_Waypoints[x][y].GetFirst(), *pTemp;
-               while(pNode)
-               {
-                    if (pNode->Entry->ConnectedWPs.Empty() ||
-                         pNode->Entry->ConnectedWPsWithMe.Empty())
-                    {
-                         BotManager.DelWaypoint(pNode->Entry);
-                         pTemp = pNode;
-                         pNode = pNode->next;
-                         delete pTemp->Entry;
-                         m_Waypoints[x][y].DeleteNode(pTemp);
-                         m_iFilteredNodes++;
-                         m_iFloodSize -= sizeof(node_s);
-                         m_iWaypointCount--;
-                         continue;
-                    }
-                    else
-                         CalcCost(pNode->Entry);
-                    pNode = pNode->next;
-               }
-          }
+          node_s *pNode = m_Nodes[x];
+          if (FilterFloodNode(pNode)) continue;
+          CalcCost(pNode);
+          x++;
      }
 
+     FinishFlood();
+}
+
+// Removes a flood node, if it isn't connected to any other nodes
+bool CWaypointClass::FilterFloodNode(node_s *pNode)
+{
+     if (!pNode->ConnectedWPs.Empty() && !pNode->ConnectedWPsWithMe.Empty()) return false;
+
+     // (one-way paths to or from it)
+     for(TLinkedList<node_s *>::node_s *p = pNode->ConnectedWPs.GetFirst(); p; p = p->next)
+          p->Entry->ConnectedWPsWithMe.DeleteEntry(pNode);
+     for(TLinkedList<node_s *>::node_s *p = pNode->ConnectedWPsWithMe.GetFirst(); p; p = p->next)
+          p->Entry->ConnectedWPs.DeleteEntry(pNode);
+     pNode->ConnectedWPs.DeleteAllNodes();
+     pNode->ConnectedWPsWithMe.DeleteAllNodes();
+     UnlinkNode(pNode);
+     delete pNode;
+     m_iFilteredNodes++;
+     m_iFloodSize -= sizeof(node_s);
+     return true;
+}
+
+void CWaypointClass::FinishFlood()
+{
      // Done with flooding
      m_bFlooding = false;
      m_bFilteringNodes = false;
@@ -1397,20 +1581,28 @@ void CWaypointClass::FloodThink()
      //ReCalcCosts();
      BotManager.PickNextTrigger();
 
-     m_iFloodSize += sizeof(m_Waypoints);
+     m_iFloodSize += sizeof(m_NodeCells);
      conoutf("Added %d wps in %d milliseconds", m_iWaypointCount, SDL_GetTicks()-m_iFloodStartTime);
      conoutf("Filtered %d wps", m_iFilteredNodes);
 
      BotManager.CalculateMaxAStarCount();
 
      conoutf("Total size: %.2f Kb", float(m_iFloodSize)/1024.0f);
+
+     CompileRoutes();
 }
 
 bool CWaypointClass::CanPlaceNodeHere(const vec &from)
 {
-     static short x, y, a, b;
-     static traceresult_s tr;
-     static vec to, v1, v2;
+     return IsFloodSpot(from) && !GetNearestFloodWP(from, 2.0f, NULL);
+}
+
+// Checks the geometry around a flood node spot, but not the other nodes (thread-safe)
+bool CWaypointClass::IsFloodSpot(const vec &from)
+{
+     short x, y, a, b;
+     traceresult_s tr;
+     vec to, v1, v2;
 
      x = short(from.x);
      y = short(from.y);
@@ -1426,8 +1618,6 @@ bool CWaypointClass::CanPlaceNodeHere(const vec &from)
           return false;
      }
 
-     if (GetNearestFloodWP(from, 2.0f, NULL)) return false;
-
      for (a=(x-1);a<=(x+1);a++)
      {
           for (b=(y-1);b<=(y+1);b++)
@@ -1456,213 +1646,317 @@ bool CWaypointClass::CanPlaceNodeHere(const vec &from)
                     return false;
                }
 
-               TraceLine(from, to, NULL, false, &tr, true);
-               if (tr.collided)
-                    return false;
-          }
-     }
+               TraceLine(from, to, NULL, false, &tr, true);
+               if (tr.collided)
+                    return false;
+          }
+     }
+
+     return true;
+}
+
+void CWaypointClass::ConnectFloodWP(node_s *pWP)
+{
+     if (!pWP) return;
+
+     static float flRange;
+     static float flDist;
+     static node_s *p;
+     static vector<node_s *> nearnodes;
+
+     // Calculate range, based on distance to nearest node
+     p = GetNearestFloodWP(pWP->v_origin, 15.0f, pWP, true);
+     if (p)
+     {
+          flDist = GetDistance(pWP->v_origin, p->v_origin);
+          flRange = min(flDist+2.0f, 15.0f);
+          if (flRange < 5.0f) flRange = 5.0f;
+     }
+     else
+          return;
+
+     GetNodesInRange(pWP->v_origin, flRange, nearnodes);
+     loopv(nearnodes)
+     {
+          p = nearnodes[i];
+          if (p == pWP) continue;
+
+          if (IsVisible(pWP->v_origin, p->v_origin, NULL, true))
+          {
+               // Connect a with b
+               pWP->ConnectedWPs.AddNode(p);
+               p->ConnectedWPsWithMe.AddNode(pWP);
+
+               // Connect b with a
+               p->ConnectedWPs.AddNode(pWP);
+               pWP->ConnectedWPsWithMe.AddNode(p);
+
+               m_iFloodSize += (2 * sizeof(node_s *));
+          }
+     }
+}
+
+node_s *CWaypointClass::GetNearestFloodWP(vec v_origin, float flRange, node_s *pIgnore,
+                                          bool SkipTags)
+{
+     return FindNearestNode(v_origin, flRange, W_FL_FLOOD, 0, pIgnore, SkipTags);
+}
+
+node_s *CWaypointClass::GetNearestTriggerFloodWP(vec v_origin, float flRange)
+{
+     return FindNearestNode(v_origin, flRange, W_FL_FLOOD | W_FL_TRIGGER, 0);
+}
+
+// Flood compiler
+//
+// CompileFlood() floods the whole map at once, on wpthreads threads, and places and connects the
+// same nodes as StartFlood()/FloodThink():
+// - the flood grid is split in strips (one column of grid points each), the threads look for the
+//   first spot around every grid point that passes the geometry checks
+// - the nodes are placed in the order of FloodThink(), on one thread, since a spot is skipped if
+//   there's a node next to it already (the next spot is checked then)
+// - the threads connect every node to the nodes placed before it, as ConnectFloodWP() would have
+//   done; the links are added in node order, so the paths come out in the same order too
+// - the unconnected nodes are filtered and the threads calculate the costs
+
+VARP(wpthreads, 1, 4, 64);
+
+enum { FLOODJOB_SPOTS = 0, FLOODJOB_LINKS, FLOODJOB_COSTS };
 
-     return true;
-}
+struct floodspot_s
+{
+     vec o;
+     int iCand; // spot candidate around the grid point, -1 if none passed
+};
 
-void CWaypointClass::ConnectFloodWP(node_s *pWP)
+struct floodjob_s
 {
-     if (!pWP) return;
+     CWaypointClass *pWPClass;
+     int iJob, iItems, iNext;
+     sl_semaphore *pLock;
+     int iGridY;
+     floodspot_s *pSpots;
+     vector<int> *pLinks;
+};
 
-     static float flRange;
-     static TLinkedList<node_s *>::node_s *pNode;
-     static short i, j, MinI, MaxI, MinJ, MaxJ, x, y, Offset;
-     static float flDist;
-     static node_s *p;
+static floodjob_s floodjob;
 
-     // Calculate range, based on distance to nearest node
-     p = GetNearestFloodWP(pWP->v_origin, 15.0f, pWP, true);
-     if (p)
+static int FloodCompileThread(void *data)
+{
+     for (;;)
      {
-          flDist = GetDistance(pWP->v_origin, p->v_origin);
-          flRange = min(flDist+2.0f, 15.0f);
-          if (flRange < 5.0f) flRange = 5.0f;
+          floodjob.pLock->wait();
+          int i = floodjob.iNext++;
+          floodjob.pLock->post();
+          if (i >= floodjob.iItems) return 0;
+          floodjob.pWPClass->FloodCompileItem(floodjob.iJob, i);
      }
-     else
-          return;
+}
 
-     Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
+void CWaypointClass::StopFlood()
+{
+     m_bFlooding = false;
+     m_bFilteringNodes = false;
+}
 
-     GetNodeIndexes(pWP->v_origin, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
+// Runs iItems items of a flood job on the calling thread and wpthreads-1 others
+void CWaypointClass::RunFloodJob(int iJob, int iItems)
+{
+     floodjob.pWPClass = this;
+     floodjob.iJob = iJob;
+     floodjob.iItems = iItems;
+     floodjob.iNext = 0;
 
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
+     vector<void *> threads;
+     loopi(min(wpthreads, iItems) - 1)
+     {
+          void *ti = sl_createthread(FloodCompileThread, NULL);
+          if (ti) threads.add(ti);
+     }
+     FloodCompileThread(NULL);
+     loopv(threads) sl_waitthread(threads[i]);
+}
 
-     for (x=MinI;x<=MaxI;x++)
+void CWaypointClass::FloodCompileItem(int iJob, int i)
+{
+     switch (iJob)
      {
-          for(y=MinJ;y<=MaxJ;y++)
+          case FLOODJOB_SPOTS: // one strip of the flood grid
           {
-               pNode = m_Waypoints[x][y].GetFirst();
-
-               while(pNode)
+               int x = MINBORD + i*4;
+               loopj(floodjob.iGridY)
                {
-                    if (pNode->Entry == pWP)
-                    {
-                         pNode = pNode->next;
-                         continue;
-                    }
-
-                    flDist = GetDistance(pWP->v_origin, pNode->Entry->v_origin);
-                    if (flDist <= flRange)
-                    {
-                         if (IsVisible(pWP->v_origin, pNode->Entry->v_origin, NULL, true))
-                         {
-                              // Connect a with b
-                              pWP->ConnectedWPs.AddNode(pNode->Entry);
-                              pNode->Entry->ConnectedWPsWithMe.AddNode(pWP);
-
-                              // Connect b with a
-                              pNode->Entry->ConnectedWPs.AddNode(pWP);
-                              pWP->ConnectedWPsWithMe.AddNode(pNode->Entry);
-
-                              m_iFloodSize += (2 * sizeof(node_s *));
-                         }
-                    }
-
-                    pNode = pNode->next;
+                    floodspot_s &spot = floodjob.pSpots[i*floodjob.iGridY + j];
+                    spot.iCand = FindFloodSpot(x, MINBORD + j*4, 0, spot.o);
                }
+               break;
+          }
+          case FLOODJOB_LINKS:
+               GetFloodLinks(m_Nodes[i], floodjob.pLinks[i]);
+               break;
+          case FLOODJOB_COSTS:
+               CalcCost(m_Nodes[i]);
+               break;
+     }
+}
+
+// Finds the first spot around grid point x, y that passes IsFloodSpot(), starting with candidate iCand.
+// Candidate 0 is the grid point itself, 1-25 are the cubes within 2 in the order of FloodThink().
+int CWaypointClass::FindFloodSpot(int x, int y, int iCand, vec &from)
+{
+     for (;iCand<=25;iCand++)
+     {
+          int a = x, b = y;
+          if (iCand)
+          {
+               a = x - 2 + (iCand-1)/5;
+               b = y - 2 + (iCand-1)%5;
+               if (OUTBORD(a, b)) continue;
+               if ((a==x) && (b==y)) continue;
           }
+          makevec(&from, a, b, GetCubeFloor(a, b) + 2.0f);
+          if (IsFloodSpot(from)) return iCand;
      }
+     return -1;
 }
 
-node_s *CWaypointClass::GetNearestFloodWP(vec v_origin, float flRange, node_s *pIgnore,
-                                          bool SkipTags)
+// As ConnectFloodWP(), right after pWP was placed: only the nodes with lower ids count (thread-safe)
+void CWaypointClass::GetFloodLinks(node_s *pWP, vector<int> &links)
 {
-     TLinkedList<node_s *>::node_s *p;
-     node_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
-     float flNearestDist = 9999.99f, flDist;
+     vector<nodedist_s> candidates;
+     int x1, y1, x2, y2;
+
+     // Calculate range, based on distance to nearest node
+     GetCellRange(pWP->v_origin, 15.0f, x1, y1, x2, y2);
+     for (int x=x1;x<=x2;x++)
+     {
+          for (int y=y1;y<=y2;y++)
+          {
+               vector<node_s *> &cell = GetNodeCell(x, y);
+               loopv(cell)
+               {
+                    node_s *p = cell[i];
+                    if (p->iIndex >= pWP->iIndex) continue;
 
-     GetNodeIndexes(v_origin, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
+                    float flDist = GetDistance(pWP->v_origin, p->v_origin);
+                    if (flDist > 15.0f) continue;
 
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
+                    nodedist_s &c = candidates.add();
+                    c.pNode = p;
+                    c.flDist = flDist;
+               }
+          }
+     }
 
-     for (int x=MinI;x<=MaxI;x++)
+     candidates.sort(nodedistcmp);
+     float flRange = 0.0f;
+     loopv(candidates)
      {
-          for(int y=MinJ;y<=MaxJ;y++)
+          if (IsVisible(pWP->v_origin, candidates[i].pNode->v_origin, NULL, true))
           {
-               p = m_Waypoints[x][y].GetFirst();
+               flRange = min(candidates[i].flDist+2.0f, 15.0f);
+               if (flRange < 5.0f) flRange = 5.0f;
+               break;
+          }
+     }
+     if (flRange == 0.0f) return;
 
-               while(p)
+     GetCellRange(pWP->v_origin, flRange, x1, y1, x2, y2);
+     for (int x=x1;x<=x2;x++)
+     {
+          for (int y=y1;y<=y2;y++)
+          {
+               vector<node_s *> &cell = GetNodeCell(x, y);
+               loopv(cell)
                {
-                    if ((p->Entry == pIgnore) || (!(p->Entry->iFlags & W_FL_FLOOD)))
-                    {
-                         p = p->next;
-                         continue;
-                    }
-
-                    flDist = GetDistance(v_origin, p->Entry->v_origin);
-                    if ((flDist < flNearestDist) && (flDist <= flRange))
-                    {
-                         if (IsVisible(v_origin, p->Entry->v_origin, NULL, SkipTags))
-                         {
-                              pNearest = p->Entry;
-                              flNearestDist = flDist;
-                         }
-                    }
+                    node_s *p = cell[i];
+                    if (p->iIndex >= pWP->iIndex) continue;
+                    if (GetDistance(pWP->v_origin, p->v_origin) > flRange) continue;
 
-                    p = p->next;
+                    if (IsVisible(pWP->v_origin, p->v_origin, NULL, true))
+                         links.add(p->iIndex);
                }
           }
      }
-     return pNearest;
 }
 
-node_s *CWaypointClass::GetNearestTriggerFloodWP(vec v_origin, float flRange)
+void CWaypointClass::CompileFlood()
 {
-     TLinkedList<node_s *>::node_s *p;
-     node_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
-     float flNearestDist = 9999.99f, flDist;
+     StopFlood();
+     Init();
 
-     GetNodeIndexes(v_origin, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
+     conoutf("Compiling flood waypoints (%d threads)...", wpthreads);
+     m_iFloodStartTime = SDL_GetTicks();
+     m_iFloodSize = 0;
+     m_iFilteredNodes = 0;
 
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
+     sl_semaphore lock(1, NULL);
+     floodjob.pLock = &lock;
 
-     for (int x=MinI;x<=MaxI;x++)
+     // Check the spots of all grid points
+     int iGridX = max((ssize - 2*MINBORD + 3) / 4, 0);
+     floodjob.iGridY = iGridX;
+     floodjob.pSpots = new floodspot_s[iGridX*floodjob.iGridY];
+     RunFloodJob(FLOODJOB_SPOTS, iGridX);
+
+     // Place the nodes
+     loopi(iGridX)
      {
-          for(int y=MinJ;y<=MaxJ;y++)
+          loopj(floodjob.iGridY)
           {
-               p = m_Waypoints[x][y].GetFirst();
+               floodspot_s &spot = floodjob.pSpots[i*floodjob.iGridY + j];
+               vec from = spot.o;
+               int iCand = spot.iCand;
+               while ((iCand >= 0) && GetNearestFloodWP(from, 2.0f, NULL))
+                    iCand = FindFloodSpot(MINBORD + i*4, MINBORD + j*4, iCand+1, from);
+               if (iCand < 0) continue;
+
+               int flags = W_FL_FLOOD;
+               if (S((int)from.x, (int)from.y)->tag) flags |= W_FL_INTAG;
+
+               LinkNode(new node_s(from, flags, 0));
+               m_iFloodSize += sizeof(node_s);
+          }
+     }
+     DELETEA(floodjob.pSpots);
 
-               while(p)
-               {
-                    if (!(p->Entry->iFlags & (W_FL_FLOOD | W_FL_TRIGGER)))
-                    {
-                         p = p->next;
-                         continue;
-                    }
+     // Connect them
+     int iNodes = m_Nodes.length();
+     floodjob.pLinks = new vector<int>[iNodes];
+     RunFloodJob(FLOODJOB_LINKS, iNodes);
+     loopi(iNodes)
+     {
+          node_s *pWP = m_Nodes[i];
+          vector<int> &links = floodjob.pLinks[i];
+          loopvj(links)
+          {
+               node_s *p = m_Nodes[links[j]];
 
-                    flDist = GetDistance(v_origin, p->Entry->v_origin);
-                    if ((flDist < flNearestDist) && (flDist <= flRange))
-                    {
-                         if (IsVisible(v_origin, p->Entry->v_origin, NULL))
-                         {
-                              pNearest = p->Entry;
-                              flNearestDist = flDist;
-                         }
-                    }
+               // Connect a with b
+               pWP->ConnectedWPs.AddNode(p);
+               p->ConnectedWPsWithMe.AddNode(pWP);
 
-                    p = p->next;
-               }
+               // Connect b with a
+               p->ConnectedWPs.AddNode(pWP);
+               pWP->ConnectedWPsWithMe.AddNode(p);
+
+               m_iFloodSize += (2 * sizeof(node_s *));
           }
      }
-     return pNearest;
-}
+     DELETEA(floodjob.pLinks);
 
-void CWaypointClass::GetNodeIndexes(const vec &v_origin, short *i, short *j)
-{
-     // Function code by cheesy and PMB
-     //*i = iabs((int)((int)(v_origin.x + (2*ssize)) / SECTOR_SIZE));
-     //*j = iabs((int)((int)(v_origin.y + (2*ssize)) / SECTOR_SIZE));
-     //*i = (int)((v_origin.x) / ssize * MAX_MAP_GRIDS);
-     //*j = (int)((v_origin.y) / ssize * MAX_MAP_GRIDS);
-     *i = iabs((int)((v_origin.x) / MAX_MAP_GRIDS));
-     *j = iabs((int)((v_origin.y) / MAX_MAP_GRIDS));
+     // Filter all nodes which aren't connected to any other nodes
+     for (int i=0;i<m_Nodes.length();)
+     {
+          if (!FilterFloodNode(m_Nodes[i])) i++;
+     }
+     RunFloodJob(FLOODJOB_COSTS, m_Nodes.length());
 
-     if (*i > MAX_MAP_GRIDS - 1)
-          *i = MAX_MAP_GRIDS - 1;
-     if (*j > MAX_MAP_GRIDS - 1)
-          *j = MAX_MAP_GRIDS - 1;
+     floodjob.pLock = NULL;
+     FinishFlood();
 }
 
+
 #endif // WP_FLOOD
 // Waypoint class end
 
@@ -1851,8 +2145,88 @@ void wpflood(void)
 }
 
 COMMAND(wpflood, "");
+
+// Compiles flood waypoints for the given maps (or the current one) and saves them, also from the
+// command line for a whole map pool: -e"wpcompile [ac_depot ac_desert]; quit"
+// Maps that already have waypoints are skipped, unless overwrite is set.
+void wpcompile(char *maps, int *overwrite)
+{
+     if (!*maps)
+     {
+          WaypointClass.CompileFlood();
+          WaypointClass.SaveWaypoints();
+          return;
+     }
+     if (multiplayer("wpcompile")) return;
+
+     vector<char *> names;
+     explodelist(maps, names);
+     loopv(names)
+     {
+          char filename[256];
+          defformatstring(wptname)("%s.wpt", names[i]);
+          BotManager.MakeBotFileName(wptname, "waypoints", NULL, filename);
+          if (!*overwrite && fileexists(filename, "r"))
+          {
+               conoutf("%s already has waypoints", names[i]);
+               continue;
+          }
+          if (load_world(names[i]) < 0) continue;
+
+          WaypointClass.SetMapName(names[i]);
+          WaypointClass.CompileFlood();
+          WaypointClass.SaveWaypoints();
+     }
+     names.deletearrays();
+}
+
+COMMAND(wpcompile, "si");
 #endif
 
+// Microbenchmark of the waypoint queries bots use, on the waypoints of the current map
+void wpbench(int *n)
+{
+     vector<node_s *> &nodes = WaypointClass.m_Nodes;
+     if (nodes.empty()) { conoutf("no waypoints"); return; }
+     int iQueries = *n > 0 ? *n : 10000, iFound = 0;
+     CBot *pBot = (bots.length() && bots[0] && bots[0]->pBot) ? bots[0]->pBot : NULL;
+     vector<node_s *> nearnodes;
+     uint start;
+
+     #define WPBENCH(name, body) \
+     { \
+          start = sl_micros(); \
+          loopi(iQueries) \
+          { \
+               node_s *pNode = nodes[rnd(nodes.length())]; \
+               vec o = pNode->v_origin; \
+               o.x += rnd(17) - 8; \
+               o.y += rnd(17) - 8; \
+               body; \
+          } \
+          uint us = max(sl_micros() - start, 1u); \
+          conoutf("%-16s %10.0f queries/s (%d found)", name, iQueries * 1e6 / us, iFound); \
+          iFound = 0; \
+     }
+
+     conoutf("%d waypoints, %d queries each", nodes.length(), iQueries);
+     WPBENCH("fromvec", if (WaypointClass.GetWaypointFromVec(pNode->v_origin)) iFound++);
+     WPBENCH("inrange 15", WaypointClass.GetNodesInRange(o, 15.0f, nearnodes); iFound += nearnodes.length());
+     WPBENCH("nearest 15", if (WaypointClass.GetNearestWaypoint(o, 15.0f)) iFound++);
+     WPBENCH("nearestflood 8", if (WaypointClass.GetNearestFloodWP(o, 8.0f, NULL)) iFound++);
+     if (pBot)
+     {
+          WPBENCH("wpfromnode", if (pBot->GetWPFromNode(pNode)) iFound++);
+     }
+     if (WaypointClass.RoutesReady())
+     {
+          WPBENCH("route", for(node_s *p = pNode, *pGoal = nodes[i % nodes.length()]; p && p != pGoal; p = WaypointClass.GetNextHop(p, pGoal)) iFound++);
+     }
+     #undef WPBENCH
+}
+
+COMMAND(wpbench, "i");
+
 // Debug functions
 #ifdef WP_FLOOD
 
@@ -2334,6 +2708,10 @@ bool CBot::AStar()
           return true;
      }
 
+     // With compiled routes the path is just a lookup
+     if (!m_bCalculatingAStarPath && WaypointClass.RoutesReady() && RouteLookup())
+          return true;
+
      // Ideas by PMB :
      // * Make locals static to speed up a bit
      // * MaxCycles per frame and make it fps dependent
@@ -2597,6 +2975,45 @@ bool CBot::AStar()
      return true;
 }
 
+// Fills m_AStarNodeList from the compiled routes, returns false if the path has to be searched
+// (a waypoint in a tagged cube is blocked now)
+bool CBot::RouteLookup()
+{
+     node_s *pNode = m_pCurrentWaypoint->pNode, *pGoal = m_pCurrentGoalWaypoint->pNode;
+
+     m_AStarNodeList.DeleteAllNodes();
+
+     loopi(WaypointClass.m_Routes.iNodes)
+     {
+          if (i && (pNode->iFlags & W_FL_INTAG) &&
+              SOLID(S((int)pNode->v_origin.x, (int)pNode->v_origin.y)))
+          {
+               m_AStarNodeList.DeleteAllNodes();
+               return false;
+          }
+
+          waypoint_s *pWP = GetWPFromNode(pNode);
+          if (!pWP)
+          {
+               m_AStarNodeList.DeleteAllNodes();
+               return false;
+          }
+          m_AStarNodeList.AddNode(pWP);
+
+          if (pNode == pGoal)
+               return true;
+
+          pNode = WaypointClass.GetNextHop(pNode, pGoal);
+          if (!pNode)
+               break;
+     }
+
+     // No route to the goal
+     condebug("Path failed");
+     m_AStarNodeList.DeleteAllNodes();
+     return true;
+}
+
 float CBot::AStarCost(waypoint_s *pWP1, waypoint_s *pWP2)
 {
      // UNDONE?
@@ -2746,272 +3163,45 @@ bool CBot::ReachedGoalWP()
 
 waypoint_s *CBot::GetWPFromNode(node_s *pNode)
 {
-     if (!pNode) return NULL;
-
-     short x, y;
-     WaypointClass.GetNodeIndexes(pNode->v_origin, &x, &y);
-
-     TLinkedList<waypoint_s *>::node_s *p = m_WaypointList[x][y].GetFirst();
-     while(p)
-     {
-          if (p->Entry->pNode == pNode)
-               return p->Entry;
+     if (!pNode || !m_WaypointList.inrange(pNode->iIndex)) return NULL;
 
-          p = p->next;
-     }
-
-     return NULL;
+     return m_WaypointList[pNode->iIndex];
 }
 
 waypoint_s *CBot::GetNearestWaypoint(vec v_src, float flRange)
 {
-     TLinkedList<waypoint_s *>::node_s *p;
-     waypoint_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
-     float flNearestDist = 9999.99f, flDist;
-
-     WaypointClass.GetNodeIndexes(v_src, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
-
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
-
-     for (int x=MinI;x<=MaxI;x++)
-     {
-          for(int y=MinJ;y<=MaxJ;y++)
-          {
-               p = m_WaypointList[x][y].GetFirst();
-
-               while(p)
-               {
-                    if (p->Entry->pNode->iFlags & W_FL_FLOOD)
-                    {
-                         p = p->next;
-                         continue;
-                    }
-
-                    flDist = GetDistance(v_src, p->Entry->pNode->v_origin);
-                    if ((flDist < flNearestDist) && (flDist <= flRange))
-                    {
-                         if (::IsVisible(v_src, p->Entry->pNode->v_origin, NULL))
-                         {
-                              pNearest = p->Entry;
-                              flNearestDist = flDist;
-                         }
-                    }
-
-                    p = p->next;
-               }
-          }
-     }
-     return pNearest;
+     return GetWPFromNode(WaypointClass.FindNearestNode(v_src, flRange, 0, W_FL_FLOOD));
 }
 
 waypoint_s *CBot::GetNearestTriggerWaypoint(vec v_src, float flRange)
 {
-     TLinkedList<waypoint_s *>::node_s *p;
-     waypoint_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
-     float flNearestDist = 9999.99f, flDist;
-
-     WaypointClass.GetNodeIndexes(v_src, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
-
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
-
-     for (int x=MinI;x<=MaxI;x++)
-     {
-          for(int y=MinJ;y<=MaxJ;y++)
-          {
-               p = m_WaypointList[x][y].GetFirst();
-
-               while(p)
-               {
-                    if (!(p->Entry->pNode->iFlags & W_FL_TRIGGER))
-                    {
-                         p = p->next;
-                         continue;
-                    }
-
-                    flDist = GetDistance(v_src, p->Entry->pNode->v_origin);
-                    if ((flDist < flNearestDist) && (flDist <= flRange))
-                    {
-                         if (::IsVisible(v_src, p->Entry->pNode->v_origin, NULL))
-                         {
-                              pNearest = p->Entry;
-                              flNearestDist = flDist;
-                         }
-                    }
-
-                    p = p->next;
-               }
-          }
-     }
-     return pNearest;
+     return GetWPFromNode(WaypointClass.FindNearestNode(v_src, flRange, W_FL_TRIGGER, 0));
 }
 
 // Makes a waypoint list for this bot based on the list from WaypointClass
 void CBot::SyncWaypoints()
 {
-     short x, y;
-     TLinkedList<node_s *>::node_s *p;
-
      // Clean everything first
-     for (x=0;x<MAX_MAP_GRIDS;x++)
-     {
-          for (y=0;y<MAX_MAP_GRIDS;y++)
-          {
-               while(!m_WaypointList[x][y].Empty())
-                    delete m_WaypointList[x][y].Pop();
-          }
-     }
+     m_WaypointList.deletecontents();
 
      // Sync
-     for (x=0;x<MAX_MAP_GRIDS;x++)
+     loopv(WaypointClass.m_Nodes)
      {
-          for (y=0;y<MAX_MAP_GRIDS;y++)
-          {
-               p = WaypointClass.m_Waypoints[x][y].GetFirst();
-               while(p)
-               {
-                    waypoint_s *pWP = new waypoint_s;
-                    pWP->pNode = p->Entry;
-                    m_WaypointList[x][y].AddNode(pWP);
-
-#ifndef RELEASE_BUILD
-                    if (!GetWPFromNode(p->Entry)) condebug("Error adding bot wp!");
-#endif
-
-                    p = p->next;
-               }
-          }
+          waypoint_s *pWP = new waypoint_s;
+          pWP->pNode = WaypointClass.m_Nodes[i];
+          m_WaypointList.add(pWP);
      }
 }
 
 #ifdef WP_FLOOD
 waypoint_s *CBot::GetNearestFloodWP(vec v_origin, float flRange)
 {
-     TLinkedList<waypoint_s *>::node_s *p;
-     waypoint_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
-     float flNearestDist = 9999.99f, flDist;
-
-     WaypointClass.GetNodeIndexes(v_origin, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
-
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
-
-     for (int x=MinI;x<=MaxI;x++)
-     {
-          for(int y=MinJ;y<=MaxJ;y++)
-          {
-               p = m_WaypointList[x][y].GetFirst();
-
-               while(p)
-               {
-                    if (!(p->Entry->pNode->iFlags & W_FL_FLOOD))
-                    {
-                         p = p->next;
-                         continue;
-                    }
-
-                    flDist = GetDistance(v_origin, p->Entry->pNode->v_origin);
-                    if ((flDist < flNearestDist) && (flDist <= flRange))
-                    {
-                         if (::IsVisible(v_origin, p->Entry->pNode->v_origin, NULL))
-                         {
-                              pNearest = p->Entry;
-                              flNearestDist = flDist;
-                         }
-                    }
-
-                    p = p->next;
-               }
-          }
-     }
-     return pNearest;
+     return GetWPFromNode(WaypointClass.FindNearestNode(v_origin, flRange, W_FL_FLOOD, 0));
 }
 
 waypoint_s *CBot::GetNearestTriggerFloodWP(vec v_origin, float flRange)
 {
-     TLinkedList<waypoint_s *>::node_s *p;
-     waypoint_s *pNearest = NULL;
-     short i, j, MinI, MaxI, MinJ, MaxJ, Offset = (short)ceil(flRange / MAX_MAP_GRIDS);
-     float flNearestDist = 9999.99f, flDist;
-
-     WaypointClass.GetNodeIndexes(v_origin, &i, &j);
-     MinI = i - Offset;
-     MaxI = i + Offset;
-     MinJ = j - Offset;
-     MaxJ = j + Offset;
-
-     if (MinI < 0)
-          MinI = 0;
-     if (MaxI > MAX_MAP_GRIDS - 1)
-          MaxI = MAX_MAP_GRIDS - 1;
-     if (MinJ < 0)
-          MinJ = 0;
-     if (MaxJ > MAX_MAP_GRIDS - 1)
-          MaxJ = MAX_MAP_GRIDS - 1;
-
-     for (int x=MinI;x<=MaxI;x++)
-     {
-          for(int y=MinJ;y<=MaxJ;y++)
-          {
-               p = m_WaypointList[x][y].GetFirst();
-
-               while(p)
-               {
-                    if (!(p->Entry->pNode->iFlags & (W_FL_FLOOD | W_FL_TRIGGER)))
-                    {
-                         p = p->next;
-                         continue;
-                    }
-
-                    flDist = GetDistance(v_origin, p->Entry->pNode->v_origin);
-                    if ((flDist < flNearestDist) && (flDist <= flRange))
-                    {
-                         if (::IsVisible(v_origin, p->Entry->pNode->v_origin, NULL))
-                         {
-                              pNearest = p->Entry;
-                              flNearestDist = flDist;
-                         }
-                    }
-
-                    p = p->next;
-               }
-          }
-     }
-     return pNearest;
+     return GetWPFromNode(WaypointClass.FindNearestNode(v_origin, flRange, W_FL_FLOOD | W_FL_TRIGGER, 0));
 }
 
 void CBot::GoToDebugGoal(vec o)
@@ -15,9 +15,10 @@
 
 #define WAYPOINT_VERSION 2
 #define EXP_WP_VERSION 1
+#define WPROUTE_VERSION 1
 #define REACHABLE_RANGE 15.0f
-#define MAX_MAP_GRIDS    64
-#define SECTOR_SIZE      18
+#define WP_CELLSIZE      8  // cube size of the spatial hash cells
+#define WP_CELLS         64 // the spatial hash has WP_CELLS*WP_CELLS buckets, cell coordinates wrap around
 
 #define W_FL_TELEPORT         (1<<1) // used if waypoint is at a teleporter
 #define W_FL_TELEPORTDEST     (1<<2) // used if waypoint is at a teleporter destination
@@ -29,6 +30,10 @@
 #define MAX_FLOODWPCONNECTDIST     2
 #define MAX_FLOODWPDIST            4.0f
 
+#define WPROUTE_MAXNODES     4096 // bigger graphs aren't compiled, the next hop table grows with the square
+#define WPROUTE_NOHOP        0xFF // no route (or already at the goal)
+#define WPROUTE_FRAMEEDGES   100000 // edges to relax per frame while compiling
+
 struct waypoint_header_s
 {
     char szFileType[10];
@@ -60,18 +65,20 @@ struct node_s
      short sTriggerNr;
      short sYaw;
      short sCost; // Base and static cost
+     int iIndex; // node id: position in CWaypointClass::m_Nodes, -1 if not linked
      TLinkedList<node_s *> ConnectedWPs;
      TLinkedList<node_s *> ConnectedWPsWithMe;
 
      TLinkedList<node_s *> FailedGoalList;
 
      // Construction
-     node_s(void) : iFlags(0), sTriggerNr(0), sYaw(-1), sCost(10) { };
+     node_s(void) : iFlags(0), sTriggerNr(0), sYaw(-1), sCost(10), iIndex(-1) { };
      node_s(const vec &o, const int &f, const short t=0, const short y=-1) : v_origin(o),
                                                                              iFlags(f),
                                                                              sTriggerNr(t),
                                                                              sYaw(y),
-                                                                             sCost(0) { };
+                                                                             sCost(0),
+                                                                             iIndex(-1) { };
 };
 
 struct waypoint_s
@@ -87,6 +94,35 @@ struct waypoint_s
                                       g[0] = g[1] = 0; };
 };
 
+// Waypoint graph compiled for route lookups: the paths are stored as CSR adjacency arrays and
+// a next hop table holds the first edge of the shortest path for every pair of nodes, so finding
+// a path is just following the table. Compiled after loading/flooding and cached in a .wpr file.
+// Nodes are indexed by node id, any change of the nodes or paths drops the routes.
+struct waypoint_routes_s
+{
+     int iNodes, iEdges;
+     unsigned int uChecksum; // of the graph the routes were compiled from
+     int *pFirstEdge; // edges of node i: pFirstEdge[i] .. pFirstEdge[i+1]-1
+     int *pEdgeTo;
+     float *pEdgeCost;
+     unsigned char *pNextHop; // [goal*iNodes + node]: edge (relative to pFirstEdge[node]) towards goal
+     int iCompiledGoals;
+
+     // Only used while compiling
+     int *pRevFirst, *pRevEdge; // edges leading to node i: pRevEdge[pRevFirst[i]] .. pRevEdge[pRevFirst[i+1]-1]
+     int *pEdgeFrom;
+
+     waypoint_routes_s(void) : iNodes(0), iEdges(0), uChecksum(0), pFirstEdge(NULL),
+                               pEdgeTo(NULL), pEdgeCost(NULL), pNextHop(NULL), iCompiledGoals(0),
+                               pRevFirst(NULL), pRevEdge(NULL), pEdgeFrom(NULL) { };
+     ~waypoint_routes_s(void) { Clear(); };
+
+     void Clear(void);
+     void ClearCompileData(void);
+     bool Compiling(void) { return pNextHop && (iCompiledGoals < iNodes); };
+     bool Ready(void) { return pNextHop && (iCompiledGoals >= iNodes); };
+};
+
 class CWaypointClass
 {
 protected:
@@ -107,10 +143,13 @@ protected:
      int m_iFloodSize;
      int m_iFilteredNodes;
 #endif
+     waypoint_routes_s m_Routes;
+
      friend class CBot;
 
 public:
-     TLinkedList<node_s *> m_Waypoints[MAX_MAP_GRIDS][MAX_MAP_GRIDS];
+     vector<node_s *> m_Nodes; // all waypoints, indexed by node id
+     vector<node_s *> m_NodeCells[WP_CELLS*WP_CELLS]; // spatial hash of the waypoints
      int m_iWaypointCount; // number of waypoints currently in use
 
      CWaypointClass(void);
@@ -134,6 +173,15 @@ public:
      void SetWPTriggerNr(node_s *wp, short sTriggerNr) { wp->sTriggerNr = sTriggerNr; };
      void SetWPYaw(node_s *wp, short sYaw) { wp->sYaw = sYaw; };
      bool WaypointsAreVisible(void) { return m_bDrawWaypoints; };
+     void LinkNode(node_s *pNode);
+     void UnlinkNode(node_s *pNode);
+     vector<node_s *> &GetNodeCell(int x, int y) { return m_NodeCells[(x&(WP_CELLS-1)) + (y&(WP_CELLS-1))*WP_CELLS]; };
+     vector<node_s *> &GetNodeCell(const vec &o) { return GetNodeCell(GetCellCoord(o.x), GetCellCoord(o.y)); };
+     static int GetCellCoord(float f) { return int(floorf(f / WP_CELLSIZE)); };
+     void GetCellRange(const vec &o, float flRange, int &x1, int &y1, int &x2, int &y2);
+     void GetNodesInRange(const vec &o, float flRange, vector<node_s *> &nodes);
+     node_s *FindNearestNode(const vec &o, float flRange, int iNeedFlags, int iSkipFlags,
+                             node_s *pIgnore = NULL, bool SkipTags = false);
      node_s *AddWaypoint(vec o, bool connectwp);
      void DeleteWaypoint(vec v_src);
      void AddPath(node_s *pWP1, node_s *pWP2);
@@ -149,10 +197,18 @@ public:
      node_s *GetNearestTriggerWaypoint(vec v_src, float flRange);
      node_s *GetWaypointFromVec(const vec &v_src);
      void DrawNearWaypoints();
-     void GetNodeIndexes(const vec &v_origin, short *i, short *j);
      void CalcCost(node_s *pNode);
      void ReCalcCosts(void);
 
+     // Route functions
+     void CompileRoutes(void);
+     void RouteThink(void);
+     void ClearRoutes(void);
+     bool LoadRoutes(void);
+     void SaveRoutes(void);
+     bool RoutesReady(void) { return m_Routes.Ready(); };
+     node_s *GetNextHop(node_s *pFrom, node_s *pGoal);
+
 
 #ifdef WP_FLOOD
      // Flood functions
@@ -160,7 +216,15 @@ public:
      void StopFlood(void);
      void FloodThink(void);
      bool CanPlaceNodeHere(const vec &from);
+     bool IsFloodSpot(const vec &from);
      void ConnectFloodWP(node_s *pWP);
+     bool FilterFloodNode(node_s *pNode);
+     void FinishFlood(void);
+     void CompileFlood(void);
+     void RunFloodJob(int iJob, int iItems);
+     void FloodCompileItem(int iJob, int i);
+     int FindFloodSpot(int x, int y, int iCand, vec &from);
+     void GetFloodLinks(node_s *pWP, vector<int> &links);
      node_s *GetNearestFloodWP(vec v_origin, float flRange, node_s *pIgnore, bool SkipTags=false);
      node_s *GetNearestFloodWP(dynent *d, float flRange) { return GetNearestFloodWP(d->o, flRange, NULL); };
      node_s *GetNearestTriggerFloodWP(vec v_origin, float flRange);
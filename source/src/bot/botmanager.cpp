@@ -50,9 +50,7 @@ void CBotManager::Think()
     if (m_pBotToView) ViewBot();
     AddDebugText("m_sMaxAStarBots: %d", m_sMaxAStarBots);
     AddDebugText("m_sCurrentTriggerNr: %d", m_sCurrentTriggerNr);
-    short x, y;
-    WaypointClass.GetNodeIndexes(player1->o, &x, &y);
-    AddDebugText("x: %d y: %d", x, y);
+    AddDebugText("x: %d y: %d", WaypointClass.GetCellCoord(player1->o.x), WaypointClass.GetCellCoord(player1->o.y));
 
     m_iFrameTime = lastmillis - m_iPrevTime;
     if (m_iFrameTime > 250) m_iFrameTime = 250;
@@ -367,17 +365,16 @@ void CBotManager::AddWaypoint(node_s *pNode)
 {
     if (bots.length())
     {
-        short x, y;
         waypoint_s *pWP;
 
         loopv(bots)
         {
             if (!bots[i] || !bots[i]->pBot) continue;
 
+            // (the node id is the next index)
             pWP = new waypoint_s;
             pWP->pNode = pNode;
-            WaypointClass.GetNodeIndexes(pNode->v_origin, &x, &y);
-            bots[i]->pBot->m_WaypointList[x][y].AddNode(pWP);
+            bots[i]->pBot->m_WaypointList.add(pWP);
 
 #ifndef RELEASE_BUILD
             if (!bots[i]->pBot->GetWPFromNode(pNode)) condebug("Error adding bot wp!");
@@ -393,26 +390,16 @@ void CBotManager::DelWaypoint(node_s *pNode)
 {
     if (bots.length())
     {
-        short x, y;
-        TLinkedList<waypoint_s *>::node_s *p;
-
         loopv(bots)
         {
             if (!bots[i] || !bots[i]->pBot) continue;
 
-            WaypointClass.GetNodeIndexes(pNode->v_origin, &x, &y);
-            p = bots[i]->pBot->m_WaypointList[x][y].GetFirst();
-
-            while(p)
-            {
-                if (p->Entry->pNode == pNode)
-                {
-                    delete p->Entry;
-                    bots[i]->pBot->m_WaypointList[x][y].DeleteNode(p);
-                    break;
-                }
-                p = p->next;
-            }
+            // same as CWaypointClass::UnlinkNode(): the last waypoint takes over the node id
+            vector<waypoint_s *> &list = bots[i]->pBot->m_WaypointList;
+            if (!list.inrange(pNode->iIndex)) continue;
+            delete list[pNode->iIndex];
+            list[pNode->iIndex] = list.last();
+            list.pop();
         }
     }
 
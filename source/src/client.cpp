@@ -8,6 +8,7 @@ VAR(connected, 1, 0, 0);
 ENetHost *clienthost = NULL;
 ENetPeer *curpeer = NULL, *connpeer = NULL;
 int connmillis = 0, connattempts = 0, discmillis = 0;
+int posnkeyframe = 0;       // >0: the server takes our position as SV_POSN, with a keyframe at least every posnkeyframe updates
 SVAR(curdemofile, "n/a");
 extern bool clfail, cllock;
 extern int searchlan;
@@ -184,6 +185,9 @@ void disconnect(int onlyclean, int async)
     {
         player1->clientnum = -1;
         player1->lifesequence = 0;
+        player1->posn.reset();
+        posnkeyframe = 0;
+        enddemodownload();
         player1->clientrole = CR_DEFAULT;
         lastpm = -1;
         kickallbots();
@@ -454,7 +458,27 @@ void c2sinfo(playerent *d)                  // send update to the server
             d->vel_t.i[1] = dyt;
             d->vel_t.i[2] = dzt;
         int usefactor = sfactor < 7 ? 7 : sfactor, sizexy = 1 << (usefactor + 4);
-        if(cn >= 0 && cn < 32 &&
+        if(posnkeyframe)
+        { // delta coded POS packet
+            posnstate s;
+            s.o[0] = x;
+            s.o[1] = y;
+            s.o[2] = z;
+            s.yaw = ya & 511;
+            s.pitch = clamp(pi, -128, 127);
+            s.roll = r;
+            s.vel[0] = dx;
+            s.vel[1] = dy;
+            s.vel[2] = dz;
+            s.f = f;
+            s.scoping = d->scoping ? 1 : 0;
+            s.shoot = d->shoot ? 1 : 0;
+            posnmsg m;
+            m.cn = cn;
+            encodeposn(s, d->posn, m, posnkeyframe);
+            putposn(q, m);
+        }
+        else if(cn >= 0 && cn < 32 &&
             usefactor <= 7 + 3 &&       // map size 7..10
             x >= 0 && x < sizexy &&
             y >= 0 && y < sizexy &&
@@ -848,7 +872,13 @@ void shiftgametime(int newmillis)
     if(newmillis > gametimemaximum) { conoutf("Invalid time specified"); return; }
 
     int gamemillis = gametimecurrent + (lastmillis - lastgametimeupdate);
-    if(newmillis < gamemillis)
+    int keymillis = curpeer ? -1 : demokeyframebefore(newmillis);
+    if(keymillis >= 0 && (newmillis < gamemillis || keymillis > gamemillis) && seekdemo(newmillis))
+    {
+        // jump to the last keyframe before that time and fast forward from there
+        skipmillis = newmillis - keymillis;
+    }
+    else if(newmillis < gamemillis)
     {
         // if rewinding
         if(!curdemofile || !curdemofile[0]) return;
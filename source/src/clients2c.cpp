@@ -115,6 +115,7 @@ void parsepositions(ucharbuf &p)
     {
         case SV_POS:                        // position of another client
         case SV_POSC:
+        case SV_POSN:
         {
             int cn, f, g;
             vec o, vel;
@@ -149,6 +150,21 @@ void parsepositions(ucharbuf &p)
                 scoping = ( q.getbits(1) ? true : false );
                 q.getbits(1);//shoot = ( q.getbits(1) ? true : false );
             }
+            else if(type == SV_POSN)
+            {
+                posnmsg m;
+                posnstate s;
+                getposn(p, m);
+                playerent *d = getclient(m.cn);
+                if(!d || !decodeposn(m, d->posn, s)) continue;  // we missed the keyframe
+                cn = m.cn;
+                o = vec(s.o[0] / DMF, s.o[1] / DMF, s.o[2] / DMF);
+                yaw = s.yaw * 360.0f / 512;
+                pitch = s.pitch * 90.0f / 127;
+                vel = vec(s.vel[0] / DVELF, s.vel[1] / DVELF, s.vel[2] / DVELF);
+                f = s.f;
+                scoping = s.scoping != 0;
+            }
             else
             {
                 cn = getint(p);
@@ -441,6 +457,14 @@ void parsemessages(int cn, playerent *d, ucharbuf &p, bool demo = false)
                 resetcamera();
                 break;
 
+            case SV_POSN:                   // the server takes our position as SV_POSN
+            {
+                extern int posnkeyframe;
+                int keyframe = getint(p);
+                if(!demo) posnkeyframe = clamp(keyframe, 0, POSNMAXKEYFRAME);
+                break;
+            }
+
             case SV_CLIENT:
             {
                 int cn = getint(p), len = getuint(p);
@@ -1015,7 +1039,7 @@ void parsemessages(int cn, playerent *d, ucharbuf &p, bool demo = false)
                 ents[i].attr6 = getint(p);
                 ents[i].attr7 = getint(p);
                 ents[i].spawned = false;
-                if(ents[i].type==LIGHT || to==LIGHT) calclight();
+                if(ents[i].type==LIGHT || to==LIGHT) relight();
                 if(ents[i].type==SOUND) audiomgr.preloadmapsound(ents[i]);
                 break;
             }
@@ -1489,6 +1513,19 @@ const char *parseDemoFilename(char *srvfinfo)
     return getDemoFilename(gmode, mplay, mdrop, stamp, srvmap);
 }
 
+// demo download in pieces
+stream *demodownload = NULL;
+string demodownloadname;
+int demodownloadlen = 0, demodownloadreceived = 0;
+
+void enddemodownload()
+{
+    if(!demodownload) return;
+    DELETEP(demodownload);
+    if(demodownloadreceived < demodownloadlen) conoutf("\f3demo download \"%s\" incomplete (%d of %d bytes)", demodownloadname, demodownloadreceived, demodownloadlen);
+    else conoutf("received demo \"%s\"", demodownloadname);
+}
+
 void receivefile(uchar *data, int len)
 {
     static char text[MAXTRANS];
@@ -1525,6 +1562,46 @@ void receivefile(uchar *data, int len)
             break;
         }
 
+        case SV_SENDDEMOSTART:
+        {
+            getstring(text, p);
+            int demosize = getint(p);
+            enddemodownload();
+            extern string demosubpath;
+            formatstring(demodownloadname)("demos/%s%s.dmo", demosubpath, parseDemoFilename(text));
+            copystring(demosubpath, "");
+            path(demodownloadname);
+            demodownload = openfile(demodownloadname, "wb");
+            if(!demodownload)
+            {
+                conoutf("failed writing to \"%s\"", demodownloadname);
+                return;
+            }
+            demodownloadlen = demosize;
+            demodownloadreceived = 0;
+            conoutf("downloading demo \"%s\" (%d KB)...", demodownloadname, (demosize + 1023) / 1024);
+            break;
+        }
+
+        case SV_SENDDEMOPIECE:
+        {
+            int offset = getint(p), piecelen = getint(p);
+            if(piecelen < 0 || p.remaining() < piecelen)
+            {
+                p.forceoverread();
+                break;
+            }
+            if(demodownload && offset == demodownloadreceived)
+            {
+                demodownload->write(&p.buf[p.len], piecelen);
+                demodownloadreceived += piecelen;
+                addmsg(SV_DEMOACK, "ri", demodownloadreceived);
+                if(demodownloadreceived >= demodownloadlen) enddemodownload();
+            }
+            p.len += piecelen;
+            break;
+        }
+
         case SV_RECVMAP:
         {
             getstring(text, p);
@@ -56,7 +56,7 @@ extern int hwtexsize, hwmaxaniso;
 extern int maploaded, msctrl;
 extern float waterlevel;
 
-#define AC_VERSION 1202
+#define AC_VERSION 1204
 #define AC_MASTER_URI "ms.cubers.net"
 #define AC_MASTER_PORT 28760
 #define MAXCL 16
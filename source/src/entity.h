@@ -439,6 +439,7 @@ public:
     weapon *prevweaponsel, *weaponsel, *nextweaponsel, *primweap, *nextprimweap, *lastattackweapon;
 
     poshist history; // Previous stored locations of this player
+    posnstream posn; // SV_POSN: the keyframe of this player's position updates
 
     const char *skin_noteam, *skin_cla, *skin_rvsf;
 
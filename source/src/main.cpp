@@ -1078,6 +1078,11 @@ int main(int argc, char **argv)
                         printf("%d\n", PROTOCOL_VERSION);
                         quitdirectly = true;
                     }
+                    else if(!strcmp(argv[i], "--mdlanimbench"))
+                    {
+                        mdlanimbench();
+                        quitdirectly = true;
+                    }
                     else if(!strncmp(argv[i], "--loadmap=", 10))
                     {
                         initmap = &argv[i][10];
@@ -1340,6 +1345,7 @@ int main(int argc, char **argv)
         frames++;
 
         audiomgr.updateaudio();
+        updatetextures();
 
         computeraytable(camera1->o.x, camera1->o.y, dynfov());
         if(frames>3 && !minimized)
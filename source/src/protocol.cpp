@@ -145,6 +145,138 @@ void getstring(char *text, ucharbuf &p, int len)
     DEBUGVAR(text);
 }
 
+// SV_POSN: a keyframe carries the absolute position of a player and the movement per update at that time,
+// every other update only carries the difference to the position predicted from the keyframe.
+// updates refer to their keyframe by number, so a lost update doesn't spoil the following ones -
+// a lost keyframe costs the updates up to the next keyframe.
+
+void encodeposn(const posnstate &s, posnstream &ps, posnmsg &m, int keyframe)   // sender: turn an update into a message (without m.cn)
+{
+    bool key = !ps.valid || ps.age + 1 >= keyframe || ((s.f ^ ps.key.f) & 0x40);  // new lifesequence: always start with a keyframe
+    if(!key) loopi(3) if(abs(s.o[i] - ps.key.o[i] - ps.step[i] * (ps.age + 1)) > 0x7fff) key = true;
+    m.d = s;
+    if(key)
+    {
+        if(ps.valid) ps.seq = (ps.seq + 1) & 7;
+        loopi(3) m.step[i] = ps.step[i] = ps.valid ? clamp(s.o[i] - ps.last[i], -POSNMAXSTEP, POSNMAXSTEP) : 0;
+        ps.key = s;
+        ps.age = 0;
+        ps.valid = true;
+    }
+    else
+    {
+        ps.age++;
+        loopi(3) m.d.o[i] = s.o[i] - ps.key.o[i] - ps.step[i] * ps.age;
+        m.d.yaw = ((s.yaw - ps.key.yaw + 256) & 511) - 256;
+        m.d.pitch = s.pitch - ps.key.pitch;
+        m.d.f = s.f ^ ps.key.f;
+    }
+    m.seq = ps.seq;
+    m.age = ps.age;
+    loopi(3) ps.last[i] = s.o[i];
+}
+
+bool decodeposn(const posnmsg &m, posnstream &ps, posnstate &s)   // receiver: false, if we don't have the keyframe the message refers to
+{
+    s = m.d;
+    if(!m.age)
+    {
+        ps.key = m.d;
+        loopi(3) ps.step[i] = m.step[i];
+        ps.seq = m.seq;
+        ps.valid = true;
+        return true;
+    }
+    if(!ps.valid || m.seq != ps.seq) return false;
+    loopi(3) s.o[i] = ps.key.o[i] + ps.step[i] * m.age + m.d.o[i];
+    s.yaw = (ps.key.yaw + m.d.yaw) & 511;
+    s.pitch = ps.key.pitch + m.d.pitch;
+    s.f = (ps.key.f ^ m.d.f) & 0xff;
+    return true;
+}
+
+// signed integers, small values are cheap: 0 takes 1 bit, up to 7 take 6 bits, up to 127 take 11 bits, up to 65535 take 20 bits
+template<class T>
+static inline void putsbits(bitbuf<T> &b, int n)
+{
+    int a = min(abs(n), 0xffff);
+    if(!a) { b.putbits(1, 0); return; }
+    if(a < 8) b.putbits(2, 1);
+    else b.putbits(3, a < 128 ? 3 : 7);
+    b.putbits(1, n < 0 ? 1 : 0);
+    b.putbits(a < 8 ? 3 : (a < 128 ? 7 : 16), a);
+}
+
+static inline int getsbits(bitbuf<ucharbuf> &b)
+{
+    if(!b.getbits(1)) return 0;
+    int s = !b.getbits(1) ? 3 : (!b.getbits(1) ? 7 : 16), neg = b.getbits(1), a = b.getbits(s);
+    return neg ? -a : a;
+}
+
+template<class T>
+static inline void putposn_(T &p, const posnmsg &m)
+{
+    const posnstate &d = m.d;
+    putint(p, SV_POSN);
+    putint(p, m.cn);
+    bitbuf<T> b(p);
+    b.putbits(4, m.age);
+    b.putbits(3, m.seq);
+    loopi(3) putsbits(b, d.o[i]);
+    if(!m.age)
+    {
+        loopi(3) putsbits(b, m.step[i]);
+        b.putbits(9, d.yaw);
+        b.putbits(8, d.pitch + 128);
+        b.putbits(8, d.f);
+    }
+    else
+    {
+        putsbits(b, d.yaw);
+        putsbits(b, d.pitch);
+        b.putbits(1, d.f ? 1 : 0);
+        if(d.f) b.putbits(8, d.f);
+    }
+    putsbits(b, d.roll);
+    bool novel = !d.vel[0] && !d.vel[1] && !d.vel[2];
+    b.putbits(1, novel ? 0 : 1);
+    if(!novel) loopi(3) putsbits(b, d.vel[i]);
+    b.putbits(1, d.scoping ? 1 : 0);
+    b.putbits(1, d.shoot ? 1 : 0);
+}
+void putposn(ucharbuf &p, const posnmsg &m) { putposn_(p, m); }
+void putposn(packetbuf &p, const posnmsg &m) { putposn_(p, m); }
+
+bool getposn(ucharbuf &p, posnmsg &m)     // parse one SV_POSN message (the message type has already been read)
+{
+    posnstate &d = m.d;
+    m.cn = getint(p);
+    bitbuf<ucharbuf> b(p);
+    m.age = b.getbits(4);
+    m.seq = b.getbits(3);
+    loopi(3) d.o[i] = getsbits(b);
+    if(!m.age)
+    {
+        loopi(3) m.step[i] = clamp(getsbits(b), -POSNMAXSTEP, POSNMAXSTEP);
+        d.yaw = b.getbits(9);
+        d.pitch = b.getbits(8) - 128;
+        d.f = b.getbits(8);
+    }
+    else
+    {
+        d.yaw = getsbits(b);
+        d.pitch = getsbits(b);
+        d.f = b.getbits(1) ? b.getbits(8) : 0;
+    }
+    d.roll = getsbits(b);
+    if(b.getbits(1)) loopi(3) d.vel[i] = getsbits(b);
+    else loopi(3) d.vel[i] = 0;
+    d.scoping = b.getbits(1);
+    d.shoot = b.getbits(1);
+    return !p.overread();
+}
+
 #define GZMSGBUFSIZE ((MAXGZMSGSIZE * 11) / 10)
 static uchar *gzbuf = new uchar[GZMSGBUFSIZE];          // not thread-safe, but nesting is no problem
 
@@ -424,6 +556,7 @@ static const int msgsizes[] =               // size inclusive message token, 0 f
     SV_CLIENT, 0,
     SV_EXTENSION, 0,
     SV_MAPIDENT, 3, SV_HUDEXTRAS, 2, SV_POINTS, 0,
+    SV_SENDDEMOSTART, 0, SV_SENDDEMOPIECE, 0, SV_DEMOACK, 2,
     -1
 };
 
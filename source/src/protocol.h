@@ -6,7 +6,8 @@
 #define CUBE_SERVINFO_PORT(serverport) (serverport+1)
 #define CUBE_SERVINFO_TO_SERV_PORT(servinfoport) (servinfoport-1)
 #define PROTOCOL_VERSION 1201           // bump when protocol changes (use negative numbers for mods!)
-#define DEMO_VERSION 2                  // bump when demo format changes
+#define DEMO_VERSION 3                  // bump when demo format changes
+#define DEMO_VERSION_FLAT 2             // old demos: one gzip stream, can only be played from the start
 #define DEMO_MAGIC "ASSAULTCUBE_DEMO"
 #define DEMO_MINTIME 10000              // don't keep demo recordings with less than 10 seconds
 #define MAXMAPSENDSIZE 65536
@@ -45,6 +46,7 @@ enum
     SV_CLIENT,
     SV_EXTENSION,
     SV_MAPIDENT, SV_HUDEXTRAS, SV_POINTS,
+    SV_SENDDEMOSTART, SV_SENDDEMOPIECE, SV_DEMOACK,
     SV_NUM
 };
 
@@ -73,6 +75,43 @@ enum { EDITXY_HEIGHT = 0, EDITXY_TEX, EDITXY_TYPE, EDITXY_VDELTA, EDITXY_EQUALIS
 #define DNF 100.0f
 #define DVELF 4.0f
 
+// demo downloads in pieces: SV_SENDDEMOSTART, then SV_SENDDEMOPIECEs, which the client confirms with SV_DEMOACK
+#define DEMOPIECES_VERSION 1204         // clients from this version on can receive demos in pieces
+#define DEMOPIECESIZE 4096              // one piece per packet (has to fit in MAXTRANS)
+#define DEMOWINDOW 65536                // max bytes sent to a client, but not yet confirmed
+
+// SV_POSN: position updates, coded as difference to a prediction from the last keyframe of the player
+#define POSN_VERSION 1203               // clients from this version on can send and read SV_POSN
+#define POSNKEYFRAME 10                 // default: a keyframe at least every 10 updates
+#define POSNMAXKEYFRAME 16
+#define POSNMAXSTEP 64                  // max movement per update used for the prediction (DMF)
+
+struct posnstate                        // one position update, quantized like SV_POSC
+{
+    int o[3];                           // DMF, z at the feet
+    int yaw, pitch, roll;               // 512 per turn, 127 per 90 degrees, 31 per 20 degrees
+    int vel[3];                         // change of velocity (DVELF), like SV_POS
+    int f, scoping, shoot;              // f: packed like in SV_POS
+};
+
+struct posnmsg                          // one SV_POSN message
+{
+    int cn, seq, age;                   // seq: number of the keyframe (0..7), age: updates since the keyframe (0: this is the keyframe)
+    posnstate d;                        // keyframe: absolute values, otherwise difference to the prediction (f: xor)
+    int step[3];                        // keyframe only: movement per update at the time of the keyframe
+};
+
+struct posnstream                       // what sender and receivers know about one player's stream of updates
+{
+    posnstate key;                      // the last keyframe
+    int step[3], seq, age;
+    int last[3];                        // sender only: position of the previous update
+    bool valid;
+
+    posnstream() { reset(); }
+    void reset() { valid = false; seq = age = 0; }
+};
+
 enum { DISC_NONE = 0, DISC_EOP, DISC_CN, DISC_MKICK, DISC_MBAN, DISC_TAGT, DISC_BANREFUSE, DISC_WRONGPW, DISC_SOPLOGINFAIL, DISC_MAXCLIENTS, DISC_MASTERMODE, DISC_AUTOKICK, DISC_AUTOBAN, DISC_DUP, DISC_BADNICK, DISC_OVERFLOW, DISC_ABUSE, DISC_AFK, DISC_FFIRE, DISC_CHEAT, DISC_NUM };
 enum { BAN_NONE = 0, BAN_VOTE, BAN_AUTO, BAN_BLACKLIST, BAN_MASTER };
 
@@ -87,7 +126,7 @@ enum { BAN_NONE = 0, BAN_VOTE, BAN_AUTO, BAN_BLACKLIST, BAN_MASTER };
 #define EXT_PLAYERSTATS_RESP_STATS      -11
 
 enum { PONGFLAG_PASSWORD = 0, PONGFLAG_BANNED, PONGFLAG_BLACKLIST, PONGFLAG_MASTERMODE = 6, PONGFLAG_NUM };
-enum { EXTPING_NOP = 0, EXTPING_NAMELIST, EXTPING_SERVERINFO, EXTPING_MAPROT, EXTPING_UPLINKSTATS, EXTPING_NUM };
+enum { EXTPING_NOP = 0, EXTPING_NAMELIST, EXTPING_SERVERINFO, EXTPING_MAPROT, EXTPING_UPLINKSTATS, EXTPING_PROFILE, EXTPING_NUM };
 
 enum
 {
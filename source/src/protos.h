@@ -414,9 +414,10 @@ struct Texture
     float scale;
     bool mipmap, canreduce;
     GLuint id;
+    bool placeholder;   // still loading (or failed to load), uses the GL texture of notexture
 };
 extern Texture *notexture, *noworldtexture;
-extern bool silent_texture_load;
+extern bool silent_texture_load, async_texture_load;
 extern bool uniformtexres;
 
 extern void scaletexture(uchar *src, uint sw, uint sh, uint bpp, uchar *dst, uint dw, uint dh);
@@ -428,6 +429,7 @@ extern SDL_Surface *forcergbsurface(SDL_Surface *os);
 extern SDL_Surface *forcergbasurface(SDL_Surface *os);
 extern Texture *textureload(const char *name, int clamp = 0, bool mipmap = true, bool canreduce = false, float scale = 1.0f, bool trydl = false);
 extern Texture *lookuptexture(int tex, Texture *failtex = notexture, bool trydl = false);
+extern void updatetextures();
 extern const char *gettextureslot(int i);
 extern bool reloadtexture(Texture &t);
 extern void reloadtextures();
@@ -501,12 +503,19 @@ extern void resetcubes();
 extern void setupstrips();
 extern void renderstripssky();
 extern void renderstrips();
+struct worldstrip { int tex, type, first, count; };
+extern vector<vertex> verts, cachedverts;
+extern bool worldcached;
+extern void resetstrips();
+extern float takestrips(vector<worldstrip> &dst);
+extern void addcachedstrips(const worldstrip *s, int n, int base);
 extern void rendershadow(int x, int y, int xs, int ys, const vec &texgenS, const vec &texgenT);
 
 // water
 extern void setwatercolor(const char *r = "", const char *g = "", const char *b = "", const char *a = "");
 extern void calcwaterscissor();
 extern void addwaterquad(int x, int y, int size);
+extern void addwaterrect(int x1, int y1, int x2, int y2);
 extern int renderwater(float hf, GLuint reflecttex, GLuint refracttex);
 extern void resetwater();
 
@@ -531,6 +540,7 @@ extern int getbuildtype();
 extern void sendintro();
 extern void getdemo(int *idx, char *dsp);
 extern void listdemos();
+extern void enddemodownload();
 
 // serverms
 bool requestmasterf(const char *fmt, ...); // for AUTH et al
@@ -647,6 +657,7 @@ extern int lastcalclight;
 
 extern void fullbrightlight(int level = -1);
 extern void calclight();
+extern void relight();
 extern void adddynlight(physent *owner, const vec &o, int reach, int expire, int fade, uchar r, uchar g = 0, uchar b = 0);
 extern void dodynlights();
 extern void undodynlights();
@@ -661,6 +672,8 @@ extern void freeblock(block *&b);
 
 // worldrender
 extern void render_world(float vx, float vy, float vh, float changelod, int yaw, int pitch, float fov, float fovy, int w, int h);
+extern void invalidateworldcache(const block &b);
+extern void flushworldcache();
 extern int lod_factor();
 
 // worldocull
@@ -900,6 +913,7 @@ extern void preload_entmodels();
 extern void preload_hudguns();
 extern bool preload_mapmodels(bool trydl = false);
 extern void renderclients();
+extern void mdlanimbench();
 extern void renderclientp(playerent *d);
 extern void renderclient(playerent *d, const char *mdlname, const char *vwepname, int tex = 0);
 extern void updateclientname(playerent *d);
@@ -1057,6 +1071,11 @@ extern void sendstring(const char *t, ucharbuf &p);
 extern void sendstring(const char *t, packetbuf &p);
 extern void sendstring(const char *t, vector<uchar> &p);
 extern void getstring(char *t, ucharbuf &p, int len = MAXTRANS);
+extern void encodeposn(const posnstate &s, posnstream &ps, posnmsg &m, int keyframe = POSNKEYFRAME);
+extern bool decodeposn(const posnmsg &m, posnstream &ps, posnstate &s);
+extern void putposn(ucharbuf &p, const posnmsg &m);
+extern void putposn(packetbuf &p, const posnmsg &m);
+extern bool getposn(ucharbuf &p, posnmsg &m);
 extern void putgzbuf(vector<uchar> &d, vector<uchar> &s); // zips a vector into a stream, stored in another vector
 extern ucharbuf *getgzbuf(ucharbuf &p); // fetch a gzipped buffer; needs to be freed properly later
 extern void freegzbuf(ucharbuf *p);  // free a ucharbuf created by getgzbuf()
@@ -1067,20 +1086,38 @@ extern void trimtrailingwhitespace(char *s);
 extern string mastername;
 extern int masterport;
 extern ENetSocket connectmaster();
+struct infoplayer { int cn, offset, len; };
+struct infosnapshot                     // everything the info responder thread needs, built by the main thread
+{
+    int refs, millis;
+    volatile bool used;                 // set by the info responder thread
+    vector<uchar> pong;                 // standard pong, up to the pong flags
+    int pongflags;                      // without PONGFLAG_BANNED and PONGFLAG_BLACKLIST
+    vector<enet_uint32> bans;
+    vector<iprange> blacklist;
+    vector<uchar> namelist, maprot, uplinkstats, profile, teamscore;
+    vector<int> cns;                    // EXT_PLAYERSTATS: all valid client numbers
+    vector<infoplayer> players;         // EXT_PLAYERSTATS: stats of all TCP clients, in "stats"
+    vector<uchar> stats;
+
+    infosnapshot() : refs(1), millis(0), used(false), pongflags(0) {}
+};
+extern void buildinfosnapshot(infosnapshot &s);
 extern void serverms(int mode, int numplayers, int minremain, char *smapname, int millis, const ENetAddress &localaddr, int *mnum, int *msend, int *mrec, int *cnum, int *csend, int *crec, int protocol_version);
 extern int msgsizelookup(int msg);
 extern const char *genpwdhash(const char *name, const char *pwd, int salt);
 extern void servermsinit(const char *master, const char *ip, int serverport, bool listen);
 extern bool serverpickup(int i, int sender);
 extern bool valid_client(int cn);
-extern void extinfo_cnbuf(ucharbuf &p, int cn);
-extern void extinfo_statsbuf(ucharbuf &p, int pid, int bpos, ENetSocket &pongsock, ENetAddress &addr, ENetBuffer &buf, int len, int *csend);
-extern void extinfo_teamscorebuf(ucharbuf &p);
 extern char *votestring(int type, char *arg1, char *arg2, char *arg3);
 extern int wizardmain(int argc, char **argv);
 
 // some tools
 extern servsqr *createservworld(const sqr *s, int _cubicsize);
+extern void layoutbits(const char *ml, int ls, uint *rows, uint *cols);
+extern bool servsqrrowdims(const servsqr *s, int len, int &first, int &last, int &minfloor, int &maxceil);
+extern void servsqrrowcount(const servsqr *s, int len, int &total, int &rest);
+extern int checkfloorplankernels(const char *ml, const servsqr *s, int ls);
 extern int calcmapdims(mapdim_s &md, const servsqr *s, int _ssize);
 extern int calcmapareastats(mapareastats_s &ms, servsqr *s, int _ssize, const mapdim_s &md);
 extern void calcentitystats(entitystats_s &es, const persistent_entity *pents, int pentsize);
@@ -1095,12 +1132,21 @@ struct demoheader
     char desc[DHDR_DESCCHARS];
     char plist[DHDR_PLISTCHARS];
 };
+// since demo version 3, the header, every chunk of recorded packets and the chunk index are separate gzip members of the file:
+// playback can start at the beginning of every chunk, because every chunk starts with a keyframe (a welcome packet with the full game state)
+#define DEMOCHUNKMILLIS 20000           // a new chunk every 20 seconds
+#define DEMOKEYFRAME 0x40               // flag on the channel of keyframe records (only played, when playback starts with that chunk)
+#define DEMOTRAILERMAGIC "ACDEMIDX"
+struct demoindexentry { int millis, offset; };
+struct demotrailer { int indexoffset, numchunks; char magic[8]; };   // uncompressed, at the very end of the file
 #define DEFDEMOFILEFMT "%w_%h_%n_%Mmin_%G"
 #define DEFDEMOTIMEFMT "%Y%m%d_%H%M"
 
 extern bool watchingdemo;
 extern int demoprotocol;
 extern void enddemoplayback();
+extern int demokeyframebefore(int millis);
+extern bool seekdemo(int millis);
 
 // logging
 
@@ -1128,15 +1174,16 @@ struct serverconfigfile
 // server commandline parsing
 struct servercommandline
 {
-    int uprate, serverport, syslogfacility, filethres, syslogthres, maxdemos, maxclients, kickthreshold, banthreshold, verbose, incoming_limit, afk_limit, ban_time, demotimelocal;
+    int uprate, serverport, syslogfacility, filethres, syslogthres, maxdemos, maxclients, kickthreshold, banthreshold, verbose, incoming_limit, afk_limit, ban_time, demotimelocal, ingestthreads, lagcomp, aoi, posn, demorate, bots, mapcache, mapthreads;
     const char *ip, *master, *logident, *serverpassword, *adminpasswd, *demopath, *maprot, *pwdfile, *blfile, *nbfile, *infopath, *motdpath, *forbidden, *demofilenameformat, *demotimestampformat;
     bool logtimestamp, demo_interm, loggamestatus;
     string motd, servdesc_full, servdesc_pre, servdesc_suf, voteperm, mapperm;
     int clfilenesting;
     vector<const char *> adminonlymaps;
+    vector<const char *> instances;
 
     servercommandline() :   uprate(0), serverport(CUBE_DEFAULT_SERVER_PORT), syslogfacility(6), filethres(-1), syslogthres(-1), maxdemos(5),
-                            maxclients(DEFAULTCLIENTS), kickthreshold(-5), banthreshold(-6), verbose(0), incoming_limit(10), afk_limit(45000), ban_time(20*60*1000), demotimelocal(0),
+                            maxclients(DEFAULTCLIENTS), kickthreshold(-5), banthreshold(-6), verbose(0), incoming_limit(10), afk_limit(45000), ban_time(20*60*1000), demotimelocal(0), ingestthreads(0), lagcomp(1), aoi(0), posn(1), demorate(64), bots(0), mapcache(-1), mapthreads(2),
                             ip(""), master(NULL), logident(""), serverpassword(""), adminpasswd(""), demopath(""),
                             maprot("config/maprot.cfg"), pwdfile("config/serverpwd.cfg"), blfile("config/serverblacklist.cfg"), nbfile("config/nicknameblacklist.cfg"),
                             infopath("config/serverinfo"), motdpath("config/motd"), forbidden("config/forbidden.cfg"),
@@ -1176,6 +1223,50 @@ struct servercommandline
                         int ai = atoi(arg+13);
                         masterport = ai == 0 ? AC_MASTER_PORT : ai;
                     }
+                    else if(!strncmp(arg, "--ingestthreads=", 16))
+                    {
+                        int ai = atoi(arg+16);
+                        ingestthreads = ai < 0 ? 0 : ai;
+                    }
+                    else if(!strncmp(arg, "--lagcomp=", 10))
+                    {
+                        int ai = atoi(arg+10);
+                        lagcomp = clamp(ai, 0, 2);
+                    }
+                    else if(!strncmp(arg, "--aoi=", 6))
+                    {
+                        int ai = atoi(arg+6);
+                        aoi = ai < 2 ? 0 : min(ai, 25);
+                    }
+                    else if(!strncmp(arg, "--posn=", 7))
+                    {
+                        int ai = atoi(arg+7);
+                        posn = clamp(ai, 0, 2);
+                    }
+                    else if(!strncmp(arg, "--demorate=", 11))
+                    {
+                        int ai = atoi(arg+11);
+                        demorate = clamp(ai, 1, 1000);
+                    }
+                    else if(!strncmp(arg, "--bots=", 7))
+                    {
+                        int ai = atoi(arg+7);
+                        bots = clamp(ai, 0, 32);
+                    }
+                    else if(!strncmp(arg, "--mapcache=", 11))
+                    {
+                        int ai = atoi(arg+11);
+                        mapcache = ai < 0 ? -1 : ai;
+                    }
+                    else if(!strncmp(arg, "--mapthreads=", 13))
+                    {
+                        int ai = atoi(arg+13);
+                        mapthreads = clamp(ai, 1, 8);
+                    }
+                    else if(!strncmp(arg, "--instance=", 11))
+                    {
+                        if(arg[11]) instances.add(arg+11);
+                    }
                     else return false;
                     break;
             case 'u': uprate = ai; break;
@@ -3,6 +3,8 @@
 #include "cube.h"
 
 vector<vertex> verts;
+vector<vertex> cachedverts;     // geometry of all cached world chunks (see worldrender.cpp)
+bool worldcached = false;       // the strips of this frame point into cachedverts instead of verts
 
 void finishstrips();
 
@@ -14,7 +16,7 @@ void setupstrips()
     glEnableClientState(GL_COLOR_ARRAY);
     glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 
-    vertex *buf = verts.getbuf();
+    vertex *buf = worldcached ? cachedverts.getbuf() : verts.getbuf();
     glVertexPointer(3, GL_FLOAT, sizeof(vertex), &buf->x);
     glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(vertex), &buf->r);
     glTexCoordPointer(2, GL_FLOAT, sizeof(vertex), &buf->u);
@@ -73,15 +75,10 @@ void renderstrips()
     glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 }
 
-void addstrip(int type, int tex, int start, int n)
+static void addstripbatch(int type, int tex, int start, int n)
 {
     stripbatch *sb = NULL;
-    if(tex==DEFAULT_SKY)
-    {
-        if(minimap) return;
-        sb = &skystrips;
-        loopi(n) skyfloor = min(skyfloor, verts[start + i].z);
-    }
+    if(tex==DEFAULT_SKY) sb = &skystrips;
     else
     {
         sb = &stripbatches[renderedtex[tex]];
@@ -101,6 +98,62 @@ void addstrip(int type, int tex, int start, int n)
     s.count.add(n);
 }
 
+void addstrip(int type, int tex, int start, int n)
+{
+    if(tex==DEFAULT_SKY)
+    {
+        if(minimap) return;
+        loopi(n) skyfloor = min(skyfloor, verts[start + i].z);
+    }
+    addstripbatch(type, tex, start, n);
+}
+
+// world cache support: a chunk is tessellated into verts like a normal frame, then its strips are taken out of the batches
+// and stored with the chunk. rendering the chunk later only adds the stored strips again, relative to its place in cachedverts.
+
+static void takestrips(vector<worldstrip> &dst, strips &s, int type, int tex)
+{
+    loopv(s.first)
+    {
+        worldstrip &w = dst.add();
+        w.tex = tex;
+        w.type = type;
+        w.first = s.first[i];
+        w.count = s.count[i];
+    }
+    s.first.setsize(0);
+    s.count.setsize(0);
+}
+
+static void takestrips(vector<worldstrip> &dst, stripbatch &sb)
+{
+    takestrips(dst, sb.tris, GL_TRIANGLES, sb.tex);
+    takestrips(dst, sb.tristrips, GL_TRIANGLE_STRIP, sb.tex);
+    takestrips(dst, sb.quads, GL_QUADS, sb.tex);
+}
+
+static float lowestvert(const strips &s)
+{
+    float z = 1e16f;
+    loopv(s.first) loopj(s.count[i]) z = min(z, verts[s.first[i] + j].z);
+    return z;
+}
+
+float takestrips(vector<worldstrip> &dst)    // returns the lowest sky vertex (for skyfloor)
+{
+    finishstrips();
+    float skyz = min(lowestvert(skystrips.tris), min(lowestvert(skystrips.tristrips), lowestvert(skystrips.quads)));
+    loopj(renderedtexs) takestrips(dst, stripbatches[j]);
+    takestrips(dst, skystrips);
+    renderedtexs = 0;
+    return skyz;
+}
+
+void addcachedstrips(const worldstrip *s, int n, int base)
+{
+    loopi(n) addstripbatch(s[i].type, s[i].tex, base + s[i].first, s[i].count);
+}
+
 // generating the actual vertices is done dynamically every frame and sits at the
 // leaves of all these functions, and are part of the cpu bottleneck on really slow
 // machines, hence the macros.
@@ -412,6 +465,7 @@ void render_square(int wtex, float floor1, float floor2, float ceil1, float ceil
 void resetcubes()
 {
     verts.setsize(0);
+    worldcached = false;
 
     striptype = 0;
     nquads = 0;
@@ -422,6 +476,8 @@ void resetcubes()
     resetwater();
 }
 
+void resetstrips() { striptype = 0; }
+
 struct shadowvertex { float u, v, x, y, z; };
 vector<shadowvertex> shadowverts;
 
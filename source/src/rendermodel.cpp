@@ -1112,3 +1112,127 @@ void loadallmapmodels()  // try to find all mapmodels in packages/models/mapmode
     silentmodelloaderror = false;
 }
 COMMAND(loadallmapmodels, "");
+
+// "ac_client --mdlanimbench": times the keyframe interpolation and vertex lighting kernels on a made-up model against plain scalar loops,
+// and counts the interpolations a crowd of players needs with and without mdlanimsteps - doesn't need GL
+
+void mdlanimbench()
+{
+    const int numverts = 1500, numframes = 32, rounds = 4000;
+    md2 mdl("mdlanimbench");
+    vertmodel::part *p = new vertmodel::part;
+    mdl.parts.add(p);
+    p->model = &mdl;
+    p->index = 0;
+    p->numframes = numframes;
+    vertmodel::mesh *m = new vertmodel::mesh;
+    p->meshes.add(m);
+    m->owner = p;
+    m->numverts = numverts;
+    m->verts = new vec[numverts*numframes];
+    seedMT(1);
+    loopi(numverts*numframes) m->verts[i] = vec(rndscale(16) - 8, rndscale(16) - 8, rndscale(16));
+    vec *out = new vec[numverts], *ref = new vec[numverts];
+    #define benchframe(n) (&m->verts[((n) % numframes)*numverts])
+    #define ip(p1, p2, t) (p1+t*(p2-p1))
+    #define maxdiff(d) { d = 0; loopj(numverts) loopk(3) d = max(d, fabsf(out[j][k] - ref[j][k])); }
+    printf("%d vertexes, %d rounds\n", numverts, rounds);
+
+    uint start = sl_micros();
+    loopi(rounds) vertmodel::lerpverts(out, benchframe(i), benchframe(i + 1), (i % 100) * 0.01f, numverts);
+    uint kernel = sl_micros() - start;
+    start = sl_micros();
+    loopi(rounds)
+    {
+        const vec *a = benchframe(i), *b = benchframe(i + 1);
+        float t = (i % 100) * 0.01f;
+        loopj(numverts) ref[j] = vec(ip(a[j].x, b[j].x, t), ip(a[j].y, b[j].y, t), ip(a[j].z, b[j].z, t));
+    }
+    uint scalar = sl_micros() - start;
+    float diff;
+    maxdiff(diff);
+    printf("interpolation:  kernel %.2f ns, scalar %.2f ns per vertex, max difference %g\n", kernel * 1000.0f / (rounds*numverts), scalar * 1000.0f / (rounds*numverts), diff);
+
+    start = sl_micros();
+    loopi(rounds) vertmodel::lerpverts(out, benchframe(i), benchframe(i + 1), 0.3f, benchframe(i + 7), benchframe(i + 8), 0.6f, (i % 100) * 0.01f, numverts);
+    kernel = sl_micros() - start;
+    start = sl_micros();
+    loopi(rounds)
+    {
+        const vec *a = benchframe(i), *b = benchframe(i + 1), *pa = benchframe(i + 7), *pb = benchframe(i + 8);
+        float t = 0.3f, pt = 0.6f, ai_t = (i % 100) * 0.01f;
+        #define ip_ai(c) ip(ip(pa[j].c, pb[j].c, pt), ip(a[j].c, b[j].c, t), ai_t)
+        loopj(numverts) ref[j] = vec(ip_ai(x), ip_ai(y), ip_ai(z));
+        #undef ip_ai
+    }
+    scalar = sl_micros() - start;
+    maxdiff(diff);
+    printf("blended:        kernel %.2f ns, scalar %.2f ns per vertex, max difference %g\n", kernel * 1000.0f / (rounds*numverts), scalar * 1000.0f / (rounds*numverts), diff);
+
+    if(!world) setupworld(8);
+    loopi(cubicsize) { world[i].r = rnd(256); world[i].g = rnd(256); world[i].b = rnd(256); }
+    glmatrixf mat;
+    mat.identity();
+    mat.translate(ssize/2, ssize/2, 0);
+    mat.rotate_around_z(30*RAD);
+    vertmodel::lightvert *lv = new vertmodel::lightvert[numverts], *lvref = new vertmodel::lightvert[numverts];
+    start = sl_micros();
+    loopi(rounds) vertmodel::lightverts(lv, benchframe(i), numverts, mat);
+    kernel = sl_micros() - start;
+    start = sl_micros();
+    loopi(rounds)
+    {
+        const vec *buf = benchframe(i);
+        loopj(numverts)
+        {
+            const sqr *s = S((int)mat.transformx(buf[j]), (int)mat.transformy(buf[j]));
+            lvref[j].r = s->r;
+            lvref[j].g = s->g;
+            lvref[j].b = s->b;
+            lvref[j].a = 255;
+        }
+    }
+    scalar = sl_micros() - start;
+    printf("vertex light:   kernel %.2f ns, scalar %.2f ns per vertex, %s\n", kernel * 1000.0f / (rounds*numverts), scalar * 1000.0f / (rounds*numverts),
+        memcmp(lv, lvref, numverts*sizeof(vertmodel::lightvert)) ? "DIFFERENT" : "same result");
+
+    // a crowd of 16 players in the same 8 frame animation (100ms per frame), rendered at 200 fps for 10 seconds:
+    // with random start times, and in four groups that started within a frame of each other
+    animstate as;
+    as.anim = ANIM_LOOP;
+    as.frame = 0;
+    as.range = 8;
+    as.speed = 100;
+    int basetimes[2][16], oldsteps = mdlanimsteps, oldmillis = lastmillis;
+    loopi(16)
+    {
+        basetimes[0][i] = rnd(800);
+        basetimes[1][i] = (i & 3) * 200 + rnd(5);
+    }
+    loopk(2) loopl(2)
+    {
+        mdlanimsteps = l ? oldsteps : 0;
+        int misses = 0, renders = 0;
+        start = sl_micros();
+        for(lastmillis = 1000; lastmillis < 11000; lastmillis += 5) loopi(16)
+        {
+            as.basetime = basetimes[k][i];
+            vertmodel::anpos cur;
+            cur.setframes(as);
+            vertmodel::dyncacheentry *first = m->dyncache.start(), *d = m->gendynverts(as, cur, NULL, 0);
+            if(d && d == m->dyncache.start() && d != first) misses++;
+            renders++;
+        }
+        printf("%s, mdlanimsteps %d: %d of %d renders interpolated, %.2f ms per second\n", k ? "in groups" : "random  ", mdlanimsteps, misses, renders, (sl_micros() - start) / 10000.0f);
+    }
+    mdlanimsteps = oldsteps;
+    lastmillis = oldmillis;
+    while(m->dyncache.start() != m->dyncache.end()) m->dyncache.start()->unlink();  // don't leave entries of the deleted mesh in dynalloc
+    #undef benchframe
+    #undef ip
+    #undef maxdiff
+    delete[] out;
+    delete[] ref;
+    delete[] lv;
+    delete[] lvref;
+}
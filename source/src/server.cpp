@@ -17,8 +17,6 @@ VARP(serverdebug, 0, 0, 1);
 #include "signal.h"
 
 // config
-vector<servermap *> servermaps;             // all available maps kept in memory
-
 servercontroller *svcctrl = NULL;
 servercommandline scl;
 servermaprot maprot;
@@ -35,7 +33,8 @@ ENetHost *serverhost = NULL;
 int laststatus = 0, servmillis = 0, lastfillup = 0;
 
 vector<client *> clients;
-vector<worldstate *> worldstates;
+vector<worldstate *> worldstates, worldstatepool;   // worldstates still referenced by queued packets, and unused ones ready for recycling
+struct { int copied, ticks, maxcopied, maxalive; } wsstats = { 0, 0, 0, 0 };    // worldstate statistics for the status line
 vector<savedscore> savedscores;
 vector<ban> bans;
 vector<demofile> demofiles;
@@ -69,9 +68,12 @@ int totalclients = 0;
 int cn2boot;
 int servertime = 0, serverlagged = 0;
 
+#include "serverinstances.h"
+#include "serverprofiler.h"
+
 // synchronising the worker threads...
 
-void poll_serverthreads()       // called once per mainloop-timeslice
+bool poll_serverthreads()       // called once per mainloop-timeslice, returns true while the readmapsthread is busy
 {
     static vector<servermap *> servermapstodelete;
     static int stage = 0, lastworkerthreadstart = 0;
@@ -81,9 +83,15 @@ void poll_serverthreads()       // called once per mainloop-timeslice
         default: // start first thread
         {
             if(startnewservermapsepoch || readmapsthread_sem->getvalue()) fatal("thread management mishap");  // zero tolerance...
+            if(mapnotifyfd >= 0 && !readmapnotifies())
+            { // additional game instance: nothing changed
+                stage = 2;
+                lastworkerthreadstart = servmillis;
+                break;
+            }
 
             // wake readmapsthread
-            logline(ACLOG_INFO,"waking readmapsthread");
+            if(mapnotifyfd < 0) logline(ACLOG_INFO,"waking readmapsthread");
             startnewservermapsepoch = true;
             readmapsthread_sem->post();
             stage = 1;
@@ -92,34 +100,35 @@ void poll_serverthreads()       // called once per mainloop-timeslice
         }
         case 1:  // readmapsthread building/updating the list of maps in memory
         {
-            servermap *fresh = (servermap *) servermapdropbox;
-            if(fresh)
+            bool done = !startnewservermapsepoch;
+            sl_membarrier();    // (everything the readmapsthread queued before it was done, is in the queue now)
+            for(servermap *fresh = servermapsloaded.takeall(), *next; fresh; fresh = next)
             {
-                if(fresh == servermapdropbox)
+                next = fresh->queuenext;
+                // got new servermap...
+                servermap *old = getservermap(fresh->fname);   // we don't check paths here - map filenames have to be unique
+                if(old)
+                {  // found map of same name
+                    logline(ACLOG_INFO,"marked servermap %s%s for deletion", old->fpath, old->fname);
+                    removeservermap(old);
+                    servermapstodelete.add(old); // mark old version for deletion
+                }
+                if(fresh->isok)
                 {
-                    // got new servermap...
-                    loopv(servermaps)
-                    {
-                        if(!strcmp(servermaps[i]->fname, fresh->fname))   // we don't check paths here - map filenames have to be unique
-                        {  // found map of same name
-                            logline(ACLOG_INFO,"marked servermap %s%s for deletion", servermaps[i]->fpath, servermaps[i]->fname);
-                            servermapstodelete.add(servermaps.remove(i)); // mark old version for deletion
-                        }
-                    }
-                    if(fresh->isok)
-                    {
-                        servermaps.add(fresh);
-                        logline(ACLOG_INFO,"added servermap %s%s", fresh->fpath, fresh->fname);
-                    }
-                    servermapdropbox = NULL;
+                    addservermap(fresh);
+                    logline(ACLOG_INFO,"added servermap %s%s", fresh->fpath, fresh->fname);
                 }
-                readmapsthread_sem->post();
+                notifyinstances(fresh);
+                if(!fresh->isok) delete fresh;
             }
-            else if(!startnewservermapsepoch)
+            if(done)
             {
                 // readmapsthread is done
                 while(!readmapsthread_sem->trywait())
                     ;
+                static bool firstscan = true;
+                if(firstscan && mapnotifyfd < 0) logline(ACLOG_INFO, "read %d servermaps in %d milliseconds (%d from the map cache)", servermaps.length(), servmillis - lastworkerthreadstart, servermapcachehits);
+                firstscan = false;
                 stage++;
             }
             break;
@@ -143,7 +152,8 @@ void poll_serverthreads()       // called once per mainloop-timeslice
         case 4:  // pause worker threads for a while (restart once a minute)
 #endif
         {
-            if(servmillis - lastworkerthreadstart > 60 * 1000) stage = 0;
+            pollinstances();
+            if(servmillis - lastworkerthreadstart > (mapnotifyfd >= 0 ? 1000 : 60 * 1000)) stage = 0;   // additional game instances only check for news from the first one
             else if(numclients() == 0)
             {   // empty server and nothing to do:
                 loopvrev(servermapstodelete) delete servermapstodelete.remove(i);    // delete outdated servermaps
@@ -151,6 +161,7 @@ void poll_serverthreads()       // called once per mainloop-timeslice
             break;
         }
     }
+    return stage == 1;
 }
 
 
@@ -160,6 +171,8 @@ bool valid_client(int cn)
     return clients.inrange(cn) && clients[cn]->type != ST_EMPTY;
 }
 
+#define MAXPOOLEDWORLDSTATES 8
+
 void cleanworldstate(ENetPacket *packet)
 {
    loopv(worldstates)
@@ -169,8 +182,9 @@ void cleanworldstate(ENetPacket *packet)
        else continue;
        if(!ws->uses)
        {
-           delete ws;
            worldstates.remove(i);
+           if(worldstatepool.length() < MAXPOOLEDWORLDSTATES) worldstatepool.add(ws);   // keep the buffers for one of the next ticks
+           else delete ws;
        }
        break;
    }
@@ -200,51 +214,210 @@ void sendpacket(int n, int chan, ENetPacket *packet, int exclude, bool demopacke
 
 static bool reliablemessages = false;
 
+// area of interest
+//
+// with "--aoi=N", players that are far apart and can't see each other get only every Nth position update of each other.
+// the visibility is precomputed for every map on a coarse grid (at most 32x32 blocks) from the floorplan (only solid cubes block the view).
+// the grid is built on a thread of its own when the map starts (from a copy of the floorplan), until it is ready, everyone gets everything.
+
+#define AOIMAXBLOCKSHIFT 5  // 32 blocks per side
+#define AOINEARDIST     48  // players closer than this always get all updates
+
+struct aoigrid
+{
+    int factor, shift, size;    // the map is 1<<factor cubes wide, blocks are 1<<shift cubes wide, size blocks per side
+    int gen, buildtime;         // number of the game, it was built for; build time in microseconds
+    const char *layout;         // (only while building)
+    vector<int> spot;           // one open cube per block (-1: block is solid)
+    vector<uint> visbits;       // one bit per pair of blocks
+
+    aoigrid() : factor(0), shift(0), size(0), gen(0), buildtime(0), layout(NULL) {}
+
+    bool clearline(int a, int b)   // can cube a see cube b
+    {
+        int mask = (1 << factor) - 1, x1 = a & mask, y1 = a >> factor, dx = (b & mask) - x1, dy = (b >> factor) - y1;
+        int steps = max(abs(dx), abs(dy));
+        for(int i = 1; i < steps; i++)
+        {
+            if(layout[x1 + (dx * i) / steps + ((y1 + (dy * i) / steps) << factor)] == 127) return false;
+        }
+        return true;
+    }
+
+    void setvisible(int a, int b)
+    {
+        int n = size * size, ab = a * n + b, ba = b * n + a;
+        visbits[ab >> 5] |= 1 << (ab & 31);
+        visbits[ba >> 5] |= 1 << (ba & 31);
+    }
+
+    void build(const char *maplayout, int maplayout_factor)    // (only uses the layout it gets: runs on the aoi thread)
+    {
+        layout = maplayout;
+        factor = maplayout_factor;
+        shift = max(factor - AOIMAXBLOCKSHIFT, 3);
+        size = 1 << max(factor - shift, 0);
+        int n = size * size, bs = 1 << shift;
+        loopi(n)
+        {   // use the open cube closest to the center of the block
+            int bx = (i % size) << shift, by = (i / size) << shift, best = -1, bestdist = INT_MAX;
+            loopj(bs) loopk(bs)
+            {
+                int x = bx + k, y = by + j, dist = pow2(2*k + 1 - bs) + pow2(2*j + 1 - bs);
+                if(dist < bestdist && layout[x + (y << factor)] != 127) { best = x + (y << factor); bestdist = dist; }
+            }
+            spot.add(best);
+        }
+        loopi((n * n + 31) / 32) visbits.add(0);
+        loopi(n) if(spot[i] >= 0) for(int j = i; j < n; j++) if(spot[j] >= 0)
+        {
+            if((abs(i % size - j % size) <= 1 && abs(i / size - j / size) <= 1) || clearline(spot[i], spot[j])) setvisible(i, j);
+        }
+        layout = NULL;
+    }
+
+    int block(const vec &o)
+    {
+        int last = (1 << factor) - 1, x = int(clamp(o.x, 0.0f, float(last))) >> shift, y = int(clamp(o.y, 0.0f, float(last))) >> shift;
+        return x + y * size;
+    }
+
+    bool visible(const vec &a, const vec &b)
+    {
+        int ab = block(a) * size * size + block(b);
+        return (visbits[ab >> 5] >> (ab & 31)) & 1;
+    }
+};
+
+aoigrid *aoi = NULL;                        // the grid of the current map, NULL while it isn't built yet
+static aoigrid *volatile aoibuilt = NULL;   // finished by the aoi thread, not yet picked up by the main thread
+static int aoigen = 0;
+
+struct aoijob { char *layout; int factor, gen; };
+
+int aoithread(void *data)
+{
+    aoijob *job = (aoijob *)data;
+    uint start = sl_micros();
+    aoigrid *g = new aoigrid;
+    g->build(job->layout, job->factor);
+    g->gen = job->gen;
+    g->buildtime = sl_micros() - start;
+    delete[] job->layout;
+    delete job;
+    delete sl_atomicswap(&aoibuilt, g);     // a grid nobody picked up is outdated anyway
+    return 0;
+}
+
+void startaoi()     // start building the grid of the current map
+{
+    DELETEP(aoi);
+    aoigen++;
+    if(!maplayout) return;
+    aoijob *job = new aoijob;
+    int len = maplayoutssize * maplayoutssize;
+    job->layout = new char[len];
+    memcpy(job->layout, maplayout, len);
+    job->factor = maplayout_factor;
+    job->gen = aoigen;
+    sl_detachthread(sl_createthread(aoithread, job));
+}
+
+void pollaoi()      // pick up a finished grid, if it belongs to the current map
+{
+    if(!aoibuilt) return;
+    aoigrid *g = sl_atomicswap(&aoibuilt, (aoigrid *)NULL);
+    if(!g) return;
+    if(g->gen != aoigen) { delete g; return; }
+    DELETEP(aoi);
+    aoi = g;
+    int open = 0;
+    loopv(aoi->spot) if(aoi->spot[i] >= 0) open++;
+    logline(ACLOG_VERBOSE, "area of interest: %dx%d blocks of %d cubes, %d open, built in %d milliseconds", aoi->size, aoi->size, 1 << aoi->shift, open, aoi->buildtime / 1000);
+}
+
+bool aoiskip(client &receiver, client &sender)      // true, if the receiver can do without the sender's position in this worldstate
+{
+    if(!aoi || receiver.state.state != CS_ALIVE || sender.state.state != CS_ALIVE) return false;
+    if((wsstats.ticks + receiver.clientnum + sender.clientnum) % scl.aoi == 0) return false;
+    if(receiver.state.o.squareddist(sender.state.o) < AOINEARDIST * AOINEARDIST) return false;
+    return !aoi->visible(receiver.state.o, sender.state.o);
+}
+
+// every client gets all positions and messages except its own:
+// the worldstate buffers hold the concatenated data twice in a row, so that "everything but mine" is always one contiguous window (starting right after the own data)
+// positions received as SV_POSN are passed on as SV_POSC (or SV_POS, if they don't fit), unless "--posn=2" is set and every client can read SV_POSN
 bool buildworldstate()
 {
-    static struct { int posoff, poslen, msgoff, msglen; } pkt[MAXCLIENTS];
-    worldstate &ws = *new worldstate;
+    static struct { int posoff, poslen, msgoff, msglen, hdrlen; bool raw, key; uchar hdr[16]; } pkt[MAXCLIENTS];
+    static bool aoiskipped[MAXCLIENTS];
+    int psize = 0, msize = 0;
+    bool rawposn = scl.posn > 1;      // pass on SV_POSN as received, if every client can read it
+    if(rawposn) loopv(clients) if(clients[i]->type==ST_TCPIP && clients[i]->isauthed && clients[i]->acversion < POSN_VERSION) { rawposn = false; break; }
     loopv(clients)
     {
         client &c = *clients[i];
-        if(c.type!=ST_TCPIP || !c.isauthed) continue;
+        pkt[i].posoff = pkt[i].msgoff = -1;
+        if((c.type!=ST_TCPIP && c.type!=ST_AI) || !c.isauthed) continue;
         c.overflow = 0;
-        if(c.position.empty()) pkt[i].posoff = -1;
-        else
+        if(!rawposn) c.posnsynced = false;
+        else if(c.rawposnkeylen) c.posnsynced = true;
+        pkt[i].raw = rawposn && c.posnsynced && !c.rawposn.empty();
+        pkt[i].key = pkt[i].raw && c.rawposnkeylen;
+        vector<uchar> &pos = pkt[i].raw ? c.rawposn : c.position;
+        if(!pos.empty())
         {
-            pkt[i].posoff = ws.positions.length();
-            ws.positions.put(c.position.getbuf(), c.position.length());
-            pkt[i].poslen = ws.positions.length() - pkt[i].posoff;
-            c.position.setsize(0);
+            pkt[i].posoff = psize;
+            psize += (pkt[i].poslen = pos.length());
         }
-        if(c.messages.empty()) pkt[i].msgoff = -1;
-        else
+        if(!c.messages.empty())
         {
-            pkt[i].msgoff = ws.messages.length();
-            putint(ws.messages, SV_CLIENT);
-            putint(ws.messages, c.clientnum);
-            putuint(ws.messages, c.messages.length());
-            ws.messages.put(c.messages.getbuf(), c.messages.length());
-            pkt[i].msglen = ws.messages.length() - pkt[i].msgoff;
-            c.messages.setsize(0);
+            ucharbuf h(pkt[i].hdr, sizeof(pkt[i].hdr));
+            putint(h, SV_CLIENT);
+            putint(h, c.clientnum);
+            putuint(h, c.messages.length());
+            pkt[i].hdrlen = h.length();
+            pkt[i].msgoff = msize;
+            msize += (pkt[i].msglen = h.length() + c.messages.length());
         }
     }
-    int psize = ws.positions.length(), msize = ws.messages.length();
-    if(psize)
+    wsstats.ticks++;
+    if(!psize && !msize)
     {
-        recordpacket(0, ws.positions.getbuf(), psize);
-        ucharbuf p = ws.positions.reserve(psize);
-        p.put(ws.positions.getbuf(), psize);
-        ws.positions.addbuf(p);
+        reliablemessages = false;
+        return false;
     }
-    if(msize)
+
+    worldstate &ws = worldstatepool.length() ? *worldstatepool.pop() : *new worldstate;
+    ws.reset();
+    uchar *pbuf = ws.positions.pad(psize * 2), *mbuf = ws.messages.pad(msize * 2);
+    loopv(clients)
     {
-        recordpacket(1, ws.messages.getbuf(), msize);
-        ucharbuf p = ws.messages.reserve(msize);
-        p.put(ws.messages.getbuf(), msize);
-        ws.messages.addbuf(p);
+        client &c = *clients[i];
+        if((c.type!=ST_TCPIP && c.type!=ST_AI) || !c.isauthed) continue;
+        if(pkt[i].posoff >= 0)
+        {
+            vector<uchar> &pos = pkt[i].raw ? c.rawposn : c.position;
+            memcpy(pbuf + pkt[i].posoff, pos.getbuf(), pkt[i].poslen);
+            memcpy(pbuf + pkt[i].posoff + psize, pos.getbuf(), pkt[i].poslen);
+            c.position.setsize(0);
+            c.rawposn.setsize(0);
+            c.rawposnkeylen = 0;
+        }
+        if(pkt[i].msgoff >= 0)
+        {
+            uchar *m = mbuf + pkt[i].msgoff;
+            memcpy(m, pkt[i].hdr, pkt[i].hdrlen);
+            memcpy(m + pkt[i].hdrlen, c.messages.getbuf(), c.messages.length());
+            memcpy(m + msize, m, pkt[i].msglen);
+            c.messages.setsize(0);
+        }
     }
-    ws.uses = 0;
+    int copied = 2 * (psize + msize);
+    wsstats.copied += copied;
+    if(copied > wsstats.maxcopied) wsstats.maxcopied = copied;
+    if(psize) recordpacket(0, pbuf, psize);
+    if(msize) recordpacket(1, mbuf, msize);
     loopv(clients)
     {
         client &c = *clients[i];
@@ -252,17 +425,38 @@ bool buildworldstate()
         ENetPacket *packet;
         if(psize && (pkt[i].posoff<0 || psize-pkt[i].poslen>0))
         {
-            packet = enet_packet_create(&ws.positions[pkt[i].posoff<0 ? 0 : pkt[i].posoff+pkt[i].poslen],
-                                        pkt[i].posoff<0 ? psize : psize-pkt[i].poslen,
-                                        ENET_PACKET_FLAG_NO_ALLOCATE);
-            sendpacket(c.clientnum, 0, packet);
-            if(!packet->referenceCount) enet_packet_destroy(packet);
-            else { ++ws.uses; packet->freeCallback = cleanworldstate; }
+            int plen = pkt[i].posoff<0 ? psize : psize-pkt[i].poslen, skipped = 0;
+            if(scl.aoi) loopvj(clients)
+            {
+                aoiskipped[j] = j != i && pkt[j].posoff >= 0 && !pkt[j].key && aoiskip(c, *clients[j]);  // keyframes always get through
+                if(aoiskipped[j]) skipped += pkt[j].poslen;
+            }
+            c.aoisent += plen - skipped;
+            c.aoisaved += skipped;
+            if(!skipped)
+            {
+                packet = enet_packet_create(&pbuf[pkt[i].posoff<0 ? 0 : pkt[i].posoff+pkt[i].poslen], plen, ENET_PACKET_FLAG_NO_ALLOCATE);
+                sendpacket(c.clientnum, 0, packet);
+                if(!packet->referenceCount) enet_packet_destroy(packet);
+                else { ++ws.uses; packet->freeCallback = cleanworldstate; }
+            }
+            else if(skipped < plen)
+            { // this client gets its own selection of positions
+                packet = enet_packet_create(NULL, plen - skipped, 0);
+                uchar *p = packet->data;
+                loopvj(clients) if(j != i && pkt[j].posoff >= 0 && !aoiskipped[j])
+                {
+                    memcpy(p, pbuf + pkt[j].posoff, pkt[j].poslen);
+                    p += pkt[j].poslen;
+                }
+                sendpacket(c.clientnum, 0, packet);
+                if(!packet->referenceCount) enet_packet_destroy(packet);
+            }
         }
 
         if(msize && (pkt[i].msgoff<0 || msize-pkt[i].msglen>0))
         {
-            packet = enet_packet_create(&ws.messages[pkt[i].msgoff<0 ? 0 : pkt[i].msgoff+pkt[i].msglen],
+            packet = enet_packet_create(&mbuf[pkt[i].msgoff<0 ? 0 : pkt[i].msgoff+pkt[i].msglen],
                                         pkt[i].msgoff<0 ? msize : msize-pkt[i].msglen,
                                         (reliablemessages ? ENET_PACKET_FLAG_RELIABLE : 0) | ENET_PACKET_FLAG_NO_ALLOCATE);
             sendpacket(c.clientnum, 1, packet);
@@ -273,12 +467,14 @@ bool buildworldstate()
     reliablemessages = false;
     if(!ws.uses)
     {
-        delete &ws;
+        if(worldstatepool.length() < MAXPOOLEDWORLDSTATES) worldstatepool.add(&ws);
+        else delete &ws;
         return false;
     }
     else
     {
         worldstates.add(&ws);
+        if(worldstates.length() > wsstats.maxalive) wsstats.maxalive = worldstates.length();
         return true;
     }
 }
@@ -504,17 +700,31 @@ void sendspawn(client *c)
 }
 
 // demo
-stream *demotmp = NULL, *demorecord = NULL, *demoplayback = NULL;
+stream *demoplayback = NULL;
+stream *demoplaybackfile = NULL;    // the file below demoplayback
+vector<demoindexentry> demoplaybackindex;
 bool recordpackets = false;
-int nextplayback = 0;
+int nextplayback = 0, demoplaybackchunk = 0;
+bool demoplaykeyframe = false;      // play the next keyframe record (set, when playback starts at a chunk)
+
+#include "serverdemo.h"
+
+void newdemochunk()     // start a new chunk with a keyframe
+{
+    putdemorecord(DEMOREC_CHUNK, NULL, 0);
+    demochunkstart = gamemillis;
+    packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+    welcomepacket(p, -1);
+    putdemorecord(1 | DEMOKEYFRAME, p.buf, p.len);
+}
 
 void writedemo(int chan, void *data, int len)
 {
-    if(!demorecord) return;
-    int stamp[3] = { gamemillis, chan, len };
-    lilswap(stamp, 3);
-    demorecord->write(stamp, sizeof(stamp));
-    demorecord->write(data, len);
+    if(!demorecording) return;
+    uint profiled = profstart();
+    if(gamemillis - demochunkstart >= DEMOCHUNKMILLIS) newdemochunk();
+    putdemorecord(chan, data, len);
+    profend(PROF_DEMO, profiled);
 }
 
 void recordpacket(int chan, void *data, int len)
@@ -640,97 +850,56 @@ const char *getDemoFilename(int gmode, int mplay, int mdrop, int tstamp, char *s
 #undef DEMOFORMAT
 #undef DEMOTSFORMAT
 
-void enddemorecord()
+void enddemorecord()   // hand the recording over to the demowriterthread, which finishes it
 {
-    if(!demorecord) return;
+    if(!demorecording) return;
 
-    delete demorecord;
+    demorecording = false;
     recordpackets = false;
-    demorecord = NULL;
-
-    if(!demotmp) return;
 
+    demofinish *f = new demofinish;
     if(gamemillis < DEMO_MINTIME)
     {
-        delete demotmp;
-        demotmp = NULL;
+        f->discard = true;
         logline(ACLOG_INFO, "Demo discarded.");
-        return;
     }
-
-    int len = demotmp->size();
-    demotmp->seek(0, SEEK_SET);
-    if(demofiles.length() >= scl.maxdemos)
+    else
     {
-        delete[] demofiles[0].data;
-        demofiles.remove(0);
-    }
-    int mr = gamemillis >= gamelimit ? 0 : (gamelimit - gamemillis + 60000 - 1)/60000;
-    demofile &d = demofiles.add();
-
-    //2010oct10:ft: suggests : formatstring(d.info)("%s, %s, %.2f%s", modestr(gamemode), smapname, len > 1024*1024 ? len/(1024*1024.f) : len/1024.0f, len > 1024*1024 ? "MB" : "kB"); // the datetime bit is pretty useless in the servmesg, no?!
-    formatstring(d.info)("%s: %s, %s, %.2f%s", asctimestr(), modestr(gamemode), smapname, len > 1024*1024 ? len/(1024*1024.f) : len/1024.0f, len > 1024*1024 ? "MB" : "kB");
-    if(mr) { concatformatstring(d.info, ", %d mr", mr); concatformatstring(d.file, "_%dmr", mr); }
-    defformatstring(msg)("Demo \"%s\" recorded\nPress F10 to download it from the server..", d.info);
-    sendservmsg(msg);
-    logline(ACLOG_INFO, "Demo \"%s\" recorded.", d.info);
-
-    // 2011feb05:ft: previously these two static formatstrings were used ..
-    //formatstring(d.file)("%s_%s_%s", timestring(), behindpath(smapname), modestr(gamemode, true)); // 20100522_10.08.48_ac_mines_DM.dmo
-    //formatstring(d.file)("%s_%s_%s", modestr(gamemode, true), behindpath(smapname), timestring( true, "%Y.%m.%d_%H%M")); // DM_ac_mines.2010.05.22_1008.dmo
-    // .. now we use client-side parseable fileattribs
-    int mPLAY = gamemillis >= gamelimit ? gamelimit/1000 : gamemillis/1000;
-    int mDROP = gamemillis >= gamelimit ? 0 : (gamelimit - gamemillis)/1000;
-    int iTIME = time(NULL);
-    const char *mTIME = numtime();
-    const char *sMAPN = behindpath(smapname);
-    string iMAPN;
-    copystring(iMAPN, sMAPN);
-    formatstring(d.file)( "%d:%d:%d:%s:%s", gamemode, mPLAY, mDROP, mTIME, iMAPN);
-
-    d.data = new uchar[len];
-    d.len = len;
-    demotmp->read(d.data, len);
-    delete demotmp;
-    demotmp = NULL;
-    if(scl.demopath[0])
-    {
-        formatstring(msg)("%s%s.dmo", scl.demopath, getDemoFilename(gamemode, mPLAY, mDROP, iTIME, iMAPN)); //d.file);
-        path(msg);
-        stream *demo = openfile(msg, "wb");
-        if(demo)
-        {
-            int wlen = (int) demo->write(d.data, d.len);
-            delete demo;
-            logline(ACLOG_INFO, "demo written to file \"%s\" (%d bytes)", msg, wlen);
-        }
-        else
+        f->mr = gamemillis >= gamelimit ? 0 : (gamelimit - gamemillis + 60000 - 1)/60000;
+
+        //2010oct10:ft: suggests : formatstring(d.info)("%s, %s, %.2f%s", modestr(gamemode), smapname, len > 1024*1024 ? len/(1024*1024.f) : len/1024.0f, len > 1024*1024 ? "MB" : "kB"); // the datetime bit is pretty useless in the servmesg, no?!
+        formatstring(f->info)("%s: %s, %s", asctimestr(), modestr(gamemode), smapname);   // the size is added by the demowriterthread
+
+        // 2011feb05:ft: previously these two static formatstrings were used ..
+        //formatstring(d.file)("%s_%s_%s", timestring(), behindpath(smapname), modestr(gamemode, true)); // 20100522_10.08.48_ac_mines_DM.dmo
+        //formatstring(d.file)("%s_%s_%s", modestr(gamemode, true), behindpath(smapname), timestring( true, "%Y.%m.%d_%H%M")); // DM_ac_mines.2010.05.22_1008.dmo
+        // .. now we use client-side parseable fileattribs
+        int mPLAY = gamemillis >= gamelimit ? gamelimit/1000 : gamemillis/1000;
+        int mDROP = gamemillis >= gamelimit ? 0 : (gamelimit - gamemillis)/1000;
+        int iTIME = time(NULL);
+        const char *mTIME = numtime();
+        const char *sMAPN = behindpath(smapname);
+        string iMAPN;
+        copystring(iMAPN, sMAPN);
+        formatstring(f->file)( "%d:%d:%d:%s:%s", gamemode, mPLAY, mDROP, mTIME, iMAPN);
+
+        if(scl.demopath[0])
         {
-            logline(ACLOG_INFO, "failed to write demo to file \"%s\"", msg);
+            formatstring(f->diskfile)("%s%s.dmo", scl.demopath, getDemoFilename(gamemode, mPLAY, mDROP, iTIME, iMAPN)); //d.file);
+            path(f->diskfile);
         }
     }
+    putdemorecord(DEMOREC_END, &f, sizeof(f));
 }
 
 void setupdemorecord()
 {
     if(numlocalclients() || !m_mp(gamemode) || gamemode == GMODE_COOPEDIT) return;
 
-    defformatstring(demotmppath)("demos/demorecord_%s_%d", scl.ip[0] ? scl.ip : "local", scl.serverport);
-    demotmp = opentempfile(demotmppath, "w+b");
-    if(!demotmp) return;
-
-    stream *f = opengzfile(NULL, "wb", demotmp);
-    if(!f)
-    {
-        delete demotmp;
-        demotmp = NULL;
-        return;
-    }
-
+    startdemowriter();
     sendservmsg("recording demo");
     logline(ACLOG_INFO, "Demo recording started.");
 
-    demorecord = f;
     recordpackets = false;
 
     demoheader hdr;
@@ -754,11 +923,10 @@ void setupdemorecord()
         if(strlen(hdr.plist) + strlen(ci->name) < DHDR_PLISTCHARS - 2) { strcat(hdr.plist, bl); strcat(hdr.plist, ci->name); }
         bl = " ";
     }
-    demorecord->write(&hdr, sizeof(demoheader));
+    putdemorecord(DEMOREC_START, &hdr, sizeof(demoheader));
 
-    packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
-    welcomepacket(p, -1);
-    writedemo(1, p.buf, p.len);
+    demorecording = true;
+    newdemochunk();     // the first keyframe is played from the start
 }
 
 void listdemos(int cn)
@@ -774,13 +942,13 @@ static void cleardemos(int n)
 {
     if(!n)
     {
-        loopv(demofiles) delete[] demofiles[i].data;
+        loopv(demofiles) demofiles[i].buf->release();
         demofiles.shrink(0);
         sendservmsg("cleared all demos");
     }
     else if(demofiles.inrange(n-1))
     {
-        delete[] demofiles[n-1].data;
+        demofiles[n-1].buf->release();
         demofiles.remove(n-1);
         defformatstring(msg)("cleared demo %d", n);
         sendservmsg(msg);
@@ -793,7 +961,8 @@ void senddemo(int cn, int num)
 {
     client *cl = cn>=0 ? clients[cn] : NULL;
     bool is_admin = (cl && cl->role == CR_ADMIN);
-    if(scl.demo_interm && (!interm || totalclients > 2) && !is_admin)
+    bool pieces = cl && cl->type == ST_TCPIP && cl->acversion >= DEMOPIECES_VERSION;  // rate limited, doesn't have to wait for the intermission
+    if(scl.demo_interm && !pieces && (!interm || totalclients > 2) && !is_admin)
     {
         sendservmsg("\f3sorry, but this server only sends demos at intermission.\n wait for the end of this game, please", cn);
         return;
@@ -819,23 +988,71 @@ void senddemo(int cn, int num)
     ci.ip = cl->peer->address.host;
     ci.clientnum = cl->clientnum;
 
+    if(pieces)
+    { // senddemopieces() does the rest
+        demodownload &dl = cl->download;
+        dl.reset();
+        dl.buf = d.buf;
+        dl.buf->refs++;
+        dl.allowance = DEMOPIECESIZE;
+        dl.lastmillis = servmillis;
+        packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+        putint(p, SV_SENDDEMOSTART);
+        sendstring(d.file, p);
+        putint(p, dl.buf->len);
+        sendpacket(cn, 2, p.finalize());
+        return;
+    }
+
     if (interm) sending_demo = true;
-    packetbuf p(MAXTRANS + d.len, ENET_PACKET_FLAG_RELIABLE);
+    packetbuf p(MAXTRANS + d.buf->len, ENET_PACKET_FLAG_RELIABLE);
     putint(p, SV_SENDDEMO);
     sendstring(d.file, p);
-    putint(p, d.len);
-    p.put(d.data, d.len);
+    putint(p, d.buf->len);
+    p.put(d.buf->data, d.buf->len);
     sendpacket(cn, 2, p.finalize());
 }
 
+void senddemopieces()   // continue all demo downloads, as far as window and rate limit of each client allow
+{
+    loopv(clients)
+    {
+        client *c = clients[i];
+        demodownload &dl = c->download;
+        if(!dl.buf) continue;
+        if(c->type != ST_TCPIP || dl.acked >= dl.buf->len)
+        {
+            dl.reset();     // done (or gone)
+            continue;
+        }
+        int elapsed = clamp(servmillis - dl.lastmillis, 0, 1000);
+        dl.allowance = min(dl.allowance + elapsed * scl.demorate * 1024 / 1000, DEMOWINDOW);
+        dl.lastmillis = servmillis;
+        while(dl.sent < dl.buf->len && dl.sent - dl.acked < DEMOWINDOW)
+        {
+            int len = min(DEMOPIECESIZE, dl.buf->len - dl.sent);
+            if(len > dl.allowance) break;
+            packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+            putint(p, SV_SENDDEMOPIECE);
+            putint(p, dl.sent);
+            putint(p, len);
+            p.put(dl.buf->data + dl.sent, len);
+            sendpacket(c->clientnum, 2, p.finalize());
+            dl.sent += len;
+            dl.allowance -= len;
+        }
+    }
+}
+
 int demoprotocol;
 bool watchingdemo = false;
 
 void enddemoplayback()
 {
-    if(!demoplayback) return;
-    delete demoplayback;
-    demoplayback = NULL;
+    if(!demoplaybackfile) return;
+    DELETEP(demoplayback);
+    DELETEP(demoplaybackfile);
+    demoplaybackindex.setsize(0);
     watchingdemo = false;
 
     loopv(clients) sendf(i, 1, "risi", SV_DEMOPLAYBACK, "", i);
@@ -845,6 +1062,41 @@ void enddemoplayback()
     loopv(clients) sendwelcome(clients[i]);
 }
 
+bool opendemochunk(int n)    // continue playback at the start of chunk n
+{
+    DELETEP(demoplayback);
+    if(!demoplaybackindex.inrange(n) || !demoplaybackfile->seek(demoplaybackindex[n].offset, SEEK_SET)) return false;
+    demoplayback = opengzfile(NULL, "rb", demoplaybackfile);
+    demoplaybackchunk = n;
+    return demoplayback != NULL;
+}
+
+bool readdemomillis()        // read the time of the next record, moves on to the next chunk, if necessary
+{
+    while(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
+    {
+        if(demoplaybackindex.empty() || !opendemochunk(demoplaybackchunk + 1)) return false;
+    }
+    lilswap(&nextplayback, 1);
+    return true;
+}
+
+bool readdemoindex(stream *f)    // read the chunk index from the end of the file
+{
+    demotrailer t;
+    if(!f->seek(-(long)sizeof(t), SEEK_END) || f->read(&t, sizeof(t))!=sizeof(t) || memcmp(t.magic, DEMOTRAILERMAGIC, sizeof(t.magic))) return false;
+    lilswap(&t.indexoffset, 2);
+    if(t.numchunks <= 0 || t.numchunks > 0x10000 || !f->seek(t.indexoffset, SEEK_SET)) return false;
+    stream *z = opengzfile(NULL, "rb", f);
+    if(!z) return false;
+    demoplaybackindex.setsize(0);
+    int len = t.numchunks * sizeof(demoindexentry);
+    bool ok = z->read(demoplaybackindex.pad(t.numchunks), len) == len;
+    delete z;
+    lilswap(&demoplaybackindex[0].millis, 2 * t.numchunks);
+    return ok;
+}
+
 void setupdemoplayback()
 {
     demoheader hdr;
@@ -852,7 +1104,8 @@ void setupdemoplayback()
     msg[0] = '\0';
     defformatstring(file)("demos/%s.dmo", smapname);
     path(file);
-    demoplayback = opengzfile(file, "rb");
+    demoplaybackfile = openfile(file, "rb");
+    demoplayback = demoplaybackfile ? opengzfile(NULL, "rb", demoplaybackfile) : NULL;
     if(!demoplayback) formatstring(msg)("could not read demo \"%s\"", file);
     else if(demoplayback->read(&hdr, sizeof(demoheader))!=sizeof(demoheader) || memcmp(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic)))
         formatstring(msg)("\"%s\" is not a demo file", file);
@@ -860,14 +1113,17 @@ void setupdemoplayback()
     {
         lilswap(&hdr.version, 1);
         lilswap(&hdr.protocol, 1);
-        if(hdr.version!=DEMO_VERSION) formatstring(msg)("demo \"%s\" requires an %s version of AssaultCube", file, hdr.version<DEMO_VERSION ? "older" : "newer");
+        if(hdr.version!=DEMO_VERSION && hdr.version!=DEMO_VERSION_FLAT) formatstring(msg)("demo \"%s\" requires an %s version of AssaultCube", file, hdr.version<DEMO_VERSION ? "older" : "newer");
         else if(hdr.protocol != PROTOCOL_VERSION && !(hdr.protocol < 0 && hdr.protocol == -PROTOCOL_VERSION) && hdr.protocol != 1132) formatstring(msg)("demo \"%s\" requires an %s version of AssaultCube", file, hdr.protocol<PROTOCOL_VERSION ? "older" : "newer");
         else if(hdr.protocol == 1132) sendservmsg("WARNING: using experimental compatibility mode for older demo protocol, expect breakage");
+        else if(hdr.version == DEMO_VERSION && (!readdemoindex(demoplaybackfile) || !opendemochunk(0))) formatstring(msg)("demo \"%s\" is damaged", file);
         demoprotocol = hdr.protocol;
     }
     if(msg[0])
     {
-        if(demoplayback) { delete demoplayback; demoplayback = NULL; }
+        DELETEP(demoplayback);
+        DELETEP(demoplaybackfile);
+        demoplaybackindex.setsize(0);
         sendservmsg(msg);
         return;
     }
@@ -876,13 +1132,9 @@ void setupdemoplayback()
     sendservmsg(msg);
     sendf(-1, 1, "risi", SV_DEMOPLAYBACK, smapname, -1);
     watchingdemo = true;
+    demoplaykeyframe = true;
 
-    if(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
-    {
-        enddemoplayback();
-        return;
-    }
-    lilswap(&nextplayback, 1);
+    if(!readdemomillis()) enddemoplayback();
 }
 
 void readdemo()
@@ -906,17 +1158,51 @@ void readdemo()
             enddemoplayback();
             return;
         }
-        sendpacket(-1, chan, packet, -1, true);
+        bool skip = (chan & DEMOKEYFRAME) && !demoplaykeyframe;    // we've got the state already
+        chan &= ~DEMOKEYFRAME;
+        demoplaykeyframe = false;
+        if(!skip) sendpacket(-1, chan, packet, -1, true);
         if(!packet->referenceCount) enet_packet_destroy(packet);
-        if(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
+        if(!readdemomillis())
         {
             enddemoplayback();
             return;
         }
-        lilswap(&nextplayback, 1);
     }
 }
 
+static int demochunkat(int millis)     // the last chunk, that starts before millis
+{
+    int lo = 0, hi = demoplaybackindex.length() - 1;
+    while(lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if(demoplaybackindex[mid].millis <= millis) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+int demokeyframebefore(int millis)     // time of the last keyframe before millis, -1: the demo can't be seeked
+{
+    if(!demoplayback || demoplaybackindex.empty()) return -1;
+    return demoplaybackindex[demochunkat(millis)].millis;
+}
+
+bool seekdemo(int millis)       // continue playback at the last keyframe before millis
+{
+    if(!demoplayback || demoplaybackindex.empty()) return false;
+    int n = demochunkat(millis);
+    if(!opendemochunk(n) || !readdemomillis())
+    {
+        enddemoplayback();
+        return false;
+    }
+    gamemillis = demoplaybackindex[n].millis;
+    demoplaykeyframe = true;
+    return true;
+}
+
 struct sflaginfo
 {
     int state;
@@ -1512,7 +1798,7 @@ bool serverpickup(int i, int sender)         // server side item pickup, acknowl
     if(sender>=0)
     {
         client *cl = clients[sender];
-        if(cl->type==ST_TCPIP)
+        if(cl->type==ST_TCPIP || cl->type==ST_AI)
         {
             if( cl->state.state!=CS_ALIVE || !cl->state.canpickup(e.type) || ( m_arena && !free_items(sender) ) ) return false;
             vec v(e.x, e.y, cl->state.o.z);
@@ -1601,6 +1887,8 @@ void serverdamage(client *target, client *actor, int damage, int gun, bool gib,
             sendf(-1, 1, "riii", SV_FLAGCNT, actor->clientnum, actor->state.flagscore);
         }
         target->position.setsize(0);
+        target->rawposn.setsize(0);
+        target->rawposnkeylen = 0;
         ts.state = CS_DEAD;
         ts.lastdeath = gamemillis;
         if(!suic) logline(ACLOG_INFO, "[%s] %s %s%s %s", actor->hostname, actor->name, valid_weapon(gun) ? killmessages[gib ? 1 : 0][gun] : "smurfed", tk ? " their teammate" : "", target->name);
@@ -2053,6 +2341,8 @@ void startgame(const char *newname, int newmode, int newtime, bool notify)
 
         int maploc = MAP_VOID;
         mapstats *ms = getservermapstats(smapname, isdedicated, &maploc);
+        if(scl.aoi) startaoi();
+        botsnewmap();
         mapbuffer.clear();
         if(isdedicated && distributablemap(maploc)) mapbuffer.load();
         if(ms)
@@ -2185,7 +2475,7 @@ int getbantype(int cn)
 {
     if(!valid_client(cn)) return BAN_NONE;
     client &c = *clients[cn];
-    if(c.type==ST_LOCAL) return BAN_NONE;
+    if(c.type!=ST_TCPIP) return BAN_NONE;
     if(checkgban(c.peer->address.host)) return BAN_MASTER;
     if(ipblacklist.check(c.peer->address.host)) return BAN_BLACKLIST;
     loopv(bans)
@@ -2246,7 +2536,7 @@ struct voteinfo
         int stats[VOTE_NUM] = {0};
         int adminvote = VOTE_NEUTRAL;
         loopv(clients)
-            if(clients[i]->type!=ST_EMPTY /*&& clients[i]->connectmillis < callmillis*/) // new connected people will vote now
+            if(clients[i]->type!=ST_EMPTY && clients[i]->type!=ST_AI /*&& clients[i]->connectmillis < callmillis*/) // new connected people will vote now
             {
                 stats[clients[i]->vote]++;
                 if(clients[i]->role==CR_ADMIN) adminvote = clients[i]->vote;
@@ -2316,7 +2606,7 @@ bool scallvote(voteinfo *v, ENetPacket *msg) // true if a regular vote was calle
     int area = isdedicated ? EE_DED_SERV : EE_LOCAL_SERV;
     int error = -1;
     client *c = clients[v->owner], *b = ( v->boot && valid_client(cn2boot) ? clients[cn2boot] : NULL );
-    v->host = v->boot && b ? b->peer->address.host : 0;
+    v->host = v->boot && b && b->type == ST_TCPIP ? b->peer->address.host : 0;
 
     int time = servmillis - c->lastvotecall;
     if ( c->nvotes > 0 && time > 4*60*1000 ) c->nvotes -= time/(4*60*1000);
@@ -2629,7 +2919,7 @@ void welcomeinitclient(packetbuf &p, int exclude = -1)
     loopv(clients)
     {
         client &c = *clients[i];
-        if(c.type!=ST_TCPIP || !c.isauthed || c.clientnum == exclude) continue;
+        if((c.type!=ST_TCPIP && c.type!=ST_AI) || !c.isauthed || c.clientnum == exclude) continue;
         putinitclient(c, p);
     }
 }
@@ -2671,6 +2961,12 @@ void welcomepacket(packetbuf &p, int n)
         putint(p, SV_FORCEDEATH);
         putint(p, n);
         sendf(-1, 1, "ri2x", SV_FORCEDEATH, n, n);
+
+        if(scl.posn && c->acversion >= POSN_VERSION)
+        { // the client may send its position as SV_POSN from now on
+            putint(p, SV_POSN);
+            putint(p, POSNKEYFRAME);
+        }
     }
     if(!c || clients.length()>1)
     {
@@ -2678,7 +2974,7 @@ void welcomepacket(packetbuf &p, int n)
         loopv(clients)
         {
             client &c = *clients[i];
-            if(c.type!=ST_TCPIP || c.clientnum==n) continue;
+            if((c.type!=ST_TCPIP && c.type!=ST_AI) || c.clientnum==n) continue;
             putint(p, c.clientnum);
             putint(p, c.state.state);
             putint(p, c.state.lifesequence);
@@ -2728,7 +3024,7 @@ int checktype(int type, client *cl)
     if(cl && cl->type==ST_LOCAL) return type;
     if(type < 0 || type >= SV_NUM) return -1;
     // server only messages
-    static int servtypes[] = { SV_SERVINFO, SV_WELCOME, SV_INITCLIENT, SV_POSN, SV_CDIS, SV_GIBDIED, SV_DIED,
+    static int servtypes[] = { SV_SERVINFO, SV_WELCOME, SV_INITCLIENT, SV_CDIS, SV_GIBDIED, SV_DIED,
                         SV_GIBDAMAGE, SV_DAMAGE, SV_HITPUSH, SV_SHOTFX, SV_AUTHREQ, SV_AUTHCHAL,
                         SV_SPAWNSTATE, SV_SPAWNDENY, SV_FORCEDEATH, SV_RESUME,
                         SV_DISCSCORES, SV_TIMEUP, SV_ITEMACC, SV_MAPCHANGE, SV_ITEMSPAWN, SV_PONG,
@@ -2737,7 +3033,7 @@ int checktype(int type, client *cl)
                         SV_CALLVOTESUC, SV_CALLVOTEERR, SV_VOTERESULT,
                         SV_SETTEAM, SV_TEAMDENY, SV_SERVERMODE, SV_IPLIST,
                         SV_SENDDEMOLIST, SV_SENDDEMO, SV_DEMOPLAYBACK,
-                        SV_CLIENT, SV_HUDEXTRAS, SV_POINTS };
+                        SV_CLIENT, SV_HUDEXTRAS, SV_POINTS, SV_SENDDEMOSTART, SV_SENDDEMOPIECE };
     // only allow edit messages in coop-edit mode
     static int edittypes[] = { SV_EDITENT, SV_EDITXY, SV_EDITARCH, SV_EDITBLOCK, SV_EDITD, SV_EDITE, SV_NEWMAP };
     if(cl)
@@ -2749,6 +3045,8 @@ int checktype(int type, client *cl)
     return type;
 }
 
+#include "serveringest.h"
+
 // server side processing of updates: does very little and most state is tracked client only
 // could be extended to move more gameplay to server (at expense of lag)
 
@@ -2872,10 +3170,10 @@ void process(ENetPacket *packet, int sender, int chan)
 
     if(packet->flags&ENET_PACKET_FLAG_RELIABLE) reliablemessages = true;
 
-    #define QUEUE_MSG { if(cl->type==ST_TCPIP) while(curmsg<p.length()) cl->messages.add(p.buf[curmsg++]); }
+    #define QUEUE_MSG { if(cl->type==ST_TCPIP || cl->type==ST_AI) while(curmsg<p.length()) cl->messages.add(p.buf[curmsg++]); }
     #define QUEUE_BUF(body) \
     { \
-        if(cl->type==ST_TCPIP) \
+        if(cl->type==ST_TCPIP || cl->type==ST_AI) \
         { \
             curmsg = p.length(); \
             { body; } \
@@ -2895,10 +3193,11 @@ void process(ENetPacket *packet, int sender, int chan)
     int curmsg;
     while((curmsg = p.length()) < p.maxlen)
     {
+        uint msgstart = profstart();
         type = checktype(getint(p), cl);
 
         #ifdef _DEBUG
-        if(type!=SV_POS && type!=SV_POSC && type!=SV_CLIENTPING && type!=SV_PING && type!=SV_CLIENT)
+        if(type!=SV_POS && type!=SV_POSC && type!=SV_POSN && type!=SV_CLIENTPING && type!=SV_PING && type!=SV_CLIENT)
         {
             DEBUGVAR(cl->name);
             ASSERT(type>=0 && type<SV_NUM);
@@ -3201,6 +3500,7 @@ void process(ENetPacket *packet, int sender, int chan)
                 cl->upspawnp = false;
                 cl->state.state = CS_ALIVE;
                 cl->state.gunselect = gunselect;
+                cl->history.reset();
                 QUEUE_BUF(
                 {
                     putint(cl->messages, SV_SPAWN);
@@ -3336,37 +3636,12 @@ void process(ENetPacket *packet, int sender, int chan)
             }
 
             case SV_POS:
-            {
-                int cn = getint(p);
-                if(cn!=sender)
-                {
-                    disconnect_client(sender, DISC_CN);
-    #ifndef STANDALONE
-                    conoutf("ERROR: invalid client (msg %d)", type);
-    #endif
-                    return;
-                }
-                loopi(3) cl->state.o[i] = getuint(p)/DMF;
-                cl->y = getuint(p);
-                cl->p = getint(p);
-                cl->g = getuint(p);
-                loopi(4) if ( (cl->g >> i) & 1 ) getint(p);
-                cl->f = getuint(p);
-                if(!cl->isonrightmap) break;
-                if(cl->type==ST_TCPIP && (cl->state.state==CS_ALIVE || cl->state.state==CS_EDITING))
-                {
-                    cl->position.setsize(0);
-                    while(curmsg<p.length()) cl->position.add(p.buf[curmsg++]);
-                }
-                if(!m_demo && !m_coop) checkmove(cl);
-                break;
-            }
-
             case SV_POSC:
+            case SV_POSN:
             {
-                bitbuf<ucharbuf> q(p);
-                int cn = q.getbits(5);
-                if(cn!=sender)
+                posupdate pu;
+                decodepos(p, type, pu);
+                if(pu.cn!=sender)
                 {
                     disconnect_client(sender, DISC_CN);
     #ifndef STANDALONE
@@ -3374,36 +3649,8 @@ void process(ENetPacket *packet, int sender, int chan)
     #endif
                     return;
                 }
-                int usefactor = q.getbits(2) + 7;
-                int xt = q.getbits(usefactor + 4);
-                int yt = q.getbits(usefactor + 4);
-                cl->y = (q.getbits(9)*360)/512;
-                cl->p = ((q.getbits(8)-128)*90)/127;
-                if(!q.getbits(1)) q.getbits(6);
-                if(!q.getbits(1)) q.getbits(4 + 4 + 4);
-                cl->f = q.getbits(8);
-                int negz = q.getbits(1);
-                int zfull = q.getbits(1);
-                int s = q.rembits();
-                if(s < 3) s += 8;
-                if(zfull) s = 11;
-                int zt = q.getbits(s);
-                if(negz) zt = -zt;
-                int g1 = q.getbits(1); // scoping
-                int g2 = q.getbits(1); // shooting
-                cl->g = (g1<<4) | (g2<<5);
-
-                if(!cl->isonrightmap || p.remaining() || p.overread()) { p.flags = 0; break; }
-                if(((cl->f >> 6) & 1) != (cl->state.lifesequence & 1) || usefactor != (smapstats.hdr.sfactor < 7 ? 7 : smapstats.hdr.sfactor)) break;
-                cl->state.o[0] = xt / DMF;
-                cl->state.o[1] = yt / DMF;
-                cl->state.o[2] = zt / DMF;
-                if(cl->type==ST_TCPIP && (cl->state.state==CS_ALIVE || cl->state.state==CS_EDITING))
-                {
-                    cl->position.setsize(0);
-                    while(curmsg<p.length()) cl->position.add(p.buf[curmsg++]);
-                }
-                if(!m_demo && !m_coop) checkmove(cl);
+                if(type == SV_POSC && (!cl->isonrightmap || !pu.complete)) p.flags = 0;
+                applypos(cl, type, pu, &p.buf[curmsg], p.length() - curmsg);
                 break;
             }
 
@@ -3665,6 +3912,15 @@ void process(ENetPacket *packet, int sender, int chan)
                 senddemo(sender, getint(p));
                 break;
 
+            case SV_DEMOACK:
+            {
+                int received = getint(p);
+                if(!cl) break;
+                demodownload &dl = cl->download;
+                if(dl.buf && received > dl.acked && received <= dl.sent) dl.acked = received;
+                break;
+            }
+
             case SV_EXTENSION:
             {
                 // AC server extensions
@@ -3746,6 +4002,7 @@ void process(ENetPacket *packet, int sender, int chan)
                 break;
             }
         }
+        profmsgend(type, msgstart);
     }
 
     if(p.overread() && sender>=0) disconnect_client(sender, DISC_EOP);
@@ -3801,10 +4058,12 @@ void sendworldstate()
     if(clients.empty()) return;
     enet_uint32 curtime = enet_time_get()-lastsend;
     if(curtime<40) return;
+    uint profiled = profstart();
     bool flush = buildworldstate();
+    profend(PROF_WORLDSTATE, profiled);
     lastsend += curtime - (curtime%40);
     if(flush) enet_host_flush(serverhost);
-    if(demorecord) recordpackets = true; // enable after 'old' worldstate is sent
+    if(demorecording) recordpackets = true; // enable after 'old' worldstate is sent
 }
 
 void rereadcfgs(void)
@@ -3816,6 +4075,21 @@ void rereadcfgs(void)
     passwords.read();
 }
 
+void logaoistats()
+{
+    int sent = 0, saved = 0;
+    loopv(clients)
+    {
+        client &c = *clients[i];
+        if(c.type != ST_TCPIP || (!c.aoisent && !c.aoisaved)) continue;
+        logline(ACLOG_VERBOSE, "AOI: %2d %-16s %6d of %6d bytes position data saved", c.clientnum, c.name, c.aoisaved, c.aoisent + c.aoisaved);
+        sent += c.aoisent;
+        saved += c.aoisaved;
+        c.aoisent = c.aoisaved = 0;
+    }
+    logline(ACLOG_INFO, "AOI: %d of %d KB position data saved", saved / 1024, (sent + saved) / 1024);
+}
+
 void loggamestatus(const char *reason)
 {
     int fragscore[2] = {0, 0}, flagscore[2] = {0, 0}, pnum[2] = {0, 0};
@@ -3935,6 +4209,8 @@ void linequalitystats(int elapsed)
     }
 }
 
+#include "serverbots.h"
+
 void serverslice(uint timeout)   // main server update, called from cube main loop in sp, or dedicated server loop
 {
     static int msend = 0, mrec = 0, csend = 0, crec = 0, mnum = 0, cnum = 0;
@@ -3961,7 +4237,9 @@ void serverslice(uint timeout)   // main server update, called from cube main lo
 
     if(minremain>0)
     {
+        uint profiled = profstart();
         processevents();
+        profend(PROF_EVENTS, profiled);
         checkitemspawns(diff);
         bool ktfflagingame = false;
         if(m_flags) loopi(2)
@@ -3982,7 +4260,9 @@ void serverslice(uint timeout)   // main server update, called from cube main lo
         if(m_arena) arenacheck();
         else if(m_autospawn) autospawncheck();
 //        if(m_lms) lmscheck();
+        profiled = profstart();
         sendextras();
+        profend(PROF_EXTRAS, profiled);
         if ( scl.afk_limit && mastermode == MM_OPEN && next_afk_check < servmillis && gamemillis > 20 * 1000 ) check_afk();
     }
 
@@ -4001,7 +4281,7 @@ void serverslice(uint timeout)   // main server update, called from cube main lo
     {
         sending_demo = false;
         loggamestatus("game finished");
-        if(demorecord) enddemorecord();
+        if(demorecording) enddemorecord();
         interm = nextsendscore = 0;
 
         //start next game
@@ -4015,9 +4295,20 @@ void serverslice(uint timeout)   // main server update, called from cube main lo
 
     if(!isdedicated) return;     // below is network only
 
+    uint profiled = profstart();
     poll_serverthreads();
+    polldemowriter();
+    if(scl.aoi) pollaoi();
+    profend(PROF_THREADS, profiled);
+    senddemopieces();
+
+    profiled = profstart();
+    botslice();
+    profend(PROF_BOTS, profiled);
 
+    profiled = profstart();
     serverms(smode, numclients(), minremain, smapname, servmillis, serverhost->address, &mnum, &msend, &mrec, &cnum, &csend, &crec, SERVER_PROTOCOL_VERSION);
+    profend(PROF_SERVERMS, profiled);
 
     if(autoteam && m_teammode && !m_arena && !interm && servmillis - lastfillup > 5000 && refillteams()) lastfillup = servmillis;
 
@@ -4036,12 +4327,16 @@ void serverslice(uint timeout)   // main server update, called from cube main lo
         {
             if(nonlocalclients) loggamestatus(NULL);
             logline(ACLOG_INFO, "Status at %s: %d remote clients, %.1f send, %.1f rec (K/sec);"
-                                         " Ping: #%d|%d|%d; CSL: #%d|%d|%d (bytes)",
+                                         " Ping: #%d|%d|%d; CSL: #%d|%d|%d (bytes); WS: %d|%d bytes/tick, %d|%d alive|pooled (%d max)",
                                           timestring(true, "%d-%m-%Y %H:%M:%S"), nonlocalclients, serverhost->totalSentData/60.0f/1024, serverhost->totalReceivedData/60.0f/1024,
-                                          mnum, msend, mrec, cnum, csend, crec);
+                                          mnum, msend, mrec, cnum, csend, crec,
+                                          wsstats.ticks ? wsstats.copied / wsstats.ticks : 0, wsstats.maxcopied, worldstates.length(), worldstatepool.length(), wsstats.maxalive);
             mnum = msend = mrec = cnum = csend = crec = 0;
+            wsstats.copied = wsstats.ticks = wsstats.maxcopied = wsstats.maxalive = 0;
+            if(scl.aoi) logaoistats();
             linequalitystats(0);
         }
+        profilerinterval(nonlocalclients > 0);
         serverhost->totalSentData = serverhost->totalReceivedData = 0;
     }
 
@@ -4051,13 +4346,17 @@ void serverslice(uint timeout)   // main server update, called from cube main lo
     {
         if(enet_host_check_events(serverhost, &event) <= 0)
         {
-            if(enet_host_service(serverhost, &event, timeout) <= 0) break;
+            profiled = profstart();
+            int r = enet_host_service(serverhost, &event, timeout);
+            profend(PROF_ENET, profiled);   // (includes waiting for packets, up to "timeout")
+            if(r <= 0) break;
             serviced = true;
         }
         switch(event.type)
         {
             case ENET_EVENT_TYPE_CONNECT:
             {
+                flushingestbatch();
                 client &c = addclient();
                 c.type = ST_TCPIP;
                 c.peer = event.peer;
@@ -4076,13 +4375,17 @@ void serverslice(uint timeout)   // main server update, called from cube main lo
             case ENET_EVENT_TYPE_RECEIVE:
             {
                 int cn = (int)(size_t)event.peer->data;
+                if(valid_client(cn) && queueingest(event.packet, cn, event.channelID)) break;
+                profiled = profstart();
                 if(valid_client(cn)) process(event.packet, cn, event.channelID);
+                profend(PROF_PROCESS, profiled);
                 if(event.packet->referenceCount==0) enet_packet_destroy(event.packet);
                 break;
             }
 
             case ENET_EVENT_TYPE_DISCONNECT:
             {
+                flushingestbatch();
                 int cn = (int)(size_t)event.peer->data;
                 if(!valid_client(cn)) break;
                 disconnect_client(cn);
@@ -4093,11 +4396,13 @@ void serverslice(uint timeout)   // main server update, called from cube main lo
                 break;
         }
     }
+    flushingestbatch();
     sendworldstate();
 }
 
 void cleanupserver()
 {
+    flushdemowriter();
     if(serverhost) { enet_host_destroy(serverhost); serverhost = NULL; }
     if(svcctrl)
     {
@@ -4107,15 +4412,6 @@ void cleanupserver()
     exitlogging();
 }
 
-int getpongflags(enet_uint32 ip)
-{
-    int flags = mastermode << PONGFLAG_MASTERMODE;
-    flags |= scl.serverpassword[0] ? 1 << PONGFLAG_PASSWORD : 0;
-    loopv(bans) if(bans[i].address.host == ip) { flags |= 1 << PONGFLAG_BANNED; break; }
-    flags |= ipblacklist.check(ip) ? 1 << PONGFLAG_BLACKLIST : 0;
-    return flags;
-}
-
 void extping_namelist(ucharbuf &p)
 {
     loopv(clients)
@@ -4163,53 +4459,27 @@ void extping_uplinkstats(ucharbuf &po)
         po.put(chokelog + 4, scl.maxclients - 3); // send logs for 4..n used slots
 }
 
-void extinfo_cnbuf(ucharbuf &p, int cn)
+void extinfo_statsbuf(ucharbuf &p, client *c)
 {
-    if(cn == -1) // add all available player ids
-    {
-        loopv(clients) if(clients[i]->type != ST_EMPTY)
-            putint(p,clients[i]->clientnum);
-    }
-    else if(valid_client(cn)) // add single player only
-    {
-        putint(p,clients[cn]->clientnum);
-    }
-}
-
-void extinfo_statsbuf(ucharbuf &p, int pid, int bpos, ENetSocket &pongsock, ENetAddress &addr, ENetBuffer &buf, int len, int *csend)
-{
-    loopv(clients)
-    {
-        if(clients[i]->type != ST_TCPIP) continue;
-        if(pid>-1 && clients[i]->clientnum!=pid) continue;
-
-        bool ismatch = mastermode == MM_MATCH;
-        putint(p,EXT_PLAYERSTATS_RESP_STATS);  // send player stats following
-        putint(p,clients[i]->clientnum);  //add player id
-        putint(p,clients[i]->ping);             //Ping
-        sendstring(clients[i]->name,p);         //Name
-        sendstring(team_string(clients[i]->team),p); //Team
-        // "team_string(clients[i]->team)" sometimes return NULL according to RK, causing the server to crash. WTF ?
-        putint(p,clients[i]->state.frags);      //Frags
-        putint(p,clients[i]->state.flagscore);  //Flagscore
-        putint(p,clients[i]->state.deaths);     //Death
-        putint(p,clients[i]->state.teamkills);  //Teamkills
-        putint(p,ismatch ? 0 : clients[i]->state.damage*100/max(clients[i]->state.shotdamage,1)); //Accuracy
-        putint(p,ismatch ? 0 : clients[i]->state.health);     //Health
-        putint(p,ismatch ? 0 : clients[i]->state.armour);     //Armour
-        putint(p,ismatch ? 0 : clients[i]->state.gunselect);  //Gun selected
-        putint(p,clients[i]->role);             //Role
-        putint(p,clients[i]->state.state);      //State (Alive,Dead,Spawning,Lagged,Editing)
-        uint ip = clients[i]->peer->address.host; // only 3 byte of the ip address (privacy protected)
-        p.put((uchar*)&ip,3);
-
-        buf.dataLength = len + p.length();
-        enet_socket_send(pongsock, &addr, &buf, 1);
-        *csend += (int)buf.dataLength;
-
-        if(pid>-1) break;
-        p.len=bpos;
-    }
+    bool ismatch = mastermode == MM_MATCH;
+    putint(p,EXT_PLAYERSTATS_RESP_STATS);  // send player stats following
+    putint(p,c->clientnum);  //add player id
+    putint(p,c->ping);             //Ping
+    sendstring(c->name,p);         //Name
+    sendstring(team_string(c->team),p); //Team
+    // "team_string(c->team)" sometimes return NULL according to RK, causing the server to crash. WTF ?
+    putint(p,c->state.frags);      //Frags
+    putint(p,c->state.flagscore);  //Flagscore
+    putint(p,c->state.deaths);     //Death
+    putint(p,c->state.teamkills);  //Teamkills
+    putint(p,ismatch ? 0 : c->state.damage*100/max(c->state.shotdamage,1)); //Accuracy
+    putint(p,ismatch ? 0 : c->state.health);     //Health
+    putint(p,ismatch ? 0 : c->state.armour);     //Armour
+    putint(p,ismatch ? 0 : c->state.gunselect);  //Gun selected
+    putint(p,c->role);             //Role
+    putint(p,c->state.state);      //State (Alive,Dead,Spawning,Lagged,Editing)
+    uint ip = c->type == ST_TCPIP ? c->peer->address.host : 0; // only 3 byte of the ip address (privacy protected)
+    p.put((uchar*)&ip,3);
 }
 
 void extinfo_teamscorebuf(ucharbuf &p)
@@ -4236,6 +4506,33 @@ void extinfo_teamscorebuf(ucharbuf &p)
     }
 }
 
+void buildinfosnapshot(infosnapshot &s)     // everything but the standard pong (see serverms.cpp)
+{
+    s.pongflags = mastermode << PONGFLAG_MASTERMODE;
+    s.pongflags |= scl.serverpassword[0] ? 1 << PONGFLAG_PASSWORD : 0;
+    loopv(bans) s.bans.add(bans[i].address.host);
+    s.blacklist = ipblacklist.ipranges;
+
+    uchar buf[MAXTRANS - 600];    // leave room for the request and the standard pong in front of it
+    #define INFOPART(v, body) { ucharbuf p(buf, sizeof(buf)); body; v.put(buf, p.length()); }
+    INFOPART(s.namelist, extping_namelist(p));
+    INFOPART(s.maprot, extping_maprot(p));
+    INFOPART(s.uplinkstats, extping_uplinkstats(p));
+    INFOPART(s.profile, extping_profile(p));
+    INFOPART(s.teamscore, extinfo_teamscorebuf(p));
+    loopv(clients) if(clients[i]->type != ST_EMPTY)
+    {
+        s.cns.add(clients[i]->clientnum);
+        if(clients[i]->type == ST_LOCAL) continue;
+        infoplayer &ip = s.players.add();
+        ip.cn = clients[i]->clientnum;
+        ip.offset = s.stats.length();
+        INFOPART(s.stats, extinfo_statsbuf(p, clients[i]));
+        ip.len = s.stats.length() - ip.offset;
+    }
+    #undef INFOPART
+}
+
 
 #ifndef STANDALONE
 void localdisconnect()
@@ -4276,6 +4573,21 @@ void quitproc(int param)
     exit(param == 2 ? EXIT_SUCCESS : EXIT_FAILURE); // 3 is the only reply on Win32 apparently, SIGINT == 2 == Ctrl-C
 }
 
+void startserverlogging(bool dedicated)
+{
+    if ( strlen(scl.servdesc_full) ) global_name = scl.servdesc_full;
+    else global_name = server_name;
+
+    string identity;
+    if(scl.logident[0]) filtertext(identity, scl.logident, FTXT__LOGIDENT);
+    else formatstring(identity)("%s#%d", scl.ip[0] ? scl.ip : "local", scl.serverport);
+    int conthres = scl.verbose > 1 ? ACLOG_DEBUG : (scl.verbose ? ACLOG_VERBOSE : ACLOG_INFO);
+    if(dedicated && !initlogging(identity, scl.syslogfacility, conthres, scl.filethres, scl.syslogthres, scl.logtimestamp))
+        printf("WARNING: logging not started!\n");
+    logline(ACLOG_INFO, "logging local AssaultCube server (version %d, protocol %d/%d) now..", AC_VERSION, SERVER_PROTOCOL_VERSION, EXT_VERSION);
+    if(instancenum) logline(ACLOG_INFO, "this is game instance #%d", instancenum);
+}
+
 void initserver(bool dedicated, int argc, char **argv)
 {
     const char *service = NULL;
@@ -4307,18 +4619,12 @@ void initserver(bool dedicated, int argc, char **argv)
         }
     }
 
-    if ( strlen(scl.servdesc_full) ) global_name = scl.servdesc_full;
-    else global_name = server_name;
-
     smapname[0] = '\0';
+    servermapcachemb = scl.mapcache;
+    maploadthreads = scl.mapthreads;
 
-    string identity;
-    if(scl.logident[0]) filtertext(identity, scl.logident, FTXT__LOGIDENT);
-    else formatstring(identity)("%s#%d", scl.ip[0] ? scl.ip : "local", scl.serverport);
-    int conthres = scl.verbose > 1 ? ACLOG_DEBUG : (scl.verbose ? ACLOG_VERBOSE : ACLOG_INFO);
-    if(dedicated && !initlogging(identity, scl.syslogfacility, conthres, scl.filethres, scl.syslogthres, scl.logtimestamp))
-        printf("WARNING: logging not started!\n");
-    logline(ACLOG_INFO, "logging local AssaultCube server (version %d, protocol %d/%d) now..", AC_VERSION, SERVER_PROTOCOL_VERSION, EXT_VERSION);
+    startserverlogging(dedicated);
+    if(dedicated && startinstances()) startserverlogging(dedicated);   // additional game instances read their own parameters and log on their own
 
     copystring(servdesc_current, scl.servdesc_full);
     servermsinit(scl.master ? scl.master : AC_MASTER_URI, scl.ip, CUBE_SERVINFO_PORT(scl.serverport), dedicated);
@@ -4380,7 +4686,9 @@ void initserver(bool dedicated, int argc, char **argv)
 
         // start file-IO threads
         readmapsthread_sem = new sl_semaphore(0, NULL);
-        sl_createthread(readmapsthread, (void *)"xxxx");
+        if(mapnotifyfd >= 0) sl_createthread(followmapsthread, NULL);   // additional game instance
+        else sl_createthread(readmapsthread, (void *)"xxxx");
+        initingestthreads(scl.ingestthreads);
 
         for(;;) serverslice(5);
     }
@@ -4413,6 +4721,8 @@ int main(int argc, char **argv)
     for(int i = 1; i<argc; i++)
     {
         if (!strncmp(argv[i],"--wizard",8)) return wizardmain(argc, argv);
+        if (!strcmp(argv[i],"--posnbench")) return posnbench();
+        if (!strcmp(argv[i],"--areabench")) return areabench();
     }
 
     if(enet_initialize()<0) fatal("Unable to initialise network module");
@@ -9,7 +9,7 @@
 #define valid_flag(f) (f >= 0 && f < 2)
 
 enum { GE_NONE = 0, GE_SHOT, GE_EXPLODE, GE_HIT, GE_AKIMBO, GE_RELOAD, GE_SUICIDE, GE_PICKUP };
-enum { ST_EMPTY, ST_LOCAL, ST_TCPIP };
+enum { ST_EMPTY, ST_LOCAL, ST_TCPIP, ST_AI };   // ST_AI: server side bot (see serverbots.h)
 
 extern int smode, servmillis;
 
@@ -106,6 +106,33 @@ struct projectilestate
 
 static const int DEATHMILLIS = 300;
 
+#define POSHISTORY 64   // about 2.5 seconds of position updates
+
+struct poshistory       // recent positions of a client, to rewind it for lag compensation (struct of arrays: searching touches only the timestamps)
+{
+    int millis[POSHISTORY];
+    float x[POSHISTORY], y[POSHISTORY], z[POSHISTORY];
+    uchar crouching[POSHISTORY];
+    int next, num;
+
+    poshistory() : next(0), num(0) {}
+
+    void reset() { next = num = 0; }
+
+    void add(int gamemillis, const vec &o, bool crouch)
+    {
+        millis[next] = gamemillis;
+        x[next] = o.x;
+        y[next] = o.y;
+        z[next] = o.z;
+        crouching[next] = crouch ? 1 : 0;
+        next = (next + 1) % POSHISTORY;
+        if(num < POSHISTORY) num++;
+    }
+
+    int oldest() { return (next - num + POSHISTORY) % POSHISTORY; }
+};
+
 struct clientstate : playerstate
 {
     vec o;
@@ -223,6 +250,33 @@ struct medals
     }
 };
 
+struct demobuffer               // a recorded demo, shared by the list of demos and all downloads of it
+{
+    uchar *data;
+    int len, refs;
+
+    demobuffer(uchar *data, int len) : data(data), len(len), refs(1) {}
+    ~demobuffer() { DELETEA(data); }
+
+    void release() { if(--refs <= 0) delete this; }
+};
+
+struct demodownload             // a demo sent to a client in pieces
+{
+    demobuffer *buf;
+    int sent, acked;            // bytes sent, bytes confirmed by the client
+    int allowance, lastmillis;  // rate limit: bytes that may be sent now
+
+    demodownload() : buf(NULL) { reset(); }
+
+    void reset()
+    {
+        if(buf) buf->release();
+        buf = NULL;
+        sent = acked = allowance = lastmillis = 0;
+    }
+};
+
 struct client                   // server side version of "dynent" type
 {
     int type;
@@ -262,6 +316,14 @@ struct client                   // server side version of "dynent" type
     uint authreq; // for AUTH
     string authname; // for AUTH
     int mapcollisions, farpickups;
+    poshistory history;
+    int lagcomphits, lagcompmisses;
+    int aoisent, aoisaved;      // position data bytes sent to and held back from this client (since the last status report)
+    posnstream posn;            // SV_POSN: what we know about the position stream of this client
+    vector<uchar> rawposn;      // the last SV_POSN message as received ("position" holds it as SV_POS), behind a keyframe, that wasn't passed on yet
+    int rawposnkeylen;          // length of that keyframe
+    bool posnsynced;            // passing on rawposn is safe, because the receivers got the current keyframe
+    demodownload download;
     enet_uint32 bottomRTT;
     medals md;
     bool upspawnp;
@@ -304,6 +366,8 @@ struct client                   // server side version of "dynent" type
         lastevent = 0;
         at3_lastforce = eff_score = 0;
         mapcollisions = farpickups = 0;
+        history.reset();
+        lagcomphits = lagcompmisses = 0;
         md.reset();
         upspawnp = false;
         lag = 0;
@@ -331,6 +395,10 @@ struct client                   // server side version of "dynent" type
         loopi(2) skin[i] = 0;
         position.setsize(0);
         messages.setsize(0);
+        posn.reset();
+        rawposn.setsize(0);
+        rawposnkeylen = 0;
+        posnsynced = false;
         isauthed = haswelcome = false;
         role = CR_DEFAULT;
         lastvotecall = 0;
@@ -346,11 +414,14 @@ struct client                   // server side version of "dynent" type
         input = inputmillis = 0;
         wn = -1;
         bs = bt = blg = bp = 0;
+        aoisent = aoisaved = 0;
+        download.reset();
     }
 
     void zap()
     {
         type = ST_EMPTY;
+        download.reset();
         role = CR_DEFAULT;
         isauthed = haswelcome = false;
     }
@@ -366,6 +437,8 @@ struct worldstate
 {
     enet_uint32 uses;
     vector<uchar> positions, messages;
+
+    void reset() { uses = 0; positions.setsize(0); messages.setsize(0); }   // keeps the buffers allocated for reuse
 };
 
 struct server_entity            // server side version of "entity" type
@@ -386,8 +459,7 @@ struct demofile
 {
     string info;
     string file;
-    uchar *data;
-    int len;
+    demobuffer *buf;
     vector<clientidentity> clientssent;
 };
 
@@ -410,6 +482,8 @@ int numclients();
 bool updateclientteam(int cln, int newteam, int ftr);
 void forcedeath(client *cl);
 void sendf(int cn, int chan, const char *format, ...);
+bool poll_serverthreads();
+void botsnewmap();
 
 extern bool isdedicated;
 extern string smapname;
@@ -440,7 +514,8 @@ const char *messagenames[SV_NUM] =
     "SV_SWITCHNAME", "SV_SWITCHSKIN", "SV_SWITCHTEAM",
     "SV_CLIENT",
     "SV_EXTENSION",
-    "SV_MAPIDENT", "SV_HUDEXTRAS", "SV_POINTS"
+    "SV_MAPIDENT", "SV_HUDEXTRAS", "SV_POINTS",
+    "SV_SENDDEMOSTART", "SV_SENDDEMOPIECE", "SV_DEMOACK"
 };
 
 const char *entnames[] =
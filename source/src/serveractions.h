@@ -165,7 +165,7 @@ struct playeraction : serveraction
         int i = findcnbyaddress(&address);
         if(i >= 0) disconnect_client(i, reason);
     }
-    virtual bool isvalid() { return valid_client(cn) && clients[cn]->role != CR_ADMIN; } // actions can't be done on admins
+    virtual bool isvalid() { return valid_client(cn) && clients[cn]->role != CR_ADMIN && clients[cn]->type != ST_AI; } // actions can't be done on admins (or bots)
     playeraction(int cn) : cn(cn)
     {
         if(isvalid()) address = clients[cn]->peer->address;
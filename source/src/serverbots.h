@@ -0,0 +1,652 @@
+// serverbots.h
+
+// server side bots
+//
+// "--bots=N" fills the game up with bots until N players are connected - as long as at least one human player is there
+// and the server is in open mastermode. every human, who joins, replaces a bot, every human, who leaves, is replaced by one.
+// bots are clients of type ST_AI, without a peer. everything they do is put into messages, that go through process():
+// the server checks and passes on their positions, spawns, shots and pickups exactly like those of remote clients.
+//
+// bots only know the floorplan (maplayout: floor height of every cube, 127 is solid, -128 is a heightfield of unknown height)
+// and the item list (sents).
+// they walk the floorplan (A*), collect items they need and shoot at enemies they can see (along a line over the floorplan,
+// like the lag compensation checks it). they ignore flags.
+//
+// the thinking is done on the botthread: every bot tick, the main thread turns the decisions of the last round into messages,
+// copies what the bots need to know into botworld and starts a new round. the botthread thinks about one bot after another
+// until the time budget of the tick is spent - bots, that didn't get their turn, keep their last decision and get the first turn
+// in the next round. the botthread only runs while the main thread leaves botworld and the bots alone, so there's nothing to lock.
+
+#define MAXBOTS         32
+#define BOTTICK         40      // milliseconds between two rounds (the position update rate of a client)
+#define BOTBUDGET     2000      // microseconds of botthread time per round
+#define BOTMAXEXPAND 16384      // A* gives up after that many cubes
+#define BOTSPEED     14.0f      // cubes per second (players run 16)
+#define BOTSTEPUP        2      // highest step a bot climbs, in cubes
+#define BOTEYE        4.2f      // eye height above the feet (as used for shots)
+#define BOTSIGHT    120.0f      // bots don't see enemies farther away
+#define BOTREACTION    400      // milliseconds an enemy has to be in sight, before a bot shoots
+#define BOTRESPAWN    2500      // milliseconds a bot stays dead
+#define BOTGOALTIME  20000      // milliseconds a bot follows a path, before it picks a new goal
+
+static const char *botnames[] = { "Ajax", "Bishop", "Cobra", "Dagger", "Echo", "Falcon", "Ghost", "Hunter", "Jackal", "Kodiak",
+                                  "Lynx", "Mamba", "Nomad", "Onyx", "Python", "Raven", "Sabre", "Titan", "Viper", "Wolf" };
+static const int botprimaries[] = { GUN_ASSAULT, GUN_SUBGUN, GUN_CARBINE, GUN_SNIPER };
+
+struct botplayer        // what bots know about the other players (only living ones are listed)
+{
+    int cn, team, lifesequence;
+    vec o;
+};
+
+struct botworld         // what bots know about the game, copied by the main thread before every round
+{
+    int millis;
+    bool teammode;
+    vector<botplayer> players;
+    vector<server_entity> ents;
+};
+
+struct serverbot
+{
+    int cn;
+    float skill;                // 0.5..1, scales the hit chance
+    uint seed;                  // the botthread has its own random numbers
+
+    // main thread only
+    int nexttry, lastping, lastreload;
+
+    // input, written by the main thread before every round
+    bool alive;
+    int lifesequence, team, health, gun, wants, needs;  // wants, needs: bits of item types, the bot can pick up and is short of
+
+    // botthread only (read by the main thread between rounds)
+    int placed;                 // the life the bot was placed for (spawn point chosen)
+    vec o;                      // feet
+    float yaw, pitch;
+    vector<int> path;           // cubes to walk, the next one last
+    int goalmillis, lastmove;
+    int enemy, enemyseen, enemymillis;
+    vec enemypos;
+
+    // output of the botthread
+    bool moving;
+    int target, targetls;       // enemy to shoot at, its lifesequence
+    float hitchance;
+    int pickup;                 // item in reach
+
+    serverbot(int cn) : cn(cn), seed(rnd(0x1000000) + 1), nexttry(0), lastping(0), lastreload(0), alive(false), lifesequence(-1), team(TEAM_SPECT),
+                        health(0), gun(GUN_KNIFE), wants(0), needs(0)
+    {
+        skill = 0.5f + rnd(51) / 100.0f;
+        reset();
+    }
+
+    void reset()
+    {
+        placed = -1;
+        o = vec(0, 0, 0);
+        yaw = pitch = 0;
+        path.setsize(0);
+        goalmillis = lastmove = 0;
+        enemy = -1;
+        enemyseen = enemymillis = 0;
+        moving = false;
+        target = targetls = pickup = -1;
+        hitchance = 0;
+    }
+
+    int random(int n) { seed = seed * 1103515245 + 12345; return int((seed >> 16) & 0x7fff) % n; }
+};
+
+vector<serverbot *> serverbots;
+botworld botw;
+sl_semaphore *botthread_start = NULL, *botthread_done = NULL;
+bool botthinking = false, botnewmap = true;
+int lastbottick = 0, botnext = 0;
+
+// botthread only (the floorplan copy is replaced by the main thread between rounds)
+
+char *botlayout = NULL;
+int botlayoutfactor = 0, botlayoutsize = 0;
+uint *navstamp = NULL, navround = 0;
+int *navcost = NULL, *navfrom = NULL;
+uint botroundstart = 0;
+bool botabort = false;
+
+struct navnode { int f, cube; };
+vector<navnode> navheap;
+
+static void navpush(int f, int cube)
+{
+    int i = navheap.length();
+    navheap.add();
+    while(i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if(navheap[parent].f <= f) break;
+        navheap[i] = navheap[parent];
+        i = parent;
+    }
+    navheap[i].f = f;
+    navheap[i].cube = cube;
+}
+
+static navnode navpop()
+{
+    navnode top = navheap[0], last = navheap.pop();
+    int n = navheap.length(), i = 0;
+    if(!n) return top;
+    for(;;)
+    {
+        int child = 2 * i + 1;
+        if(child >= n) break;
+        if(child + 1 < n && navheap[child + 1].f < navheap[child].f) child++;
+        if(navheap[child].f >= last.f) break;
+        navheap[i] = navheap[child];
+        i = child;
+    }
+    navheap[i] = last;
+    return top;
+}
+
+static inline int botcube(const vec &o) { return clamp(int(o.x), 0, botlayoutsize - 1) + (clamp(int(o.y), 0, botlayoutsize - 1) << botlayoutfactor); }
+
+static inline int botfloor(const vec &o)
+{
+    if(o.x < 0 || o.y < 0 || o.x >= botlayoutsize || o.y >= botlayoutsize) return 127;
+    return botlayout[int(o.x) + (int(o.y) << botlayoutfactor)];
+}
+
+static bool botclearline(const vec &from, const vec &to)    // same as clearline() in serverchecks.h, on the botthread's copy of the floorplan
+{
+    vec d = vec(to).sub(from);
+    int steps = (int)ceil(max(fabs(d.x), fabs(d.y)));
+    if(steps < 2) return true;
+    d.div(steps);
+    vec p = from;
+    for(int i = 1; i < steps; i++)
+    {
+        p.add(d);
+        if(botfloor(p) > p.z + 1) return false;
+    }
+    return true;
+}
+
+static int navdist(int a, int b)     // octile distance, 10 per cube
+{
+    int mask = botlayoutsize - 1, dx = abs((a & mask) - (b & mask)), dy = abs((a >> botlayoutfactor) - (b >> botlayoutfactor));
+    return 10 * max(dx, dy) + 4 * min(dx, dy);
+}
+
+static bool botfindpath(serverbot &b, int from, int to, bool mayabort)   // A* over the floorplan, false if there's no path (or no time to find it)
+{
+    static const int dirs[8][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 }, { 1, 1 }, { -1, 1 }, { 1, -1 }, { -1, -1 } };
+    b.path.setsize(0);
+    if(botlayout[to] == 127) return false;
+    if(from == to) return true;
+    if(!++navround)
+    {
+        memset(navstamp, 0, sizeof(uint) << (2 * botlayoutfactor));
+        navround = 1;
+    }
+    navheap.setsize(0);
+    navstamp[from] = navround;
+    navcost[from] = 0;
+    navfrom[from] = -1;
+    navpush(navdist(from, to), from);
+    int mask = botlayoutsize - 1, expanded = 0;
+    while(navheap.length())
+    {
+        navnode n = navpop();
+        if(n.cube == to) break;
+        if(n.f != navcost[n.cube] + navdist(n.cube, to)) continue;     // outdated entry
+        if(++expanded > BOTMAXEXPAND) return false;
+        if(mayabort && !(expanded & 255) && sl_micros() - botroundstart > BOTBUDGET) { botabort = true; return false; }
+        int x = n.cube & mask, y = n.cube >> botlayoutfactor, floor = botlayout[n.cube];
+        loopi(8)
+        {
+            int nx = x + dirs[i][0], ny = y + dirs[i][1];
+            if(nx < 0 || ny < 0 || nx >= botlayoutsize || ny >= botlayoutsize) continue;
+            int next = nx + (ny << botlayoutfactor);
+            if(botlayout[next] == 127 || (botlayout[next] - floor > BOTSTEPUP && floor != -128)) continue;
+            if(i >= 4 && (botlayout[nx + (y << botlayoutfactor)] == 127 || botlayout[x + (ny << botlayoutfactor)] == 127)) continue;   // don't cut corners
+            int cost = navcost[n.cube] + (i >= 4 ? 14 : 10);
+            if(navstamp[next] == navround && navcost[next] <= cost) continue;
+            navstamp[next] = navround;
+            navcost[next] = cost;
+            navfrom[next] = n.cube;
+            navpush(cost + navdist(next, to), next);
+        }
+    }
+    if(navstamp[to] != navround) return false;
+    for(int c = to; c != from; c = navfrom[c]) b.path.add(c);
+    return true;
+}
+
+static void botplace(serverbot &b)     // choose a spawn point: the playerstart farthest from the closest enemy (of a few random ones)
+{
+    b.reset();
+    b.placed = b.lifesequence;
+    b.lastmove = botw.millis;
+    vector<int> starts;
+    loopv(botw.ents) if(botw.ents[i].type == PLAYERSTART) starts.add(i);
+    float bestdist = -1;
+    loopk(starts.length() ? 4 : 0)
+    {
+        server_entity &e = botw.ents[starts[b.random(starts.length())]];
+        vec o(e.x + 0.5f, e.y + 0.5f, 0);
+        int floor = botfloor(o);
+        if(floor == 127 || floor == -128) continue;
+        float closest = 1e10f;
+        loopv(botw.players)
+        {
+            botplayer &p = botw.players[i];
+            if(p.cn != b.cn && (!botw.teammode || p.team != b.team)) closest = min(closest, p.o.distxy(o));
+        }
+        if(closest > bestdist) { bestdist = closest; b.o = o; }
+    }
+    if(bestdist < 0) loopk(100)  // no usable playerstart: any open cube
+    {
+        vec o(b.random(botlayoutsize) + 0.5f, b.random(botlayoutsize) + 0.5f, 0);
+        int floor = botfloor(o);
+        if(floor != 127 && floor != -128) { b.o = o; break; }
+    }
+    b.o.z = botfloor(b.o);
+    b.yaw = b.random(360);
+}
+
+static void botnewgoal(serverbot &b, bool mayabort)
+{
+    int goal = -1;
+    float bestdist = 1e10f;
+    loopv(botw.ents)   // the closest item the bot needs badly
+    {
+        server_entity &e = botw.ents[i];
+        if(!e.spawned || !(b.needs & (1 << e.type))) continue;
+        float dist = b.o.distxy(vec(e.x, e.y, 0));
+        if(dist < bestdist) { bestdist = dist; goal = botcube(vec(e.x, e.y, 0)); }
+    }
+    if(goal < 0 && b.enemymillis && botw.millis - b.enemymillis < 5000) goal = botcube(b.enemypos);   // hunt
+    if(goal < 0 && botw.ents.length()) loopk(10)   // somewhere else: an item (preferably a useful one) or a playerstart
+    {
+        server_entity &e = botw.ents[b.random(botw.ents.length())];
+        if(e.type != PLAYERSTART && !isitem(e.type)) continue;
+        goal = botcube(vec(e.x, e.y, 0));
+        if(e.spawned && (b.wants & (1 << e.type))) break;
+    }
+    if(goal < 0) goal = botcube(vec(b.random(botlayoutsize), b.random(botlayoutsize), 0));
+    b.goalmillis = botw.millis;
+    if(!botfindpath(b, botcube(b.o), goal, mayabort)) b.goalmillis -= BOTGOALTIME - 1000;   // try again in a second
+}
+
+static void botwalk(serverbot &b, int dt)
+{
+    float step = BOTSPEED * dt / 1000.0f;
+    int mask = botlayoutsize - 1;
+    while(step > 0 && b.path.length())
+    {
+        int c = b.path.last();
+        vec d((c & mask) + 0.5f - b.o.x, (c >> botlayoutfactor) + 0.5f - b.o.y, 0);
+        float len = d.magnitudexy();
+        if(len > 0.01f)
+        {
+            b.yaw = atan2f(d.x, -d.y) / RAD;
+            b.moving = true;
+        }
+        if(len <= step)
+        {
+            b.o.add(d);
+            b.path.drop();
+            step -= len;
+        }
+        else
+        {
+            b.o.add(d.mul(step / len));
+            step = 0;
+        }
+    }
+    int floor = botfloor(b.o);
+    if(floor != 127 && floor != -128) b.o.z = floor;   // (on heightfields, keep the height of the last known floor)
+}
+
+static void botthink(serverbot &b, bool mayabort)
+{
+    b.moving = false;
+    b.target = b.pickup = -1;
+    if(!b.alive) return;
+    if(b.placed != b.lifesequence) botplace(b);
+    int dt = clamp(botw.millis - b.lastmove, 0, 200);
+    b.lastmove = botw.millis;
+
+    // the closest enemy in sight
+    vec eye = vec(b.o).add(vec(0, 0, BOTEYE));
+    botplayer *enemy = NULL;
+    float enemydist = BOTSIGHT;
+    loopv(botw.players)
+    {
+        botplayer &p = botw.players[i];
+        if(p.cn == b.cn || (botw.teammode && p.team == b.team)) continue;
+        float dist = p.o.dist(b.o);
+        if(dist < enemydist && botclearline(eye, vec(p.o).add(vec(0, 0, BOTEYE)))) { enemy = &p; enemydist = dist; }
+    }
+    if(enemy)
+    {
+        if(b.enemy != enemy->cn) b.enemyseen = botw.millis;
+        b.enemy = enemy->cn;
+        b.enemymillis = botw.millis;
+        b.enemypos = enemy->o;
+    }
+    else b.enemy = -1;
+
+    // walk, unless there's an enemy close enough to fight it from here
+    float range = b.gun == GUN_KNIFE ? 2.5f : (b.gun == GUN_SNIPER ? 80.0f : 24.0f);
+    if(!enemy || enemydist > range)
+    {
+        if(b.path.empty() || botw.millis - b.goalmillis > BOTGOALTIME) botnewgoal(b, mayabort);
+        botwalk(b, dt);
+    }
+
+    if(enemy)
+    {
+        vec d = vec(enemy->o).sub(b.o);
+        b.yaw = atan2f(d.x, -d.y) / RAD;
+        b.pitch = atan2f(d.z, d.magnitudexy()) / RAD;
+        if(botw.millis - b.enemyseen >= BOTREACTION && (b.gun != GUN_KNIFE || enemydist < 3.0f))
+        {
+            b.target = enemy->cn;
+            b.targetls = enemy->lifesequence;
+            b.hitchance = b.gun == GUN_KNIFE ? 0.9f : b.skill * clamp(1.0f - enemydist / (b.gun == GUN_SNIPER ? 200.0f : 80.0f), 0.1f, 0.85f);
+        }
+    }
+    else b.pitch = 0;
+    if(b.yaw < 0) b.yaw += 360;
+
+    loopv(botw.ents)   // pick up whatever is in reach
+    {
+        server_entity &e = botw.ents[i];
+        if(e.spawned && (b.wants & (1 << e.type)) && b.o.distxy(vec(e.x, e.y, 0)) < 2.5f) { b.pickup = i; break; }
+    }
+}
+
+int botthread(void *nop)
+{
+    for(;;)
+    {
+        botthread_start->wait();
+        botroundstart = sl_micros();
+        botabort = false;
+        int n = serverbots.length(), first = botnext;
+        loopk(n)
+        {
+            int i = (first + k) % n;
+            if(k && sl_micros() - botroundstart > BOTBUDGET) { botnext = i; break; }   // out of time: this one goes first next round
+            botthink(*serverbots[i], k > 0);
+            if(botabort) { botnext = i; break; }
+            botnext = (i + 1) % n;
+        }
+        botthread_done->post();
+    }
+    return 0;
+}
+
+// main thread
+
+void botsnewmap() { botnewmap = true; }     // called by startgame()
+
+static void botmessage(serverbot &b, int chan, packetbuf &p)
+{
+    process(p.finalize(), b.cn, chan);
+}
+
+static bool addbot()
+{
+    client &c = addclient();
+    c.type = ST_AI;
+    c.connectmillis = servmillis;
+    c.state.state = CS_SPECTATE;
+    c.salt = rnd(0x1000000)*((servmillis%1000)+1);
+    copystring(c.hostname, "bot");
+
+    string name;
+    loopk(10)
+    {
+        formatstring(name)("[bot]%s", botnames[rnd(sizeof(botnames)/sizeof(botnames[0]))]);
+        bool taken = false;
+        loopv(clients) if(clients[i]->type != ST_EMPTY && !strcmp(clients[i]->name, name)) taken = true;
+        if(!taken) break;
+    }
+    packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+    putint(p, SV_CONNECT);
+    putint(p, AC_VERSION);
+    putint(p, 0);
+    sendstring(name, p);
+    sendstring(scl.serverpassword[0] ? genpwdhash(name, scl.serverpassword, c.salt) : "", p);
+    sendstring("", p);
+    putint(p, CR_DEFAULT);
+    putint(p, botprimaries[rnd(sizeof(botprimaries)/sizeof(botprimaries[0]))]);
+    loopi(2) putint(p, rnd(4));
+    serverbot *b = new serverbot(c.clientnum);
+    botmessage(*b, 1, p);
+    if(!c.isauthed)
+    {
+        logline(ACLOG_INFO, "[%s] could not add a bot", c.hostname);
+        c.zap();
+        delete b;
+        return false;
+    }
+    serverbots.add(b);
+    return true;
+}
+
+static void removebot(int i)
+{
+    serverbot *b = serverbots.remove(i);
+    client &c = *clients[b->cn];
+    sdropflag(c.clientnum);
+    logline(ACLOG_INFO, "[%s] removed bot %s cn %d", c.hostname, c.name, c.clientnum);
+    c.zap();
+    sendf(-1, 1, "rii", SV_CDIS, c.clientnum);
+    if(curvote) curvote->evaluate();
+    delete b;
+}
+
+static void checkbotcount()     // one bot per human less than scl.bots
+{
+    int humans = 0, want = 0;
+    loopv(clients) if(clients[i]->type == ST_TCPIP && clients[i]->isauthed) humans++;
+    if(humans && mastermode == MM_OPEN && !m_coop) want = clamp(scl.bots - humans, 0, MAXBOTS);
+    while(serverbots.length() > want) removebot(serverbots.length() - 1);
+    if(serverbots.length() < want) addbot();     // one at a time
+    if(botnext >= serverbots.length()) botnext = 0;
+}
+
+static void runbot(serverbot &b)   // turn the bot's decisions into messages
+{
+    client &c = *clients[b.cn];
+    clientstate &gs = c.state;
+    if(!c.isonrightmap)
+    {
+        packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+        putint(p, SV_MAPIDENT);
+        putint(p, smapstats.cgzsize);
+        putint(p, smapstats.hdr.maprevision);
+        botmessage(b, 1, p);
+    }
+    if(servmillis - b.lastping > 5000)
+    {
+        packetbuf p(MAXTRANS);
+        putint(p, SV_CLIENTPING);
+        putint(p, BOTTICK);
+        botmessage(b, 1, p);
+        b.lastping = servmillis;
+    }
+    if(interm) return;
+
+    if(gs.state != CS_ALIVE)
+    {
+        packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+        if(gs.lastspawn >= 0)
+        {
+            putint(p, SV_SPAWN);
+            putint(p, gs.lifesequence);
+            putint(p, gs.gunselect);
+        }
+        else if(!m_arena && servmillis > b.nexttry && (gs.state == CS_SPECTATE || gamemillis - gs.lastdeath > BOTRESPAWN))
+        {
+            putint(p, SV_TRYSPAWN);
+            b.nexttry = servmillis + 1000;
+        }
+        if(p.length()) botmessage(b, 1, p);
+        return;
+    }
+    if(b.placed != gs.lifesequence) return;     // wait until the botthread has chosen a spawn point
+
+    packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+    int gun = gs.mag[gs.primary] + gs.ammo[gs.primary] > 0 ? gs.primary : GUN_KNIFE;
+    if(gun == GUN_KNIFE && gs.mag[GUN_PISTOL] + gs.ammo[GUN_PISTOL] > 0) gun = gs.akimbo ? GUN_AKIMBO : GUN_PISTOL;
+    if(gun != gs.gunselect)
+    {
+        putint(p, SV_WEAPCHANGE);
+        putint(p, gun);
+    }
+    else if(!gs.mag[gun] && gs.ammo[gun] > 0 && gamemillis - b.lastreload > reloadtime(gun))
+    {
+        putint(p, SV_RELOAD);
+        putint(p, gamemillis);
+        putint(p, gun);
+        b.lastreload = gamemillis;
+    }
+    bool shoot = false;
+    if(b.target >= 0 && valid_client(b.target) && gun == gs.gunselect && gs.mag[gun] > 0 && gamemillis - gs.lastshot >= gs.gunwait[gun])
+    {
+        client &t = *clients[b.target];
+        if(t.state.state == CS_ALIVE && t.state.lifesequence == b.targetls)
+        {
+            vec from = vec(gs.o).add(vec(0, 0, BOTEYE)), to = vec(t.state.o).add(vec(0, 0, 2.5f)), dir = vec(to).sub(from);
+            if(dir.magnitude() > 0.1f)
+            {
+                dir.normalize();
+                bool hit = rnd(1000) < int(b.hitchance * 1000);
+                if(!hit)
+                {   // pass the target on one side
+                    vec side = vec(0, 0, 0).cross(dir, vec(0, 0, 1));
+                    if(side.magnitude() < 0.1f) side = vec(1, 0, 0);
+                    to.add(side.normalize().mul((rnd(2) ? 1 : -1) * (2.5f + rnd(20) / 10.0f)));
+                }
+                putint(p, SV_SHOOT);
+                putint(p, gamemillis);
+                putint(p, gun);
+                loopk(3) putint(p, int(to[k]*DMF));
+                putint(p, hit ? 1 : 0);
+                if(hit)
+                {
+                    putint(p, t.clientnum);
+                    putint(p, t.state.lifesequence);
+                    putint(p, gun == GUN_SNIPER && !rnd(4) ? 1 : 0);   // headshot
+                    loopk(3) putint(p, int(dir[k]*DNF));
+                }
+                shoot = true;
+            }
+        }
+    }
+    if(b.pickup >= 0 && sents.inrange(b.pickup) && sents[b.pickup].spawned && gs.canpickup(sents[b.pickup].type))
+    {
+        putint(p, SV_ITEMPICKUP);
+        putint(p, b.pickup);
+        b.pickup = -1;
+    }
+
+    packetbuf q(100);
+    putint(q, SV_POS);
+    putint(q, b.cn);
+    putuint(q, int(b.o.x*DMF));
+    putuint(q, int(b.o.y*DMF));
+    putuint(q, int(b.o.z*DMF));
+    putuint(q, int(b.yaw));
+    putint(q, int(b.pitch));
+    putuint(q, shoot ? 1<<5 : 0);
+    putuint(q, (b.moving ? 1<<2 : 0) | (1<<4) | ((gs.lifesequence&1)<<6));
+    botmessage(b, 0, q);     // position first: shots start there
+    if(p.length()) botmessage(b, 1, p);
+}
+
+static void startbotround()
+{
+    if(botnewmap)
+    {   // the botthread gets its own copy of the floorplan
+        DELETEA(botlayout);
+        DELETEA(navstamp);
+        DELETEA(navcost);
+        DELETEA(navfrom);
+        botnewmap = false;
+        if(!maplayout) return;
+        botlayoutfactor = maplayout_factor;
+        botlayoutsize = maplayoutssize;
+        int n = 1 << (2 * botlayoutfactor);
+        botlayout = new char[n];
+        memcpy(botlayout, maplayout, n);
+        navstamp = new uint[n];
+        memset(navstamp, 0, n * sizeof(uint));
+        navround = 0;
+        navcost = new int[n];
+        navfrom = new int[n];
+        loopv(serverbots) serverbots[i]->reset();
+    }
+    if(!botlayout) return;
+
+    botw.millis = gamemillis;
+    botw.teammode = m_teammode;
+    botw.players.setsize(0);
+    loopv(clients)
+    {
+        client &c = *clients[i];
+        if(c.type == ST_EMPTY || !c.isauthed || c.state.state != CS_ALIVE) continue;
+        botplayer &p = botw.players.add();
+        p.cn = c.clientnum;
+        p.team = c.team;
+        p.lifesequence = c.state.lifesequence;
+        p.o = c.state.o;
+    }
+    botw.ents = sents;
+    loopv(serverbots)
+    {
+        serverbot &b = *serverbots[i];
+        clientstate &gs = clients[b.cn]->state;
+        b.alive = gs.state == CS_ALIVE;
+        b.lifesequence = gs.lifesequence;
+        b.team = clients[b.cn]->team;
+        b.health = gs.health;
+        b.gun = gs.gunselect;
+        b.wants = b.needs = 0;
+        for(int type = I_CLIPS; type <= I_AKIMBO; type++) if(gs.canpickup(type)) b.wants |= 1 << type;
+        if(gs.health < 60) b.needs |= 1 << I_HEALTH;
+        if(gs.armour < 30) b.needs |= (1 << I_HELMET) | (1 << I_ARMOUR);
+        if(gs.mag[gs.primary] + gs.ammo[gs.primary] < magsize(gs.primary)) b.needs |= (1 << I_AMMO) | (1 << I_CLIPS);
+        b.needs &= b.wants;
+    }
+    if(!botthread_start)
+    {   // (started on demand: a thread would not survive startinstances())
+        botthread_start = new sl_semaphore(0, NULL);
+        botthread_done = new sl_semaphore(0, NULL);
+        sl_createthread(botthread, NULL);
+    }
+    botthinking = true;
+    botthread_start->post();
+}
+
+void botslice()
+{
+    if(!scl.bots) return;
+    if(botthinking)
+    {
+        if(botthread_done->trywait()) return;  // the last round isn't finished yet
+        botthinking = false;
+    }
+    if(servmillis - lastbottick < BOTTICK) return;
+    lastbottick = servmillis;
+    checkbotcount();
+    if(serverbots.empty()) return;
+    loopv(serverbots) runbot(*serverbots[i]);
+    startbotround();
+}
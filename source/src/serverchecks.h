@@ -3,15 +3,19 @@ inline bool is_lagging(client *cl)
     return ( cl->spj > 50 || cl->ping > 500 || cl->ldt > 80 ); // do not change this except if you really know what are you doing
 }
 
-inline bool outside_border(vec &po)
+inline bool outside_border(const vec &po)
 {
     return (po.x < 0 || po.y < 0 || po.x >= maplayoutssize || po.y >= maplayoutssize);
 }
 
-inline void checkclientpos(client *cl)
+inline bool collideswithmap(const vec &po)   // only reads the floorplan: also used by the ingest threads
 {
-    vec &po = cl->state.o;
-    if( outside_border(po) || maplayout[((int) po.x) + (((int) po.y) << maplayout_factor)] > po.z + 3)
+    return maplayout && (outside_border(po) || maplayout[((int) po.x) + (((int) po.y) << maplayout_factor)] > po.z + 3);
+}
+
+inline void checkclientpos(client *cl, bool collides)
+{
+    if(collides)
     {
         if(gamemillis > 10000 && (servmillis - cl->connectmillis) > 10000) cl->mapcollisions++;
         if(cl->mapcollisions && !(cl->mapcollisions % 25))
@@ -21,6 +25,88 @@ inline void checkclientpos(client *cl)
     }
 }
 
+// lag compensation
+//
+// the server keeps the recent positions of every player (client::history). when a shot arrives, the target is rewound to
+// the time the shooter saw it (time of the shot minus ping), the shot has to pass through the player's capsule there
+// and must not be blocked by the map (only solid cubes and floors: maplayout knows nothing about ceilings).
+
+#define LAGCOMPMAXREWIND 1000   // never rewind more than a second
+#define LAGCOMPSLACK      100   // accept positions within this many milliseconds around the rewound time
+#define LAGCOMPTOLERANCE 1.5f   // added to the player radius
+
+static float segmentdist2(const vec &p1, const vec &q1, const vec &p2, const vec &q2, float &s)  // squared distance between two segments, s: position of the closest point on the first one (0..1)
+{
+    vec d1 = vec(q1).sub(p1), d2 = vec(q2).sub(p2), r = vec(p1).sub(p2);
+    float a = d1.squaredlen(), e = d2.squaredlen(), f = d2.dot(r), t = 0;
+    s = 0;
+    if(a > 1e-6f)
+    {
+        float c = d1.dot(r);
+        if(e > 1e-6f)
+        {
+            float b = d1.dot(d2), denom = a*e - b*b;
+            if(denom > 1e-6f) s = clamp((b*f - c*e) / denom, 0.0f, 1.0f);
+            t = (b*s + f) / e;
+            if(t < 0) { t = 0; s = clamp(-c / a, 0.0f, 1.0f); }
+            else if(t > 1) { t = 1; s = clamp((b - c) / a, 0.0f, 1.0f); }
+        }
+        else s = clamp(-c / a, 0.0f, 1.0f);
+    }
+    else if(e > 1e-6f) t = clamp(f / e, 0.0f, 1.0f);
+    vec c1 = vec(d1).mul(s).add(p1), c2 = vec(d2).mul(t).add(p2);
+    return c1.squareddist(c2);
+}
+
+static bool clearline(const vec &from, const vec &to)  // false, if a solid cube or a floor is in the way (the cubes at both ends are not checked)
+{
+    if(!maplayout) return true;
+    vec d = vec(to).sub(from);
+    int steps = (int)ceil(max(fabs(d.x), fabs(d.y)));
+    if(steps < 2) return true;
+    d.div(steps);
+    vec p = from;
+    for(int i = 1; i < steps; i++)
+    {
+        p.add(d);
+        if(outside_border(p) || maplayout[((int) p.x) + (((int) p.y) << maplayout_factor)] > p.z + 1) return false;
+    }
+    return true;
+}
+
+static bool hitposition(int gun, const vec &from, const vec &to, const poshistory &ph, int i)  // does the shot hit a player at history entry i?
+{
+    float height = ph.crouching[i] ? 3.6f : 5.2f;
+    vec bottom(ph.x[i], ph.y[i], ph.z[i] + 1.1f), top(ph.x[i], ph.y[i], ph.z[i] + height - 1.1f);
+    if(gun == GUN_SHOTGUN) return clearline(from, vec(bottom).add(top).mul(0.5f));    // the rays are spread: only check, if the target was visible
+    float s, r = 1.1f + LAGCOMPTOLERANCE;
+    if(segmentdist2(from, to, bottom, top, s) > r*r) return false;
+    return gun == GUN_KNIFE || clearline(from, vec(to).sub(from).mul(s).add(from));
+}
+
+bool checkhit(client *c, client *target, shotevent &e)   // returns false, if the hit should not count
+{
+    poshistory &ph = target->history;
+    if(!scl.lagcomp || !ph.num || m_demo || m_coop) return true;
+    vec from(e.from[0], e.from[1], e.from[2]), to(e.to[0], e.to[1], e.to[2]);
+    int rewind = e.millis - clamp(c->ping, 0, LAGCOMPMAXREWIND), closest = -1, closestdiff = INT_MAX;
+    bool hit = false;
+    for(int k = 0, i = ph.oldest(); k < ph.num && !hit; k++, i = (i + 1) % POSHISTORY)
+    {
+        int diff = abs(ph.millis[i] - rewind);
+        if(diff < closestdiff) { closestdiff = diff; closest = i; }
+        if(diff <= LAGCOMPSLACK) hit = hitposition(e.gun, from, to, ph, i);
+    }
+    if(!hit && closestdiff > LAGCOMPSLACK) hit = hitposition(e.gun, from, to, ph, closest);   // no position update near that time: use the closest one
+    if(hit) c->lagcomphits++;
+    else
+    {
+        c->lagcompmisses++;
+        if(!(c->lagcompmisses % 10)) logline(ACLOG_INFO, "[%s] %s: %d of %d hits did not match the target position", c->hostname, c->name, c->lagcompmisses, c->lagcomphits + c->lagcompmisses);
+    }
+    return hit || scl.lagcomp < 2;
+}
+
 #define POW2XY(A,B) (pow2(A.x-B.x)+pow2(A.y-B.y))
 
 extern inline void addban(client *cl, int reason, int type = BAN_AUTO);
@@ -31,8 +117,7 @@ extern inline void addban(client *cl, int reason, int type = BAN_AUTO);
 
 #define MINELINE 50
 
-//FIXME
-/* There are smarter ways to implement this function, but most probably they will be very complex */
+/* reference implementation: checkarea() gets the same result from the runs of non-solid cubes (debug builds compare both) */
 int getmaxarea(int inversed_x, int inversed_y, int transposed, int ml_factor, char *ml)
 {
     int ls = (1 << ml_factor);
@@ -90,16 +175,188 @@ int getmaxarea(int inversed_x, int inversed_y, int transposed, int ml_factor, ch
     return maxarea;
 }
 
+// checkarea() looks at the floorplan from eight directions. the row kernel turns rows and columns into bitmasks of non-solid cubes
+// once, then the eight passes only jump from run to run (and stop, where getmaxarea() stops).
+
+static int findbit(const uint *bits, int words, int pos, bool set)  // first bit (from pos on), that is set (or clear), or words * 32
+{
+    for(int i = pos / 32; i < words; i++)
+    {
+        uint b = (set ? bits[i] : ~bits[i]) & (~0u << (pos & 31));
+        if(b) return i * 32 + firstbit(b);
+        pos = 0;
+    }
+    return words * 32;
+}
+
+static int findbitrev(const uint *bits, int pos, bool set)  // last bit (up to pos), that is set (or clear), or -1
+{
+    for(int i = pos / 32; i >= 0; i--)
+    {
+        uint b = (set ? bits[i] : ~bits[i]) & (~0u >> (31 - (pos & 31)));
+        if(b) return i * 32 + lastbit(b);
+        pos = 31;
+    }
+    return -1;
+}
+
+static int getmaxareabits(const uint *bits, int ls, bool inversed_x, bool inversed_y)   // getmaxarea() on the bitmasks of the lines
+{
+    int words = ls / 32, oxi = 0, oxf = 0, area = 0, maxarea = 0;
+    bool sav_y = false;
+
+    for(int j = 0; j < ls; j++)
+    {
+        const uint *line = bits + (inversed_y ? ls - 1 - j : j) * words;
+        int xi = 0, xf = 0, pos = inversed_x ? ls - 1 : 0;
+        for(;;)
+        {   // every run of non-solid cubes: its first cube is the new begin of the line, the last one the new end (a single cube doesn't change the end)
+            int first, last;
+            if(inversed_x)
+            {
+                if((first = findbitrev(line, pos, true)) < 0) break;
+                last = findbitrev(line, first, false) + 1;
+                pos = last - 1;
+            }
+            else
+            {
+                if((first = findbit(line, words, pos, true)) >= ls) break;
+                last = findbit(line, words, first, false) - 1;
+                pos = last + 1;
+            }
+            xi = first;
+            if(last != first) xf = last;
+            if(xf - xi > MINELINE || pos < 0 || pos >= ls) break;
+        }
+
+        if(xf - xi > MINELINE)
+        {
+            if(sav_y)
+            {
+                if(2*oxi + MINELINE < 2*xf && 2*xi + MINELINE < 2*oxf) area += xf - xi;
+                else
+                {
+                    oxi = xi;
+                    oxf = xf;
+                }
+            }
+            else
+            {
+                oxi = xi;
+                oxf = xf;
+                sav_y = true;
+            }
+        }
+        else
+        {
+            sav_y = false;
+            if(area > maxarea) maxarea = area;
+            area = 0;
+        }
+    }
+    return maxarea;
+}
+
 int checkarea(int maplayout_factor, char *maplayout)
 {
-    int area = 0, maxarea = 0;
+    int ls = 1 << maplayout_factor, maxarea = 0;
+    vector<uint> rows, cols;
+    layoutbits(maplayout, ls, rows.pad(ls * ls / 32), cols.pad(ls * ls / 32));
     for (int i=0; i < 8; i++) {
-        area = getmaxarea((i & 1),(i & 2),(i & 4), maplayout_factor, maplayout);
+        int area = getmaxareabits(i & 4 ? cols.getbuf() : rows.getbuf(), ls, (i & 1) != 0, (i & 2) != 0);
+        #ifdef _DEBUG
+        ASSERT(area == getmaxarea((i & 1),(i & 2),(i & 4), maplayout_factor, maplayout));
+        #endif
         if ( area > maxarea ) maxarea = area;
     }
     return maxarea;
 }
 
+#ifdef STANDALONE
+// "ac_server --areabench": compare checkarea() (every one of its passes) and the floorplan row kernels with their reference versions on random floorplans
+
+static uint areabenchseed = 1;
+static int areabenchrnd(int n) { areabenchseed = areabenchseed * 1103515245 + 12345; return int((areabenchseed >> 16) & 0x7fff) % n; }
+
+static void areabenchfloorplan(int k, char *ml, servsqr *s, int ls)
+{
+    switch(k % 3)
+    {
+        case 0:                                 // random cubes, 20..80% solid
+        {
+            int solid = 20 * (1 + (k / 3) % 4);
+            loopi(ls * ls) ml[i] = areabenchrnd(100) < solid ? 127 : areabenchrnd(16);
+            break;
+        }
+        case 1:                                 // rooms and corridors
+        {
+            memset(ml, 127, ls * ls);
+            loopj(ls / 4)
+            {
+                bool corridor = !areabenchrnd(3);
+                int w = corridor ? 2 + areabenchrnd(3) : 4 + areabenchrnd(ls / 2), h = corridor ? 8 + areabenchrnd(ls - 8) : 4 + areabenchrnd(ls / 2);
+                if(areabenchrnd(2)) swap(w, h);
+                int x = areabenchrnd(ls - w), y = areabenchrnd(ls - h), floor = areabenchrnd(16);
+                loop(yy, h) loop(xx, w) ml[(y + yy) * ls + x + xx] = floor;
+            }
+            break;
+        }
+        case 2:                                 // open field with a wall around and pillars
+            loop(y, ls) loop(x, ls) ml[y * ls + x] = !x || !y || x == ls - 1 || y == ls - 1 || !areabenchrnd(50) ? 127 : 0;
+            break;
+    }
+    loopi(ls * ls)
+    {
+        s[i].type = (ml[i] == 127 ? SOLID : 1 + areabenchrnd(5)) | (!areabenchrnd(8) ? 0x40 : 0);    // (some with tag bits)
+        s[i].floor = areabenchrnd(256) - 128;
+        s[i].ceil = areabenchrnd(256) - 128;
+        s[i].vdelta = areabenchrnd(3) ? 0 : areabenchrnd(256);
+    }
+}
+
+int areabench()
+{
+    const int num = 150;
+    int mismatches = 0, kernelmismatches = 0;
+    uint bitstime = 0, reftime = 0;
+    loopk(num)
+    {
+        int factor = 6 + k % 5, ls = 1 << factor;
+        char *ml = new char[ls * ls];
+        servsqr *s = new servsqr[ls * ls];
+        areabenchfloorplan(k, ml, s, ls);
+        kernelmismatches += checkfloorplankernels(ml, s, ls);
+
+        vector<uint> rows, cols;
+        layoutbits(ml, ls, rows.pad(ls * ls / 32), cols.pad(ls * ls / 32));
+        int maxarea = 0;
+        loopi(8)
+        {
+            int area = getmaxareabits(i & 4 ? cols.getbuf() : rows.getbuf(), ls, (i & 1) != 0, (i & 2) != 0), refarea = getmaxarea((i & 1), (i & 2), (i & 4), factor, ml);
+            if(area != refarea)
+            {
+                printf("floorplan %d (size %d): pass %d: %d instead of %d\n", k, factor, i, area, refarea);
+                mismatches++;
+            }
+            maxarea = max(maxarea, refarea);
+        }
+        uint start = sl_micros();
+        int area = checkarea(factor, ml);
+        bitstime += sl_micros() - start;
+        start = sl_micros();
+        int refarea = 0;
+        loopi(8) refarea = max(refarea, getmaxarea((i & 1), (i & 2), (i & 4), factor, ml));
+        reftime += sl_micros() - start;
+        if(area != maxarea || refarea != maxarea) mismatches++;
+        delete[] ml;
+        delete[] s;
+    }
+    printf("%d random floorplans (sizes 6..10): checkarea() %u us, getmaxarea() %u us, %d mismatches; row kernels: %d mismatches\n",
+        num, bitstime, reftime, mismatches, kernelmismatches);
+    return mismatches || kernelmismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
 /**
 This part is related to medals system. WIP
  */
@@ -571,7 +828,7 @@ This part is here for compatibility purposes.
 If you know nothing about these detections, please, just ignore it.
 */
 
-inline void checkmove(client *cl)
+inline void checkmove(client *cl, bool collides)   // collides: collideswithmap(cl->state.o)
 {
     cl->ldt = gamemillis - cl->lmillis;
     cl->lmillis = gamemillis;
@@ -585,7 +842,7 @@ inline void checkmove(client *cl)
         cl->inputmillis = servmillis;
     }
 
-    if(maplayout) checkclientpos(cl);
+    checkclientpos(cl, collides);
 
 #ifdef ACAC
     m_engine(cl);
@@ -0,0 +1,282 @@
+// serverdemo.h
+
+// demo recording thread
+//
+// the game thread only copies every recorded packet into a ring buffer (one writer, one reader, no locks).
+// the demowriterthread takes the records from the ring, compresses them and writes the temporary demo file.
+// at the end of the game, the demowriterthread also finishes the demo (writes the chunk index, reads the file back
+// into memory and stores a copy in the demo path) - so the game thread never waits for zlib or the disk.
+//
+// finished demos are handed back to the game thread, which adds them to the list of downloadable demos.
+// the demowriterthread never logs directly (logline is not thread-safe), it passes its messages back with the demo.
+
+#define DEMORINGSIZE (1 << 22)      // 4MB, has to be a power of two (holds several minutes of a full game)
+
+enum { DEMOREC_START = -1, DEMOREC_CHUNK = -2, DEMOREC_END = -3 };   // control records, use the place of the channel number
+
+struct demoring     // records: { int millis, chan, len; uchar data[len]; }
+{
+    uchar *buf;
+    volatile uint head, tail;   // bytes ever written (game thread) and bytes ever read (demowriterthread)
+
+    demoring() : buf(new uchar[DEMORINGSIZE]), head(0), tail(0) {}
+    ~demoring() { DELETEA(buf); }
+
+    void copyin(uint pos, const void *data, int len)
+    {
+        pos &= DEMORINGSIZE - 1;
+        int first = min(len, int(DEMORINGSIZE - pos));
+        memcpy(buf + pos, data, first);
+        memcpy(buf, (const uchar *)data + first, len - first);
+    }
+
+    void copyout(uint pos, void *data, int len)
+    {
+        pos &= DEMORINGSIZE - 1;
+        int first = min(len, int(DEMORINGSIZE - pos));
+        memcpy(data, buf + pos, first);
+        memcpy((uchar *)data + first, buf, len - first);
+    }
+
+    bool put(int millis, int chan, const void *data, int len)   // game thread, returns false if the ring is full
+    {
+        int stamp[3] = { millis, chan, len };
+        uint pos = head, total = sizeof(stamp) + len;
+        if(DEMORINGSIZE - (pos - tail) < total) return false;
+        copyin(pos, stamp, sizeof(stamp));
+        copyin(pos + sizeof(stamp), data, len);
+        sl_membarrier();    // the record has to be complete before it is published
+        head = pos + total;
+        return true;
+    }
+
+    bool get(int &millis, int &chan, vector<uchar> &data)     // demowriterthread, returns false if the ring is empty
+    {
+        uint pos = tail;
+        if(head == pos) return false;
+        sl_membarrier();    // don't read the record before the head
+        int stamp[3];
+        copyout(pos, stamp, sizeof(stamp));
+        millis = stamp[0];
+        chan = stamp[1];
+        data.setsize(0);
+        copyout(pos + sizeof(stamp), data.pad(stamp[2]), stamp[2]);
+        sl_membarrier();    // done reading, before the space is released
+        tail = pos + sizeof(stamp) + stamp[2];
+        return true;
+    }
+};
+
+struct demofinish   // a finished recording, passed from the game thread to the demowriterthread and back
+{
+    bool discard;
+    string info, file, diskfile;    // info is completed by the demowriterthread (file size)
+    int mr;                         // minutes remaining
+    uchar *data;
+    int len;
+    string msg;                     // what the demowriterthread has to tell the log
+    int loglevel;
+
+    demofinish() : discard(false), mr(0), data(NULL), len(0), loglevel(ACLOG_INFO) { info[0] = file[0] = diskfile[0] = msg[0] = '\0'; }
+};
+
+demoring *demorecordring = NULL;
+sl_semaphore *demowriter_sem = NULL;            // wakes the demowriterthread (one post per record)
+sl_semaphore *demofinished_lock = NULL;         // guards demosfinished
+vector<demofinish *> demosfinished;             // finished demos, waiting to be picked up by the game thread
+volatile bool demowriteridle = true;
+bool demorecording = false;                     // game thread: a recording is running
+int demochunkstart = 0;
+
+// demowriterthread only
+
+stream *demotmp = NULL, *demorecord = NULL;
+vector<demoindexentry> demorecordindex;
+string demowritererror;
+
+static void demowriterfail(const char *msg)
+{
+    if(!demowritererror[0]) copystring(demowritererror, msg);
+    DELETEP(demorecord);
+    DELETEP(demotmp);
+}
+
+static void demowriterstart(demoheader *hdr)
+{
+    DELETEP(demorecord);
+    DELETEP(demotmp);
+    demorecordindex.setsize(0);
+    demowritererror[0] = '\0';
+    defformatstring(demotmppath)("demos/demorecord_%s_%d", scl.ip[0] ? scl.ip : "local", scl.serverport);
+    demotmp = opentempfile(demotmppath, "w+b");
+    if(!demotmp) { demowriterfail("could not create the temporary demo file"); return; }
+    stream *f = opengzfile(NULL, "wb", demotmp);
+    if(!f) { demowriterfail("demo recording failed"); return; }
+    f->write(hdr, sizeof(demoheader));
+    delete f;
+}
+
+static void demowriterchunk(int millis)     // finish the current chunk (if any) and start a new one
+{
+    if(!demotmp) return;
+    DELETEP(demorecord);
+    demoindexentry &e = demorecordindex.add();
+    e.millis = millis;
+    e.offset = demotmp->tell();
+    demorecord = opengzfile(NULL, "wb", demotmp);
+    if(!demorecord) demowriterfail("demo recording failed");
+}
+
+static void demowriterrecord(int millis, int chan, void *data, int len)
+{
+    if(!demorecord) return;
+    int stamp[3] = { millis, chan, len };
+    lilswap(stamp, 3);
+    demorecord->write(stamp, sizeof(stamp));
+    demorecord->write(data, len);
+}
+
+static void demowriterend(demofinish *d)
+{
+    DELETEP(demorecord);
+    if(!demotmp)
+    {
+        if(!d->discard) copystring(d->msg, demowritererror[0] ? demowritererror : "demo recording failed");
+        d->loglevel = ACLOG_ERROR;
+        d->discard = true;
+    }
+    if(d->discard)
+    {
+        DELETEP(demotmp);
+        demorecordindex.setsize(0);
+        return;
+    }
+
+    // append the chunk index
+    demotrailer t;
+    t.indexoffset = demotmp->tell();
+    t.numchunks = demorecordindex.length();
+    memcpy(t.magic, DEMOTRAILERMAGIC, sizeof(t.magic));
+    stream *f = opengzfile(NULL, "wb", demotmp);
+    if(f)
+    {
+        lilswap(&demorecordindex[0].millis, 2 * demorecordindex.length());
+        f->write(demorecordindex.getbuf(), demorecordindex.length() * sizeof(demoindexentry));
+        delete f;
+    }
+    demorecordindex.setsize(0);
+    lilswap(&t.indexoffset, 2);
+    demotmp->write(&t, sizeof(t));
+
+    int len = d->len = demotmp->size();
+    concatformatstring(d->info, ", %.2f%s", len > 1024*1024 ? len/(1024*1024.f) : len/1024.0f, len > 1024*1024 ? "MB" : "kB");
+    if(d->mr) concatformatstring(d->info, ", %d mr", d->mr);
+    d->data = new uchar[len];
+    demotmp->seek(0, SEEK_SET);
+    demotmp->read(d->data, len);
+    DELETEP(demotmp);
+
+    if(d->diskfile[0])
+    {
+        stream *demo = openfile(d->diskfile, "wb");
+        if(demo)
+        {
+            int wlen = (int) demo->write(d->data, d->len);
+            delete demo;
+            formatstring(d->msg)("demo written to file \"%s\" (%d bytes)", d->diskfile, wlen);
+        }
+        else formatstring(d->msg)("failed to write demo to file \"%s\"", d->diskfile);
+    }
+}
+
+int demowriterthread(void *nop)
+{
+    vector<uchar> data;
+    int millis, chan;
+    for(;;)
+    {
+        demowriter_sem->wait();
+        demowriteridle = false;
+        while(demorecordring->get(millis, chan, data)) switch(chan)
+        {
+            case DEMOREC_START: demowriterstart((demoheader *)data.getbuf()); break;
+            case DEMOREC_CHUNK: demowriterchunk(millis); break;
+            case DEMOREC_END:
+            {
+                demofinish *d;
+                memcpy(&d, data.getbuf(), sizeof(d));
+                demowriterend(d);
+                demofinished_lock->wait();
+                demosfinished.add(d);
+                demofinished_lock->post();
+                break;
+            }
+            default: demowriterrecord(millis, chan, data.getbuf(), data.length()); break;
+        }
+        demowriteridle = true;
+    }
+    return 0;
+}
+
+// game thread
+
+void putdemorecord(int chan, const void *data, int len)
+{
+    if(!demorecordring->put(gamemillis, chan, data, len))
+    {
+        static int lastwarning = 0;
+        if(!lastwarning || servmillis - lastwarning > 10000)
+        {
+            logline(ACLOG_WARNING, "demo writer can't keep up, waiting for it");
+            lastwarning = servmillis;
+        }
+        do { demowriter_sem->post(); sl_sleep(1); } while(!demorecordring->put(gamemillis, chan, data, len));
+    }
+    demowriter_sem->post();
+}
+
+void startdemowriter()
+{
+    if(demorecordring) return;     // (started on demand: a thread would not survive startinstances())
+    demorecordring = new demoring;
+    demowriter_sem = new sl_semaphore(0, NULL);
+    demofinished_lock = new sl_semaphore(1, NULL);
+    sl_createthread(demowriterthread, NULL);
+}
+
+void polldemowriter()   // pick up demos, the demowriterthread has finished
+{
+    if(!demofinished_lock || demofinished_lock->trywait()) return;
+    vector<demofinish *> finished;
+    while(demosfinished.length()) finished.add(demosfinished.remove(0));
+    demofinished_lock->post();
+
+    loopv(finished)
+    {
+        demofinish *f = finished[i];
+        if(f->msg[0]) logline(f->loglevel, "%s", f->msg);
+        if(!f->discard)
+        {
+            if(demofiles.length() >= scl.maxdemos)
+            {
+                demofiles[0].buf->release();
+                demofiles.remove(0);
+            }
+            demofile &d = demofiles.add();
+            copystring(d.info, f->info);
+            copystring(d.file, f->file);
+            d.buf = new demobuffer(f->data, f->len);
+            defformatstring(msg)("Demo \"%s\" recorded\nPress F10 to download it from the server..", d.info);
+            sendservmsg(msg);
+            logline(ACLOG_INFO, "Demo \"%s\" recorded.", d.info);
+        }
+        delete f;
+    }
+}
+
+void flushdemowriter()  // wait until the demowriterthread is idle (shutdown)
+{
+    if(!demorecordring) return;
+    while(demorecordring->head != demorecordring->tail || !demowriteridle) sl_sleep(10);
+    polldemowriter();
+}
@@ -67,6 +67,7 @@ void processevent(client *c, shotevent &e)
                 if(!clients.inrange(h.target)) continue;
                 client *target = clients[h.target];
                 if(target->type==ST_EMPTY || target->state.state!=CS_ALIVE || h.lifesequence!=target->state.lifesequence) continue;
+                if(target != c && !checkhit(c, target, e)) continue;
 
                 int rays = 1, damage = 0;
                 bool gib = false;
@@ -16,6 +16,21 @@ const char *servermappath_incom = SERVERMAP_PATH_INCOMING;
 #define FLOORPLANBUFSIZE  (sizeof(struct servsqr) << ((SERVERMAXMAPFACTOR) * 2))              // that's 4MB for size 10 maps (or 1 MB for size 9 maps)
 
 stream *readmaplog = NULL;   // the readmaps thread always logs directly to file
+sl_semaphore *readmaplog_lock = NULL;   // (the map loader threads share the log)
+
+void readmaplogf(const char *fmt, ...) PRINTFARGS(1, 2);
+void readmaplogf(const char *fmt, ...)
+{
+    if(!readmaplog) return;
+    char s[2 * MAXSTRLEN];
+    va_list ap;
+    va_start(ap, fmt);
+    vformatstring(s, fmt, ap, sizeof(s));
+    va_end(ap);
+    if(readmaplog_lock) readmaplog_lock->wait();
+    readmaplog->putstring(s);
+    if(readmaplog_lock) readmaplog_lock->post();
+}
 
 struct servermap  // in-memory version of a map file on a server
 {
@@ -39,6 +54,7 @@ struct servermap  // in-memory version of a map file on a server
     short *entpos_x, *entpos_y;
 
     bool isok;                      // definitive flag!
+    servermap *queuenext;           // (servermapsloaded)
     #ifdef _DEBUG
     char maptitle[129];
     #endif
@@ -49,12 +65,48 @@ struct servermap  // in-memory version of a map file on a server
     bool isro() { return fpath == servermappath_off || fpath == servermappath_serv; }
     bool isofficial() { return fpath == servermappath_off; }
 
-    int getmemusage() { return sizeof(struct servermap) + cgzlen + cfggzlen + layoutgzlen + numents * (sizeof(uchar) + sizeof(short) * 3); }
+    int getmemusage() { return sizeof(struct servermap) + (cgzraw ? getfilesmemusage() : 0) + layoutgzlen + numents * (sizeof(uchar) + sizeof(short) * 3); }
+    int getfilesmemusage() { return cgzlen + (cfgrawgz ? cfggzlen : 0); }
+
+    void dropfiles() { DELETEA(cgzraw); DELETEA(cfgrawgz); }   // keep only the statistics in memory (map store)
 
-    void load(void)  // load map into memory and extract everything important about it  (assumes struct to be zeroed: can only be called once)
+    bool loadfiles()  // read the map files back into memory, fails if they changed since load() (a cfgrawgz, that's already there, is kept)
     {
-        static uchar *staticbuffer = NULL;
-        if(!staticbuffer) staticbuffer = new uchar[FLOORPLANBUFSIZE];     // this buffer gets reused for every map load several times (also: because of this, load() is not thread safe)
+        if(cgzraw) return true;
+        if(!isok) return false;
+        defformatstring(filename)("%s%s.cgz", fpath, fname);
+        int len = 0;
+        uchar *cgz = (uchar *)loadfile(path(filename), &len), hash[TIGERHASHSIZE];
+        if(cgz) tigerhash(hash, cgz, len);
+        if(!cgz || len != cgzlen || memcmp(hash, cgzhash, TIGERHASHSIZE))
+        {
+            DELETEA(cgz);
+            return false;
+        }
+        uchar *cfggz = NULL;
+        if(cfglen)
+        {
+            formatstring(filename)("%s%s.cfg", fpath, fname);
+            uchar *cfg = (uchar *)loadfile(path(filename), &len);
+            if(cfg) tigerhash(hash, cfg, len);
+            uLongf gzbufsize = GZBUFSIZE;
+            if(!cfgrawgz) cfggz = new uchar[GZBUFSIZE];
+            if(!cfg || len != cfglen || memcmp(hash, cfghash, TIGERHASHSIZE) || (cfggz && (compress2(cfggz, &gzbufsize, cfg, cfglen, 9) != Z_OK || (int)gzbufsize != cfggzlen)))
+            {
+                DELETEA(cfg);
+                DELETEA(cfggz);
+                DELETEA(cgz);
+                return false;
+            }
+            DELETEA(cfg);
+        }
+        cgzraw = cgz;
+        if(cfggz) cfgrawgz = cfggz;
+        return true;
+    }
+
+    void load(uchar *scratch)  // load map into memory and extract everything important about it  (assumes struct to be zeroed: can only be called once)
+    {                          // scratch: FLOORPLANBUFSIZE bytes, that get reused several times (one buffer per thread)
 
         const char *err = NULL;
         stream *f = NULL;
@@ -80,12 +132,12 @@ struct servermap  // in-memory version of a map file on a server
         {
             uLongf gzbufsize = GZBUFSIZE;
             ASSERT(GZBUFSIZE < FLOORPLANBUFSIZE);
-            if(compress2(staticbuffer, &gzbufsize, cfgraw, cfglen, 9) != Z_OK) gzbufsize = 0;
+            if(compress2(scratch, &gzbufsize, cfgraw, cfglen, 9) != Z_OK) gzbufsize = 0;
             cfggzlen = (int) gzbufsize;
             if(cgzlen + cfggzlen < MAXMAPSENDSIZE)
             { // map is small enough to be sent
                 cfgrawgz = new uchar[cfggzlen];
-                memcpy(cfgrawgz, staticbuffer, cfggzlen);
+                memcpy(cfgrawgz, scratch, cfggzlen);
             }
             else err = "cgz + cfg.gz too big to send";
         }
@@ -96,7 +148,7 @@ struct servermap  // in-memory version of a map file on a server
         {
             const int sizeof_header = sizeof(header), sizeof_baseheader = sizeof(header) - sizeof(int) * 16;
             f = opengzfile(filename, "rb");
-            header *h = (header *)staticbuffer;
+            header *h = (header *)scratch;
             if(!f) err = "can't open map file";
             else if(f->read(h, sizeof_baseheader) != sizeof_baseheader || (strncmp(h->head, "CUBE", 4) && strncmp(h->head, "ACMP",4))) err = "bad map file";
             if(err) goto loadfailed;
@@ -120,14 +172,14 @@ struct servermap  // in-memory version of a map file on a server
                 lilswap(&h->waterlevel, 1);
                 waterlevel = version >= 4 ? h->waterlevel : -100000;
                 restofhead = clamp(headersize - sizeof_header, 0, MAXHEADEREXTRA);
-                if(f->read(staticbuffer, restofhead) != restofhead) err = "map file truncated";
+                if(f->read(scratch, restofhead) != restofhead) err = "map file truncated";
             }
         }
         if(err) goto loadfailed;
 
         // parse header extras
         {
-            ucharbuf p(staticbuffer, restofhead);
+            ucharbuf p(scratch, restofhead);
             while(1)
             {
                 int len = getuint(p), flags = getuint(p), type = flags & HX_TYPEMASK;
@@ -155,7 +207,7 @@ struct servermap  // in-memory version of a map file on a server
         {
             bool oldentityformat = version < 10; // version < 10 have only 4 attributes and no scaling
             ASSERT(MAXENTITIES * sizeof(persistent_entity) < FLOORPLANBUFSIZE);
-            persistent_entity *es = (persistent_entity *) staticbuffer;
+            persistent_entity *es = (persistent_entity *) scratch;
             loopi(numents)
             {
                 persistent_entity &e = es[i];
@@ -192,7 +244,7 @@ struct servermap  // in-memory version of a map file on a server
 
         // convert and count entities for server use
         {
-            persistent_entity *es = (persistent_entity *) staticbuffer;
+            persistent_entity *es = (persistent_entity *) scratch;
             calcentitystats(entstats, es, numents);
             enttypes = new uchar[numents];  // FIXME: cut this down to useful entities
             entpos_x = new short[numents];
@@ -210,7 +262,7 @@ struct servermap  // in-memory version of a map file on a server
         // read full map geometry (without textures)
         {
             layoutlen = 1 << (sfactor * 2);
-            servsqr *ss = (servsqr *)staticbuffer, *tt = NULL, *ee = ss + layoutlen;
+            servsqr *ss = (servsqr *)scratch, *tt = NULL, *ee = ss + layoutlen;
             while(ss < ee && !err)
             {
                 int type = f->getchar(), n;
@@ -268,13 +320,13 @@ struct servermap  // in-memory version of a map file on a server
 
         // collect geometry stats (exactly the same as calculated by the client)
         {
-            if(calcmapdims(mapdims, (servsqr *)staticbuffer, 1 << sfactor) < 0) err = "world geometry error";
+            if(calcmapdims(mapdims, (servsqr *)scratch, 1 << sfactor) < 0) err = "world geometry error";
         }
         if(err) goto loadfailed;
 
         // merge vdelta into floor & ceil
         {
-            servsqr *ss = (servsqr *)staticbuffer;
+            servsqr *ss = (servsqr *)scratch;
             int linelen = 1 << sfactor, linegap = linelen - mapdims.xspan;
             ss += linelen * mapdims.y1 + mapdims.x1;
             for(int j = mapdims.yspan; j > 0; j--, ss += linegap) loopirev(mapdims.xspan)
@@ -296,13 +348,13 @@ struct servermap  // in-memory version of a map file on a server
 
         // calculate area statistics from type & vdelta values (destroys vdelta!)
         {
-            if(calcmapareastats(areastats, (servsqr *)staticbuffer, 1 << sfactor, mapdims) < 0) err = "world layout malformed"; // should be a quite fringe error
+            if(calcmapareastats(areastats, (servsqr *)scratch, 1 << sfactor, mapdims) < 0) err = "world layout malformed"; // should be a quite fringe error
         }
         if(err) goto loadfailed;
 
         // work "player accessibility" into the floorplan, calculate map bounding box for player-accessible areas only
         {
-            servsqr *ss = (servsqr *)staticbuffer;
+            servsqr *ss = (servsqr *)scratch;
             int linelen = 1 << sfactor, linegap = linelen - mapdims.xspan;
             ss += linelen * mapdims.y1 + mapdims.x1;
             x1 = y1 = linelen; zmin = 127; zmax = -128;
@@ -331,8 +383,8 @@ struct servermap  // in-memory version of a map file on a server
 
         // create compact floorplan
         {
-            char *layout = (char *)staticbuffer;
-            servsqr *ss = (servsqr *)staticbuffer;
+            char *layout = (char *)scratch;
+            servsqr *ss = (servsqr *)scratch;
             loopirev(layoutlen)
             {
                 switch(ss->type & TAGTRIGGERMASK)
@@ -345,12 +397,12 @@ struct servermap  // in-memory version of a map file on a server
             }
             ASSERT(layoutlen * 3 <= (int)FLOORPLANBUFSIZE);
             uLongf gzbufsize = layoutlen * 2;   // valid for sizeof(struct servsqr) >= 3
-            if(compress2(staticbuffer + layoutlen, &gzbufsize, staticbuffer, layoutlen, 9) != Z_OK) gzbufsize = 0;
+            if(compress2(scratch + layoutlen, &gzbufsize, scratch, layoutlen, 9) != Z_OK) gzbufsize = 0;
             layoutgzlen = (int) gzbufsize;
             if(layoutgzlen > 0 && layoutgzlen < layoutlen)
             { // gzipping went well -> keep it
                 layoutgz = new uchar[layoutgzlen];
-                memcpy(layoutgz, staticbuffer + layoutlen, layoutgzlen);
+                memcpy(layoutgz, scratch + layoutlen, layoutgzlen);
             }
             else err = "gzipping the floorplan failed";
         }
@@ -359,23 +411,82 @@ struct servermap  // in-memory version of a map file on a server
         DELETEP(f);
         if(err)
         {   // fail
-            if(readmaplog) readmaplog->printf("reading map '%s%s' failed: %s.\n", fpath, fname, err);
+            readmaplogf("reading map '%s%s' failed: %s.\n", fpath, fname, err);
         }
         else
         {   // success
-            if(readmaplog) readmaplog->printf("read map '%s%s': cgz %d bytes, cfg %d bytes (%d gz), version %d, size %d, rev %d, "
-                                              "ents %d, x %d:%d, y %d:%d, z %d:%d, layout %d bytes, spawns %d:%d:%d, flags %d:%d\n",
-                                               fpath, fname, cgzlen, cfglen, cfggzlen, version, sfactor, maprevision,
-                                               numents, x1, x2, y1, y2, zmin, zmax, layoutgzlen, entstats.spawns[0], entstats.spawns[1], entstats.spawns[2], entstats.flags[0], entstats.flags[1]);
+            logread(false);
             isok = true;
         }
     }
+
+    void logread(bool cached)
+    {
+        readmaplogf("read map '%s%s'%s: cgz %d bytes, cfg %d bytes (%d gz), version %d, size %d, rev %d, "
+                                          "ents %d, x %d:%d, y %d:%d, z %d:%d, layout %d bytes, spawns %d:%d:%d, flags %d:%d\n",
+                                           fpath, fname, cached ? " from cache" : "", cgzlen, cfglen, cfggzlen, version, sfactor, maprevision,
+                                           numents, x1, x2, y1, y2, zmin, zmax, layoutgzlen, entstats.spawns[0], entstats.spawns[1], entstats.spawns[2], entstats.flags[0], entstats.flags[1]);
+    }
 };
 
+// map registry (main thread only)
+
+vector<servermap *> servermaps;                                     // all available maps kept in memory
+hashtable<const char *, servermap *> servermapindex(1 << 13);       // the same maps, by name (map filenames have to be unique among the paths)
+
+servermap *getservermap(const char *mapname)
+{
+    servermap **sm = servermapindex.access(behindpath(mapname));
+    return sm ? *sm : NULL;
+}
+
+// map store ("--mapcache=N"): only the statistics of every map stay in memory, the map files are read when a map is played
+// (and may be downloaded). the files of the last played maps are kept in memory, until they need more than N MB.
+
+int servermapcachemb = -1;                  // -1: all map files stay in memory
+vector<servermap *> servermapfiles;         // maps with their files in memory (map store only), least recently used first
+uint64_t servermapfilesmem = 0;             // in bytes (64 bit: --mapcache can be 2 GB or more)
+
+void addservermap(servermap *sm)
+{
+    servermaps.add(sm);
+    servermapindex[sm->fname] = sm;
+}
+
+void removeservermap(servermap *sm)
+{
+    servermapindex.remove(sm->fname);
+    servermaps.removeobj(sm);
+    if(servermapfiles.find(sm) >= 0)
+    {
+        servermapfiles.removeobj(sm);
+        servermapfilesmem -= sm->getfilesmemusage();
+    }
+}
+
+bool loadservermapfiles(servermap *sm)     // make sure, the map files are in memory
+{
+    if(servermapcachemb < 0) return sm->cgzraw != NULL;
+    if(servermapfiles.find(sm) >= 0) servermapfiles.removeobj(sm);
+    else
+    {
+        if(!sm->loadfiles()) return false;
+        servermapfilesmem += sm->getfilesmemusage();
+    }
+    servermapfiles.add(sm);
+    while(servermapfilesmem > uint64_t(servermapcachemb) << 20 && servermapfiles.length() > 1)
+    {
+        servermap *old = servermapfiles.remove(0);
+        servermapfilesmem -= old->getfilesmemusage();
+        old->dropfiles();
+    }
+    return true;
+}
+
 // data structures to sync data flow between main thread and readmapsthread
-volatile servermap *servermapdropbox = NULL;     // changed servermap entry back to the main thread
 volatile bool startnewservermapsepoch = false;    // signal readmapsthread to start an new full search
 sl_semaphore *readmapsthread_sem = NULL;         // sync readmapsthread with main thread
+volatile bool readmapsonce = false;                // end readmapsthread after one scan (see startinstances())
 
 // readmapsthread
 //
@@ -385,61 +496,272 @@ sl_semaphore *readmapsthread_sem = NULL;         // sync readmapsthread with mai
 // * basically extracts everything from the map file, that the server needs to run a game on it
 // (may take a while, but we're not in a hurry)
 //
-// the thread processes one map at a time and waits for the main thread to store and enlist the findings
+// the thread only collects new and changed maps, they are loaded in parallel by the map loaders (see below)
+// and handed to the main thread one by one, as soon as they are ready
 //
 
-struct mapfilename { const char *fname, *fpath; int cgzlen, cfglen, epoch; }; // for tracking map/cfg file (-size) changes
+enum { MAPPATH_OFF = 0, MAPPATH_SERV, MAPPATH_INCOM, MAPPATH_NUM };   // in order of priority
+
+static const char *mappathbyindex(int idx) { return idx == MAPPATH_OFF ? servermappath_off : (idx == MAPPATH_SERV ? servermappath_serv : servermappath_incom); }
+static int mappathindex(const char *fpath) { return fpath == servermappath_off ? MAPPATH_OFF : (fpath == servermappath_serv ? MAPPATH_SERV : MAPPATH_INCOM); }
+
+struct mapfilename { const char *fname, *fpath; filestamp cgz, cfg; int epoch; bool present; }; // for tracking map/cfg file changes
 vector<mapfilename> mapfilenames; // this list only grows
+hashtable<const char *, int> mapfilenameindex[MAPPATH_NUM];    // index of mapfilenames, by name - one table per path
 
-void updateservermap(int index, bool deletethis)
+// map loaders
+//
+// the readmapsthread (or followmapsthread) only collects the maps that need to be loaded, then "--mapthreads" loader threads
+// load them in parallel, every one with its own scratch buffer. the loaded servermaps go to the main thread through
+// servermapsloaded - and so do servermaps that only signal that a map is gone (not loaded, isok is false).
+// the queue is lock-free: the loaders push with compare-and-swap, the main thread takes the whole list with one atomic swap.
+
+#define MAXMAPTHREADS 8
+
+struct servermapqueue
 {
-    mapfilename &m = mapfilenames[index];
-    servermap *sm = new servermap(m.fname, m.fpath);
-    if(!deletethis) sm->load();
-    if(sm->isok)
+    servermap *volatile head;   // last pushed first
+
+    servermapqueue() : head(NULL) {}
+
+    void push(servermap *sm)    // any thread
+    {
+        do sm->queuenext = head; while(!sl_atomiccas(&head, sm->queuenext, sm));
+    }
+
+    servermap *takeall()        // main thread: returns the list in the order of push()
     {
-        m.cgzlen = sm->cgzlen;
-        m.cfglen = sm->cfglen;
+        servermap *sm = sl_atomicswap(&head, (servermap *)NULL), *list = NULL;
+        while(sm)
+        {
+            servermap *next = sm->queuenext;
+            sm->queuenext = list;
+            list = sm;
+            sm = next;
+        }
+        return list;
     }
-    else m.cgzlen = m.cfglen = 0;
+};
+
+servermapqueue servermapsloaded;
+int maploadthreads = 2;
+vector<int> maploadjobs;            // mapfilenames to load (only read by the loaders)
+volatile int maploadnext = 0;
+
+// map cache
+//
+// everything load() extracts from a map is also written to SERVERMAP_PATH_CACHE, one file per map. a map is only parsed again,
+// if the size or modification time of its files changed - and if the files are read anyway (they stay in memory, unless we're
+// a map store), also if their tiger hashes changed. the cache files are native byte order: they're not meant to be copied to other machines.
 
-    // pipe sm to main thread....
-    // we're handing a pointer to a new servermap to the main thread (who manages the array for all servermaps)
-    // if the new servermap is not loaded properly, that's the signal for the main thread to delete the entry from the array
-    while(servermapdropbox) readmapsthread_sem->wait(); // wait for the main thread to process the last sent servermap
-    servermapdropbox = sm;
+#define SERVERMAP_PATH_CACHE "packages" PATHDIVS "maps" PATHDIVS "servercache" PATHDIVS
+#define SERVERMAPCACHEVERSION 1
+
+struct servermapcachehdr
+{
+    char magic[4];                  // "ACSM"
+    int cacheversion, hdrsize, byteorder;
+    filestamp cgz, cfg;             // key: sizes and modification times of the map files (taken before they were read)
+    uchar cgzhash[TIGERHASHSIZE], cfghash[TIGERHASHSIZE];
+    int cgzlen, cfglen, cfggzlen;
+    int version, headersize, sfactor, numents, maprevision, waterlevel;
+    int layoutlen, layoutgzlen;
+    mapdim_s mapdims;
+    entitystats_s entstats;
+    mapareastats_s areastats;
+    int x1, x2, y1, y2, zmin, zmax;
+    // followed by: cfgrawgz[cfggzlen] (if cfglen), layoutgz[layoutgzlen], enttypes[numents], entpos_x[numents], entpos_y[numents]
+};
+
+volatile int servermapcachehits = 0;
+
+static const char *servermapcachefile(mapfilename &m, char *fname)   // fname: MAXSTRLEN
+{
+    static const char *dirs[MAPPATH_NUM] = { "official", "servermaps", "incoming" };
+    formatstring(fname)(SERVERMAP_PATH_CACHE "%s" PATHDIVS "%s.smc", dirs[mappathindex(m.fpath)], m.fname);
+    return path(fname);
 }
 
-int getmapfilenameindex(const char *fname, const char *fpath)
+servermap *loadservermapcache(mapfilename &m, bool withfiles)    // any thread: returns NULL, if the map is not in the cache (or changed)
 {
-    loopv(mapfilenames) if(fpath == mapfilenames[i].fpath && !strcmp(fname, mapfilenames[i].fname)) return i;
-    return -1;
+    string fname;
+    int len = 0;
+    uchar *buf = (uchar *)loadfile(servermapcachefile(m, fname), &len);
+    if(!buf) return NULL;
+    servermap *sm = new servermap(m.fname, m.fpath);
+    servermapcachehdr &h = *(servermapcachehdr *)buf;
+    bool ok = len >= (int)sizeof(h) && !memcmp(h.magic, "ACSM", 4) && h.cacheversion == SERVERMAPCACHEVERSION && h.hdrsize == (int)sizeof(h) && h.byteorder == 0x01020304 &&
+              !memcmp(&h.cgz, &m.cgz, sizeof(filestamp)) && !memcmp(&h.cfg, &m.cfg, sizeof(filestamp)) &&
+              h.numents >= 0 && h.numents <= MAXENTITIES && h.cfggzlen >= 0 && h.layoutgzlen > 0 &&
+              len == (int)sizeof(h) + (h.cfglen ? h.cfggzlen : 0) + h.layoutgzlen + h.numents * int(sizeof(uchar) + sizeof(short) * 2);
+    if(ok)
+    {
+        memcpy(sm->cgzhash, h.cgzhash, TIGERHASHSIZE);
+        memcpy(sm->cfghash, h.cfghash, TIGERHASHSIZE);
+        sm->cgzlen = h.cgzlen; sm->cfglen = h.cfglen; sm->cfggzlen = h.cfggzlen;
+        sm->version = h.version; sm->headersize = h.headersize; sm->sfactor = h.sfactor; sm->numents = h.numents; sm->maprevision = h.maprevision; sm->waterlevel = h.waterlevel;
+        sm->layoutlen = h.layoutlen; sm->layoutgzlen = h.layoutgzlen;
+        sm->mapdims = h.mapdims;
+        sm->entstats = h.entstats;
+        sm->areastats = h.areastats;
+        sm->x1 = h.x1; sm->x2 = h.x2; sm->y1 = h.y1; sm->y2 = h.y2; sm->zmin = h.zmin; sm->zmax = h.zmax;
+        uchar *p = buf + sizeof(h);
+        if(sm->cfglen)
+        {
+            sm->cfgrawgz = new uchar[sm->cfggzlen];
+            memcpy(sm->cfgrawgz, p, sm->cfggzlen);
+            p += sm->cfggzlen;
+        }
+        sm->layoutgz = new uchar[sm->layoutgzlen];
+        memcpy(sm->layoutgz, p, sm->layoutgzlen);
+        p += sm->layoutgzlen;
+        sm->enttypes = new uchar[sm->numents];
+        sm->entpos_x = new short[sm->numents];
+        sm->entpos_y = new short[sm->numents];
+        memcpy(sm->enttypes, p, sm->numents * sizeof(uchar));
+        memcpy(sm->entpos_x, p += sm->numents * sizeof(uchar), sm->numents * sizeof(short));
+        memcpy(sm->entpos_y, p += sm->numents * sizeof(short), sm->numents * sizeof(short));
+        sm->isok = true;
+        if(withfiles && !sm->loadfiles()) ok = false;  // the map files changed without changing size or time
+    }
+    delete[] buf;
+    if(!ok)
+    {
+        delete sm;
+        return NULL;
+    }
+    sm->logread(true);
+    sl_atomicadd(&servermapcachehits, 1);
+    return sm;
 }
 
-void trymapfiles(const char *fpath, const char *fname, int epoch)  //check, if map files were added or altered (detecting alteration requires filesizes to be changed as well, as usual)
+void storeservermapcache(servermap *sm, mapfilename &m)    // any thread: write the results of a successful load() to the cache
 {
-    bool updatethis = false;
-    int mapfileindex = getmapfilenameindex(fname, fpath);
-    if(mapfileindex < 0)
-    { // new map file
-        mapfileindex = mapfilenames.length();
-        mapfilename &m = mapfilenames.add();
-        m.fname = newstring(fname);
-        m.fpath = fpath;
-        m.cgzlen = m.cfglen = 0;
-        m.epoch = epoch;
-        updatethis = true;
+    servermapcachehdr h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "ACSM", 4);
+    h.cacheversion = SERVERMAPCACHEVERSION;
+    h.hdrsize = sizeof(h);
+    h.byteorder = 0x01020304;
+    h.cgz = m.cgz; h.cfg = m.cfg;
+    memcpy(h.cgzhash, sm->cgzhash, TIGERHASHSIZE);
+    memcpy(h.cfghash, sm->cfghash, TIGERHASHSIZE);
+    h.cgzlen = sm->cgzlen; h.cfglen = sm->cfglen; h.cfggzlen = sm->cfggzlen;
+    h.version = sm->version; h.headersize = sm->headersize; h.sfactor = sm->sfactor; h.numents = sm->numents; h.maprevision = sm->maprevision; h.waterlevel = sm->waterlevel;
+    h.layoutlen = sm->layoutlen; h.layoutgzlen = sm->layoutgzlen;
+    h.mapdims = sm->mapdims;
+    h.entstats = sm->entstats;
+    h.areastats = sm->areastats;
+    h.x1 = sm->x1; h.x2 = sm->x2; h.y1 = sm->y1; h.y2 = sm->y2; h.zmin = sm->zmin; h.zmax = sm->zmax;
+    string fname;
+    stream *f = openfile(servermapcachefile(m, fname), "wb");
+    if(!f) return;
+    f->write(&h, sizeof(h));
+    if(sm->cfglen) f->write(sm->cfgrawgz, sm->cfggzlen);
+    f->write(sm->layoutgz, sm->layoutgzlen);
+    f->write(sm->enttypes, sm->numents * sizeof(uchar));
+    f->write(sm->entpos_x, sm->numents * sizeof(short));
+    f->write(sm->entpos_y, sm->numents * sizeof(short));
+    delete f;   // (a file that was not completely written, fails the size check)
+}
+
+void updateservermap(int index, bool deletethis)     // queue a map for loading, or tell the main thread right away, that it's gone
+{
+    mapfilename &m = mapfilenames[index];
+    m.present = !deletethis;   // (a map that failed to load counts as present: it's only tried again, if its files change)
+    maploadjobs.removeobj(index);
+    if(deletethis)
+    {
+        string fname;
+        delfile(findfile(servermapcachefile(m, fname), "r"));
+        servermapsloaded.push(new servermap(m.fname, m.fpath));
     }
-    else
+    else maploadjobs.add(index);
+}
+
+int maploaderthread(void *scratch)
+{
+    for(;;)
     {
-        defformatstring(fcgz)("%s%s.cgz", fpath, fname);
-        defformatstring(fcfg)("%s%s.cfg", fpath, fname);
-        if(mapfilenames[mapfileindex].cgzlen != getfilesize(path(fcgz)) || mapfilenames[mapfileindex].cfglen != getfilesize(path(fcfg)))
+        int i = sl_atomicadd(&maploadnext, 1);
+        if(i >= maploadjobs.length()) return 0;
+        mapfilename &m = mapfilenames[maploadjobs[i]];
+        servermap *sm = loadservermapcache(m, servermapcachemb < 0);
+        if(!sm)
         {
-            updatethis = true;  // changed filesize detected
+            sm = new servermap(m.fname, m.fpath);
+            sm->load((uchar *)scratch);
+            if(sm->isok) storeservermapcache(sm, m);
         }
+        if(servermapcachemb >= 0) sm->dropfiles();
+        servermapsloaded.push(sm);
+    }
+}
+
+void loadservermaps()   // load all queued maps, the calling thread is one of the loaders
+{
+    static uchar *scratch[MAXMAPTHREADS];
+    if(maploadjobs.empty()) return;
+    if(!readmaplog_lock)
+    {
+        readmaplog_lock = new sl_semaphore(1, NULL);
+        uchar hash[TIGERHASHSIZE];
+        tigerhash(hash, (const uchar *)"", 0);  // (initializes the tiger s-boxes, before several threads use them)
+    }
+    int n = clamp(min(maploadthreads, maploadjobs.length()), 1, MAXMAPTHREADS);
+    loopi(n) if(!scratch[i]) scratch[i] = new uchar[FLOORPLANBUFSIZE];
+    maploadnext = 0;
+    vector<void *> loaders;
+    for(int i = 1; i < n; i++)
+    {
+        void *ti = sl_createthread(maploaderthread, scratch[i]);
+        if(ti) loaders.add(ti);
     }
-    if(updatethis) updateservermap(mapfileindex, false);
+    maploaderthread(scratch[0]);
+    loopv(loaders) sl_waitthread(loaders[i]);
+    maploadjobs.setsize(0);
+}
+
+int getmapfilenameindex(const char *fname, const char *fpath)
+{
+    int *index = mapfilenameindex[mappathindex(fpath)].access(fname);
+    return index ? *index : -1;
+}
+
+int addmapfilename(const char *fpath, const char *fname, int epoch)
+{
+    mapfilename &m = mapfilenames.add();
+    m.fname = newstring(fname);
+    m.fpath = fpath;
+    m.cgz.size = m.cfg.size = -1;
+    m.cgz.mtime = m.cfg.mtime = 0;
+    m.epoch = epoch;
+    m.present = false;
+    mapfilenameindex[mappathindex(fpath)][m.fname] = mapfilenames.length() - 1;
+    return mapfilenames.length() - 1;
+}
+
+void getmapfilestamps(const char *fpath, const char *fname, filestamp &cgz, filestamp &cfg)
+{
+    defformatstring(fcgz)("%s%s.cgz", fpath, fname);
+    defformatstring(fcfg)("%s%s.cfg", fpath, fname);
+    getfilestamp(path(fcgz), cgz);
+    getfilestamp(path(fcfg), cfg);
+}
+
+void trymapfiles(const char *fpath, const char *fname, int epoch, bool checkfiles)  // check, if map files were added or altered (size or modification time changed)
+{
+    int mapfileindex = getmapfilenameindex(fname, fpath);
+    if(mapfileindex < 0) mapfileindex = addmapfilename(fpath, fname, epoch);   // new map file
+    else if(mapfilenames[mapfileindex].present && !checkfiles) return;         // directory unchanged
+
+    mapfilename &m = mapfilenames[mapfileindex];
+    filestamp cgz, cfg;
+    getmapfilestamps(fpath, fname, cgz, cfg);
+    if(m.present && cgz.size == m.cgz.size && cgz.mtime == m.cgz.mtime && cfg.size == m.cfg.size && cfg.mtime == m.cfg.mtime) return;
+    m.cgz = cgz;
+    m.cfg = cfg;
+    updateservermap(mapfileindex, false);
 }
 
 void tagmapfile(const char *fpath, const char *fname, int epoch)  // tag list entry, if file (+path) is already in it
@@ -448,6 +770,21 @@ void tagmapfile(const char *fpath, const char *fname, int epoch)  // tag list en
     if(mapfileindex >= 0) mapfilenames[mapfileindex].epoch = epoch;
 }
 
+// the map directories are only listed again, if their fingerprint (mtime/inode in all search paths) changed.
+// files in unchanged directories are not checked at all - except on every MAPFULLSCAN-th scan, which also catches
+// map files that were rewritten in place (that doesn't touch the directory).
+
+#define MAPFULLSCAN 10
+
+struct mapdirscan
+{
+    uint stamp;
+    bool valid, changed;
+    vector<char *> files;
+
+    mapdirscan() : stamp(0), valid(false), changed(true) {}
+};
+
 int readmapsthread(void *logfileprefix)
 {
     static int readmaps_epoch = 0;
@@ -463,43 +800,57 @@ int readmapsthread(void *logfileprefix)
             readmaplog = openfile(logfilename, "a");
         }
 
-        vector<char *> maps_off, maps_serv, maps_incom;
+        static mapdirscan dirs[MAPPATH_NUM];
+        bool fullscan = readmaps_epoch % MAPFULLSCAN == 0;
+        uint scanstart = (uint)time(NULL);
 
-        // get all map file names
-        listfiles(servermappath_off, "cgz", maps_off, stringsort);
-        listfiles(servermappath_serv, "cgz", maps_serv, stringsort);
-        listfiles(servermappath_incom, "cgz", maps_incom, stringsort);
-        if(readmaplog) readmaplog->printf("\n#### %s #### scanning all map directories... found %d official maps, %d servermaps and %d maps in 'incoming'\n", timestring(false), maps_off.length(), maps_serv.length(), maps_incom.length());
+        // get all map file names (of the directories that changed)
+        loopi(MAPPATH_NUM)
+        {
+            mapdirscan &d = dirs[i];
+            uint newest, stamp = getdirstamp(mappathbyindex(i), &newest);
+            d.changed = fullscan || !d.valid || stamp != d.stamp;
+            if(d.changed)
+            {
+                d.files.deletearrays();
+                listfiles(mappathbyindex(i), "cgz", d.files, stringsort);
+            }
+            d.stamp = stamp;
+            d.valid = newest + 1 < scanstart;   // the directory changed in the last second: it could still change without getting a new stamp
+        }
+        if(readmaplog) readmaplog->printf("\n#### %s #### scanning all map directories... found %d official maps, %d servermaps and %d maps in 'incoming'%s\n", timestring(false),
+                                          dirs[MAPPATH_OFF].files.length(), dirs[MAPPATH_SERV].files.length(), dirs[MAPPATH_INCOM].files.length(), fullscan ? " (full scan)" : "");
 
         // enforce priority: official > servermaps > incoming
         // (every map name is only allowed once among the paths)
-        loopv(maps_off)
+        hashtable<const char *, int> mapnames(1 << 13);
+        vector<const char *> maps[MAPPATH_NUM];
+        loopi(MAPPATH_NUM) loopvj(dirs[i].files)
         {
-            loopvjrev(maps_serv) if(!strcmp(maps_off[i], maps_serv[j])) delstring(maps_serv.remove(j));
-            loopvjrev(maps_incom) if(!strcmp(maps_off[i], maps_incom[j])) delstring(maps_incom.remove(j));
-        }
-        loopv(maps_serv)
-        {
-            loopvjrev(maps_incom) if(!strcmp(maps_serv[i], maps_incom[j])) delstring(maps_incom.remove(j));
+            const char *fname = dirs[i].files[j];
+            if(mapnames.access(fname)) continue;
+            mapnames[fname] = i;
+            maps[i].add(fname);
         }
 
         int lastepoch = readmaps_epoch;
         readmaps_epoch++;
         // tag all files in the list that we have found again in this round by giving it the new epoch number
-        loopv(maps_off) tagmapfile(servermappath_off, maps_off[i], readmaps_epoch);
-        loopv(maps_serv) tagmapfile(servermappath_serv, maps_serv[i], readmaps_epoch);
-        loopv(maps_incom) tagmapfile(servermappath_incom, maps_incom[i], readmaps_epoch);
+        loopi(MAPPATH_NUM) loopvj(maps[i]) tagmapfile(mappathbyindex(i), maps[i][j], readmaps_epoch);
 
         // signal deletion of all files in the list that are no longer found to the main thread
         loopvrev(mapfilenames) if(mapfilenames[i].epoch == lastepoch) updateservermap(i, true);
 
         // process all currently available files: load new or changed files and pass them to the main thread
-        loopv(maps_off) trymapfiles(servermappath_off, maps_off[i], readmaps_epoch);
-        loopv(maps_serv) trymapfiles(servermappath_serv, maps_serv[i], readmaps_epoch);
-        loopv(maps_incom) trymapfiles(servermappath_incom, maps_incom[i], readmaps_epoch);
+        loopi(MAPPATH_NUM) loopvj(maps[i]) trymapfiles(mappathbyindex(i), maps[i][j], readmaps_epoch, dirs[i].changed);
+        int loads = maploadjobs.length(), cachehits = servermapcachehits;
+        uint loadstart = sl_micros();
+        loadservermaps();
+        if(loads) readmaplogf("loaded %d maps (%d from the cache) in %u milliseconds\n", loads, servermapcachehits - cachehits, (sl_micros() - loadstart) / 1000);
 
         DELETEP(readmaplog);    // always close the logfile when done, so we can create a new one, if someone removed or renamed the old one
         startnewservermapsepoch = false;
+        if(readmapsonce) break;
     }
     return 0;
 }
@@ -542,6 +893,20 @@ struct servermapbuffer  // sending of maps between clients
         const char *name = behindpath(smapname);   // no paths allowed here
 
         clear();
+        servermap *sm = getservermap(name);
+        if(sm && sm->isro() && !sm->isofficial() && sm->cgzlen + sm->cfggzlen < MAXMAPSENDSIZE && loadservermapfiles(sm))
+        { // servermaps only change, if the admin changes them: take them from the map cache (incoming maps are always read from disk)
+            copystring(mapname, name);
+            cgzsize = sm->cgzlen;
+            cfgsize = sm->cfgrawgz ? sm->cfglen : 0;
+            cfgsizegz = sm->cfgrawgz ? sm->cfggzlen : 0;
+            datasize = cgzsize + cfgsizegz;
+            data = new uchar[datasize];
+            memcpy(data, sm->cgzraw, cgzsize);
+            if(cfgsizegz) memcpy(data + cgzsize, sm->cfgrawgz, cfgsizegz);
+            logline(ACLOG_INFO,"loaded map %s%s from the map cache, %d + %d(%d) bytes.", sm->fpath, sm->fname, cgzsize, cfgsize, cfgsizegz);
+            return;
+        }
         formatstring(cgzname)(SERVERMAP_PATH "%s.cgz", name);
         path(cgzname);
         if(fileexists(cgzname, "r"))
@@ -648,6 +1013,13 @@ int findmappath(const char *mapname, char *filename)
     string tempname;
     if(!filename) filename = tempname;
     const char *name = behindpath(mapname);
+    servermap *sm = isdedicated ? getservermap(name) : NULL;
+    if(sm && sm->isro())
+    { // official maps and servermaps only change, if the admin changes them: the registry is good enough (incoming maps are changed by the clients, those are always checked)
+        formatstring(filename)("%s%s.cgz", sm->fpath, sm->fname);
+        path(filename);
+        return sm->isofficial() ? MAP_OFFICIAL : MAP_CUSTOM;
+    }
     formatstring(filename)(SERVERMAP_PATH_BUILTIN "%s.cgz", name);
     path(filename);
     int loc = MAP_NOTFOUND;
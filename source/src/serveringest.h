@@ -0,0 +1,408 @@
+// serveringest.h
+
+// decoding of position packets, optionally on worker threads
+//
+// position updates are by far the most frequent packets a server receives (every playing client sends 25 per second).
+// with "--ingestthreads=N", all packets that arrive during one enet service round are collected in a batch,
+// the main thread and N worker threads decode the position packets of the batch in parallel,
+// then the main thread applies the results in the original order of arrival.
+// everything else is handled by process() as usual - and so is everything, if no ingest threads are used.
+// besides the decoding, the workers also do the checks that only depend on the packet: the sender's client number
+// and the collision of absolute positions (SV_POS, SV_POSC) with the floorplan. the floorplan doesn't change during a batch.
+// (SV_POSN positions depend on the sender's last keyframe, they are decoded and checked by the main thread.)
+//
+// while the workers are running, the main thread only decodes its own share of the batch,
+// so the workers can safely read everything that belongs to the batch without any locking.
+
+struct posupdate
+{
+    int cn, usefactor;          // usefactor is only used by SV_POSC
+    int y, p, g, f;
+    vec o;
+    bool complete;              // SV_POSC: packet was parsed to its exact end, SV_POSN: packet was parsed without error
+    bool collides;              // SV_POS, SV_POSC: o is outside the map or in solid
+    posnmsg n;                  // SV_POSN: the message, which still needs the client's keyframe to get absolute values
+};
+
+void decodepos(ucharbuf &p, int type, posupdate &pu)   // parse one SV_POS, SV_POSC or SV_POSN message (the message type has already been read)
+{
+    if(type == SV_POS)
+    {
+        pu.cn = getint(p);
+        loopi(3) pu.o[i] = getuint(p)/DMF;
+        pu.y = getuint(p);
+        pu.p = getint(p);
+        pu.g = getuint(p);
+        loopi(4) if ( (pu.g >> i) & 1 ) getint(p);
+        pu.f = getuint(p);
+        pu.usefactor = 0;
+        pu.complete = true;
+    }
+    else if(type == SV_POSN)
+    {
+        pu.complete = getposn(p, pu.n);
+        pu.cn = pu.n.cn;
+        pu.usefactor = 0;
+    }
+    else
+    {
+        bitbuf<ucharbuf> q(p);
+        pu.cn = q.getbits(5);
+        pu.usefactor = q.getbits(2) + 7;
+        int xt = q.getbits(pu.usefactor + 4);
+        int yt = q.getbits(pu.usefactor + 4);
+        pu.y = (q.getbits(9)*360)/512;
+        pu.p = ((q.getbits(8)-128)*90)/127;
+        if(!q.getbits(1)) q.getbits(6);
+        if(!q.getbits(1)) q.getbits(4 + 4 + 4);
+        pu.f = q.getbits(8);
+        int negz = q.getbits(1);
+        int zfull = q.getbits(1);
+        int s = q.rembits();
+        if(s < 3) s += 8;
+        if(zfull) s = 11;
+        int zt = q.getbits(s);
+        if(negz) zt = -zt;
+        int g1 = q.getbits(1); // scoping
+        int g2 = q.getbits(1); // shooting
+        pu.g = (g1<<4) | (g2<<5);
+        pu.o = vec(xt / DMF, yt / DMF, zt / DMF);
+        pu.complete = !p.remaining() && !p.overread();
+    }
+    pu.collides = type != SV_POSN && collideswithmap(pu.o);
+}
+
+void posntopos(vector<uchar> &q, int cn, const posnstate &s, int sfactor)    // write a resolved SV_POSN update as SV_POSC (or SV_POS, if it doesn't fit), for clients that can't read SV_POSN
+{
+    int usefactor = sfactor < 7 ? 7 : sfactor, sizexy = 1 << (usefactor + 4), z = s.o[2];
+    if(cn >= 0 && cn < 32 &&
+        usefactor <= 7 + 3 &&
+        s.o[0] >= 0 && s.o[0] < sizexy &&
+        s.o[1] >= 0 && s.o[1] < sizexy &&
+        z >= -2047 && z <= 2047 &&
+        s.yaw >= 0 && s.yaw < 512 &&
+        s.pitch >= -128 && s.pitch <= 127 &&
+        s.roll >= -32 && s.roll <= 31 &&
+        s.vel[0] >= -8 && s.vel[0] <= 7 &&
+        s.vel[1] >= -8 && s.vel[1] <= 7 &&
+        s.vel[2] >= -8 && s.vel[2] <= 7)
+    { // compact POS packet, written exactly like c2sinfo() does
+        uchar buf[32];
+        ucharbuf p(buf, sizeof(buf));
+        bool noroll = !s.roll, novel = !s.vel[0] && !s.vel[1] && !s.vel[2];
+        bitbuf<ucharbuf> b(p);
+        putint(p, SV_POSC);
+        b.putbits(5, cn);
+        b.putbits(2, usefactor - 7);
+        b.putbits(usefactor + 4, s.o[0]);
+        b.putbits(usefactor + 4, s.o[1]);
+        b.putbits(9, s.yaw);
+        b.putbits(8, s.pitch + 128);
+        b.putbits(1, noroll ? 1 : 0);
+        if(!noroll) b.putbits(6, s.roll + 32);
+        b.putbits(1, novel ? 1 : 0);
+        if(!novel) loopi(3) b.putbits(4, s.vel[i] + 8);
+        b.putbits(8, s.f);
+        b.putbits(1, z < 0 ? 1 : 0);
+        if(z < 0) z = -z;
+        int bits = (b.rembits() - 1 + 8) % 8;
+        if(bits < 3) bits += 8;
+        if(z >= (1 << bits)) bits = 11;
+        b.putbits(1, bits == 11 ? 1 : 0);
+        b.putbits(bits, z);
+        b.putbits(1, s.scoping ? 1 : 0);
+        b.putbits(1, s.shoot ? 1 : 0);
+        q.put(buf, p.length());
+        return;
+    }
+    int g = (s.vel[0]?1:0) | ((s.vel[1]?1:0)<<1) | ((s.vel[2]?1:0)<<2) | ((s.roll?1:0)<<3) | ((s.scoping?1:0)<<4) | ((s.shoot?1:0)<<5);
+    putint(q, SV_POS);
+    putint(q, cn);
+    loopi(3) putuint(q, s.o[i]);
+    putuint(q, (s.yaw * 360) / 512);
+    putint(q, (s.pitch * 90) / 127);
+    putuint(q, g);
+    if(s.roll) putint(q, (s.roll * 125) / 31);
+    loopi(3) if(s.vel[i]) putint(q, s.vel[i]);
+    putuint(q, s.f);
+}
+
+void applypos(client *cl, int type, posupdate &pu, const uchar *msg, int msglen)  // msg: the raw message, which gets forwarded to the other clients
+{
+    posnstate s;
+    if(type == SV_POSN)
+    {
+        if(!pu.complete || !decodeposn(pu.n, cl->posn, s)) return;     // we lost the keyframe, this update refers to
+        pu.o = vec(s.o[0] / DMF, s.o[1] / DMF, s.o[2] / DMF);
+        pu.y = (s.yaw * 360) / 512;
+        pu.p = (s.pitch * 90) / 127;
+        pu.g = (s.scoping<<4) | (s.shoot<<5);
+        pu.f = s.f;
+        pu.collides = collideswithmap(pu.o);
+    }
+    cl->y = pu.y;
+    cl->p = pu.p;
+    cl->g = pu.g;
+    cl->f = pu.f;
+    if(type == SV_POS) cl->state.o = pu.o;
+    if(!cl->isonrightmap) return;
+    if(type == SV_POSC || type == SV_POSN)
+    {
+        if(!pu.complete) return;
+        if(((cl->f >> 6) & 1) != (cl->state.lifesequence & 1) || (type == SV_POSC && pu.usefactor != (smapstats.hdr.sfactor < 7 ? 7 : smapstats.hdr.sfactor))) return;
+        cl->state.o = pu.o;
+    }
+    if(cl->state.state==CS_ALIVE) cl->history.add(gamemillis, cl->state.o, (cl->f >> 7) & 1);
+    if((cl->type==ST_TCPIP || cl->type==ST_AI) && (cl->state.state==CS_ALIVE || cl->state.state==CS_EDITING))
+    {
+        cl->position.setsize(0);
+        if(type == SV_POSN)
+        {
+            posntopos(cl->position, cl->clientnum, s, smapstats.hdr.sfactor);
+            if(!pu.n.age) cl->rawposnkeylen = 0;
+            cl->rawposn.setsize(cl->rawposnkeylen);     // keep a keyframe, that wasn't passed on yet
+            cl->rawposn.put(msg, msglen);
+            if(!pu.n.age) cl->rawposnkeylen = msglen;
+        }
+        else
+        {
+            cl->position.put(msg, msglen);
+            cl->rawposn.setsize(0);
+            cl->rawposnkeylen = 0;
+        }
+    }
+    if(!m_demo && !m_coop) checkmove(cl, pu.collides);
+}
+
+#define MAXINGESTTHREADS 8
+#define MINTHREADEDINGEST 8     // smaller batches are decoded by the main thread alone
+
+struct ingestpacket
+{
+    ENetPacket *packet;
+    int sender, chan;
+    int type;                   // SV_POS, SV_POSC or SV_POSN, if the packet was decoded to a posupdate, -1 otherwise (goes to process())
+    posupdate pu;
+};
+
+vector<ingestpacket> ingestbatch;
+static int numingestthreads = 0, ingestparts = 1;
+static sl_semaphore *ingest_start[MAXINGESTTHREADS], *ingest_done = NULL;
+
+void ingestdecode(int part)     // decode every ingestparts'th packet of the batch
+{
+    for(int i = part; i < ingestbatch.length(); i += ingestparts)
+    {
+        ingestpacket &ip = ingestbatch[i];
+        ip.type = -1;
+        if(ip.chan != 0) continue;
+        ucharbuf p(ip.packet->data, ip.packet->dataLength);
+        int type = getint(p);
+        if(type != SV_POS && type != SV_POSC && type != SV_POSN) continue;
+        decodepos(p, type, ip.pu);
+        if(!p.remaining() && !p.overread() && ip.pu.complete && ip.pu.cn == ip.sender) ip.type = type;   // anything unusual is left to process()
+    }
+}
+
+int ingestthread(void *part)
+{
+    int k = (int)(size_t)part;
+    for(;;)
+    {
+        ingest_start[k - 1]->wait();
+        ingestdecode(k);
+        ingest_done->post();
+    }
+    return 0;
+}
+
+void initingestthreads(int num)
+{
+#ifdef ACAC
+    num = 0;    // the anticheat needs to see every message in process()
+#endif
+    numingestthreads = clamp(num, 0, MAXINGESTTHREADS);
+    if(!numingestthreads) return;
+    ingest_done = new sl_semaphore(0, NULL);
+    loopi(numingestthreads)
+    {
+        ingest_start[i] = new sl_semaphore(0, NULL);
+        sl_createthread(ingestthread, (void *)(size_t)(i + 1));
+    }
+    logline(ACLOG_VERBOSE, "decoding position packets with %d ingest threads", numingestthreads);
+}
+
+bool queueingest(ENetPacket *packet, int sender, int chan)   // returns false, if the packet has to be processed right away
+{
+    if(!numingestthreads) return false;
+    ingestpacket &ip = ingestbatch.add();
+    ip.packet = packet;
+    ip.sender = sender;
+    ip.chan = chan;
+    return true;
+}
+
+void flushingestbatch()         // decode and apply all queued packets
+{
+    if(ingestbatch.empty()) return;
+    ingestparts = ingestbatch.length() < MINTHREADEDINGEST ? 1 : numingestthreads + 1;
+    loopi(ingestparts - 1) ingest_start[i]->post();
+    ingestdecode(0);
+    loopi(ingestparts - 1) ingest_done->wait();
+
+    loopv(ingestbatch)
+    {
+        ingestpacket &ip = ingestbatch[i];
+        if(valid_client(ip.sender))
+        {
+            client *cl = clients[ip.sender];
+            if(ip.type < 0 || !cl->isauthed) process(ip.packet, ip.sender, ip.chan);
+            else
+            { // same as process() would do with the packet
+                if(ip.packet->flags&ENET_PACKET_FLAG_RELIABLE) reliablemessages = true;
+                int type = checkmessage(cl, checktype(ip.type, cl));
+                if(type == -2) disconnect_client(ip.sender, DISC_OVERFLOW);
+                else applypos(cl, type, ip.pu, ip.packet->data, (int)ip.packet->dataLength);
+            }
+        }
+        if(!ip.packet->referenceCount) enet_packet_destroy(ip.packet);
+    }
+    ingestbatch.setsize(0);
+}
+
+#ifdef STANDALONE
+// "ac_server --posnbench": encode and decode made-up position streams as SV_POSN and compare the size to SV_POSC and SV_POS
+
+static uint posnbenchseed = 1;
+static int posnbenchrnd(int n) { posnbenchseed = posnbenchseed * 1103515245 + 12345; return int((posnbenchseed >> 16) & 0x7fff) % n; }
+
+static void posnbenchtrace(int k, posnstate *states, int num)
+{
+    float x = 512, y = 512, z = 4, vz = 0, dir = 0, yaw = 0, pitch = 0;
+    posnbenchseed = 1;
+    loopi(num)
+    {
+        posnstate &s = states[i];
+        memset(&s, 0, sizeof(s));
+        int f = 1 << 4;                                 // on the floor
+        switch(k)
+        {
+            case 0: break;                              // standing
+            case 1:                                     // running straight
+                x += 0.64f;
+                if(x > 1000) x = 24;
+                f |= 1 << 2;
+                break;
+            case 2:                                     // running circles
+                dir += 0.04f;
+                x = 512 + 16 * cosf(dir);
+                y = 512 + 16 * sinf(dir);
+                yaw = dir * 180 / PI + 90;
+                f |= 1 << 2;
+                break;
+            case 3:                                     // running around and jumping, turning and looking up and down all the time
+                if(!(i % 12)) dir = posnbenchrnd(360) * RAD;
+                x = clamp(x + 0.64f * cosf(dir), 24.0f, 1000.0f);
+                y = clamp(y + 0.64f * sinf(dir), 24.0f, 1000.0f);
+                if(z <= 4 && !posnbenchrnd(20)) vz = 1.0f;
+                z += vz;
+                vz -= 0.1f;
+                if(z <= 4) { z = 4; vz = 0; }
+                else f = 0;
+                yaw += posnbenchrnd(21) - 10;
+                pitch = clamp(pitch + posnbenchrnd(11) - 5, -80.0f, 80.0f);
+                s.vel[2] = z > 4 ? -1 : 0;
+                s.scoping = posnbenchrnd(2);
+                s.shoot = !posnbenchrnd(5);
+                f |= (1 << 2) | posnbenchrnd(3);   // moving and strafing
+                break;
+        }
+        while(yaw >= 360) yaw -= 360;
+        while(yaw < 0) yaw += 360;
+        s.o[0] = int(x * DMF);
+        s.o[1] = int(y * DMF);
+        s.o[2] = int(z * DMF);
+        s.yaw = int(yaw * 512 / 360) & 511;
+        s.pitch = int(pitch * 127 / 90);
+        s.f = f;
+    }
+}
+
+int posnbench()
+{
+    const int num = 10000, rounds = 100, maxlen = 64;
+    const char *tracenames[] = { "standing", "running", "circling", "erratic" };
+    posnstate *states = new posnstate[num];
+    uchar *msgs = new uchar[num * maxlen];
+    int *lens = new int[num];
+    vector<uchar> pos;
+    printf("%d updates per trace, %d rounds, keyframe every %d updates\n", num, rounds, POSNKEYFRAME);
+    loopk(4)
+    {
+        posnbenchtrace(k, states, num);
+        posnstream enc, dec;
+        posnmsg m;
+        posnstate s;
+        int posnbytes = 0, errors = 0, lost = 0;
+
+        enet_uint32 start = enet_time_get();
+        loopj(rounds)
+        {
+            enc.reset();
+            loopi(num)
+            {
+                ucharbuf q(msgs + i * maxlen, maxlen);
+                m.cn = 7;
+                encodeposn(states[i], enc, m);
+                putposn(q, m);
+                lens[i] = q.len;
+            }
+        }
+        int enctime = enet_time_get() - start;
+
+        start = enet_time_get();
+        loopj(rounds)
+        {
+            dec.reset();
+            loopi(num)
+            {
+                ucharbuf p(msgs + i * maxlen, lens[i]);
+                if(getint(p) != SV_POSN || !getposn(p, m) || !decodeposn(m, dec, s) || memcmp(&s, &states[i], sizeof(posnstate))) errors++;
+            }
+        }
+        int dectime = enet_time_get() - start;
+
+        dec.reset();
+        loopi(num) if(posnbenchrnd(10))     // lose every 10th update
+        {
+            ucharbuf p(msgs + i * maxlen, lens[i]);
+            getint(p);
+            getposn(p, m);
+            if(!decodeposn(m, dec, s)) lost++;
+        }
+        int posbytes = 0, poscbytes = 0;
+        loopi(num)
+        {
+            posnbytes += lens[i];
+            pos.setsize(0);
+            posntopos(pos, 7, states[i], 11);   // too big for SV_POSC
+            posbytes += pos.length();
+            pos.setsize(0);
+            posntopos(pos, 7, states[i], 10);   // passed on to older clients
+            poscbytes += pos.length();
+            ucharbuf p(pos.getbuf(), pos.length());
+            posupdate pu;
+            int type = getint(p);
+            decodepos(p, type, pu);
+            vec o(states[i].o[0] / DMF, states[i].o[1] / DMF, states[i].o[2] / DMF);
+            if(!pu.complete || pu.cn != 7 || pu.o != o || pu.f != states[i].f) errors += rounds;
+        }
+        printf("%-9s SV_POSN %5.2f bytes (SV_POSC %5.2f, SV_POS %5.2f), encode %4.0f ns, decode %4.0f ns, %d errors, %d unusable updates at 10%% loss\n", tracenames[k],
+            float(posnbytes) / num, float(poscbytes) / num, float(posbytes) / num, enctime * 1e6f / (num * rounds), dectime * 1e6f / (num * rounds), errors / rounds, lost);
+    }
+    delete[] states;
+    delete[] msgs;
+    delete[] lens;
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,201 @@
+// serverinstances.h
+
+// running several games from one server (only on POSIX systems)
+//
+// every "--instance=<file>" on the commandline starts one additional game, which gets the commandline of the first game
+// plus all parameters from the file (like "-C<file>"). at least the port has to be different for every game, of course.
+//
+// every game is a separate process: the first game reads all maps before the other games are started (by fork()),
+// so all games share the map cache in memory copy-on-write - as long as nobody writes to it.
+// no other thread may run during the fork, so the readmapsthread ends after the first scan and is started again afterwards.
+// only the first game scans the map directories: every change it finds is passed to the other games through a pipe,
+// and they reload only the maps that actually changed. changes that don't fit into a full pipe are kept and sent later.
+//
+// when the first game exits, all other games exit as well.
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/wait.h>
+#endif
+
+#define MAXSERVERINSTANCES 16
+
+struct serverinstance { int pid, notifyfd; const char *cfgfile; };
+vector<serverinstance> serverinstances;     // the other games (first game only)
+int instancenum = 0;                        // 0: first game, 1..: additional games
+int mapnotifyfd = -1;                       // read end of the map change pipe (additional games only)
+
+struct mapnotify { uchar fpathidx, deleted; string fname; };   // sent through the pipe, has to be smaller than PIPE_BUF
+vector<mapnotify> mapnotifies;              // map changes, the additional game still has to load
+vector<mapnotify> unsentnotifies[MAXSERVERINSTANCES];   // first game: map changes, that didn't fit into the pipe of a game yet
+
+void flushinstancenotifies()   // first game: write as many of the kept map changes to the pipes as they take
+{
+#ifndef WIN32
+    loopv(serverinstances)
+    {
+        serverinstance &si = serverinstances[i];
+        vector<mapnotify> &q = unsentnotifies[i];
+        int sent = 0;
+        if(si.notifyfd < 0) q.setsize(0);
+        while(sent < q.length())
+        {
+            if(write(si.notifyfd, &q[sent], sizeof(mapnotify)) == sizeof(mapnotify)) sent++;
+            else
+            {
+                if(errno != EAGAIN)
+                { // the game is gone
+                    close(si.notifyfd);
+                    si.notifyfd = -1;
+                    sent = q.length();
+                }
+                break;
+            }
+        }
+        if(sent) q.remove(0, sent);
+    }
+#endif
+}
+
+void notifyinstances(servermap *sm)    // first game: pass a changed (or deleted) servermap entry on to the other games
+{
+#ifndef WIN32
+    if(serverinstances.empty()) return;
+    mapnotify n;
+    memset(&n, 0, sizeof(n));
+    n.fpathidx = mappathindex(sm->fpath);
+    n.deleted = sm->isok ? 0 : 1;
+    copystring(n.fname, sm->fname);
+    loopv(serverinstances) if(serverinstances[i].notifyfd >= 0) unsentnotifies[i].add(n);
+    flushinstancenotifies();
+#endif
+}
+
+void pollinstances()   // first game: pass on kept map changes, log additional games that exited
+{
+#ifndef WIN32
+    if(serverinstances.empty()) return;
+    flushinstancenotifies();
+    int status, pid;
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0) loopv(serverinstances) if(serverinstances[i].pid == pid)
+    {
+        logline(ACLOG_WARNING, "game instance #%d (pid %d, '%s') exited with status %d", i + 1, pid, serverinstances[i].cfgfile, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        serverinstances[i].pid = -1;
+    }
+#endif
+}
+
+int readmapnotifies()   // additional games: fetch map changes from the pipe, returns the number of changed maps
+{
+#ifndef WIN32
+    mapnotify n;
+    int r;
+    while((r = read(mapnotifyfd, &n, sizeof(n))) == sizeof(n))
+    {
+        n.fname[MAXSTRLEN - 1] = '\0';
+        if(n.fpathidx < MAPPATH_NUM) mapnotifies.add(n);
+    }
+    if(!r)
+    {
+        logline(ACLOG_INFO, "the first game instance is gone, shutting down...");
+        exit(EXIT_SUCCESS);
+    }
+#endif
+    return mapnotifies.length();
+}
+
+int followmapsthread(void *nop)   // replaces readmapsthread in additional games: only loads the maps, the first game told us about
+{
+    while(1)
+    {
+        while(!startnewservermapsepoch) readmapsthread_sem->wait();
+        loopv(mapnotifies)
+        {
+            mapnotify &n = mapnotifies[i];
+            const char *fpath = mappathbyindex(n.fpathidx);
+            int index = getmapfilenameindex(n.fname, fpath);
+            if(index < 0)
+            {
+                if(n.deleted) continue;
+                index = addmapfilename(fpath, n.fname, 0);
+            }
+            if(!n.deleted) getmapfilestamps(fpath, n.fname, mapfilenames[index].cgz, mapfilenames[index].cfg);   // (the key of the map cache)
+            updateservermap(index, n.deleted != 0);
+        }
+        mapnotifies.setsize(0);
+        loadservermaps();
+        startnewservermapsepoch = false;
+    }
+    return 0;
+}
+
+bool startinstances()  // returns true in the additional games
+{
+    if(scl.instances.empty()) return false;
+#ifdef WIN32
+    logline(ACLOG_WARNING, "running several game instances is not supported on this platform");
+    return false;
+#else
+    if(scl.instances.length() > MAXSERVERINSTANCES - 1)
+    {
+        logline(ACLOG_WARNING, "only %d additional game instances allowed", MAXSERVERINSTANCES - 1);
+        scl.instances.setsize(MAXSERVERINSTANCES - 1);
+    }
+
+    // read all maps before forking, so every game uses the same map cache
+    logline(ACLOG_INFO, "reading all maps before starting %d additional game instances...", scl.instances.length());
+    readmapsthread_sem = new sl_semaphore(0, NULL);
+    readmapsonce = true;
+    void *ti = sl_createthread(readmapsthread, (void *)"xxxx");
+    while(poll_serverthreads()) sl_sleep(1);
+    sl_waitthread(ti);      // fork() only copies the calling thread: nothing else may be running (or hold a lock) now
+    readmapsonce = false;
+    DELETEP(readmapsthread_sem);    // every game starts its own map thread later
+    int mem = 0;
+    loopv(servermaps) mem += servermaps[i]->getmemusage();
+    logline(ACLOG_INFO, "%d maps (%d KB) in the map cache", servermaps.length(), mem / 1024);
+
+    signal(SIGPIPE, SIG_IGN);   // an additional game exiting must not kill us
+    loopv(scl.instances)
+    {
+        serverinstance &si = serverinstances.add();
+        si.pid = si.notifyfd = -1;
+        si.cfgfile = scl.instances[i];
+        int fd[2];
+        if(pipe(fd))
+        {
+            logline(ACLOG_ERROR, "could not create pipe for game instance #%d", i + 1);
+            continue;
+        }
+        fflush(NULL);   // don't let both processes write the same buffered output
+        int pid = fork();
+        if(!pid)
+        { // additional game
+            close(fd[1]);
+            loopvj(serverinstances) if(serverinstances[j].notifyfd >= 0) close(serverinstances[j].notifyfd);
+            serverinstances.setsize(0);
+            fcntl(fd[0], F_SETFL, O_NONBLOCK);
+            mapnotifyfd = fd[0];
+            instancenum = i + 1;
+            defformatstring(cfgarg)("-C%s", scl.instances[i]);
+            scl.instances.setsize(0);
+            scl.checkarg(cfgarg);
+            return true;
+        }
+        close(fd[0]);
+        if(pid < 0)
+        {
+            logline(ACLOG_ERROR, "could not start game instance #%d", i + 1);
+            close(fd[1]);
+            continue;
+        }
+        fcntl(fd[1], F_SETFL, O_NONBLOCK);
+        si.pid = pid;
+        si.notifyfd = fd[1];
+        logline(ACLOG_INFO, "started game instance #%d (pid %d) from '%s'", i + 1, pid, si.cfgfile);
+    }
+    return false;
+#endif
+}
@@ -176,154 +176,386 @@ static inline void updatemasterserver(int millis, int port)
 }
 
 ENetSocket pongsock = ENET_SOCKET_NULL, lansock = ENET_SOCKET_NULL;
-extern int getpongflags(enet_uint32 ip);
 
-void serverms(int mode, int numplayers, int minremain, char *smapname, int millis, const ENetAddress &localaddr, int *mnum, int *msend, int *mrec, int *cnum, int *csend, int *crec, int protocol_version)
+// info responder thread
+//
+// answers the server info requests (pings from server browsers and the masterserver, extinfo) on its own thread.
+// the answers come from an infosnapshot, which the main thread renews every worldstate tick (if the last one was used)
+// and at least once per second - the thread never touches the live server state.
+// the thread drains both sockets completely, in batches (recvmmsg/sendmmsg on linux), and limits the requests per ip.
+// requests for the server info text (rare) are passed on to the main thread, because those texts are read on demand.
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#define INFOBATCH 32                // datagrams per recvmmsg/sendmmsg
+#define INFORATE 20                 // requests per second and ip...
+#define INFOBURST 40                // ...after a burst of 40
+#define INFORATESLOTS 1024          // has to be a power of two
+
+struct infobatch
 {
-    flushmasteroutput();
-    updatemasterserver(millis, localaddr.port);
+    int num;
+    ENetAddress addr[INFOBATCH];
+    int len[INFOBATCH];
+    uchar data[INFOBATCH][MAXTRANS];
+};
 
-    static ENetSocketSet sockset;
-    ENET_SOCKETSET_EMPTY(sockset);
-    ENetSocket maxsock = pongsock;
-    ENET_SOCKETSET_ADD(sockset, pongsock);
-    if(mastersock != ENET_SOCKET_NULL)
+struct inforequest { ENetAddress addr; vector<uchar> data; };
+
+infosnapshot *curinfo = NULL;               // latest snapshot (written by the main thread only)
+sl_semaphore *infolock = NULL;              // guards curinfo, reference counts, inforequests and infostats
+vector<inforequest *> inforequests;         // server info text requests for the main thread
+struct { int mnum, msend, mrec, cnum, csend, crec, dropped; } infostats = { 0, 0, 0, 0, 0, 0, 0 };
+
+static void releaseinfo(infosnapshot *s)
+{
+    infolock->wait();
+    bool last = --s->refs <= 0;
+    infolock->post();
+    if(last) delete s;
+}
+
+static int inforeceive(ENetSocket sock, infobatch &b)
+{
+#ifdef __linux__
+    static mmsghdr msgs[INFOBATCH];
+    static iovec iov[INFOBATCH];
+    static sockaddr_in sa[INFOBATCH];
+    memset(msgs, 0, sizeof(msgs));
+    loopi(INFOBATCH)
+    {
+        iov[i].iov_base = b.data[i];
+        iov[i].iov_len = MAXTRANS;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &sa[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sa[i]);
+    }
+    int n = recvmmsg(sock, msgs, INFOBATCH, MSG_DONTWAIT, NULL);
+    if(n <= 0) return 0;
+    loopi(n)
     {
-        maxsock = max(maxsock, mastersock);
-        ENET_SOCKETSET_ADD(sockset, mastersock);
+        b.addr[i].host = sa[i].sin_addr.s_addr;
+        b.addr[i].port = ENET_NET_TO_HOST_16(sa[i].sin_port);
+        b.len[i] = msgs[i].msg_len;
     }
-    if(lansock != ENET_SOCKET_NULL)
+    return n;
+#else
+    int n = 0;
+    for(; n < INFOBATCH; n++)
     {
-        maxsock = max(maxsock, lansock);
-        ENET_SOCKETSET_ADD(sockset, lansock);
+        ENetBuffer buf;
+        buf.data = b.data[n];
+        buf.dataLength = MAXTRANS;
+        int len = enet_socket_receive(sock, &b.addr[n], &buf, 1);
+        if(len <= 0) break;
+        b.len[n] = len;
     }
-    if(enet_socketset_select(maxsock, &sockset, NULL, 0) <= 0) return;
+    return n;
+#endif
+}
 
-    // reply all server info requests
-    static uchar data[MAXTRANS];
-    ENetBuffer buf;
-    ENetAddress addr;
-    buf.data = data;
-    int len;
+static void infosend(infobatch &b)
+{
+    if(!b.num) return;
+#ifdef __linux__
+    static mmsghdr msgs[INFOBATCH];
+    static iovec iov[INFOBATCH];
+    static sockaddr_in sa[INFOBATCH];
+    memset(msgs, 0, sizeof(msgs));
+    memset(sa, 0, sizeof(sa));
+    loopi(b.num)
+    {
+        sa[i].sin_family = AF_INET;
+        sa[i].sin_addr.s_addr = b.addr[i].host;
+        sa[i].sin_port = ENET_HOST_TO_NET_16(b.addr[i].port);
+        iov[i].iov_base = b.data[i];
+        iov[i].iov_len = b.len[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &sa[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sa[i]);
+    }
+    for(int sent = 0, r; sent < b.num; sent += r) if((r = sendmmsg(pongsock, msgs + sent, b.num - sent, 0)) <= 0) break;
+#else
+    loopi(b.num)
+    {
+        ENetBuffer buf;
+        buf.data = b.data[i];
+        buf.dataLength = b.len[i];
+        enet_socket_send(pongsock, &b.addr[i], &buf, 1);
+    }
+#endif
+    b.num = 0;
+}
 
-    loopi(2)
+static bool inforatelimit(enet_uint32 ip, int millis)   // returns true, if the request has to be dropped
+{
+    static struct { enet_uint32 ip; int allowance, last; } slots[INFORATESLOTS];    // allowance: requests * 1000
+    uint h = ip * 2654435761U;
+    int n = (h >> 16) & (INFORATESLOTS - 1);
+    if(slots[n].ip != ip)
     {
-        ENetSocket sock = i ? lansock : pongsock;
-        if(sock == ENET_SOCKET_NULL || !ENET_SOCKETSET_CHECK(sockset, sock)) continue;
+        slots[n].ip = ip;
+        slots[n].allowance = INFOBURST * 1000;
+    }
+    else slots[n].allowance = min(slots[n].allowance + clamp(millis - slots[n].last, 0, INFOBURST * 1000 / INFORATE) * INFORATE, INFOBURST * 1000);
+    slots[n].last = millis;
+    if(slots[n].allowance < 1000) return true;
+    slots[n].allowance -= 1000;
+    return false;
+}
 
-        buf.dataLength = sizeof(data);
-        len = enet_socket_receive(sock, &addr, &buf, 1);
-        if(len < 0) continue;
+static int infoflags(infosnapshot &s, enet_uint32 ip)
+{
+    int flags = s.pongflags;
+    loopv(s.bans) if(s.bans[i] == ip) { flags |= 1 << PONGFLAG_BANNED; break; }
+    iprange t;
+    t.lr = ENET_NET_TO_HOST_32(ip); // blacklist uses host byte order
+    t.ur = 0;
+    if(s.blacklist.search(&t, cmpipmatch)) flags |= 1 << PONGFLAG_BLACKLIST;
+    return flags;
+}
 
-        // ping & pong buf
-        ucharbuf pi(data, len), po(&data[len], sizeof(data)-len);
-        bool std = false;
-        if(getint(pi) != 0) // std pong
+// answers one request, the replies start with the request
+static bool inforeply(infosnapshot &s, const uchar *req, int len, const ENetAddress &addr, infobatch &out, int *num, int *sent)
+{
+    #define NEWREPLY \
+        if(out.num >= INFOBATCH) infosend(out); \
+        out.addr[out.num] = addr; \
+        memcpy(out.data[out.num], req, len); \
+        ucharbuf po(out.data[out.num] + len, MAXTRANS - len);
+    #define ENDREPLY { out.len[out.num] = len + po.length(); *sent += out.len[out.num++]; }
+
+    ucharbuf pi((uchar *)req, len);
+    NEWREPLY;
+    (*num)++;
+    if(getint(pi) != 0) // std pong
+    {
+        po.put(s.pong.getbuf(), s.pong.length());
+        putint(po, infoflags(s, addr.host));
+        if(pi.remaining())
         {
-            extern struct servercommandline scl;
-            extern string servdesc_current;
-            (*mnum)++; *mrec += len; std = true;
-            putint(po, protocol_version);
-            putint(po, mode);
-            putint(po, numplayers);
-            putint(po, minremain);
-            sendstring(smapname, po);
-            sendstring(servdesc_current, po);
-            putint(po, scl.maxclients);
-            putint(po, getpongflags(addr.host));
-            if(pi.remaining())
+            int query = getint(pi);
+            switch(query)
             {
-                int query = getint(pi);
-                switch(query)
-                {
-                    case EXTPING_NAMELIST:
-                    {
-                        extern void extping_namelist(ucharbuf &p);
-                        putint(po, query);
-                        extping_namelist(po);
-                        break;
-                    }
-                    case EXTPING_SERVERINFO:
-                    {
-                        extern void extping_serverinfo(ucharbuf &pi, ucharbuf &po);
-                        putint(po, query);
-                        extping_serverinfo(pi, po);
-                        break;
-                    }
-                    case EXTPING_MAPROT:
-                    {
-                        extern void extping_maprot(ucharbuf &po);
-                        putint(po, query);
-                        extping_maprot(po);
-                        break;
-                    }
-                    case EXTPING_UPLINKSTATS:
-                    {
-                        extern void extping_uplinkstats(ucharbuf &po);
-                        putint(po, query);
-                        extping_uplinkstats(po);
-                        break;
-                    }
-                    case EXTPING_NOP:
-                    default:
-                        putint(po, EXTPING_NOP);
-                        break;
-                }
+                case EXTPING_NAMELIST: putint(po, query); po.put(s.namelist.getbuf(), s.namelist.length()); break;
+                case EXTPING_SERVERINFO: return false;    // main thread
+                case EXTPING_MAPROT: putint(po, query); po.put(s.maprot.getbuf(), s.maprot.length()); break;
+                case EXTPING_UPLINKSTATS: putint(po, query); po.put(s.uplinkstats.getbuf(), s.uplinkstats.length()); break;
+                case EXTPING_PROFILE: putint(po, query); po.put(s.profile.getbuf(), s.profile.length()); break;
+                case EXTPING_NOP:
+                default:
+                    putint(po, EXTPING_NOP);
+                    break;
             }
         }
-        else // ext pong - additional server infos
+    }
+    else // ext pong - additional server infos
+    {
+        int extcmd = getint(pi);
+        putint(po, EXT_ACK);
+        putint(po, EXT_VERSION);
+
+        switch(extcmd)
         {
-            (*cnum)++; *crec += len;
-            int extcmd = getint(pi);
-            putint(po, EXT_ACK);
-            putint(po, EXT_VERSION);
+            case EXT_UPTIME:        // uptime in seconds
+                putint(po, uint(s.millis)/1000);
+                break;
 
-            switch(extcmd)
+            case EXT_PLAYERSTATS:   // playerstats
             {
-                case EXT_UPTIME:        // uptime in seconds
+                int cn = getint(pi);     // get requested player, -1 for all
+                if(cn != -1 && s.cns.find(cn) < 0)
                 {
-                    putint(po, uint(millis)/1000);
+                    putint(po, EXT_ERROR);
                     break;
                 }
+                putint(po, EXT_ERROR_NONE);              // add no error flag
+                int bpos = po.length();
+                putint(po, EXT_PLAYERSTATS_RESP_IDS);    // send player ids following
+                if(cn == -1) loopv(s.cns) putint(po, s.cns[i]);
+                else putint(po, cn);
+                ENDREPLY;                                // send all available player ids
+                uchar head[MAXTRANS];
+                memcpy(head, out.data[out.num - 1], len + bpos);
+                loopv(s.players) if(cn == -1 || s.players[i].cn == cn)
+                {
+                    NEWREPLY;
+                    po.put(head + len, bpos);
+                    po.put(s.stats.getbuf() + s.players[i].offset, s.players[i].len);
+                    ENDREPLY;
+                }
+                return true;
+            }
+
+            case EXT_TEAMSCORE:
+                po.put(s.teamscore.getbuf(), s.teamscore.length());
+                break;
 
-                case EXT_PLAYERSTATS:   // playerstats
+            default:
+                putint(po, EXT_ERROR);
+                break;
+        }
+    }
+    ENDREPLY;
+    return true;
+    #undef NEWREPLY
+    #undef ENDREPLY
+}
+
+int inforesponderthread(void *nop)
+{
+    static infobatch in, out;
+    out.num = 0;
+    for(;;)
+    {
+        ENetSocketSet sockset;
+        ENET_SOCKETSET_EMPTY(sockset);
+        ENET_SOCKETSET_ADD(sockset, pongsock);
+        ENetSocket maxsock = pongsock;
+        if(lansock != ENET_SOCKET_NULL)
+        {
+            maxsock = max(maxsock, lansock);
+            ENET_SOCKETSET_ADD(sockset, lansock);
+        }
+        if(enet_socketset_select(maxsock, &sockset, NULL, 1000) <= 0) continue;
+
+        infolock->wait();
+        infosnapshot *s = curinfo;
+        s->refs++;
+        s->used = true;
+        infolock->post();
+
+        int millis = (int)enet_time_get(), mnum = 0, msend = 0, mrec = 0, cnum = 0, csend = 0, crec = 0, dropped = 0;
+        vector<inforequest *> forward;
+        loopk(2)
+        {
+            ENetSocket sock = k ? lansock : pongsock;
+            if(sock == ENET_SOCKET_NULL) continue;
+            while((in.num = inforeceive(sock, in)) > 0)
+            {
+                loopi(in.num)
                 {
-                    int cn = getint(pi);     // get requested player, -1 for all
-                    if(!valid_client(cn) && cn != -1)
+                    if(inforatelimit(in.addr[i].host, millis)) { dropped++; continue; }
+                    ucharbuf pi(in.data[i], in.len[i]);
+                    bool std = getint(pi) != 0;
+                    if(std) mrec += in.len[i];
+                    else crec += in.len[i];
+                    if(!inforeply(*s, in.data[i], in.len[i], in.addr[i], out, std ? &mnum : &cnum, std ? &msend : &csend))
                     {
-                        putint(po, EXT_ERROR);
-                        break;
+                        inforequest *r = forward.add(new inforequest);
+                        r->addr = in.addr[i];
+                        r->data.put(in.data[i], in.len[i]);
                     }
-                    putint(po, EXT_ERROR_NONE);              // add no error flag
-
-                    int bpos = po.length();                  // remember buffer position
-                    putint(po, EXT_PLAYERSTATS_RESP_IDS);    // send player ids following
-                    extinfo_cnbuf(po, cn);
-                    *csend += int(buf.dataLength = len + po.length());
-                    enet_socket_send(pongsock, &addr, &buf, 1); // send all available player ids
-                    po.len = bpos;
-
-                    extinfo_statsbuf(po, cn, bpos, pongsock, addr, buf, len, csend);
-                    return;
                 }
+                infosend(out);
+                if(in.num < INFOBATCH) break;
+            }
+        }
+        releaseinfo(s);
+
+        infolock->wait();
+        loopv(forward) inforequests.add(forward[i]);
+        infostats.mnum += mnum; infostats.msend += msend; infostats.mrec += mrec;
+        infostats.cnum += cnum; infostats.csend += csend; infostats.crec += crec;
+        infostats.dropped += dropped;
+        infolock->post();
+    }
+    return 0;
+}
 
-                case EXT_TEAMSCORE:
-                    extinfo_teamscorebuf(po);
-                    break;
+void serverms(int mode, int numplayers, int minremain, char *smapname, int millis, const ENetAddress &localaddr, int *mnum, int *msend, int *mrec, int *cnum, int *csend, int *crec, int protocol_version)
+{
+    flushmasteroutput();
+    updatemasterserver(millis, localaddr.port);
 
-                default:
-                    putint(po,EXT_ERROR);
-                    break;
+    if(pongsock != ENET_SOCKET_NULL)
+    {
+        // publish a new snapshot for the info responder thread
+        static int lastpublish = 0;
+        if(!curinfo || millis - lastpublish >= 1000 || (curinfo->used && millis - lastpublish >= 40))
+        {
+            extern struct servercommandline scl;
+            extern string servdesc_current;
+            infosnapshot *s = new infosnapshot;
+            s->millis = millis;
+            putint(s->pong, protocol_version);
+            putint(s->pong, mode);
+            putint(s->pong, numplayers);
+            putint(s->pong, minremain);
+            sendstring(smapname, s->pong);
+            sendstring(servdesc_current, s->pong);
+            putint(s->pong, scl.maxclients);
+            buildinfosnapshot(*s);
+            lastpublish = millis;
+            if(!infolock)
+            { // (started on first use: a thread would not survive startinstances())
+                curinfo = s;
+                infolock = new sl_semaphore(1, NULL);
+                sl_createthread(inforesponderthread, NULL);
+            }
+            else
+            {
+                infolock->wait();
+                infosnapshot *old = curinfo;
+                curinfo = s;
+                infolock->post();
+                releaseinfo(old);
             }
         }
 
-        buf.dataLength = len + po.length();
-        enet_socket_send(pongsock, &addr, &buf, 1);
-        if(std) *msend += (int)buf.dataLength;
-        else *csend += (int)buf.dataLength;
+        // answer the requests, the thread passed on to us, and collect its statistics
+        static vector<inforequest *> requests;
+        static int dropped = 0, lastdroplog = 0;
+        if(!infolock->trywait())
+        {
+            while(inforequests.length()) requests.add(inforequests.remove(0));
+            *mnum += infostats.mnum; *msend += infostats.msend; *mrec += infostats.mrec;
+            *cnum += infostats.cnum; *csend += infostats.csend; *crec += infostats.crec;
+            dropped += infostats.dropped;
+            memset(&infostats, 0, sizeof(infostats));
+            infolock->post();
+        }
+        loopv(requests)
+        {
+            inforequest *r = requests[i];
+            ucharbuf pi(r->data.getbuf(), r->data.length());
+            getint(pi);
+            getint(pi);
+            uchar data[MAXTRANS];
+            int len = r->data.length();
+            memcpy(data, r->data.getbuf(), len);
+            ucharbuf po(&data[len], sizeof(data) - len);
+            po.put(curinfo->pong.getbuf(), curinfo->pong.length());
+            putint(po, infoflags(*curinfo, r->addr.host));
+            putint(po, EXTPING_SERVERINFO);
+            extern void extping_serverinfo(ucharbuf &pi, ucharbuf &po);
+            extping_serverinfo(pi, po);
+            ENetBuffer buf;
+            buf.data = data;
+            buf.dataLength = len + po.length();
+            enet_socket_send(pongsock, &r->addr, &buf, 1);
+            *msend += (int)buf.dataLength;
+            delete r;
+        }
+        requests.setsize(0);
+        if(dropped && millis - lastdroplog > 60 * 1000)
+        {
+            logline(ACLOG_INFO, "info responder: %d requests dropped (more than %d per second from one ip)", dropped, INFORATE);
+            dropped = 0;
+            lastdroplog = millis;
+        }
     }
 
-    if(mastersock != ENET_SOCKET_NULL && ENET_SOCKETSET_CHECK(sockset, mastersock)) flushmasterinput();
+    if(mastersock == ENET_SOCKET_NULL) return;
+    ENetSocketSet sockset;
+    ENET_SOCKETSET_EMPTY(sockset);
+    ENET_SOCKETSET_ADD(sockset, mastersock);
+    if(enet_socketset_select(mastersock, &sockset, NULL, 0) > 0) flushmasterinput();
 }
 
 // this function should be made better, because it is used just ONCE (no need of so much parameters)
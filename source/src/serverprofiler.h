@@ -0,0 +1,105 @@
+// serverprofiler.h
+
+// tick profiler
+//
+// times the phases of serverslice() and every message type in process(), in microseconds.
+// the timings go into histograms with four buckets per power of two, which give p50/p99 estimates with an
+// error below 25% and exact maximums. recording is just a few integer operations - everything is profiled on the main thread,
+// so there's nothing to lock.
+//
+// the histograms are collected for one status report interval (one minute), then the last interval
+// is kept for EXTPING_PROFILE queries (and "-V" logs it with the status report).
+
+#define PROFBUCKETS 128
+
+enum { PROF_ENET = 0, PROF_PROCESS, PROF_EVENTS, PROF_EXTRAS, PROF_WORLDSTATE, PROF_DEMO, PROF_THREADS, PROF_SERVERMS, PROF_BOTS, PROF_NUM };
+static const char *profnames[PROF_NUM] = { "enet", "process", "events", "extras", "worldstate", "demo", "threads", "serverms", "bots" };
+
+struct profhist
+{
+    uint count, max;
+    uint buckets[PROFBUCKETS];
+
+    void reset() { count = max = 0; memset(buckets, 0, sizeof(buckets)); }
+
+    static int bucket(uint us)     // 0..3: exact, then four buckets for every power of two
+    {
+        if(us < 4) return us;
+        int b = 2;
+        while(b < 31 && us >> (b + 1)) b++;
+        return 4 * (b - 1) + ((us >> (b - 2)) & 3);
+    }
+
+    static uint bucketmax(int i)   // largest value, that goes into bucket i
+    {
+        if(i < 4) return i;
+        int b = i / 4 + 1;
+        return ((uint(4 + (i & 3) + 1) << (b - 2)) - 1);
+    }
+
+    void add(uint us)
+    {
+        count++;
+        if(us > max) max = us;
+        buckets[bucket(us)]++;
+    }
+
+    uint percentile(int pct)
+    {
+        if(!count) return 0;
+        uint need = (uint)(((unsigned long long)count * pct + 99) / 100), sum = 0;
+        loopi(PROFBUCKETS) if((sum += buckets[i]) >= need) return min(bucketmax(i), max);
+        return max;
+    }
+};
+
+struct profstats
+{
+    profhist phases[PROF_NUM], msgs[SV_NUM];
+
+    void reset()
+    {
+        loopi(PROF_NUM) phases[i].reset();
+        loopi(SV_NUM) msgs[i].reset();
+    }
+};
+
+profstats profcur, proflast;     // the running interval and the last complete one
+
+inline uint profstart() { return sl_micros(); }
+inline void profend(int phase, uint start) { profcur.phases[phase].add(sl_micros() - start); }
+inline void profmsgend(int type, uint start) { if(type >= 0 && type < SV_NUM) profcur.msgs[type].add(sl_micros() - start); }
+
+static void logprofhist(const char *name, profhist &h)
+{
+    logline(ACLOG_VERBOSE, "profile: %-20s %8u calls, p50 %6u us, p99 %6u us, max %7u us", name, h.count, h.percentile(50), h.percentile(99), h.max);
+}
+
+void profilerinterval(bool log)    // called with every status report
+{
+    proflast = profcur;
+    profcur.reset();
+    if(!log) return;
+    loopi(PROF_NUM) if(proflast.phases[i].count) logprofhist(profnames[i], proflast.phases[i]);
+    loopi(SV_NUM) if(proflast.msgs[i].count) logprofhist(messagenames[i], proflast.msgs[i]);
+}
+
+static void putprofhist(ucharbuf &po, profhist &h)
+{
+    putint(po, h.count);
+    putint(po, h.percentile(50));
+    putint(po, h.percentile(99));
+    putint(po, h.max);
+}
+
+void extping_profile(ucharbuf &po)  // PROF_NUM, { count, p50, p99, max } for every phase, then { type, count, p50, p99, max } for every message type seen, -1
+{
+    putint(po, PROF_NUM);
+    loopi(PROF_NUM) putprofhist(po, proflast.phases[i]);
+    loopi(SV_NUM) if(proflast.msgs[i].count)
+    {
+        putint(po, i);
+        putprofhist(po, proflast.msgs[i]);
+    }
+    putint(po, -1);
+}
@@ -7,6 +7,9 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
 #endif
 
 string homedir = "";
@@ -94,7 +97,7 @@ const char *parentdir(const char *directory)
 {
     const char *p = directory + strlen(directory);
     while(p > directory && *p != '/' && *p != '\\') p--;
-    static string parent;
+    static sl_threadlocal string parent;
     size_t len = p-directory+1;
     copystring(parent, directory, len);
     return parent;
@@ -124,7 +127,7 @@ bool createdir(const char *path)
     size_t len = strlen(path);
     if(path[len-1]==PATHDIV)
     {
-        static string strip;
+        static sl_threadlocal string strip;
         path = copystring(strip, path, len);
     }
 #ifdef WIN32
@@ -228,7 +231,7 @@ const char *findfile(const char *filename, const char *mode)
 {
     while(filename[0] == PATHDIV) filename++; // skip leading pathdiv
     while(!strncmp(".." PATHDIVS, filename, 3)) filename += 3; // skip leading "../" (don't allow access to files below "AC root dir")
-    static string s;
+    static sl_threadlocal string s;     // (the server loads maps on several threads)
     formatstring(s)("%s%s", homedir, filename);         // homedir may be ""
     findfilelocation = FFL_HOME;
     if(homedir[0] && fileexists(s, mode)) return s;
@@ -1049,6 +1052,76 @@ int getfilesize(const char *filename)
     return len;
 }
 
+static bool statpath(const char *name, struct stat *st)     // (strips trailing path dividers, stat() on windows doesn't like them)
+{
+    string p;
+    copystring(p, name);
+    size_t len = strlen(p);
+    while(len > 1 && p[len - 1] == PATHDIV) p[--len] = '\0';
+    return !stat(p, st);
+}
+
+bool getfilestamp(const char *filename, filestamp &fs)   // like getfilesize(), but only stat()s the file - also gets the modification time (no zip files, thread-safe)
+{
+    struct stat st;
+    string s;
+    bool found = false;
+    if(homedir[0])
+    {
+        formatstring(s)("%s%s", homedir, filename);
+        found = statpath(s, &st);
+    }
+    loopv(packagedirs) if(!found)
+    {
+        formatstring(s)("%s%s", packagedirs[i], filename);
+        found = statpath(s, &st);
+    }
+    if(!found) found = statpath(filename, &st);
+    if(!found)
+    {
+        fs.size = -1;
+        fs.mtime = 0;
+        return false;
+    }
+    fs.size = (int)st.st_size;
+    fs.mtime = (uint)st.st_mtime;
+    return true;
+}
+
+static void stampdir(const char *dir, uint &h, uint &newest)
+{
+    struct stat st;
+    uint v[3] = { 0, 0, 0 };
+    if(statpath(dir, &st))
+    {
+        v[0] = (uint)st.st_ino;
+        v[1] = (uint)st.st_mtime;
+        v[2] = (uint)st.st_size;
+        if(v[1] > newest) newest = v[1];
+    }
+    const uchar *b = (const uchar *)v;
+    loopi(sizeof(v)) h = (h ^ b[i]) * 16777619U;
+}
+
+uint getdirstamp(const char *dir, uint *newest)  // fingerprint of a directory in all places, listfiles() looks: changes, if files are added, removed or renamed - but not, if a file is rewritten in place
+{
+    uint h = 2166136261U, n = 0;
+    string s;
+    stampdir(dir, h, n);
+    if(homedir[0])
+    {
+        formatstring(s)("%s%s", homedir, dir);
+        stampdir(s, h, n);
+    }
+    loopv(packagedirs)
+    {
+        formatstring(s)("%s%s", packagedirs[i], dir);
+        stampdir(s, h, n);
+    }
+    if(newest) *newest = n;
+    return h;
+}
+
 stream *opentempfile(const char *name, const char *mode)
 {
     const char *found = findfile(name, mode);
@@ -144,7 +144,7 @@ void uploadtexture(GLenum target, GLenum internal, int tw, int th, GLenum format
     if(buf) delete[] buf;
 }
 
-void createtexture(int tnum, int w, int h, void *pixels, int clamp, bool mipmap, bool canreduce, GLenum format)
+static void setuptexture(int tnum, int clamp, bool mipmap)
 {
     glBindTexture(GL_TEXTURE_2D, tnum);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, clamp&1 ? GL_CLAMP_TO_EDGE : GL_REPEAT);
@@ -157,7 +157,11 @@ void createtexture(int tnum, int w, int h, void *pixels, int clamp, bool mipmap,
                 (bilinear ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST_MIPMAP_LINEAR) :
                 (bilinear ? GL_LINEAR_MIPMAP_NEAREST : GL_NEAREST_MIPMAP_NEAREST)) :
             (bilinear ? GL_LINEAR : GL_NEAREST));
+}
 
+void createtexture(int tnum, int w, int h, void *pixels, int clamp, bool mipmap, bool canreduce, GLenum format)
+{
+    setuptexture(tnum, clamp, mipmap);
     int tw = w, th = h;
     if(pixels) resizetexture(w, h, mipmap, canreduce, GL_TEXTURE_2D, tw, th);
     uploadtexture(GL_TEXTURE_2D, format, tw, th, format, GL_UNSIGNED_BYTE, pixels, w, h, mipmap);
@@ -322,76 +326,405 @@ bool silent_texture_load = false;
 VARFP(hirestextures, 0, 1, 1, initwarning("texture resolution", INIT_LOAD));
 bool uniformtexres = !hirestextures;
 
-GLuint loadsurface(const char *texname, int &xs, int &ys, int &bpp, int clamp = 0, bool mipmap = true, bool canreduce = false, float scale = 1.0f, bool trydl = false)
+static const char *texfilename(const char *texname)   // strip the "<cmd>" prefix
 {
-    const char *file = texname;
-    if(texname[0]=='<')
-    {
-        file = strchr(texname, '>');
-        if(!file) { if(!silent_texture_load) conoutf("could not load texture %s", texname); return 0; }
-        file++;
-    }
+    if(texname[0] != '<') return texname;
+    const char *file = strchr(texname, '>');
+    return file ? file + 1 : NULL;
+}
 
-    SDL_Surface *s = NULL;
-    const char *ffile = findfile(file, "rb");
-    if(findfilelocation == FFL_ZIP)
-    {
-        stream *z = openzipfile(file, "rb");
-        if(z)
-        {
-            SDL_RWops *rw = z->rwops();
-            if(rw)
-            {
-                s = IMG_Load_RW(rw, 0);
-                SDL_FreeRW(rw);
-            }
-            delete z;
-        }
-    }
-    else if(!s) s = IMG_Load(ffile);
-    if(!s)
-    {
-        if(trydl) requirepackage(PCK_TEXTURE, file);
-        else if(!silent_texture_load) conoutf("couldn't load texture %s", texname);
-        return 0;
-    }
+static SDL_Surface *preparesurface(const char *texname, SDL_Surface *s, float scale, const char *&err)    // everything between decoding and uploading (thread-safe)
+{
     s = fixsurfaceformat(s);
+    if(!s) { err = "couldn't load texture %s"; return NULL; }
     if(strstr(texname,"playermodel")) { fixcl(s, 45); }
     else if(strstr(texname,"skin") && strstr(texname,"weapon")) { fixcl(s, 44); }
 
-    GLenum format = texformat(s->format->BitsPerPixel);
-    if(!format)
+    if(!texformat(s->format->BitsPerPixel))
     {
         SDL_FreeSurface(s);
-        conoutf("texture must be 8, 16, 24, or 32 bpp: %s", texname);
-        return 0;
+        err = "texture must be 8, 16, 24, or 32 bpp: %s";
+        return NULL;
     }
     if(max(s->w, s->h) > (1<<12))
     {
         SDL_FreeSurface(s);
-        conoutf("texture size exceeded %dx%d pixels: %s", 1<<12, 1<<12, texname);
-        return 0;
+        err = "texture size exceeded 4096x4096 pixels: %s";
+        return NULL;
     }
 
     if(texname[0]=='<')
     {
         const char *cmd = &texname[1], *arg1 = strchr(cmd, ':');//, *arg2 = arg1 ? strchr(arg1, ',') : NULL;
         if(!arg1) arg1 = strchr(cmd, '>');
-        if(!strncmp(cmd, "decal", arg1-cmd)) { s = texdecal(s); format = texformat(s->format->BitsPerPixel); }
+        if(!strncmp(cmd, "decal", arg1-cmd)) s = texdecal(s);
     }
 
     if(uniformtexres && scale > 1.0f) scalesurface(s, 1.0f/scale);
+    return s;
+}
 
+struct teximage     // a decoded texture with all its mip levels, ready to upload
+{
+    int w, h, bpp;          // image size, bits per pixel
+    int tw, th, levels;     // texture size (after resizetexture()), number of mip levels
+    uchar *data;            // all levels, one after the other
+    int len;
+
+    teximage() : w(0), h(0), bpp(0), tw(0), th(0), levels(0), data(NULL), len(0) {}
+    ~teximage() { DELETEA(data); }
+};
+
+static void buildmips(SDL_Surface *s, bool mipmap, bool canreduce, teximage &ti)     // the same levels, that uploadtexture() would create
+{
+    int bpp = s->format->BytesPerPixel;
+    ti.w = s->w;
+    ti.h = s->h;
+    ti.bpp = s->format->BitsPerPixel;
+    resizetexture(ti.w, ti.h, mipmap, canreduce, GL_TEXTURE_2D, ti.tw, ti.th);
+    ti.len = ti.levels = 0;
+    for(int w = ti.tw, h = ti.th;; w = max(w/2, 1), h = max(h/2, 1))
+    {
+        ti.len += w*h*bpp;
+        ti.levels++;
+        if(!mipmap || max(w, h) <= 1) break;
+    }
+    ti.data = new uchar[ti.len];
+    uchar *src = (uchar *)s->pixels, *dst = ti.data;
+    int sw = s->w, sh = s->h;
+    loopi(ti.levels)
+    {
+        int w = max(ti.tw >> i, 1), h = max(ti.th >> i, 1);
+        if(w == sw && h == sh) memcpy(dst, src, w*h*bpp);
+        else scaletexture(src, sw, sh, bpp, dst, w, h);
+        src = dst;
+        dst += w*h*bpp;
+        sw = w;
+        sh = h;
+    }
+}
+
+static GLuint uploadteximage(teximage &ti, int clamp, bool mipmap)
+{
     GLuint tnum;
     glGenTextures(1, &tnum);
-    createtexture(tnum, s->w, s->h, s->pixels, clamp, mipmap, canreduce, format);
-    xs = s->w;
-    ys = s->h;
-    bpp = s->format->BitsPerPixel;
-    SDL_FreeSurface(s);
+    setuptexture(tnum, clamp, mipmap);
+    GLenum format = texformat(ti.bpp);
+    int bpp = formatsize(format);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    uchar *p = ti.data;
+    loopi(ti.levels)
+    {
+        int w = max(ti.tw >> i, 1), h = max(ti.th >> i, 1);
+        glTexImage2D(GL_TEXTURE_2D, i, format, w, h, 0, format, GL_UNSIGNED_BYTE, p);
+        p += w*h*bpp;
+    }
     return tnum;
 }
 
+static uchar *readwholefile(stream *f, int &len)    // (closes the file)
+{
+    uchar *buf = NULL;
+    if(f)
+    {
+        len = f->size();
+        if(len > 0)
+        {
+            buf = new uchar[len];
+            if(f->read(buf, len) != len) DELETEA(buf);
+        }
+        delete f;
+    }
+    return buf;
+}
+
+// texture cache
+//
+// decoded textures are stored in TEXCACHEPATH with all their mip levels, zlib-compressed. the name of a cache file is the tiger hash
+// of the image file and everything else, that changes the texture (texture name, scale and the texture size settings): if an image
+// or a setting changes, other cache files are used. a cached texture skips decoding, the surface fixes and scaling, and the mipmap
+// generation. the cache files are native byte order, "cleartexturecache" deletes them.
+
+#define TEXCACHEPATH "packages" PATHDIVS "texcache" PATHDIVS
+#define TEXCACHEVERSION 1
+
+VARP(texcache, 0, 1, 1);
+
+struct texcachehdr
+{
+    char magic[4];                  // "ACTC"
+    int cacheversion, hdrsize, byteorder;
+    uchar key[TIGERHASHSIZE];
+    int w, h, bpp, tw, th, levels, len, zlen;
+    // followed by: data[zlen] (compressed teximage data)
+};
+
+string texcachedir = "";            // set by the main thread, before the loader threads use it
+
+static const char *texcachefile(const uchar *key, char *fname)    // fname: MAXSTRLEN
+{
+    copystring(fname, texcachedir);
+    char *p = fname + strlen(fname);
+    loopi(TIGERHASHSIZE) p += sprintf(p, "%02x", key[i]);
+    strcpy(p, ".atc");
+    return fname;
+}
+
+static void texcachekey(uchar *key, const char *texname, const uchar *file, int filelen, float scale, bool mipmap, bool canreduce)
+{
+    int settings[7] = { uniformtexres, mipmap, canreduce, texreduce, maxtexsize, hwtexsize, int(scale * 1000) };
+    void *state = tigerhash_init(key);
+    tigerhash_add(key, file, filelen, state);
+    tigerhash_add(key, texname, (int)strlen(texname), state);
+    tigerhash_add(key, settings, sizeof(settings), state);
+    tigerhash_finish(key, state);
+}
+
+static bool loadtexcache(const uchar *key, teximage &ti)     // any thread
+{
+    string fname;
+    int len = 0;
+    uchar *buf = readwholefile(openrawfile(texcachefile(key, fname), "rb"), len);
+    if(!buf) return false;
+    texcachehdr &h = *(texcachehdr *)buf;
+    bool ok = len >= (int)sizeof(h) && !memcmp(h.magic, "ACTC", 4) && h.cacheversion == TEXCACHEVERSION && h.hdrsize == (int)sizeof(h) && h.byteorder == 0x01020304 &&
+              !memcmp(h.key, key, TIGERHASHSIZE) && texformat(h.bpp) && h.zlen == len - (int)sizeof(h) &&
+              h.tw > 0 && h.th > 0 && h.tw <= (1<<12) && h.th <= (1<<12) && h.levels > 0 && h.levels <= 13;
+    if(ok)
+    { // the levels have to fit the texture size
+        int levellen = 0;
+        loopi(h.levels) levellen += max(h.tw >> i, 1) * max(h.th >> i, 1) * (h.bpp / 8);
+        ok = levellen == h.len;
+    }
+    if(ok)
+    {
+        ti.data = new uchar[h.len];
+        uLongf dlen = h.len;
+        ok = uncompress(ti.data, &dlen, buf + sizeof(h), h.zlen) == Z_OK && (int)dlen == h.len;
+        ti.w = h.w; ti.h = h.h; ti.bpp = h.bpp; ti.tw = h.tw; ti.th = h.th; ti.levels = h.levels; ti.len = h.len;
+    }
+    delete[] buf;
+    return ok;
+}
+
+static void storetexcache(const uchar *key, teximage &ti)     // any thread
+{
+    texcachehdr h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "ACTC", 4);
+    h.cacheversion = TEXCACHEVERSION;
+    h.hdrsize = sizeof(h);
+    h.byteorder = 0x01020304;
+    memcpy(h.key, key, TIGERHASHSIZE);
+    h.w = ti.w; h.h = ti.h; h.bpp = ti.bpp; h.tw = ti.tw; h.th = ti.th; h.levels = ti.levels; h.len = ti.len;
+    uLongf zlen = compressBound(ti.len);
+    uchar *z = new uchar[zlen];
+    if(compress2(z, &zlen, ti.data, ti.len, Z_BEST_SPEED) == Z_OK)
+    {
+        h.zlen = (int)zlen;
+        string fname;
+        stream *f = openrawfile(texcachefile(key, fname), "wb");
+        if(f)
+        {
+            f->write(&h, sizeof(h));
+            f->write(z, h.zlen);
+            delete f;   // (a file that was not completely written, fails the size check)
+        }
+    }
+    delete[] z;
+}
+
+static void inittexcache()     // main thread
+{
+    if(!texcachedir[0]) copystring(texcachedir, findfile(TEXCACHEPATH, "wb"));     // (creates the directory)
+}
+
+void cleartexturecache()
+{
+    inittexcache();
+    vector<char *> files;
+    listdir(texcachedir, "atc", files);
+    int deleted = 0;
+    loopv(files)
+    {
+        defformatstring(fname)("%s%s.atc", texcachedir, files[i]);
+        if(delfile(fname)) deleted++;
+    }
+    conoutf("deleted %d cached textures", deleted);
+    files.deletearrays();
+}
+COMMAND(cleartexturecache, "");
+
+static bool decodetexture(const char *texname, const uchar *file, int filelen, float scale, bool mipmap, bool canreduce, teximage &ti, const char *&err)    // thread-safe
+{
+    uchar key[TIGERHASHSIZE];
+    bool cache = texcache && texcachedir[0];
+    if(cache)
+    {
+        texcachekey(key, texname, file, filelen, scale, mipmap, canreduce);
+        if(loadtexcache(key, ti)) return true;
+        DELETEA(ti.data);
+    }
+    SDL_RWops *rw = SDL_RWFromConstMem(file, filelen);
+    SDL_Surface *s = rw ? IMG_Load_RW(rw, 1) : NULL;
+    if(!s) { err = "couldn't load texture %s"; return false; }
+    s = preparesurface(texname, s, scale, err);
+    if(!s) return false;
+    buildmips(s, mipmap, canreduce, ti);
+    SDL_FreeSurface(s);
+    if(cache) storetexcache(key, ti);
+    return true;
+}
+
+GLuint loadsurface(const char *texname, int &xs, int &ys, int &bpp, int clamp = 0, bool mipmap = true, bool canreduce = false, float scale = 1.0f, bool trydl = false)
+{
+    const char *file = texfilename(texname);
+    if(!file) { if(!silent_texture_load) conoutf("could not load texture %s", texname); return 0; }
+
+    int len = 0;
+    const char *ffile = findfile(file, "rb");
+    uchar *data = readwholefile(findfilelocation == FFL_ZIP ? openzipfile(file, "rb") : openrawfile(ffile, "rb"), len);
+    if(!data)
+    {
+        if(trydl) requirepackage(PCK_TEXTURE, file);
+        else if(!silent_texture_load) conoutf("couldn't load texture %s", texname);
+        return 0;
+    }
+    inittexcache();
+    teximage ti;
+    const char *err = NULL;
+    bool ok = decodetexture(texname, data, len, scale, mipmap, canreduce, ti, err);
+    delete[] data;
+    if(!ok)
+    {
+        if(!silent_texture_load) conoutf(err, texname);
+        return 0;
+    }
+    xs = ti.w;
+    ys = ti.h;
+    bpp = ti.bpp;
+    return uploadteximage(ti, clamp, mipmap);
+}
+
+// asynchronous texture loading
+//
+// while a map loads (async_texture_load), textureload() only checks that the image file exists and returns a placeholder texture,
+// that uses the GL texture of notexture. the loader threads read and decode the image (or take it from the texture cache) and
+// build the mip levels, updatetextures() uploads the finished textures, a few milliseconds every frame. files from zip mounts
+// are read on the main thread (the zip archives are not thread-safe), only the decoding is done by the loader threads.
+
+VARP(texloadthreads, 0, 2, 8);     // 0: load all textures directly
+VARP(texuploadtime, 1, 4, 100);    // milliseconds per frame for uploading textures
+
+bool async_texture_load = false;
+
+struct texloadjob
+{
+    Texture *tex;
+    string file;            // image file on disk
+    uchar *data;            // ...or the content of a file from a zip mount
+    int len;
+    bool ok;
+    teximage ti;            // result
+    const char *err;
+
+    texloadjob() : tex(NULL), data(NULL), len(0), ok(false), err(NULL) { file[0] = '\0'; }
+    ~texloadjob() { DELETEA(data); }
+};
+
+sl_semaphore *texload_sem = NULL;       // counts the queued jobs
+sl_semaphore *texload_lock = NULL;      // guards both lists
+vector<texloadjob *> texloadqueue, texloaddone;
+int texloaders = 0;                     // running loader threads (never stopped)
+
+int texloaderthread(void *nop)
+{
+    for(;;)
+    {
+        texload_sem->wait();
+        texload_lock->wait();
+        texloadjob *j = texloadqueue.length() ? texloadqueue.remove(0) : NULL;
+        texload_lock->post();
+        if(!j) continue;
+
+        if(!j->data) j->data = readwholefile(openrawfile(j->file, "rb"), j->len);
+        if(j->data) j->ok = decodetexture(j->tex->name, j->data, j->len, j->tex->scale, j->tex->mipmap, j->tex->canreduce, j->ti, j->err);
+        else j->err = "couldn't load texture %s";
+        DELETEA(j->data);
+
+        texload_lock->wait();
+        texloaddone.add(j);
+        texload_lock->post();
+    }
+    return 0;
+}
+
+static texloadjob *newtexloadjob(const char *texname)     // NULL, if the file doesn't exist
+{
+    const char *file = texfilename(texname);
+    if(!file) return NULL;
+    texloadjob *j = new texloadjob;
+    const char *ffile = findfile(file, "rb");
+    if(findfilelocation == FFL_ZIP) j->data = readwholefile(openzipfile(file, "rb"), j->len);
+    else if(fileexists(ffile, "rb")) copystring(j->file, ffile);
+    if(!j->data && !j->file[0]) DELETEP(j);
+    return j;
+}
+
+static void queuetexload(texloadjob *j, Texture *t)
+{
+    if(!texload_lock)
+    {
+        IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);    // (load the image libraries before the loader threads use them)
+        texload_sem = new sl_semaphore(0, NULL);
+        texload_lock = new sl_semaphore(1, NULL);
+    }
+    while(texloaders < texloadthreads)
+    {
+        sl_createthread(texloaderthread, NULL);
+        texloaders++;
+    }
+    inittexcache();
+    j->tex = t;
+    texload_lock->wait();
+    texloadqueue.add(j);
+    texload_lock->post();
+    texload_sem->post();
+}
+
+int slotchanges = 0;     // counts changed slot textures (the world cache keeps texture coordinates)
+
+void updatetextures()   // called every frame: upload decoded images
+{
+    if(!texload_lock) return;
+    uint start = sl_micros();
+    bool resized = false;
+    for(;;)
+    {
+        texload_lock->wait();
+        texloadjob *j = texloaddone.length() ? texloaddone.remove(0) : NULL;
+        texload_lock->post();
+        if(!j) break;
+        Texture &t = *j->tex;
+        if(t.placeholder)   // (reloadtexture() may have loaded it already)
+        {
+            if(j->ok)
+            {
+                t.id = uploadteximage(j->ti, t.clamp, t.mipmap);
+                if(t.xs != j->ti.w || t.ys != j->ti.h) resized = true;
+                t.xs = j->ti.w;
+                t.ys = j->ti.h;
+                t.bpp = j->ti.bpp;
+                t.placeholder = false;
+            }
+            else conoutf(j->err, t.name);    // (stays a placeholder)
+        }
+        delete j;
+        if(sl_micros() - start >= uint(texuploadtime * 1000)) break;
+    }
+    if(resized) slotchanges++;    // texture coordinates depend on the texture size
+}
+
 // management of texture slots
 // each texture slot can have multiple texture frames, of which currently only the first is used
 // additional frames can be used for various shaders
@@ -404,7 +737,16 @@ Texture *textureload(const char *name, int clamp, bool mipmap, bool canreduce, f
     Texture *t = textures.access(pname);
     if(t) return t;
     int xs, ys, bpp;
-    GLuint id = loadsurface(pname + TEXSCALEPREFIXSIZE, xs, ys, bpp, clamp, mipmap, canreduce, scale, trydl);
+    GLuint id;
+    texloadjob *j = async_texture_load && texloadthreads && notexture ? newtexloadjob(pname + TEXSCALEPREFIXSIZE) : NULL;
+    if(j)
+    { // use notexture, until the image is decoded
+        id = notexture->id;
+        xs = notexture->xs;
+        ys = notexture->ys;
+        bpp = notexture->bpp;
+    }
+    else id = loadsurface(pname + TEXSCALEPREFIXSIZE, xs, ys, bpp, clamp, mipmap, canreduce, scale, trydl);
     if(!id) return notexture;
     char *key = newstring(pname);
     t = &textures[key];
@@ -417,6 +759,8 @@ Texture *textureload(const char *name, int clamp, bool mipmap, bool canreduce, f
     t->canreduce = canreduce;
     t->id = id;
     t->scale = scale;
+    t->placeholder = j != NULL;
+    if(j) queuetexload(j, t);
     return t;
 }
 
@@ -508,6 +852,7 @@ Texture *lookuptexture(int tex, Texture *failtex, bool trydl)
         Slot &s = slots[tex];
         if(!s.loaded)
         {
+            Texture *old = s.tex;
             defformatstring(pname)("packages/textures/%s", path(s.name, true));
             s.tex = textureload(pname, 0, true, true, s.scale, trydl);
             if(!trydl)
@@ -515,6 +860,7 @@ Texture *lookuptexture(int tex, Texture *failtex, bool trydl)
                 if(s.tex==notexture) s.tex = failtex;
                 s.loaded = true;
             }
+            if(s.tex != old) slotchanges++;
         }
         if(s.tex) t = s.tex;
     }
@@ -524,13 +870,15 @@ Texture *lookuptexture(int tex, Texture *failtex, bool trydl)
 void cleanuptextures()
 {
     enumerate(textures, Texture, t,
-        if(t.id) { glDeleteTextures(1, &t.id); t.id = 0; }
+        if(t.id && !t.placeholder) glDeleteTextures(1, &t.id);
+        t.id = 0;
     );
 }
 
 bool reloadtexture(Texture &t)
 {
-    if(t.id) glDeleteTextures(1, &t.id);
+    if(t.id && !t.placeholder) glDeleteTextures(1, &t.id);
+    t.placeholder = false;
     int xs = 1, ys = 1, bpp = 0;
     t.id = loadsurface(t.name, xs, ys, bpp, t.clamp, t.mipmap, t.canreduce, t.scale);
     t.xs = xs;
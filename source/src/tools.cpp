@@ -96,24 +96,208 @@ servsqr *createservworld(const sqr *s, int _cubicsize) // create a server-style
     return res;
 }
 
+// floorplan row kernels
+//
+// the map checks walk whole floorplans several times, so the inner loops work on complete rows, 16 bytes at a time (SSE2).
+// the scalar versions are the reference: debug builds compare the results of both on every call, "ac_server --areabench" on random floorplans.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define FLOORPLAN_SSE2
+#endif
+
+static void layoutbits_scalar(const char *ml, int ls, uint *rows, uint *cols)
+{
+    int words = (ls + 31) / 32;
+    memset(rows, 0, ls * words * sizeof(uint));
+    memset(cols, 0, ls * words * sizeof(uint));
+    loop(y, ls) loop(x, ls) if(ml[y * ls + x] != 127)
+    {
+        rows[y * words + x / 32] |= 1u << (x & 31);
+        cols[x * words + y / 32] |= 1u << (y & 31);
+    }
+}
+
+void layoutbits(const char *ml, int ls, uint *rows, uint *cols)   // floorplan (ls * ls): bit x of row y (and bit y of column x) is set, if the cube is not solid (127)
+{                                                                   // rows, cols: ls * ((ls + 31) / 32) words
+#ifdef FLOORPLAN_SSE2
+    ASSERT(ls >= 32 && !(ls & 31));
+    int words = ls / 32;
+    const __m128i solid = _mm_set1_epi8(127);
+    for(int y = 0; y < ls; y += 8) for(int x = 0; x < ls; x += 32)
+    {   // 8 rows x 32 cubes: the row bits come from movemask, the column bits are collected bytewise (byte x: bit r is row y + r)
+        __m128i clo = _mm_setzero_si128(), chi = _mm_setzero_si128();
+        loop(r, 8)
+        {
+            const char *row = ml + (y + r) * ls + x;
+            __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)row), solid), hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row + 16)), solid);
+            rows[(y + r) * words + x / 32] = ~(_mm_movemask_epi8(lo) | (_mm_movemask_epi8(hi) << 16));
+            __m128i bit = _mm_set1_epi8(char(1 << r));
+            clo = _mm_or_si128(clo, _mm_and_si128(lo, bit));
+            chi = _mm_or_si128(chi, _mm_and_si128(hi, bit));
+        }
+        uchar c[32];
+        _mm_storeu_si128((__m128i *)c, clo);
+        _mm_storeu_si128((__m128i *)(c + 16), chi);
+        uint *col = cols + x * words + y / 32;
+        int shift = y & 31;
+        loopk(32)
+        {
+            uint b = uint(uchar(~c[k])) << shift;
+            if(shift) col[k * words] |= b;
+            else col[k * words] = b;
+        }
+    }
+    #ifdef _DEBUG
+    vector<uint> rrows, rcols;
+    layoutbits_scalar(ml, ls, rrows.pad(ls * words), rcols.pad(ls * words));
+    ASSERT(!memcmp(rows, rrows.getbuf(), ls * words * sizeof(uint)) && !memcmp(cols, rcols.getbuf(), ls * words * sizeof(uint)));
+    #endif
+#else
+    layoutbits_scalar(ml, ls, rows, cols);
+#endif
+}
+
+static bool servsqrrowdims_scalar(const servsqr *s, int len, int &first, int &last, int &minfloor, int &maxceil)
+{
+    first = last = -1;
+    loopi(len) if((s[i].type & TAGTRIGGERMASK) != SOLID)
+    {
+        if(first < 0) first = i;
+        last = i;
+        if(s[i].floor < minfloor) minfloor = s[i].floor;
+        if(s[i].ceil > maxceil) maxceil = s[i].ceil;
+    }
+    return first >= 0;
+}
+
+#ifdef FLOORPLAN_SSE2
+static inline __m128i min32(__m128i a, __m128i b) { __m128i m = _mm_cmpgt_epi32(a, b); return _mm_or_si128(_mm_and_si128(m, b), _mm_andnot_si128(m, a)); }
+static inline __m128i max32(__m128i a, __m128i b) { __m128i m = _mm_cmpgt_epi32(a, b); return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b)); }
+static inline __m128i select32(__m128i m, __m128i a, __m128i b) { return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b)); }
+static inline int hsum32(__m128i v) { int t[4]; _mm_storeu_si128((__m128i *)t, v); return t[0] + t[1] + t[2] + t[3]; }
+#endif
+
+bool servsqrrowdims(const servsqr *s, int len, int &first, int &last, int &minfloor, int &maxceil)  // non-solid cubes of a row: first and last index, lowest floor, highest ceiling (only lowered/raised)
+{
+#ifdef FLOORPLAN_SSE2
+    #ifdef _DEBUG
+    int rfirst, rlast, rminfloor = minfloor, rmaxceil = maxceil;
+    servsqrrowdims_scalar(s, len, rfirst, rlast, rminfloor, rmaxceil);
+    #endif
+    const __m128i typemask = _mm_set1_epi32(TAGTRIGGERMASK), ones = _mm_set1_epi32(-1), hifloor = _mm_set1_epi32(127), loceil = _mm_set1_epi32(-128);
+    __m128i minf = hifloor, maxc = loceil;
+    int i = 0;
+    first = last = -1;
+    for(; i + 4 <= len; i += 4)     // servsqr: { type, floor, ceil, vdelta } - four cubes per register
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i)),
+                open = _mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(v, typemask), _mm_setzero_si128()), ones);
+        int m = _mm_movemask_ps(_mm_castsi128_ps(open));
+        if(!m) continue;
+        if(first < 0) first = i + firstbit(m);
+        last = i + lastbit(m);
+        minf = min32(minf, select32(open, _mm_srai_epi32(_mm_slli_epi32(v, 16), 24), hifloor));
+        maxc = max32(maxc, select32(open, _mm_srai_epi32(_mm_slli_epi32(v, 8), 24), loceil));
+    }
+    int f[4], c[4];
+    _mm_storeu_si128((__m128i *)f, minf);
+    _mm_storeu_si128((__m128i *)c, maxc);
+    loopk(4)
+    {
+        if(f[k] < minfloor) minfloor = f[k];
+        if(c[k] > maxceil) maxceil = c[k];
+    }
+    for(; i < len; i++) if((s[i].type & TAGTRIGGERMASK) != SOLID)
+    {
+        if(first < 0) first = i;
+        last = i;
+        if(s[i].floor < minfloor) minfloor = s[i].floor;
+        if(s[i].ceil > maxceil) maxceil = s[i].ceil;
+    }
+    #ifdef _DEBUG
+    ASSERT(first == rfirst && last == rlast && minfloor == rminfloor && maxceil == rmaxceil);
+    #endif
+    return first >= 0;
+#else
+    return servsqrrowdims_scalar(s, len, first, last, minfloor, maxceil);
+#endif
+}
+
+static void servsqrrowcount_scalar(const servsqr *s, int len, int &total, int &rest)
+{
+    loopi(len) if(!SOLID(&s[i]))
+    {
+        total++;
+        if(!s[i].vdelta) rest++;
+    }
+}
+
+void servsqrrowcount(const servsqr *s, int len, int &total, int &rest)   // adds the non-solid cubes of a row to total, the ones among them with vdelta 0 to rest
+{
+#ifdef FLOORPLAN_SSE2
+    #ifdef _DEBUG
+    int rtotal = total, rrest = rest;
+    servsqrrowcount_scalar(s, len, rtotal, rrest);
+    #endif
+    const __m128i typemask = _mm_set1_epi32(0xFF), vdeltamask = _mm_set1_epi32((int)0xFF000000), zero = _mm_setzero_si128();
+    __m128i t = zero, r = zero;
+    int i = 0;
+    for(; i + 4 <= len; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i)),
+                solid = _mm_cmpeq_epi32(_mm_and_si128(v, typemask), zero),
+                unseen = _mm_andnot_si128(solid, _mm_cmpeq_epi32(_mm_and_si128(v, vdeltamask), zero));
+        t = _mm_sub_epi32(t, _mm_andnot_si128(solid, _mm_set1_epi32(-1)));    // (-1 per non-solid cube)
+        r = _mm_sub_epi32(r, unseen);
+    }
+    total += hsum32(t);
+    rest += hsum32(r);
+    servsqrrowcount_scalar(s + i, len - i, total, rest);
+    #ifdef _DEBUG
+    ASSERT(total == rtotal && rest == rrest);
+    #endif
+#else
+    servsqrrowcount_scalar(s, len, total, rest);
+#endif
+}
+
+int checkfloorplankernels(const char *ml, const servsqr *s, int ls)   // compares the row kernels with their scalar versions on one floorplan, returns the number of mismatches
+{
+    int words = (ls + 31) / 32, mismatches = 0;
+    vector<uint> rows, cols, rrows, rcols;
+    layoutbits(ml, ls, rows.pad(ls * words), cols.pad(ls * words));
+    layoutbits_scalar(ml, ls, rrows.pad(ls * words), rcols.pad(ls * words));
+    if(memcmp(rows.getbuf(), rrows.getbuf(), ls * words * sizeof(uint)) || memcmp(cols.getbuf(), rcols.getbuf(), ls * words * sizeof(uint))) mismatches++;
+    for(int y = 0; y < ls; y++, s += ls) loopk(5)     // whole rows, rows with a remainder of 1..3 cubes and an unaligned row
+    {
+        const servsqr *row = s + (k < 4 ? 0 : 1);
+        int len = ls - (k < 4 ? k : 1), first, last, minfloor = 127, maxceil = -128, rfirst, rlast, rminfloor = 127, rmaxceil = -128, total = 0, rest = 0, rtotal = 0, rrest = 0;
+        bool open = servsqrrowdims(row, len, first, last, minfloor, maxceil), ropen = servsqrrowdims_scalar(row, len, rfirst, rlast, rminfloor, rmaxceil);
+        if(open != ropen || first != rfirst || last != rlast || minfloor != rminfloor || maxceil != rmaxceil) mismatches++;
+        servsqrrowcount(row, len, total, rest);
+        servsqrrowcount_scalar(row, len, rtotal, rrest);
+        if(total != rtotal || rest != rrest) mismatches++;
+    }
+    return mismatches;
+}
+
 int calcmapdims(mapdim_s &md, const servsqr *s, int _ssize)
 {
     int res = 0;
     md.x1 = md.y1 = _ssize;
     md.x2 = md.y2 = 0;
     md.minfloor = 127; md.maxceil = -128;
-    for(int y = 0; y < _ssize; y++) for(int x = 0; x < _ssize; x++)
+    for(int y = 0; y < _ssize; y++, s += _ssize)
     {
-        if((s->type & TAGTRIGGERMASK) != SOLID)
+        int first, last;
+        if(servsqrrowdims(s, _ssize, first, last, md.minfloor, md.maxceil))
         {
-            if(x < md.x1) md.x1 = x;
-            if(x > md.x2) md.x2 = x;
+            if(first < md.x1) md.x1 = first;
+            if(last > md.x2) md.x2 = last;
             if(y < md.y1) md.y1 = y;
             md.y2 = y;
-            if(s->floor < md.minfloor) md.minfloor = s->floor;
-            if(s->ceil > md.maxceil) md.maxceil = s->ceil;
         }
-        s++;
     }
     if(md.x2 < md.x1 || md.y2 < md.y1)
     { // map is completely solid -> default to empty map values
@@ -223,15 +407,7 @@ int calcmapareastats(mapareastats_s &ms, servsqr *_servworld, int _ssize, const
         if(!epoch) epoch++;
     }
     ss = bb;
-    for(int j = md.yspan; j > 0; j--, ss += linegap) loopirev(md.xspan)
-    {
-        if(!SOLID(ss))
-        {
-            ms.total++;
-            if(!ss->vdelta) ms.rest++; // count all cubes not in view of one of the probe points
-        }
-        ss++;
-    }
+    for(int j = md.yspan; j > 0; j--, ss += _ssize) servsqrrowcount(ss, md.xspan, ms.total, ms.rest); // count all cubes not in view of one of the probe points
     ASSERT(tab.length() == MAS_GRID2);
     tab.sort(cmpintdesc);
     loopv(tab)
@@ -1026,6 +1202,25 @@ void sl_sleep(int duration)
 }
 #endif
 
+// microseconds from an arbitrary starting point (wraps every 71 minutes, only use differences)
+#ifdef WIN32
+uint sl_micros()
+{
+    static LARGE_INTEGER freq = { 0 };
+    LARGE_INTEGER c;
+    if(!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&c);
+    return uint((c.QuadPart / freq.QuadPart) * 1000000 + (c.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+}
+#else
+uint sl_micros()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return uint(t.tv_sec) * 1000000u + uint(t.tv_nsec / 1000);
+}
+#endif
+
 void parseupdatelist(hashtable<const char *, int> &ht, char *buf, const char *prefix, const char *suffix)
 {
     for(char *d = buf; *d; d++) if(!isalnum(*d) && !strchr("._-() /\n", *d)) *d = ' '; // allowed chars in media path strings (except ' ')
@@ -830,6 +830,14 @@ inline char *newstringbuf(const char *s)        { return newstring(s, MAXSTRLEN-
 inline void delstring(const char *s)            { delete[] (char *)s; }
 #define DELSTRING(s) if(s) { delstring(s); s = NULL; }
 
+#if defined(__GNUC__)
+    inline int firstbit(uint m) { return __builtin_ctz(m); }          // lowest set bit (m != 0)
+    inline int lastbit(uint m) { return 31 - __builtin_clz(m); }      // highest set bit (m != 0)
+#else
+    inline int firstbit(uint m) { unsigned long i; _BitScanForward(&i, m); return i; }
+    inline int lastbit(uint m) { unsigned long i; _BitScanReverse(&i, m); return i; }
+#endif
+
 #ifndef INT_LEAST64_MIN
 typedef unsigned long long int uint64_t;
 #endif
@@ -943,10 +951,14 @@ extern int findfilelocation;
 enum { FFL_WORKDIR = -2, FFL_HOME = -1, FFL_ZIP = 0 };
 extern const char *findfile(const char *filename, const char *mode);
 extern int getfilesize(const char *filename);
+struct filestamp { int size; uint mtime; };
+extern bool getfilestamp(const char *filename, filestamp &fs);
+extern uint getdirstamp(const char *dir, uint *newest = NULL);
 extern stream *openvecfile(vector<uchar> *s = NULL, bool autodelete = true);
 extern stream *openmemfile(const uchar *buf, int size, int *refcnt);
 extern bool findzipfile(const char *name);
 extern stream *openzipfile(const char *filename, const char *mode);
+extern stream *openrawfile(const char *filename, const char *mode);
 extern stream *openfile(const char *filename, const char *mode);
 extern stream *opentempfile(const char *filename, const char *mode);
 extern stream *opengzfile(const char *filename, const char *mode, stream *file = NULL, int level = Z_BEST_COMPRESSION);
@@ -1028,6 +1040,20 @@ extern int sl_waitthread(void *ti);
 extern bool sl_pollthread(void *ti);
 extern void sl_detachthread(void *ti);
 extern void sl_sleep(int duration);
+extern uint sl_micros();
+
+#if defined(__GNUC__)
+    #define sl_membarrier() __sync_synchronize()    // full memory barrier (for data passed between threads without locks)
+    #define sl_threadlocal __thread
+    template<class T> inline bool sl_atomiccas(T *volatile *p, T *o, T *n) { return __sync_bool_compare_and_swap(p, o, n); }    // *p = n, if *p == o
+    inline int sl_atomicadd(volatile int *p, int v) { return __sync_fetch_and_add(p, v); }                                        // returns the old value
+#else
+    #define sl_membarrier() MemoryBarrier()
+    #define sl_threadlocal __declspec(thread)
+    template<class T> inline bool sl_atomiccas(T *volatile *p, T *o, T *n) { return InterlockedCompareExchangePointer((PVOID volatile *)p, n, o) == o; }
+    inline int sl_atomicadd(volatile int *p, int v) { return InterlockedExchangeAdd((volatile LONG *)p, v); }
+#endif
+template<class T> inline T *sl_atomicswap(T *volatile *p, T *n) { T *o; do o = *p; while(!sl_atomiccas(p, o, n)); return o; }
 extern bool ismainthread();
 
 #endif
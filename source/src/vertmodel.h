@@ -13,6 +13,15 @@ const int dbgvlight = 0;
 //VAR(dbgvlight, 0, 0, 1);
 
 VARP(mdldlist, 0, 1, 1);
+VARP(mdlanimsteps, 0, 64, 1024);    // animations are sampled at this many steps per keyframe, so models at the same phase share the interpolated vertexes (0: exact)
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define VERTMODEL_SSE2
+#endif
+#ifdef __AVX__
+    #include <immintrin.h>
+#endif
 
 vec modelpos;
 float modelroll, modelyaw, modelpitch;
@@ -30,6 +39,7 @@ struct vertmodel : model
             fr1 = (int)(double(time)/as.speed); // round to full frames
             t = (time-double(fr1)*as.speed)/as.speed; // progress of the frame, value from 0.0f to 1.0f
             ASSERT(t >= 0.0f);
+            if(mdlanimsteps) t = floorf(t*mdlanimsteps)/mdlanimsteps;
             if(as.anim&ANIM_LOOP)
             {
                 fr1 = fr1%as.range+as.frame;
@@ -87,6 +97,105 @@ struct vertmodel : model
     struct lightvert { uchar r, g, b, a; };
     struct tri { ushort vert[3]; ushort neighbor[3]; };
 
+    // keyframe interpolation and vertex lighting kernels
+    //
+    // the vertex arrays are interpolated as flat float arrays, four floats at a time (eight with AVX), the vertex lighting transforms
+    // four vertexes at a time. the operations are the same as in the scalar loops, so are the results ("--mdlanimbench" compares them).
+
+    static void lerpverts(vec *dst, const vec *v1, const vec *v2, float t, int numverts)     // dst = v1 + t*(v2 - v1)
+    {
+        float *d = (float *)dst;
+        const float *a = (const float *)v1, *b = (const float *)v2;
+        int n = numverts*3, i = 0;
+#ifdef __AVX__
+        const __m256 t8 = _mm256_set1_ps(t);
+        for(; i + 8 <= n; i += 8)
+        {
+            __m256 x = _mm256_loadu_ps(a + i);
+            _mm256_storeu_ps(d + i, _mm256_add_ps(x, _mm256_mul_ps(t8, _mm256_sub_ps(_mm256_loadu_ps(b + i), x))));
+        }
+#endif
+#ifdef VERTMODEL_SSE2
+        const __m128 t4 = _mm_set1_ps(t);
+        for(; i + 4 <= n; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(a + i);
+            _mm_storeu_ps(d + i, _mm_add_ps(x, _mm_mul_ps(t4, _mm_sub_ps(_mm_loadu_ps(b + i), x))));
+        }
+#endif
+        for(; i < n; i++) d[i] = a[i] + t*(b[i] - a[i]);
+    }
+
+    static void lerpverts(vec *dst, const vec *v1, const vec *v2, float t, const vec *p1, const vec *p2, float pt, float ai_t, int numverts)  // blend with the previous animation
+    {
+        float *d = (float *)dst;
+        const float *a = (const float *)v1, *b = (const float *)v2, *pa = (const float *)p1, *pb = (const float *)p2;
+        int n = numverts*3, i = 0;
+#ifdef __AVX__
+        const __m256 t8 = _mm256_set1_ps(t), pt8 = _mm256_set1_ps(pt), ai8 = _mm256_set1_ps(ai_t);
+        for(; i + 8 <= n; i += 8)
+        {
+            __m256 x = _mm256_loadu_ps(a + i), px = _mm256_loadu_ps(pa + i);
+            x = _mm256_add_ps(x, _mm256_mul_ps(t8, _mm256_sub_ps(_mm256_loadu_ps(b + i), x)));
+            px = _mm256_add_ps(px, _mm256_mul_ps(pt8, _mm256_sub_ps(_mm256_loadu_ps(pb + i), px)));
+            _mm256_storeu_ps(d + i, _mm256_add_ps(px, _mm256_mul_ps(ai8, _mm256_sub_ps(x, px))));
+        }
+#endif
+#ifdef VERTMODEL_SSE2
+        const __m128 t4 = _mm_set1_ps(t), pt4 = _mm_set1_ps(pt), ai4 = _mm_set1_ps(ai_t);
+        for(; i + 4 <= n; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(a + i), px = _mm_loadu_ps(pa + i);
+            x = _mm_add_ps(x, _mm_mul_ps(t4, _mm_sub_ps(_mm_loadu_ps(b + i), x)));
+            px = _mm_add_ps(px, _mm_mul_ps(pt4, _mm_sub_ps(_mm_loadu_ps(pb + i), px)));
+            _mm_storeu_ps(d + i, _mm_add_ps(px, _mm_mul_ps(ai4, _mm_sub_ps(x, px))));
+        }
+#endif
+        for(; i < n; i++)
+        {
+            float x = a[i] + t*(b[i] - a[i]), px = pa[i] + pt*(pb[i] - pa[i]);
+            d[i] = px + ai_t*(x - px);
+        }
+    }
+
+    static void lightverts(lightvert *v, const vec *buf, int numverts, const glmatrixf &m)     // light of the cubes below the vertexes
+    {
+        int i = 0;
+#ifdef VERTMODEL_SSE2
+        const __m128 m0 = _mm_set1_ps(m.v[0]), m4 = _mm_set1_ps(m.v[4]), m8 = _mm_set1_ps(m.v[8]), m12 = _mm_set1_ps(m.v[12]),
+                     m1 = _mm_set1_ps(m.v[1]), m5 = _mm_set1_ps(m.v[5]), m9 = _mm_set1_ps(m.v[9]), m13 = _mm_set1_ps(m.v[13]);
+        for(; i + 4 <= numverts; i += 4)
+        {
+            const float *p = (const float *)&buf[i];
+            __m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);     // x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+            __m128 x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0)),
+                   y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)),
+                   z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 3, 0)), _MM_SHUFFLE(1, 0, 2, 0));
+            int cx[4], cy[4];
+            _mm_storeu_si128((__m128i *)cx, _mm_cvttps_epi32(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m0), _mm_mul_ps(y, m4)), _mm_mul_ps(z, m8)), m12)));
+            _mm_storeu_si128((__m128i *)cy, _mm_cvttps_epi32(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m1), _mm_mul_ps(y, m5)), _mm_mul_ps(z, m9)), m13)));
+            loopj(4)
+            {
+                const sqr *s = S(cx[j], cy[j]);
+                v->r = s->r;
+                v->g = s->g;
+                v->b = s->b;
+                v->a = 255;
+                v++;
+            }
+        }
+#endif
+        for(; i < numverts; i++)
+        {
+            const sqr *s = S((int)m.transformx(buf[i]), (int)m.transformy(buf[i]));
+            v->r = s->r;
+            v->g = s->g;
+            v->b = s->b;
+            v->a = 255;
+            v++;
+        }
+    }
+
     struct part;
 
     typedef tristrip::drawcall drawcall;
@@ -219,20 +328,8 @@ struct vertmodel : model
             }
             else d->prev.fr1 = -1;
 
-            #define iploop(body) \
-                loopi(numverts) \
-                { \
-                    vec &v = buf[i]; \
-                    body; \
-                }
-            #define ip(p1, p2, t) (p1+t*(p2-p1))
-            #define ip_v(p, c, t) ip(p##1[i].c, p##2[i].c, t)
-            #define ip_v_ai(c) ip(ip_v(pvert, c, prev->t), ip_v(vert, c, cur.t), ai_t)
-            if(prev) iploop(v = vec(ip_v_ai(x), ip_v_ai(y), ip_v_ai(z)))
-            else iploop(v = vec(ip_v(vert, x, cur.t), ip_v(vert, y, cur.t), ip_v(vert, z, cur.t)))
-            #undef ip
-            #undef ip_v
-            #undef ip_v_ai
+            if(prev) lerpverts(buf, vert1, vert2, cur.t, pvert1, pvert2, prev->t, ai_t, numverts);
+            else lerpverts(buf, vert1, vert2, cur.t, numverts);
 
             if(d->verts() == lastvertexarray) lastvertexarray = (void *)-1;
 
@@ -407,19 +504,7 @@ struct vertmodel : model
             if(prev) d->prev = *prev;
             else d->prev.fr1 = -1;
 
-            const glmatrixf &m = matrixstack[matrixpos];
-            lightvert *v = d->verts();
-            loopi(numverts)
-            {
-                int x = (int)m.transformx(*buf), y = (int)m.transformy(*buf);
-                const sqr *s = S(x, y);
-                v->r = s->r;
-                v->g = s->g;
-                v->b = s->b;
-                v->a = 255;
-                v++;
-                buf++;
-            }
+            lightverts(d->verts(), buf, numverts, matrixstack[matrixpos]);
             if(d->verts() == lastcolorarray) lastcolorarray = (void *)-1;
             return d;
         }
@@ -888,6 +973,7 @@ struct vertmodel : model
             {
                 prev.setframes(d->prev[index]);
                 ai_t = (lastmillis-d->lastanimswitchtime[index])/(float)animationinterpolationtime;
+                if(mdlanimsteps) ai_t = floorf(ai_t*mdlanimsteps)/mdlanimsteps;
             }
 
             glPushMatrix();
@@ -281,26 +281,26 @@ int renderwater(float hf, GLuint reflecttex, GLuint refracttex)
     return nquads;
 }
 
-void addwaterquad(int x, int y, int size)       // update bounding rect that contains water
+void addwaterrect(int x1, int y1, int x2, int y2)     // update bounding rect that contains water
 {
-    int x2 = x+size;
-    int y2 = y+size;
     if(wx1<0)
     {
-        wx1 = x;
-        wy1 = y;
+        wx1 = x1;
+        wy1 = y1;
         wx2 = x2;
         wy2 = y2;
     }
     else
     {
-        if(x<wx1) wx1 = x;
-        if(y<wy1) wy1 = y;
+        if(x1<wx1) wx1 = x1;
+        if(y1<wy1) wy1 = y1;
         if(x2>wx2) wx2 = x2;
         if(y2>wy2) wy2 = y2;
     }
 }
 
+void addwaterquad(int x, int y, int size) { addwaterrect(x, y, x+size, y+size); }
+
 void calcwaterscissor()
 {
     vec4 v[4];
@@ -19,6 +19,7 @@ _mapconfigdata mapconfigdata;
 void remip(const block &b, int level)
 {
     if(level>=SMALLEST_FACTOR) return;
+    if(!level) invalidateworldcache(b);
     int lighterr = lighterror*3;
     sqr *w = wmip[level];
     sqr *v = wmip[level+1];
@@ -232,7 +233,7 @@ void entproperty(int *prop, float *famount, int *unscaled)
     clampentityattributes(e);
     switch(e.type)
     {
-        case LIGHT: calclight(); break;
+        case LIGHT: relight(); break;
         case SOUND:
             audiomgr.preloadmapsound(e);
             entityreference entref(&e);
@@ -308,7 +309,7 @@ void delent()
 
     switch(t)
     {
-        case LIGHT: calclight(); break;
+        case LIGHT: relight(); break;
     }
     unsavededits++;
 }
@@ -411,11 +412,11 @@ void newentity(int index, int x, int y, int z, const char *what, float v1f, floa
     }
     if(oldtype!=type) switch(oldtype)
     {
-        case LIGHT: calclight(); break;
+        case LIGHT: relight(); break;
     }
     switch(type)
     {
-        case LIGHT: calclight(); break;
+        case LIGHT: relight(); break;
         case SOUND: audiomgr.preloadmapsound(e); break;
     }
     if(index >= 0 || type != DUMMYENT) unsavededits++;      // no need to save dummies
@@ -451,7 +452,7 @@ void clearents(char *name)
     }
     switch(type)
     {
-        case LIGHT: calclight(); break;
+        case LIGHT: relight(); break;
     }
     if(found) unsavededits++;
 }
@@ -472,7 +473,7 @@ void deleteentity(char *ns)
     deleted_ents.add(e);
     memset(&e, 0, sizeof(persistent_entity));
     e.type = NOTUSED;
-    if(t == LIGHT) calclight();
+    if(t == LIGHT) relight();
     unsavededits++;
 }
 COMMAND(deleteentity, "s");
@@ -530,7 +531,7 @@ void editentity(char **args, int numargs) // index x y z a1 a2 a3 a4 ...
             clampentityattributes(e);
             switch(e.type)
             {
-                case LIGHT: calclight(); break;
+                case LIGHT: relight(); break;
                 case SOUND: audiomgr.preloadmapsound(e); break;
             }
             unsavededits++;
@@ -1019,6 +1019,7 @@ int load_world(char *mname)        // still supports all map formats that have e
 
     c2skeepalive();
 
+    async_texture_load = true;    // textures and model skins are decoded on the loader threads, the map starts with placeholders
     watch.start();
     loopi(256) if(texuse[i]) lookupworldtexture(i, autodownload ? true : false);
     int texloadtime = watch.elapsed();
@@ -1052,6 +1053,7 @@ int load_world(char *mname)        // still supports all map formats that have e
     c2skeepalive();
     watch.start();
     res |= preload_mapmodels(false) ? 0 : LWW_MISSINGMEDIA * 4;
+    async_texture_load = false;
     clientlogf("loaded mapmodels (%d milliseconds)", mdlloadtime+watch.elapsed());
     c2skeepalive();
     watch.start();
@@ -1101,7 +1103,7 @@ char *getfiledesc(const char *dir, const char *name, const char *ext) // extract
         lilswap(&hdr.version, 1);
         lilswap(&hdr.protocol, 1);
         const char *tag = "(incompatible file) ";
-        if(hdr.version == DEMO_VERSION)
+        if(hdr.version == DEMO_VERSION || hdr.version == DEMO_VERSION_FLAT)
         {
             if(hdr.protocol == PROTOCOL_VERSION) tag = "";
             else if(hdr.protocol == -PROTOCOL_VERSION) tag = "(recorded on modded server) ";
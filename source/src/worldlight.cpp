@@ -4,118 +4,149 @@
 
 #define LIGHTSCALE 4
 
-void lightray(float bx, float by, const persistent_entity &light, float fade = 1, bool flicker = false)     // done in realtime, needs to be fast
+static const int PRECBITS = 12;
+static const float PRECF = 4096.0f;
+
+// a light ray is set up first (all random values applied) and traced later - calclight() sets up the rays of all lights
+// in a fixed order (with a static seed) and traces them on several threads
+
+enum { LR_COLOURED = 0, LR_WHITE, LR_WHITEGREY, LR_OLD };     // how a ray adds its light to the cubes
+
+struct lightray
+{
+    int type, steps, x, y, stepx, stepy, l, stepl, g, stepg, b, stepb;
+};
+
+static bool setuplightray(lightray &r, float bx, float by, const persistent_entity &light, float fade, bool flicker)
 {
     float lx = light.x+(flicker ? (rnd(21)-10)*0.1f : 0);
     float ly = light.y+(flicker ? (rnd(21)-10)*0.1f : 0);
     float dx = bx-lx;
     float dy = by-ly;
     float dist = sqrtf(dx*dx+dy*dy);
-    if(dist<1.0f) return;
+    if(dist<1.0f) return false;
     int reach = light.attr1;
     int steps = (int)(reach*reach*1.6f/dist);
-    const int PRECBITS = 12;
-    const float PRECF = 4096.0f;
-    int x = (int)(lx*PRECF);
-    int y = (int)(ly*PRECF);
     int fadescale = (int)(fade*PRECF);
-    int l = light.attr2*fadescale;
-    int stepx = (int)(dx/(float)steps*PRECF);
-    int stepy = (int)(dy/(float)steps*PRECF);
-    int stepl = (int)(l/(float)steps);
+    r.type = LR_OLD;
+    r.steps = steps;
+    r.x = (int)(lx*PRECF);
+    r.y = (int)(ly*PRECF);
+    r.stepx = (int)(dx/(float)steps*PRECF);
+    r.stepy = (int)(dy/(float)steps*PRECF);
+    r.l = light.attr2*fadescale;
+    r.stepl = (int)(r.l/(float)steps);
+    r.g = r.stepg = r.b = r.stepb = 0;
 
     if(maxtmus)
     {
-        l /= LIGHTSCALE;
-        stepl /= LIGHTSCALE;
+        r.l /= LIGHTSCALE;
+        r.stepl /= LIGHTSCALE;
 
         if(light.attr3 || light.attr4)      // coloured light version, special case because most lights are white
         {
             if(flicker)
             {
                 int dimness = rnd((((255<<PRECBITS)-(int(light.attr2)+int(light.attr3)+int(light.attr4))*fadescale/3)>>(PRECBITS+4))+1);
-                x += stepx*dimness;
-                y += stepy*dimness;
+                r.x += r.stepx*dimness;
+                r.y += r.stepy*dimness;
             }
 
-            if(OUTBORD(x>>PRECBITS, y>>PRECBITS)) return;
-
-            int g = light.attr3*fadescale;
-            int stepg = (int)(g/(float)steps);
-            int b = light.attr4*fadescale;
-            int stepb = (int)(b/(float)steps);
-            g /= LIGHTSCALE;
-            stepg /= LIGHTSCALE;
-            b /= LIGHTSCALE;
-            stepb /= LIGHTSCALE;
-            loopi(steps)
-            {
-                sqr *s = S(x>>PRECBITS, y>>PRECBITS);
-                s->r = min((l>>PRECBITS)+s->r, 255);
-                s->g = min((g>>PRECBITS)+s->g, 255);
-                s->b = min((b>>PRECBITS)+s->b, 255);
-                if(SOLID(s)) return;
-                x += stepx;
-                y += stepy;
-                l -= stepl;
-                g -= stepg;
-                b -= stepb;
-                stepl -= 25;
-                stepg -= 25;
-                stepb -= 25;
-            }
+            if(OUTBORD(r.x>>PRECBITS, r.y>>PRECBITS)) return false;
+
+            r.type = LR_COLOURED;
+            r.g = light.attr3*fadescale;
+            r.stepg = (int)(r.g/(float)steps);
+            r.b = light.attr4*fadescale;
+            r.stepb = (int)(r.b/(float)steps);
+            r.g /= LIGHTSCALE;
+            r.stepg /= LIGHTSCALE;
+            r.b /= LIGHTSCALE;
+            r.stepb /= LIGHTSCALE;
         }
         else        // white light, special optimized version
         {
             if(flicker)
             {
                 int dimness = rnd((((255<<PRECBITS)-(light.attr2*fadescale))>>(PRECBITS+4))+1);
-                x += stepx*dimness;
-                y += stepy*dimness;
+                r.x += r.stepx*dimness;
+                r.y += r.stepy*dimness;
             }
 
-            if(OUTBORD(x>>PRECBITS, y>>PRECBITS)) return;
+            if(OUTBORD(r.x>>PRECBITS, r.y>>PRECBITS)) return false;
 
-            if(hdr.ambient > 0xFF) loopi(steps)
-            {
-                sqr *s = S(x>>PRECBITS, y>>PRECBITS);
+            r.type = hdr.ambient > 0xFF ? LR_WHITE : LR_WHITEGREY;
+        }
+    }
+    return steps > 0;
+}
+
+static inline void lightrayarea(const lightray &r, int &x1, int &y1, int &x2, int &y2)   // the cubes, a ray can touch
+{
+    int ex = (r.x + r.stepx*(r.steps-1))>>PRECBITS, ey = (r.y + r.stepy*(r.steps-1))>>PRECBITS;
+    x1 = min(r.x>>PRECBITS, ex);
+    y1 = min(r.y>>PRECBITS, ey);
+    x2 = max(r.x>>PRECBITS, ex);
+    y2 = max(r.y>>PRECBITS, ey);
+}
+
+template<int TYPE> static void tracelightray(const lightray &r, const block &clip)
+{
+    int x = r.x, y = r.y, l = r.l, stepl = r.stepl, g = r.g, stepg = r.stepg, b = r.b, stepb = r.stepb;
+    const int cx1 = clip.x, cy1 = clip.y, cx2 = clip.x + clip.xs, cy2 = clip.y + clip.ys;
+    loopi(r.steps)
+    {
+        int cx = x>>PRECBITS, cy = y>>PRECBITS;
+        sqr *s = S(cx, cy);
+        if(cx >= cx1 && cy >= cy1 && cx < cx2 && cy < cy2) switch(TYPE)
+        {
+            case LR_COLOURED:
+                s->r = min((l>>PRECBITS)+s->r, 255);
+                s->g = min((g>>PRECBITS)+s->g, 255);
+                s->b = min((b>>PRECBITS)+s->b, 255);
+                break;
+            case LR_WHITE:
                 s->r = min((l>>PRECBITS)+s->r, 255);
                 s->g = min((l>>PRECBITS)+s->g, 255);
                 s->b = min((l>>PRECBITS)+s->b, 255);
-                if(SOLID(s)) return;
-                x += stepx;
-                y += stepy;
-                l -= stepl;
-                stepl -= 25;
-            }
-            else loopi(steps)
-            {
-                sqr *s = S(x>>PRECBITS, y>>PRECBITS);
+                break;
+            case LR_WHITEGREY:
                 s->r = s->g = s->b = min((l>>PRECBITS)+s->r, 255);
-                if(SOLID(s)) return;
-                x += stepx;
-                y += stepy;
-                l -= stepl;
-                stepl -= 25;
+                break;
+            case LR_OLD:        // the old (white) light code, here for the few people with old video cards that don't support overbright
+            {
+                int light = l>>PRECBITS;
+                if(light>s->r) s->r = s->g = s->b = (uchar)light;
+                break;
             }
         }
+        else if((cx < cx1 && r.stepx <= 0) || (cx >= cx2 && r.stepx >= 0) || (cy < cy1 && r.stepy <= 0) || (cy >= cy2 && r.stepy >= 0)) return;  // won't come back
+        if(SOLID(s)) return;
+        x += r.stepx;
+        y += r.stepy;
+        l -= stepl;
+        if(TYPE == LR_OLD) continue;
+        stepl -= 25;
+        if(TYPE != LR_COLOURED) continue;
+        g -= stepg;
+        b -= stepb;
+        stepg -= 25;
+        stepb -= 25;
     }
-    else        // the old (white) light code, here for the few people with old video cards that don't support overbright
+}
+
+static void tracelightray(const lightray &r, const block &clip)    // done in realtime, needs to be fast; only lights cubes inside clip
+{
+    switch(r.type)
     {
-        loopi(steps)
-        {
-            sqr *s = S(x>>PRECBITS, y>>PRECBITS);
-            int light = l>>PRECBITS;
-            if(light>s->r) s->r = s->g = s->b = (uchar)light;
-            if(SOLID(s)) return;
-            x += stepx;
-            y += stepy;
-            l -= stepl;
-        }
+        case LR_COLOURED: tracelightray<LR_COLOURED>(r, clip); break;
+        case LR_WHITE: tracelightray<LR_WHITE>(r, clip); break;
+        case LR_WHITEGREY: tracelightray<LR_WHITEGREY>(r, clip); break;
+        case LR_OLD: tracelightray<LR_OLD>(r, clip); break;
     }
 }
 
-void calclightsource(const persistent_entity &l, float fade = 1, bool flicker = true)
+static void addlightrays(vector<lightray> &rays, const persistent_entity &l, float fade, bool flicker)
 {
     int reach = l.attr1;
     int sx = l.x-reach;
@@ -125,8 +156,19 @@ void calclightsource(const persistent_entity &l, float fade = 1, bool flicker =
 
     const float s = 0.8f;
 
-    for(float sx2 = (float)sx; sx2<=ex; sx2+=s*2) { lightray(sx2, (float)sy, l, fade, flicker); lightray(sx2, (float)ey, l, fade, flicker); }
-    for(float sy2 = sy+s; sy2<=ey-s; sy2+=s*2)    { lightray((float)sx, sy2, l, fade, flicker); lightray((float)ex, sy2, l, fade, flicker); }
+    #define addray(bx, by) { if(!setuplightray(rays.add(), bx, by, l, fade, flicker)) rays.drop(); }
+    for(float sx2 = (float)sx; sx2<=ex; sx2+=s*2) { addray(sx2, (float)sy); addray(sx2, (float)ey); }
+    for(float sy2 = sy+s; sy2<=ey-s; sy2+=s*2)    { addray((float)sx, sy2); addray((float)ex, sy2); }
+    #undef addray
+}
+
+void calclightsource(const persistent_entity &l, float fade = 1, bool flicker = true)
+{
+    static vector<lightray> rays;
+    rays.setsize(0);
+    addlightrays(rays, l, fade, flicker);
+    block all = { 0, 0, ssize, ssize };
+    loopv(rays) tracelightray(rays[i], all);
 }
 
 void postlightarealine(sqr *s, int len)
@@ -144,7 +186,7 @@ void postlightarealine(sqr *s, int len)
     }
 }
 
-void postlightarea(const block &a)    // median filter, smooths out random noise in light and makes it more mipable
+static void filterlightarea(const block &a)
 {
     int ia = (a.xs + 1) >> 1, ib = a.xs - ia;;
     for(int y = a.ys - 1; y >= 0; y -= 2)
@@ -159,6 +201,11 @@ void postlightarea(const block &a)    // median filter, smooths out random noise
         postlightarealine(s, ia);
         postlightarealine(s + 1, ib);
     }
+}
+
+void postlightarea(const block &a)    // median filter, smooths out random noise in light and makes it more mipable
+{
+    filterlightarea(a);
     remip(a);
 }
 
@@ -166,24 +213,144 @@ int lastcalclight = 0;
 
 VARP(fullbrightlevel, 0, 176, 255);
 
+static void clearlightstate();
+
 void fullbrightlight(int level)
 {
     if(level < 0) level = fullbrightlevel;
 
     loopi(mipsize) world[i].r = world[i].g = world[i].b = level;
     lastcalclight = totalmillis;
+    clearlightstate();
+    flushworldcache();
 }
 
 VARF(ambient, 0, 0, 0xFFFFFF, if(!noteditmode("ambient")) { hdr.ambient = ambient; calclight(); unsavededits++;});
 
-void calclight()
+// calclight() traces the rays of all lights on up to lightthreads threads: every thread lights a band of map rows
+// at a time and only writes there. so the contributions to every cube are added in the same order as with a single thread
+// and the result doesn't depend on the number of threads (coloured and white lights on grey ambient don't commute).
+//
+// in edit mode, the rays, the solid cubes and the resulting light of the last run are kept: relight() compares
+// the new rays to them, retraces only the area around the changed lights and runs the median filter on a slightly larger area,
+// so the result is exactly the same as the one of calclight().
+
+VARP(lightthreads, 1, 4, 16);
+
+struct lightsource { int firstray, numrays; block area; };
+
+struct lightset
 {
-    if(editmode)
+    vector<lightray> rays;
+    vector<lightsource> sources;
+};
+
+static lightset lightsets[2];
+static int curlightset = 0;
+
+static struct
+{
+    bool valid;
+    int ssize, ambient, maxtmus;
+    block bb;
+    vector<uchar> solid, rgb;     // solid cubes and light of the last run
+} lightstate;
+
+static void collectlights(lightset &ls)
+{
+    ls.rays.setsize(0);
+    ls.sources.setsize(0);
+
+    seedMT(ents.length() + hdr.maprevision);   // static seed -> nothing random here
+
+    loopv(ents)
     {
-        servsqr *servworld = createservworld(world, cubicsize);
-        calcmapdims(clmapdims, servworld, ssize);
-        delete[] servworld;
+        entity &e = ents[i];
+        if(e.type!=LIGHT) continue;
+        lightsource &src = ls.sources.add();
+        src.firstray = ls.rays.length();
+        addlightrays(ls.rays, e, 1, true);
+        src.numrays = ls.rays.length() - src.firstray;
+        int x1 = ssize, y1 = ssize, x2 = -1, y2 = -1;
+        loopj(src.numrays)
+        {
+            int rx1, ry1, rx2, ry2;
+            lightrayarea(ls.rays[src.firstray + j], rx1, ry1, rx2, ry2);
+            x1 = min(x1, rx1); y1 = min(y1, ry1);
+            x2 = max(x2, rx2); y2 = max(y2, ry2);
+        }
+        block a = { x1, y1, max(x2 - x1 + 1, 0), max(y2 - y1 + 1, 0) };
+        src.area = a;
+    }
+
+    popMT();   // undo the static seedMT() from above
+}
+
+static inline bool insidearea(const block &a, const block &b)
+{
+    return b.x >= a.x && b.y >= a.y && b.x+b.xs <= a.x+a.xs && b.y+b.ys <= a.y+a.ys;
+}
+
+static inline bool overlaparea(const block &a, const block &b)
+{
+    return a.x < b.x+b.xs && b.x < a.x+a.xs && a.y < b.y+b.ys && b.y < a.y+a.ys;
+}
+
+static struct
+{
+    const lightset *ls;
+    block area;
+    int bandsize, numbands;
+    volatile int nextband;
+} lightjob;
+
+static int lightthread(void *nop)
+{
+    const lightset &ls = *lightjob.ls;
+    for(;;)
+    {
+        int band = sl_atomicadd(&lightjob.nextband, 1);
+        if(band >= lightjob.numbands) break;
+        block clip = lightjob.area;
+        clip.y += band * lightjob.bandsize;
+        clip.ys = min(lightjob.bandsize, lightjob.area.ys - band * lightjob.bandsize);
+        loopv(ls.sources)
+        {
+            const lightsource &src = ls.sources[i];
+            if(!overlaparea(src.area, clip)) continue;
+            bool inside = insidearea(clip, src.area);
+            loopj(src.numrays)
+            {
+                const lightray &r = ls.rays[src.firstray + j];
+                if(!inside)
+                {
+                    int x1, y1, x2, y2;
+                    lightrayarea(r, x1, y1, x2, y2);
+                    block a = { x1, y1, x2 - x1 + 1, y2 - y1 + 1 };
+                    if(!overlaparea(a, clip)) continue;
+                }
+                tracelightray(r, clip);
+            }
+        }
     }
+    return 0;
+}
+
+static void tracelights(const lightset &ls, const block &area)
+{
+    lightjob.ls = &ls;
+    lightjob.area = area;
+    lightjob.bandsize = lightthreads > 1 ? max(area.ys / (lightthreads * 4), 8) : area.ys;     // a few bands per thread, to even out the load
+    lightjob.numbands = (area.ys + lightjob.bandsize - 1) / lightjob.bandsize;
+    lightjob.nextband = 0;
+    vector<void *> threads;
+    loopi(min(lightthreads, lightjob.numbands) - 1) threads.add(sl_createthread(lightthread, NULL));
+    lightthread(NULL);
+    loopv(threads) sl_waitthread(threads[i]);
+}
+
+static void lightambient(const block &a)
+{
     uchar r = (hdr.ambient>>16) & 0xFF, g = (hdr.ambient>>8) & 0xFF, b = hdr.ambient & 0xFF;
     if(!r && !g)
     {
@@ -191,27 +358,174 @@ void calclight()
         r = g = b;
     }
     else if(!maxtmus) r = g = b = max(max(r, g), b); // the old (white) light code, here for the few people with old video cards that don't support overbright
-    sqr *s = S(0,0);
-    loopirev(cubicsize)
+    for(int y = a.y; y < a.y + a.ys; y++)
     {
-        s->r = r;
-        s->g = g;
-        s->b = b;
-        s++;
+        sqr *s = S(a.x, y);
+        loopirev(a.xs)
+        {
+            s->r = r;
+            s->g = g;
+            s->b = b;
+            s++;
+        }
     }
+}
 
-    seedMT(ents.length() + hdr.maprevision);   // static seed -> nothing random here
-
-    loopv(ents)
+static void clearlightstate()
+{
+    lightstate.valid = false;
+    lightstate.solid.shrink(0);
+    lightstate.rgb.shrink(0);
+    loopi(2)
     {
-        entity &e = ents[i];
-        if(e.type==LIGHT) calclightsource(e);
+        lightsets[i].rays.shrink(0);
+        lightsets[i].sources.shrink(0);
     }
+}
 
-    popMT();   // undo the static seedMT() from above
+static void savelightstate(const block &bb, const block *area = NULL)   // area: only that part has changed
+{
+    if(!editmode) { clearlightstate(); return; }
+    if(!area)
+    {
+        lightstate.valid = true;
+        lightstate.ssize = ssize;
+        lightstate.ambient = hdr.ambient;
+        lightstate.maxtmus = maxtmus;
+        lightstate.bb = bb;
+        lightstate.solid.setsize(0);
+        lightstate.rgb.setsize(0);
+        lightstate.solid.pad(cubicsize);
+        lightstate.rgb.pad(cubicsize * 3);
+    }
+    block a = { 0, 0, ssize, ssize };
+    if(area) a = *area;
+    for(int y = a.y; y < a.y + a.ys; y++)
+    {
+        int i = (y<<sfactor) + a.x;
+        const sqr *s = &world[i];
+        uchar *solid = &lightstate.solid[i], *rgb = &lightstate.rgb[i * 3];
+        loopirev(a.xs)
+        {
+            *solid++ = SOLID(s) ? 1 : 0;
+            *rgb++ = s->r;
+            *rgb++ = s->g;
+            *rgb++ = s->b;
+            s++;
+        }
+    }
+}
 
+static block lightbb()
+{
+    if(editmode)
+    {
+        servsqr *servworld = createservworld(world, cubicsize);
+        calcmapdims(clmapdims, servworld, ssize);
+        delete[] servworld;
+    }
     block bb = { clmapdims.x1 - 1, clmapdims.y1 - 1, clmapdims.xspan + 2, clmapdims.yspan + 2 };
+    return bb;
+}
+
+static void fulllight(const lightset &ls, const block &bb)
+{
+    block all = { 0, 0, ssize, ssize };
+    lightambient(all);
+    tracelights(ls, all);
+    flushworldcache();
     postlightarea(bb);
+    savelightstate(bb);
+    setvar("fullbright", 0);
+    lastcalclight = totalmillis;
+}
+
+void calclight()
+{
+    block bb = lightbb();
+    curlightset = 0;
+    collectlights(lightsets[0]);
+    fulllight(lightsets[0], bb);
+}
+
+void relight()      // edit mode: only relight the area, where lights or solid cubes have changed
+{
+    if(!editmode || !lightstate.valid || lightstate.ssize != ssize || lightstate.ambient != hdr.ambient || lightstate.maxtmus != maxtmus) { calclight(); return; }
+    block bb = lightbb();
+    if(memcmp(&bb, &lightstate.bb, sizeof(block))) { calclight(); return; }
+
+    const lightset &last = lightsets[curlightset];
+    lightset &cur = lightsets[curlightset ^= 1];
+    collectlights(cur);
+    if(cur.sources.length() != last.sources.length()) { fulllight(cur, bb); return; }
+
+    // find the cubes that need to be relit: changed solid cubes, light that was changed by something else
+    // (paste, undo) and the area of every light that has changed or sees a changed solid cube
+    int x1 = ssize, y1 = ssize, x2 = -1, y2 = -1;
+    #define addarea(ax1, ay1, ax2, ay2) { x1 = min(x1, ax1); y1 = min(y1, ay1); x2 = max(x2, ax2); y2 = max(y2, ay2); }
+    vector<int> solidchanges;
+    const uchar *solid = lightstate.solid.getbuf(), *rgb = lightstate.rgb.getbuf();
+    sqr *s = S(0,0);
+    loopi(cubicsize)
+    {
+        if(((SOLID(s) ? 1 : 0) ^ solid[i]) | (s->r ^ rgb[0]) | (s->g ^ rgb[1]) | (s->b ^ rgb[2]))
+        {
+            if((SOLID(s) ? 1 : 0) != solid[i]) solidchanges.add(i);
+            if(s->r != rgb[0] || s->g != rgb[1] || s->b != rgb[2]) addarea(i & (ssize - 1), i >> sfactor, i & (ssize - 1), i >> sfactor);
+        }
+        s++;
+        rgb += 3;
+    }
+    loopv(cur.sources)
+    {
+        const lightsource &n = cur.sources[i], &o = last.sources[i];
+        bool changed = n.numrays != o.numrays || (n.numrays && memcmp(&cur.rays[n.firstray], &last.rays[o.firstray], n.numrays * sizeof(lightray)));
+        loopvj(solidchanges)
+        {
+            if(changed) break;
+            block c = { solidchanges[j] & (ssize - 1), solidchanges[j] >> sfactor, 1, 1 };
+            changed = overlaparea(n.area, c);
+        }
+        if(!changed) continue;
+        if(n.area.xs) addarea(n.area.x, n.area.y, n.area.x + n.area.xs - 1, n.area.y + n.area.ys - 1);
+        if(o.area.xs) addarea(o.area.x, o.area.y, o.area.x + o.area.xs - 1, o.area.y + o.area.ys - 1);
+    }
+    #undef addarea
+    loopv(solidchanges) lightstate.solid[solidchanges[i]] ^= 1;
+    if(x2 < x1)     // nothing to do
+    {
+        lastcalclight = totalmillis;
+        return;
+    }
+    if((x2 - x1 + 1) * (y2 - y1 + 1) * 4 > bb.xs * bb.ys) { fulllight(cur, bb); return; }
+
+    // retrace all lights in g, filter everything inside the map in g, but only keep the result for f:
+    // the filter reaches four cubes sideways and two cubes up and down, the cubes near the borders of g are not right
+    #define growarea(n) { max(x1 - n, 0), max(y1 - n, 0), min(x2 + n + 1, ssize) - max(x1 - n, 0), min(y2 + n + 1, ssize) - max(y1 - n, 0) }
+    block g = growarea(11), f = growarea(5);
+    #undef growarea
+    lightambient(g);
+    tracelights(cur, g);
+    block fg = g;     // filter area: g inside bb, with the same row and column pairing as bb
+    if(fg.x < bb.x) { fg.xs -= bb.x - fg.x; fg.x = bb.x; }
+    if(fg.y < bb.y) { fg.ys -= bb.y - fg.y; fg.y = bb.y; }
+    fg.xs = min(fg.xs, bb.x + bb.xs - fg.x);
+    fg.ys = min(fg.ys, bb.y + bb.ys - fg.y);
+    if((fg.x - bb.x) & 1) { fg.x++; fg.xs--; }
+    if((bb.y + bb.ys - fg.y - fg.ys) & 1) fg.ys--;
+    if(fg.xs > 0 && fg.ys > 0) filterlightarea(fg);
+    rgb = lightstate.rgb.getbuf();
+    for(int y = g.y; y < g.y + g.ys; y++) for(int x = g.x; x < g.x + g.xs; x++)
+    {
+        if(x >= f.x && y >= f.y && x < f.x + f.xs && y < f.y + f.ys) continue;
+        sqr *s = S(x, y);
+        const uchar *c = &rgb[((y<<sfactor) + x) * 3];
+        s->r = c[0];
+        s->g = c[1];
+        s->b = c[2];
+    }
+    remip(f);
+    savelightstate(bb, &f);
     setvar("fullbright", 0);
     lastcalclight = totalmillis;
 }
@@ -235,11 +549,6 @@ vector<dlight> dlights;
 
 VARP(dynlight, 0, 1, 1);
 
-static inline bool insidearea(const block &a, const block &b)
-{
-    return b.x >= a.x && b.y >= a.y && b.x+b.xs <= a.x+a.xs && b.y+b.ys <= a.y+a.ys;
-}
-
 void preparedynlight(dlight &d)
 {
     block area = { (int)d.o.x-d.reach, (int)d.o.y-d.reach, d.reach*2+1, d.reach*2+1 };
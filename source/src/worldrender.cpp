@@ -100,9 +100,26 @@ bool issemi(int mip, int x, int y, int x1, int y1, int x2, int y2)
 
 bool render_floor, render_ceil;
 
+static int tesslevel = -1;      // >= 0: render_seg_new() tessellates a chunk for the world cache down to this mip level
+static int *tesswater = NULL;   // water rect of the tessellated chunk
+
+static void waterquad(int x, int y, int size)
+{
+    if(tesswater)
+    {
+        if(tesswater[0] < 0 || x < tesswater[0]) tesswater[0] = x;
+        if(tesswater[1] < 0 || y < tesswater[1]) tesswater[1] = y;
+        tesswater[2] = max(tesswater[2], x + size);
+        tesswater[3] = max(tesswater[3], y + size);
+    }
+    else if(!reflecting) addwaterquad(x, y, size);
+}
+
 // the core recursive function, renders a rect of cubes at a certain mip level from a viewer perspective
 // call itself for lower mip levels, on most modern machines however this function will use the higher
 // mip levels only for perfect mips.
+// when tessellating for the world cache, everything that could be seen from any viewer is rendered
+// (all floors, ceilings and both sides of walls - backface culling sorts them out), without occlusion.
 
 void render_seg_new(float vx, float vy, float vh, int mip, int x, int y, int xs, int ys)
 {
@@ -115,17 +132,29 @@ void render_seg_new(float vx, float vy, float vh, int mip, int x, int y, int xs,
     int ly = vyy-lodtop;
     int rx = vxx+lodright;
     int ry = vyy+lodbot;
+    int wl = vxx, wr = vxx, wt = vyy, wb = vyy;     // walls facing the viewer
+    float vfloor = render_floor ? vh : -1e16f, vceil = render_ceil ? vh : 1e16f;
+    int minmip = 0;
+    bool tess = tesslevel >= 0;
+    if(tess)
+    {
+        lx = ly = wl = wt = 0;
+        rx = ry = wr = wb = sz;
+        vfloor = 1e16f;
+        vceil = -1e16f;
+        minmip = tesslevel;
+    }
 
     float fsize = (float)(1<<mip);
     for(int oy = y; oy<ys; oy++)       // first collect occlusion information for this block
     {
         sqr *s = SWS(w,x,oy,mfactor);
-        for(int ox = x; ox<xs; ox++, s++) s->occluded = isoccluded(camera1->o.x, camera1->o.y, (float)(ox<<mip), (float)(oy<<mip), fsize);
+        for(int ox = x; ox<xs; ox++, s++) s->occluded = tess ? 0 : isoccluded(camera1->o.x, camera1->o.y, (float)(ox<<mip), (float)(oy<<mip), fsize);
     }
 
     int pvx = (int)vx>>mip;
     int pvy = (int)vy>>mip;
-    if(pvx>=0 && pvy>=0 && pvx<sz && pvy<sz)
+    if(!tess && pvx>=0 && pvy>=0 && pvx<sz && pvy<sz)
     {
         //SWS(w,vxx,vyy,mfactor)->occluded = 0;
         SWS(w, pvx, pvy, mfactor)->occluded = 0;  // player cell never occluded
@@ -148,7 +177,7 @@ void render_seg_new(float vx, float vy, float vh, int mip, int x, int y, int xs,
 
     int rendered = 0;
     LOOPH   // floors
-        if(s->defer && mip && xx>=lx && xx<rx && yy>=ly && yy<ry)
+        if(s->defer && mip>minmip && xx>=lx && xx<rx && yy>=ly && yy<ry)
         {
             s->occluded = 1; // shortcut for the other LOOPHs
             int start = xx;
@@ -161,18 +190,18 @@ void render_seg_new(float vx, float vy, float vh, int mip, int x, int y, int xs,
         {
             case SPACE:
             case CHF:
-                if(s->floor<=vh && render_floor)
+                if(s->floor<=vfloor)
                 {
                     sqr *v = SWS(s,0,1,mfactor);
                     render_flat(s->ftex, xx<<mip, yy<<mip, 1<<mip, s->floor, s, s + 1, v + 1, v, false);
-                    if(s->floor < waterlevel && !reflecting) addwaterquad(xx<<mip, yy<<mip, 1<<mip);
+                    if(s->floor < waterlevel) waterquad(xx<<mip, yy<<mip, 1<<mip);
                 }
                 break;
             case FHF:
             {
                 LOOPD
                 render_flatdelta(s->ftex, xx<<mip, yy<<mip, 1<<mip, df(s), df(t), df(u), df(v), s, t, u, v, false);
-                if(s->floor - s->vdelta/4.0f < waterlevel && !reflecting) addwaterquad(xx<<mip, yy<<mip, 1<<mip);
+                if(s->floor - s->vdelta/4.0f < waterlevel) waterquad(xx<<mip, yy<<mip, 1<<mip);
                 break;
             }
         }
@@ -186,7 +215,7 @@ void render_seg_new(float vx, float vy, float vh, int mip, int x, int y, int xs,
         {
             case SPACE:
             case FHF:
-                if(s->ceil>=vh && render_ceil)
+                if(s->ceil>=vceil)
                 {
                     sqr *v = SWS(s,0,1,mfactor);
                     render_flat(s->ctex, xx<<mip, yy<<mip, 1<<mip, s->ceil, s, s + 1, v + 1, v, true);
@@ -247,16 +276,16 @@ void render_seg_new(float vx, float vy, float vh, int mip, int x, int y, int xs,
 
         if(normalwall)
         {
-            if(xx>=vxx && xx!=0    && !SOLID(z) && (!SOLID(s) || z->type!=CORNER)
+            if(xx>=wl  && xx!=0    && !SOLID(z) && (!SOLID(s) || z->type!=CORNER)
                 && (z->type!=SEMISOLID || issemi(mip, xx-1, yy, 1, 0, 1, 1)))
                 render_wall(s, z, xx,   yy,   xx,   yy+1, mip, s, v, true, 0);  // left
-            if(xx<=vxx && xx!=sz-1 && !SOLID(t) && (!SOLID(s) || t->type!=CORNER)
+            if(xx<=wr  && xx!=sz-1 && !SOLID(t) && (!SOLID(s) || t->type!=CORNER)
                 && (t->type!=SEMISOLID || issemi(mip, xx+1, yy, 0, 0, 0, 1)))
                 render_wall(s, t, xx+1, yy,   xx+1, yy+1, mip, t, u, false, 1);  // right
-            if(yy>=vyy && yy!=0    && !SOLID(w) && (!SOLID(s) || w->type!=CORNER)
+            if(yy>=wt  && yy!=0    && !SOLID(w) && (!SOLID(s) || w->type!=CORNER)
                 && (w->type!=SEMISOLID || issemi(mip, xx, yy-1, 0, 1, 1, 1)))
                 render_wall(s, w, xx,   yy,   xx+1, yy,   mip, s, t, false, 2);  // top
-            if(yy<=vyy && yy!=sz-1 && !SOLID(v) && (!SOLID(s) || v->type!=CORNER)
+            if(yy<=wb  && yy!=sz-1 && !SOLID(v) && (!SOLID(s) || v->type!=CORNER)
                 && (v->type!=SEMISOLID || issemi(mip, xx, yy+1, 0, 0, 1, 0)))
                 render_wall(s, v, xx,   yy+1, xx+1, yy+1, mip, v, u, true, 3);  // bot
         }
@@ -265,7 +294,7 @@ void render_seg_new(float vx, float vy, float vh, int mip, int x, int y, int xs,
     extern vector<int> tagclipcubes;
     extern bool showtagclipfocus;
     extern int showtagclips;
-    if(editmode && !showtagclipfocus && showtagclips) LOOPH   // tag clips
+    if(editmode && !tess && !showtagclipfocus && showtagclips) LOOPH   // tag clips
         if(mip)
         {
             int ix1 = xx<<mip, ix2 = (xx+1)<<mip, iy1 = yy<<mip, iy2 = (yy+1)<<mip;
@@ -292,6 +321,192 @@ void distlod(int &low, int &high, int angle, float widef)
     if(high<min_lod) high = min_lod;
 }
 
+// world cache
+//
+// instead of walking the mipmaps and rebuilding every strip every frame, the map is tessellated once into chunks of
+// 32x32 cubes (one cube at MAX_MIP), separately for every mip level a chunk is rendered at. a frame then only selects
+// the visible chunks, picks their detail level from the lod rects and adds their stored strips to the batches.
+// the chunk geometry is kept in one client-side vertex array (cachedverts) and drawn through the usual strip batches.
+// every change to the geometry or the light of the map (editing, calclight, dynlights) goes through remip(),
+// which drops the cached chunks around the changed block - they are tessellated again, when they are needed.
+
+VARP(worldcache, 0, 0, 1);
+
+struct worldchunk
+{
+    struct detail       // the chunk, tessellated down to one mip level
+    {
+        bool valid;
+        int firstvert, numverts, lastused;
+        float skyz;
+        int water[4];   // x1, y1, x2, y2 or -1
+        vector<worldstrip> strips;
+
+        detail() : valid(false), firstvert(0), numverts(0), lastused(0) {}
+    } levels[MAX_MIP+1];
+};
+
+static worldchunk *worldchunks = NULL;
+static int worldchunksize = 0, cachedgarbage = 0, worldcachekey[4];
+
+void flushworldcache()
+{
+    DELETEA(worldchunks);
+    worldchunksize = cachedgarbage = 0;
+    cachedverts.setsize(0);
+}
+
+static void dropchunkdetail(worldchunk::detail &d)
+{
+    if(!d.valid) return;
+    cachedgarbage += d.numverts;
+    d.valid = false;
+    d.strips.setsize(0);
+}
+
+void invalidateworldcache(const block &b)      // called by remip()
+{
+    if(!worldchunks) return;
+    // cubes use the light and the shape of their right and lower neighbours and the walls of a perfect mip depend on the
+    // whole neighbouring mip, so the chunks around the block have to go as well
+    int x1 = max((b.x>>MAX_MIP) - 1, 0), x2 = min(((b.x+b.xs)>>MAX_MIP) + 1, worldchunksize - 1),
+        y1 = max((b.y>>MAX_MIP) - 1, 0), y2 = min(((b.y+b.ys)>>MAX_MIP) + 1, worldchunksize - 1);
+    for(int y = y1; y <= y2; y++) for(int x = x1; x <= x2; x++) loopi(MAX_MIP+1) dropchunkdetail(worldchunks[y*worldchunksize + x].levels[i]);
+}
+
+static float tessellatechunk(int cx, int cy, int level, vector<worldstrip> &strips, int *water)    // vertices go to verts, returns the lowest sky vertex
+{
+    verts.setsize(0);
+    resetstrips();
+    water[0] = water[1] = water[2] = water[3] = -1;
+    tesslevel = level;
+    tesswater = water;
+    render_seg_new(0, 0, 0, MAX_MIP, cx, cy, cx+1, cy+1);
+    tesslevel = -1;
+    tesswater = NULL;
+    return takestrips(strips);
+}
+
+static void buildchunk(int cx, int cy, int level, worldchunk::detail &d)
+{
+    d.strips.setsize(0);
+    d.skyz = tessellatechunk(cx, cy, level, d.strips, d.water);
+    d.firstvert = cachedverts.length();
+    d.numverts = verts.length();
+    cachedverts.put(verts.getbuf(), verts.length());
+    d.valid = true;
+}
+
+static int chunkdetail(float vx, float vy, int cx, int cy)     // the mip level render_seg_new() would use for the chunk
+{
+    for(int mip = MAX_MIP; mip > 0; mip--)
+    {
+        int vxx = ((int)vx+(1<<mip)/2)>>mip, vyy = ((int)vy+(1<<mip)/2)>>mip, cs = MAX_MIP - mip;
+        if((cx<<cs) >= vxx+lodright || ((cx+1)<<cs) <= vxx-lodleft || (cy<<cs) >= vyy+lodbot || ((cy+1)<<cs) <= vyy-lodtop) return mip;
+    }
+    return 0;
+}
+
+static int sortchunkdetails(worldchunk::detail **a, worldchunk::detail **b) { return (*a)->firstvert - (*b)->firstvert; }
+
+static void compactworldcache()     // removes dropped chunks (and chunks that haven't been used for a while) from cachedverts
+{
+    if(cachedgarbage < 0x10000 || cachedgarbage < cachedverts.length() / 2) return;
+    vector<worldchunk::detail *> live;
+    loopi(worldchunksize*worldchunksize) loopj(MAX_MIP+1)
+    {
+        worldchunk::detail &d = worldchunks[i].levels[j];
+        if(d.valid && lastmillis - d.lastused > 10000) dropchunkdetail(d);
+        if(d.valid) live.add(&d);
+    }
+    live.sort(sortchunkdetails);
+    int n = 0;
+    loopv(live)
+    {
+        worldchunk::detail &d = *live[i];
+        if(d.firstvert != n) memmove(&cachedverts.getbuf()[n], &cachedverts.getbuf()[d.firstvert], d.numverts * sizeof(vertex));
+        d.firstvert = n;
+        n += d.numverts;
+    }
+    cachedverts.setsize(n);
+    cachedgarbage = 0;
+}
+
+static void checkworldcache()
+{
+    extern int slotchanges, mergestrips;
+    int key[4] = { lighterror, mergestrips, slotchanges, hdr.waterlevel };     // everything else that goes into the vertices
+    if(worldchunks && (worldchunksize != ssize>>MAX_MIP || memcmp(key, worldcachekey, sizeof(key)))) flushworldcache();
+    memcpy(worldcachekey, key, sizeof(key));
+    if(!worldchunks)
+    {
+        worldchunksize = ssize>>MAX_MIP;
+        worldchunks = new worldchunk[worldchunksize*worldchunksize];
+    }
+}
+
+static void render_worldcache(float vx, float vy)
+{
+    checkworldcache();
+    static vector<worldchunk::detail *> visible;
+    visible.setsize(0);
+    int pcx = (int)vx>>MAX_MIP, pcy = (int)vy>>MAX_MIP, csize = 1<<MAX_MIP;
+    loop(cy, worldchunksize) loop(cx, worldchunksize)
+    {
+        if((cx != pcx || cy != pcy) && isoccluded(camera1->o.x, camera1->o.y, float(cx*csize), float(cy*csize), float(csize))) continue;
+        int level = chunkdetail(vx, vy, cx, cy);
+        worldchunk::detail &d = worldchunks[cy*worldchunksize + cx].levels[level];
+        if(!d.valid) buildchunk(cx, cy, level, d);
+        d.lastused = lastmillis;
+        visible.add(&d);
+    }
+    compactworldcache();
+    loopv(visible)
+    {
+        worldchunk::detail &d = *visible[i];
+        addcachedstrips(d.strips.getbuf(), d.strips.length(), d.firstvert);
+        skyfloor = min(skyfloor, d.skyz);
+        if(d.water[0] >= 0 && !reflecting) addwaterrect(d.water[0], d.water[1], d.water[2], d.water[3]);
+    }
+    worldcached = true;
+}
+
+// headless benchmark: tessellate every chunk of the map at every mip level (doesn't touch the cache)
+
+void worldcachebench()
+{
+    if(!world) return;
+    int n = ssize>>MAX_MIP, water[4];
+    vector<worldstrip> strips;
+    float skyfloorbak = skyfloor;
+    conoutf("tessellating %d chunks of %dx%d cubes:", n*n, 1<<MAX_MIP, 1<<MAX_MIP);
+    loopirev(MAX_MIP+1)
+    {
+        int numverts = 0, numstrips = 0, usedchunks = 0;
+        uint start = sl_micros();
+        loop(cy, n) loop(cx, n)
+        {
+            strips.setsize(0);
+            tessellatechunk(cx, cy, i, strips, water);
+            numverts += verts.length();
+            numstrips += strips.length();
+            if(verts.length()) usedchunks++;
+        }
+        uint us = sl_micros() - start;
+        conoutf("mip %d: %d us total, %.1f us per chunk (%.1f per non-empty chunk), %d vertices (%d kB), %d strips",
+            i, us, float(us)/(n*n), usedchunks ? float(us)/usedchunks : 0.0f, numverts, int(numverts*sizeof(vertex)/1024), numstrips);
+    }
+    verts.setsize(0);
+    skyfloor = skyfloorbak;
+    if(worldchunks)
+    {
+        int cached = 0;
+        loopi(worldchunksize*worldchunksize) loopj(MAX_MIP+1) if(worldchunks[i].levels[j].valid) cached++;
+        conoutf("world cache: %d chunk details, %d vertices (%d kB, %d dropped)", cached, cachedverts.length(), int(cachedverts.length()*sizeof(vertex)/1024), cachedgarbage);
+    }
+}
+COMMAND(worldcachebench, "");
+
 // does some out of date view frustrum optimisation that doesn't contribute much anymore
 
 void render_world(float vx, float vy, float vh, float changelod, int yaw, int pitch, float fov, float fovy, int w, int h)
@@ -333,7 +548,12 @@ void render_world(float vx, float vy, float vh, float changelod, int yaw, int pi
     render_floor = pitch<0.5f*fovy;
     render_ceil  = -pitch<0.5f*fovy;
 
-    render_seg_new(vx, vy, vh, MAX_MIP, 0, 0, ssize>>MAX_MIP, ssize>>MAX_MIP);
-    mipstats(stats);
+    extern bool showm;
+    if(worldcache && !minimap && !editmode && !showm) render_worldcache(vx, vy);
+    else
+    {
+        render_seg_new(vx, vy, vh, MAX_MIP, 0, 0, ssize>>MAX_MIP, ssize>>MAX_MIP);
+        mipstats(stats);
+    }
 }
 